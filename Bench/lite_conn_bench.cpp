@@ -0,0 +1,370 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <boost/program_options.hpp>
+#include "networking/networking.hpp"
+#include "networking/lite_conn.hpp"
+
+namespace po = boost::program_options;
+using SteadyClock = std::chrono::steady_clock;
+
+enum class Workload {
+	Data, // SendData, one way latency
+	ReliableData, // SendReliableData, one way latency
+	Request // SendRequest answered with the same payload, round trip time
+};
+
+struct BenchCase {
+	Workload workload;
+	size_t payloadSize;
+	size_t connections;
+	bool impaired;
+};
+
+struct BenchResult {
+	BenchCase config;
+	uint64_t sent = 0;
+	uint64_t delivered = 0;
+	SteadyClock::duration elapsed = {};
+	std::vector<SteadyClock::duration> latencies;
+	uint64_t retransmissions = 0;
+};
+
+struct BenchOptions {
+	USHORT port;
+	SteadyClock::duration duration;
+	// Data messages sent per connection before waiting for them to arrive
+	size_t window;
+	// How long the sender waits for a burst or a response before presuming it lost
+	SteadyClock::duration lossTimeout;
+	size_t queueCapacity;
+	SteadyClock::duration updateInterval;
+	ImpairmentSetting impairment;
+	// Applied to both managers, empty sends without congestion control
+	std::optional<CongestionSetting> congestion;
+};
+
+static const char* WorkloadName(Workload workload) {
+	switch (workload) {
+	case Workload::Data: return "SendData";
+	case Workload::ReliableData: return "SendReliableData";
+	case Workload::Request: return "SendRequest";
+	}
+	return "";
+}
+
+// Every message starts with the time it was sent, both ends run in this process and share the clock
+static void Stamp(std::vector<char>& payload) {
+	auto now = SteadyClock::now().time_since_epoch().count();
+	memcpy(payload.data(), &now, sizeof(now));
+}
+
+static SteadyClock::duration Age(std::span<const char> data) {
+	SteadyClock::rep sent;
+	memcpy(&sent, data.data(), sizeof(sent));
+	return SteadyClock::now() - SteadyClock::time_point(SteadyClock::duration(sent));
+}
+
+static void RunStream(const BenchOptions& options, bool reliable, std::vector<std::shared_ptr<LiteConnConnection>>& clients,
+	std::vector<std::shared_ptr<LiteConnConnection>>& servers, BenchResult& result)
+{
+	std::atomic<bool> stop = false;
+	std::atomic<uint64_t> delivered = 0;
+	// Polls every connection so one idle connection does not delay the others
+	std::thread receiver([&]() {
+		while (!stop) {
+			bool idle = true;
+			for (auto& connection : servers) {
+				while (auto message = connection->Receive()) {
+					result.latencies.push_back(Age(message->data));
+					delivered++;
+					idle = false;
+				}
+			}
+			if (idle) std::this_thread::yield();
+		}
+	});
+
+	std::vector<char> payload(result.config.payloadSize);
+	auto awaitBurst = [&]() {
+		auto deadline = SteadyClock::now() + options.lossTimeout;
+		while (delivered < result.sent && SteadyClock::now() < deadline) std::this_thread::yield();
+	};
+	auto start = SteadyClock::now();
+	auto end = start + options.duration;
+	while (SteadyClock::now() < end) {
+		for (size_t i = 0; i < options.window; i++) {
+			for (auto& connection : clients) {
+				Stamp(payload);
+				if (reliable) connection->SendReliableData(payload);
+				else connection->SendData(payload);
+				result.sent++;
+			}
+		}
+		awaitBurst();
+	}
+	result.elapsed = SteadyClock::now() - start;
+	stop = true;
+	receiver.join();
+	result.delivered = delivered;
+}
+
+static void RunRequests(const BenchOptions& options, std::vector<std::shared_ptr<LiteConnConnection>>& clients,
+	std::vector<std::shared_ptr<LiteConnConnection>>& servers, BenchResult& result)
+{
+	std::atomic<bool> stop = false;
+	std::thread responder([&]() {
+		while (!stop) {
+			bool idle = true;
+			for (auto& connection : servers) {
+				while (auto message = connection->Receive()) {
+					if (message->requestHandle) message->requestHandle->Respond(message->data);
+					idle = false;
+				}
+			}
+			if (idle) std::this_thread::yield();
+		}
+	});
+
+	// Every connection keeps one request outstanding
+	std::vector<BenchResult> partial(clients.size());
+	std::vector<std::thread> requesters;
+	auto start = SteadyClock::now();
+	auto end = start + options.duration;
+	for (size_t i = 0; i < clients.size(); i++) {
+		requesters.emplace_back([&, i]() {
+			auto& connection = clients[i];
+			auto& own = partial[i];
+			std::vector<char> payload(result.config.payloadSize);
+			while (SteadyClock::now() < end) {
+				Stamp(payload);
+				auto response = connection->SendRequest(payload);
+				if (!response) break;
+				own.sent++;
+				if (!response->WaitForResponse(options.lossTimeout)) continue;
+				if (auto message = response->GetResponse()) {
+					own.latencies.push_back(Age(message->data));
+					own.delivered++;
+				}
+			}
+		});
+	}
+	for (auto& requester : requesters) {
+		requester.join();
+	}
+	result.elapsed = SteadyClock::now() - start;
+	stop = true;
+	responder.join();
+
+	for (auto& own : partial) {
+		result.sent += own.sent;
+		result.delivered += own.delivered;
+		result.latencies.insert(result.latencies.end(), own.latencies.begin(), own.latencies.end());
+	}
+}
+
+static std::optional<BenchResult> RunCase(const BenchCase& config, const BenchOptions& options) {
+	LiteConnSetting setting;
+	if (config.impaired) setting.impairment = options.impairment;
+	setting.congestion = options.congestion;
+	LiteConnManager server(options.port, config.connections, options.queueCapacity, DEFAULT_UDP_BUFFER_SIZE, options.updateInterval, setting);
+	LiteConnManager client(options.queueCapacity, config.connections, DEFAULT_UDP_BUFFER_SIZE, options.updateInterval, setting);
+	if (!server.Good() || !client.Good()) {
+		std::cerr << "Failed to open the sockets of the benchmark" << std::endl;
+		return {};
+	}
+	server.isListening = true;
+
+	TimeoutSetting timeout = {
+		.connectionTimeout = std::chrono::seconds(5),
+		.connectionRetryInterval = std::chrono::milliseconds(100),
+		.impRetryInterval = std::chrono::milliseconds(100),
+		.replyKeepDuration = std::chrono::seconds(3)
+	};
+	sockaddr_in address = {};
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_family = AF_INET;
+	address.sin_port = htons(options.port);
+
+	std::vector<std::shared_ptr<LiteConnConnection>> clients;
+	std::vector<std::shared_ptr<LiteConnConnection>> servers;
+	for (size_t i = 0; i < config.connections; i++) {
+		auto connection = client.ConnectPeer(address, timeout);
+		if (!connection || !connection->WaitForConnectionComplete(std::chrono::seconds(5))) {
+			std::cerr << "Failed to connect to the benchmark server" << std::endl;
+			return {};
+		}
+		auto accepted = server.Accept(timeout, std::chrono::seconds(5));
+		if (!accepted) {
+			std::cerr << "The benchmark server did not accept a connection" << std::endl;
+			return {};
+		}
+		clients.push_back(std::move(connection));
+		servers.push_back(std::move(accepted));
+	}
+
+	BenchResult result = { .config = config };
+	if (config.workload == Workload::Request) {
+		RunRequests(options, clients, servers, result);
+	}
+	else {
+		RunStream(options, config.workload == Workload::ReliableData, clients, servers, result);
+	}
+	for (auto& connection : clients) {
+		result.retransmissions += connection->Stats().retransmissions;
+	}
+	return result;
+}
+
+static double Microseconds(SteadyClock::duration duration) {
+	return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+// Nearest rank percentile of sorted samples
+static double Percentile(const std::vector<SteadyClock::duration>& sorted, double fraction) {
+	if (sorted.empty()) return 0;
+	auto rank = static_cast<size_t>(fraction * sorted.size());
+	return Microseconds(sorted[std::min(rank, sorted.size() - 1)]);
+}
+
+static void WriteResult(std::ostream& out, BenchResult& result) {
+	std::sort(result.latencies.begin(), result.latencies.end());
+	double seconds = std::chrono::duration<double>(result.elapsed).count();
+	out << "{\"workload\": \"" << WorkloadName(result.config.workload) << "\""
+		<< ", \"payload\": " << result.config.payloadSize
+		<< ", \"connections\": " << result.config.connections
+		<< ", \"network\": \"" << (result.config.impaired ? "impaired" : "loopback") << "\""
+		<< ", \"latency\": \"" << (result.config.workload == Workload::Request ? "round_trip" : "one_way") << "\""
+		<< ", \"sent\": " << result.sent
+		<< ", \"delivered\": " << result.delivered
+		<< ", \"seconds\": " << seconds
+		<< ", \"packets_per_second\": " << (seconds > 0 ? result.delivered / seconds : 0)
+		<< ", \"p50_us\": " << Percentile(result.latencies, 0.5)
+		<< ", \"p99_us\": " << Percentile(result.latencies, 0.99)
+		<< ", \"p999_us\": " << Percentile(result.latencies, 0.999)
+		<< ", \"retransmissions\": " << result.retransmissions << "}";
+}
+
+template<typename T>
+static std::vector<T> ParseList(const std::string& text) {
+	std::vector<T> values;
+	std::stringstream stream(text);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		if (!item.empty()) values.push_back(static_cast<T>(std::stoull(item)));
+	}
+	return values;
+}
+
+int main(int argc, char* args[]) {
+	std::string workloads, sizes, connections, network, output;
+	size_t durationMs, lossTimeoutMs, updateIntervalUs, latencyMs, jitterMs, bandwidth;
+	double loss, duplicate, reorder, maxBandwidth;
+	uint64_t seed;
+	bool congestion = false;
+	BenchOptions options;
+
+	po::options_description cmdOptions("Options:");
+	cmdOptions.add_options()
+		("help,h", "show help message")
+		("port,p", po::value<USHORT>(&options.port)->default_value(35000), "Port of the benchmark server")
+		("workloads", po::value<std::string>(&workloads)->default_value("data,reliable,request"), "Comma separated workloads out of data, reliable and request")
+		("sizes", po::value<std::string>(&sizes)->default_value("16,64,256,1024"), "Comma separated payload sizes in bytes, at least 8")
+		("connections", po::value<std::string>(&connections)->default_value("1,4,16"), "Comma separated connection counts")
+		("network", po::value<std::string>(&network)->default_value("loopback"), "loopback, impaired or both")
+		("duration", po::value<size_t>(&durationMs)->default_value(2000), "Milliseconds each case runs")
+		("window", po::value<size_t>(&options.window)->default_value(32), "Data messages sent per connection before waiting for them")
+		("loss-timeout", po::value<size_t>(&lossTimeoutMs)->default_value(200), "Milliseconds after which a message or response is presumed lost")
+		("queue", po::value<size_t>(&options.queueCapacity)->default_value(4096), "Received messages each connection holds")
+		("update-interval", po::value<size_t>(&updateIntervalUs)->default_value(1000), "Microseconds between the routing threads' timer runs")
+		("loss", po::value<double>(&loss)->default_value(0.01), "Impaired network: probability a datagram is lost")
+		("duplicate", po::value<double>(&duplicate)->default_value(0), "Impaired network: probability a datagram is duplicated")
+		("reorder", po::value<double>(&reorder)->default_value(0.01), "Impaired network: probability a datagram is held back")
+		("latency", po::value<size_t>(&latencyMs)->default_value(20), "Impaired network: one way delay in milliseconds")
+		("jitter", po::value<size_t>(&jitterMs)->default_value(5), "Impaired network: standard deviation of the delay in milliseconds")
+		("bandwidth", po::value<size_t>(&bandwidth)->default_value(0), "Impaired network: bytes per second, 0 is unlimited")
+		("seed", po::value<uint64_t>(&seed)->default_value(1), "Impaired network: seed of the impairment")
+		("congestion", po::bool_switch(&congestion), "Enable congestion control and pacing on every connection")
+		("max-bandwidth", po::value<double>(&maxBandwidth)->default_value(0), "Congestion control: bytes per second each connection sends at most, 0 is unbounded")
+		("output,o", po::value<std::string>(&output), "File the JSON results are written to, standard output by default");
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, args, cmdOptions), vm);
+	po::notify(vm);
+
+	if (vm.count("help")) {
+		std::cout << cmdOptions;
+		return 0;
+	}
+
+	options.duration = std::chrono::milliseconds(durationMs);
+	options.lossTimeout = std::chrono::milliseconds(lossTimeoutMs);
+	options.updateInterval = std::chrono::microseconds(updateIntervalUs);
+	options.impairment = {
+		.lossRate = loss,
+		.duplicateRate = duplicate,
+		.reorderRate = reorder,
+		.latency = std::chrono::milliseconds(latencyMs),
+		.jitter = std::chrono::milliseconds(jitterMs),
+		.distribution = DelayDistribution::Normal,
+		.bandwidth = bandwidth,
+		.seed = seed
+	};
+
+	if (congestion) {
+		options.congestion = CongestionSetting{ .maxBandwidth = maxBandwidth };
+	}
+
+	std::vector<Workload> selected;
+	std::stringstream workloadStream(workloads);
+	std::string name;
+	while (std::getline(workloadStream, name, ',')) {
+		if (name == "data") selected.push_back(Workload::Data);
+		else if (name == "reliable") selected.push_back(Workload::ReliableData);
+		else if (name == "request") selected.push_back(Workload::Request);
+		else {
+			std::cerr << "Unknown workload " << name << std::endl;
+			return 1;
+		}
+	}
+	std::vector<bool> networks;
+	if (network == "loopback" || network == "both") networks.push_back(false);
+	if (network == "impaired" || network == "both") networks.push_back(true);
+	if (networks.empty()) {
+		std::cerr << "Unknown network " << network << std::endl;
+		return 1;
+	}
+
+	Networking::init();
+
+	std::ofstream file;
+	if (!output.empty()) file.open(output);
+	std::ostream& out = output.empty() ? std::cout : file;
+	out << "{\"duration_ms\": " << durationMs << ", \"window\": " << options.window
+		<< ", \"update_interval_us\": " << updateIntervalUs << ", \"results\": [";
+	bool first = true;
+	for (bool impaired : networks) {
+		for (auto workload : selected) {
+			for (auto count : ParseList<size_t>(connections)) {
+				for (auto size : ParseList<size_t>(sizes)) {
+					BenchCase config = {
+						.workload = workload,
+						.payloadSize = std::max(size, sizeof(SteadyClock::rep)),
+						.connections = count,
+						.impaired = impaired
+					};
+					auto result = RunCase(config, options);
+					if (!result) return 1;
+					std::cerr << WorkloadName(workload) << " " << config.payloadSize << "B x" << count << (impaired ? " impaired" : "")
+						<< ": " << result->delivered << "/" << result->sent << " delivered" << std::endl;
+					out << (std::exchange(first, false) ? "\n\t" : ",\n\t");
+					WriteResult(out, result.value());
+				}
+			}
+		}
+	}
+	out << "\n]}" << std::endl;
+	return 0;
+}
@@ -15,13 +15,13 @@
 #include "rendering/model.hpp"
 #include "rendering/particle_system.hpp"
 #include "cursor.hpp"
+#include "multiplayer/setting.hpp"
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/string_cast.hpp>
 
 using namespace std;
 
 static constexpr int numConnections = 1;
-static constexpr int packetQueueCapacity = 100;
 static constexpr int maxPacketSize = 1500;
 static constexpr int networkTickRate = 100;
 
@@ -196,7 +196,7 @@ optional<type_index> GameState::Run() {
 	return Self();
 }
 
-Game::Game(ObjectManager& manager, Clock& clock, USHORT localPort, const sockaddr_in& serverAddr) : serverAddr(serverAddr), gameClock(clock), manager(manager), state(), textures(), connectionManager(localPort, numConnections, 100, maxPacketSize, std::chrono::seconds(1) / networkTickRate) {
+Game::Game(ObjectManager& manager, Clock& clock, USHORT localPort, const sockaddr_in& serverAddr) : serverAddr(serverAddr), gameClock(clock), manager(manager), state(), textures(), connectionManager(localPort, numConnections, ClientPacketQueueCapacity, maxPacketSize, std::chrono::seconds(1) / networkTickRate, ConnectionSetting) {
 	trailShader = make_unique<Shader>(SHADER_DIR "mouse_trail.vert", SHADER_DIR "mouse_trail.frag");
 	trailTexture = textureFromFile(TEXTURE_DIR "FruitNinja_blade0.png");
 	trailArrow = textureFromFile(TEXTURE_DIR "blade0_arrow.png");
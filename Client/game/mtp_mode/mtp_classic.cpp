@@ -204,7 +204,6 @@ void MTP_ClassicMode::OnEnter() {
 	Input::keyCallbacks.emplace(typeid(MTP_ClassicMode), std::bind(&MTP_ClassicMode::RecordKeyboardInput, this, std::placeholders::_1, std::placeholders::_2));
 	server = game.connectionManager.ConnectPeer(game.serverAddr, ConnectionTimeOut);
 	connectionState = ConnectionState::Connecting;
-	currIndex = 0;
 	game.manager.Register(ui.exit);
 	PositionUI();
 	StartCoroutine(FadeInUI(1));
@@ -234,19 +233,17 @@ void MTP_ClassicMode::EnterConnecting() {
 
 void MTP_ClassicMode::ProcessServerData() {
 	if (server && server->IsConnected()) {
-		for (auto pkt = server->Receive(); pkt.has_value(); pkt = server->Receive()) {
-			auto serverData = ServerPacket::Deserialize(pkt->data);
+		auto count = server->ReceiveAll(received);
+		for (auto& pkt : std::span(received.data(), count)) {
+			auto serverData = ServerPacket::Deserialize(pkt.data);
 			
 			std::visit(
 				overload{
 					[](std::monostate) { Debug::LogError("Server data failed to deserialize!"); },
 					[this](std::tuple<uint64_t, PlayerContext, PlayerContext> contexts){ 
-						auto index = std::get<0>(contexts);
-						if (index > currIndex) {
-							currIndex = index;
-							context1 = std::move(std::get<1>(contexts));
-							context2 = std::move(std::get<2>(contexts));
-						}
+						// The game state channel drops snapshots older than the latest one
+						context1 = std::move(std::get<1>(contexts));
+						context2 = std::move(std::get<2>(contexts));
 					},
 					[this](ServerPacket::ServerCommand cmd){ 
 						if (cmd == ServerPacket::ServerCommand::StartGame) {
@@ -267,12 +264,12 @@ void MTP_ClassicMode::ProcessServerData() {
 							Debug::LogError("Cannot spawn slicable: Invalid slicable type id!");
 							return;
 						}
-						if (!pkt->requestHandle) {
+						if (!pkt.requestHandle) {
 							Debug::LogError("Cannot spawn slicable: The request handle does not exist!");
 							return;
 						}
 
-						pendingSlicables.emplace(request.index, std::move(pkt->requestHandle.value()));
+						pendingSlicables.emplace(request.index, std::move(pkt.requestHandle.value()));
 
 						std::shared_ptr<Model> topSliceModels[SlicableType::Count] = {
 							this->game.models.appleTopModel,
@@ -409,6 +406,8 @@ void MTP_ClassicMode::ProcessServerData() {
 					}
 				}, serverData
 			);
+			// Return the datagram to the pool now rather than when the slot is reused
+			pkt = {};
 		}
 	}
 }
@@ -433,7 +432,7 @@ void MTP_ClassicMode::SendInput() {
 	inputState.index++;
 	inputState.mouseX = static_cast<float>(cursorX / dim.x);
 	inputState.mouseY= static_cast<float>(cursorY / dim.y);
-	server->SendData(ClientPacket::SerializeInput(inputState));
+	server->Send(MTP_Channel::Input, ClientPacket::SerializeInput(inputState));
 	inputState.keys = PlayerKeyPressed::None;
 }
 
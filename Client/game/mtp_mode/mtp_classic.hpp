@@ -51,7 +51,6 @@ class MTP_ClassicMode : public GameState {
 	} gameState;
 
 	PlayerInputState inputState = {.index = 0, .keys = 0, .mouseX = 0, .mouseY = 0};
-	uint64_t currIndex = 0;
 	PlayerContext context1;
 	PlayerContext context2;
 
@@ -60,6 +59,8 @@ class MTP_ClassicMode : public GameState {
 
 	std::unordered_map<uint64_t, std::weak_ptr<Object>> pendingRemoteSlicables;
 	std::unordered_map<uint64_t, LiteConnRequest> pendingSlicables;
+	// Large enough to take every queued message at once
+	std::array<LiteConnMessage, ClientPacketQueueCapacity> received;
 
 	void EnterConnecting();
 	void EnterDisconnected();
@@ -1,5 +1,6 @@
 #include "coroutine.hpp"
 #include <iostream>
+#include <utility>
 using namespace std;
 
 Coroutine::Coroutine(promise_type* p) noexcept : handle(coroutine_handle<promise_type>::from_promise(*p)) {}
@@ -13,6 +14,9 @@ bool Coroutine::Advance(Clock& clock) const {
 	if (handle.done()) {
 		return false;
 	}
+	if (handle.promise().parked) {
+		return true;
+	}
 	auto& yieldOption = handle.promise().option;
 	if (yieldOption) {
 		auto& option = yieldOption.value();
@@ -40,6 +44,24 @@ bool Coroutine::Finished() const {
 	return handle.done();
 }
 
+bool Coroutine::Parked() const {
+	return handle.promise().parked;
+}
+
+void Coroutine::Park(std::coroutine_handle<promise_type> handle) {
+	handle.promise().parked = true;
+}
+
+void Coroutine::Wake(std::coroutine_handle<promise_type> handle) {
+	auto& promise = handle.promise();
+	if (promise.manager) {
+		promise.manager->Wake(handle.address());
+	}
+	else {
+		promise.parked = false;
+	}
+}
+
 #pragma region YieldOption
 Coroutine::YieldOption Coroutine::YieldOption::Wait(float timeToWait) {
 	return Coroutine::YieldOption { .waitTime = timeToWait };
@@ -61,20 +83,54 @@ void Coroutine::promise_type::unhandled_exception() noexcept { std::terminate();
 #pragma endregion
 
 void CoroutineManager::Run(Clock& clock) {
+	// Woken coroutines continue in this run after the running ones
+	vector<void*> resumed;
+	{
+		lock_guard<mutex> guard(wokenLock);
+		resumed.swap(woken);
+	}
+	for (auto address : resumed) {
+		auto entry = parked.find(address);
+		if (entry == parked.end()) continue;
+		entry->second->handle.promise().parked = false;
+		coroutines.push_back(std::move(entry->second));
+		parked.erase(entry);
+	}
+
 	for (auto i = coroutines.begin(); i != coroutines.end();) {
 		auto& coroutine = *i;
 		if (coroutine->Finished() || !coroutine->Advance(clock)) {
 			i = coroutines.erase(i);
 			continue;
 		}
+		if (coroutine->Parked()) {
+			parked.emplace(coroutine->handle.address(), std::move(coroutine));
+			i = coroutines.erase(i);
+			continue;
+		}
 		++i;
 	}
 }
 
+void CoroutineManager::Wake(void* address) {
+	lock_guard<mutex> guard(wokenLock);
+	woken.push_back(address);
+}
+
 weak_ptr<Coroutine> CoroutineManager::AddCoroutine(Coroutine&& task) {
-	return coroutines.emplace_back(make_shared<Coroutine>(std::forward<Coroutine>(task)));
+	auto& result = coroutines.emplace_back(make_shared<Coroutine>(std::forward<Coroutine>(task)));
+	result->handle.promise().manager = this;
+	return result;
+}
+
+void CoroutineManager::Clear() {
+	coroutines.clear();
+	parked.clear();
+	// Wakes of the destroyed coroutines that arrived meanwhile must not match coroutines added later
+	lock_guard<mutex> guard(wokenLock);
+	woken.clear();
 }
 
 bool CoroutineManager::Empty() const {
-	return coroutines.empty();
+	return coroutines.empty() && parked.empty();
 }
\ No newline at end of file
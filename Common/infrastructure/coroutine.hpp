@@ -2,10 +2,16 @@
 #define COROUTINE_H
 #include <memory>
 #include <list>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
 #include <coroutine>
 #include <optional>
 #include "clock.hpp"
 
+class CoroutineManager;
+
 struct Coroutine {
 public:
 	struct YieldOption {
@@ -20,6 +26,10 @@ public:
 	};
 	struct promise_type {
 		std::optional<YieldOption> option;
+		// Set while the coroutine awaits an operation completed by another thread, it is not advanced until woken
+		std::atomic<bool> parked = false;
+		// The manager running the coroutine, wakes it on its own thread
+		CoroutineManager* manager = nullptr;
 		Coroutine get_return_object() noexcept;
 		std::suspend_always initial_suspend() noexcept;
 		std::suspend_always final_suspend() noexcept;
@@ -29,6 +39,7 @@ public:
 	};
 private:
 	std::coroutine_handle<promise_type> handle;
+	friend class CoroutineManager;
 public:
 	Coroutine(promise_type* p) noexcept;
 	Coroutine(Coroutine&& other) noexcept;
@@ -36,14 +47,38 @@ public:
 
 	bool Advance(Clock& clock) const;
 	bool Finished() const;
+	bool Parked() const;
+
+	/// <summary>
+	/// Called by an awaiter before it suspends the coroutine until an operation completes on another thread
+	/// </summary>
+	static void Park(std::coroutine_handle<promise_type> handle);
+
+	/// <summary>
+	/// Called from any thread once the operation a parked coroutine awaits completes.
+	/// The coroutine is resumed by its manager's next Run(), or by the next Advance() if it has no manager.
+	/// </summary>
+	static void Wake(std::coroutine_handle<promise_type> handle);
 };
 
 class CoroutineManager {
+	friend struct Coroutine;
+	// Coroutines woken by other threads, guarded by wokenLock which is never held while calling out
+	std::mutex wokenLock;
+	std::vector<void*> woken;
+	// Parked coroutines are kept aside so Run() does not visit them until they are woken
+	std::unordered_map<void*, std::shared_ptr<Coroutine>> parked;
 	std::list<std::shared_ptr<Coroutine>> coroutines;
+
+	void Wake(void* address);
 public:
 	CoroutineManager() = default;
+	CoroutineManager(const CoroutineManager& other) = delete;
+	CoroutineManager& operator = (const CoroutineManager& other) = delete;
 	void Run(Clock& clock);
 	std::weak_ptr<Coroutine> AddCoroutine(Coroutine&& coroutine);
+	// Destroys every coroutine, including parked ones
+	void Clear();
 	bool Empty() const;
 };
 
@@ -9,7 +9,7 @@
 #include <bit>
 #include <glm/glm.hpp>
 #include <array>
-#include <WinSock2.h>
+#include "networking/networking.hpp"
 #include "debug/log.hpp"
 
 
@@ -1,7 +1,6 @@
 #ifndef MULTIPLAYER_SETTING
 #define MULTIPLAYER_SETTING
 #include <glm/glm.hpp>
-#include <winsock2.h>
 #include "networking/lite_conn.hpp"
 
 static TimeoutSetting ConnectionTimeOut {
@@ -11,6 +10,24 @@ static TimeoutSetting ConnectionTimeOut {
 	.replyKeepDuration = std::chrono::seconds(3)
 };
 
+// Channels of the game connection, the client and the server use the same layout
+namespace MTP_Channel {
+	enum : uint8_t {
+		GameState, // Server snapshots, stale ones are dropped
+		Input, // Client input, stale ones are dropped
+		Command // Server commands, delivered in order
+	};
+}
+
+// Messages a client connection queues until the game reads them, the client drains them all once per frame
+static constexpr size_t ClientPacketQueueCapacity = 100;
+
+static const LiteConnSetting ConnectionSetting = {
+	.channels = { ChannelType::UnreliableSequenced, ChannelType::UnreliableSequenced, ChannelType::ReliableOrdered },
+	// Snapshots grow with the slices of both players, small messages are not worth the codec's time
+	.compressionThreshold = 128
+};
+
 namespace MTP_Setting {
 	constexpr float fruitPlaneZ = 0;
 	constexpr float bombPlaneZ = 5;
@@ -0,0 +1,152 @@
+#include "capture.hpp"
+#include <algorithm>
+#include <cstring>
+
+static constexpr char CAPTURE_MAGIC[4] = { 'L', 'C', 'A', 'P' };
+static constexpr uint8_t CAPTURE_VERSION = 1;
+
+static void WriteVarint(std::vector<char>& output, uint64_t value) {
+	while (value >= 0x80) {
+		output.push_back(static_cast<char>((value & 0x7F) | 0x80));
+		value >>= 7;
+	}
+	output.push_back(static_cast<char>(value));
+}
+
+static std::optional<uint64_t> ReadVarint(std::istream& input) {
+	uint64_t value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		auto byte = input.get();
+		if (byte == std::char_traits<char>::eof()) return {};
+		value |= uint64_t(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) return value;
+	}
+	return {};
+}
+
+// Fixed size fields are little endian regardless of the host byte order
+static void WriteFixed(std::vector<char>& output, uint64_t value, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		output.push_back(static_cast<char>(value >> (8 * i)));
+	}
+}
+
+static std::optional<uint64_t> ReadFixed(std::istream& input, size_t size) {
+	uint64_t value = 0;
+	for (size_t i = 0; i < size; i++) {
+		auto byte = input.get();
+		if (byte == std::char_traits<char>::eof()) return {};
+		value |= uint64_t(static_cast<uint8_t>(byte)) << (8 * i);
+	}
+	return value;
+}
+
+static std::chrono::nanoseconds Since(std::chrono::steady_clock::time_point time) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch());
+}
+
+PacketRecorder::PacketRecorder(const std::string& path, std::span<const char> metadata)
+	: file(path, std::ios::binary | std::ios::trunc), previous(std::chrono::steady_clock::now())
+{
+	metadata = metadata.first(std::min<size_t>(metadata.size(), UINT16_MAX));
+	buffer.insert(buffer.end(), std::begin(CAPTURE_MAGIC), std::end(CAPTURE_MAGIC));
+	buffer.push_back(static_cast<char>(CAPTURE_VERSION));
+	WriteFixed(buffer, metadata.size(), sizeof(uint16_t));
+	buffer.insert(buffer.end(), metadata.begin(), metadata.end());
+	// Records store the time since the previous one, the first one since the start of the capture
+	WriteFixed(buffer, static_cast<uint64_t>(Since(previous).count()), sizeof(uint64_t));
+	WriteOut();
+}
+
+PacketRecorder::~PacketRecorder() {
+	Flush();
+}
+
+bool PacketRecorder::Good() const {
+	return file.good();
+}
+
+void PacketRecorder::WriteOut() {
+	file.write(buffer.data(), buffer.size());
+	buffer.clear();
+}
+
+void PacketRecorder::Record(PacketDirection direction, const sockaddr_in& address, std::span<const std::span<const char>> parts) {
+	size_t size = 0;
+	for (auto& part : parts) {
+		size += part.size();
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	auto now = std::chrono::steady_clock::now();
+	buffer.push_back(static_cast<char>(direction));
+	WriteVarint(buffer, static_cast<uint64_t>((Since(now) - Since(previous)).count()));
+	WriteVarint(buffer, size);
+	auto addressBytes = reinterpret_cast<const char*>(&address.sin_addr.s_addr);
+	buffer.insert(buffer.end(), addressBytes, addressBytes + sizeof(address.sin_addr.s_addr));
+	auto portBytes = reinterpret_cast<const char*>(&address.sin_port);
+	buffer.insert(buffer.end(), portBytes, portBytes + sizeof(address.sin_port));
+	for (auto& part : parts) {
+		buffer.insert(buffer.end(), part.begin(), part.end());
+	}
+	previous = now;
+	if (buffer.size() >= BUFFER_SIZE) WriteOut();
+}
+
+void PacketRecorder::Flush() {
+	std::lock_guard<std::mutex> guard(lock);
+	WriteOut();
+	file.flush();
+}
+
+CaptureReader::CaptureReader(const std::string& path) : file(path, std::ios::binary) {
+	char magic[sizeof(CAPTURE_MAGIC)];
+	if (!file.read(magic, sizeof(magic)) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) return;
+	if (file.get() != CAPTURE_VERSION) return;
+	auto size = ReadFixed(file, sizeof(uint16_t));
+	if (!size) return;
+	metadata.resize(*size);
+	if (!file.read(metadata.data(), metadata.size())) return;
+	auto start = ReadFixed(file, sizeof(uint64_t));
+	if (!start) return;
+	previous = std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(*start)));
+	good = true;
+}
+
+bool CaptureReader::Good() const {
+	return good;
+}
+
+std::span<const char> CaptureReader::Metadata() const {
+	return metadata;
+}
+
+std::optional<CapturedPacket> CaptureReader::Next() {
+	if (!good) return {};
+	auto direction = file.get();
+	if (direction == std::char_traits<char>::eof()) return {};
+	auto delta = ReadVarint(file);
+	auto size = ReadVarint(file);
+	// Datagrams are at most 65535 bytes, anything larger is a corrupted record
+	if (!delta || !size || *size > UINT16_MAX || direction > static_cast<int>(PacketDirection::Outbound)) {
+		good = false;
+		return {};
+	}
+
+	CapturedPacket packet = {
+		.direction = static_cast<PacketDirection>(direction),
+		.time = previous + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(*delta)),
+		.address = {},
+		.payload = std::vector<char>(*size)
+	};
+	packet.address.sin_family = AF_INET;
+	file.read(reinterpret_cast<char*>(&packet.address.sin_addr.s_addr), sizeof(packet.address.sin_addr.s_addr));
+	file.read(reinterpret_cast<char*>(&packet.address.sin_port), sizeof(packet.address.sin_port));
+	file.read(packet.payload.data(), packet.payload.size());
+	if (!file) {
+		good = false;
+		return {};
+	}
+	previous = packet.time;
+	return packet;
+}
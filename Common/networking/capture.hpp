@@ -0,0 +1,81 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "networking.hpp"
+
+enum class PacketDirection : uint8_t {
+	Inbound,
+	Outbound
+};
+
+struct CapturedPacket {
+	PacketDirection direction;
+	// On the steady_clock scale of the recording process
+	std::chrono::steady_clock::time_point time;
+	// The source of inbound datagrams, the target of outbound ones
+	sockaddr_in address;
+	std::vector<char> payload;
+};
+
+/// <summary>
+/// Appends datagrams to a capture file, shared by the sockets of a manager.
+/// The file starts with a header holding the owner's metadata, then each record holds the direction, the time since the
+/// previous record and the size as varints, followed by the IPv4 address, the port and the payload.
+/// </summary>
+class PacketRecorder {
+private:
+	std::mutex lock;
+	std::ofstream file;
+	// Records are written out once the buffer grows past BUFFER_SIZE
+	std::vector<char> buffer;
+	std::chrono::steady_clock::time_point previous;
+	static constexpr size_t BUFFER_SIZE = 1 << 16;
+
+	void WriteOut();
+public:
+	/// <param name="metadata"> Stored in the header for the replay, at most 65535 bytes </param>
+	PacketRecorder(const std::string& path, std::span<const char> metadata = {});
+	PacketRecorder(const PacketRecorder& other) = delete;
+	PacketRecorder& operator = (const PacketRecorder& other) = delete;
+	~PacketRecorder();
+
+	bool Good() const;
+
+	/// <summary>
+	/// Appends a datagram gathered from the parts, the time is read under the lock so records are in time order
+	/// </summary>
+	void Record(PacketDirection direction, const sockaddr_in& address, std::span<const std::span<const char>> parts);
+
+	/// <summary>
+	/// Writes the buffered records to the file
+	/// </summary>
+	void Flush();
+};
+
+/// <summary>
+/// Reads a capture file written by PacketRecorder one record at a time
+/// </summary>
+class CaptureReader {
+private:
+	std::ifstream file;
+	std::vector<char> metadata;
+	std::chrono::steady_clock::time_point previous;
+	bool good = false;
+public:
+	explicit CaptureReader(const std::string& path);
+
+	/// <returns> false if the file could not be opened or is not a capture </returns>
+	bool Good() const;
+	std::span<const char> Metadata() const;
+
+	/// <returns> The next record, empty at the end of the file or at a truncated record </returns>
+	std::optional<CapturedPacket> Next();
+};
+#endif
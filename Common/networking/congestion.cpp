@@ -0,0 +1,86 @@
+#include "congestion.hpp"
+#include <algorithm>
+
+CongestionController::CongestionController(const CongestionSetting& setting)
+	: setting(setting), window(static_cast<double>(std::clamp(setting.initialWindow, setting.minWindow, setting.maxWindow))), threshold(static_cast<double>(setting.maxWindow)) {}
+
+size_t CongestionController::Window() const {
+	return static_cast<size_t>(window);
+}
+
+uint64_t CongestionController::Decreases() const {
+	return decreases;
+}
+
+void CongestionController::OnAcknowledged(size_t packets) {
+	for (size_t i = 0; i < packets; i++) {
+		window += window < threshold ? 1 : 1 / window;
+	}
+	window = std::min(window, static_cast<double>(setting.maxWindow));
+}
+
+void CongestionController::Decrease(std::chrono::steady_clock::time_point sent, std::chrono::steady_clock::time_point now) {
+	if (sent < recoveryStart) return;
+	window = std::max(window * setting.decrease, static_cast<double>(setting.minWindow));
+	threshold = window;
+	recoveryStart = now;
+	decreases++;
+}
+
+void CongestionController::OnLoss(std::chrono::steady_clock::time_point sent, std::chrono::steady_clock::time_point now) {
+	Decrease(sent, now);
+}
+
+void CongestionController::OnRoundTrip(std::chrono::steady_clock::duration sample, std::chrono::steady_clock::time_point sent, std::chrono::steady_clock::time_point now) {
+	minRoundTrip = std::min(minRoundTrip, sample);
+	if (setting.queueDelayThreshold > std::chrono::steady_clock::duration::zero() && sample - minRoundTrip > setting.queueDelayThreshold) {
+		Decrease(sent, now);
+	}
+}
+
+double CongestionController::PacingRate(std::chrono::steady_clock::duration smoothedRtt, size_t packetSize) const {
+	double rate = setting.maxBandwidth;
+	if (smoothedRtt > std::chrono::steady_clock::duration::zero()) {
+		double windowRate = setting.pacingGain * window * static_cast<double>(packetSize) / std::chrono::duration<double>(smoothedRtt).count();
+		rate = rate > 0 ? std::min(rate, windowRate) : windowRate;
+	}
+	return rate;
+}
+
+TokenBucket::TokenBucket(double rate, double burst, std::chrono::steady_clock::time_point now)
+	: rate(rate), burst(burst), tokens(burst), refilled(now) {}
+
+void TokenBucket::Refill(std::chrono::steady_clock::time_point now) {
+	if (now <= refilled) return;
+	tokens = std::min(burst, tokens + rate * std::chrono::duration<double>(now - refilled).count());
+	refilled = now;
+}
+
+void TokenBucket::SetRate(double rate, std::chrono::steady_clock::time_point now) {
+	// Tokens earned so far are kept at the previous rate
+	Refill(now);
+	this->rate = rate;
+}
+
+double TokenBucket::Rate() const {
+	return rate;
+}
+
+bool TokenBucket::Ready(std::chrono::steady_clock::time_point now) {
+	if (rate <= 0) return true;
+	Refill(now);
+	return tokens > 0;
+}
+
+void TokenBucket::Take(double amount, std::chrono::steady_clock::time_point now) {
+	if (rate <= 0) return;
+	Refill(now);
+	tokens -= amount;
+}
+
+std::chrono::steady_clock::time_point TokenBucket::NextReady(std::chrono::steady_clock::time_point now) {
+	if (Ready(now)) return now;
+	// Rounded up so the bucket is positive once the time is reached
+	auto wait = std::chrono::duration<double>((-tokens) / rate);
+	return now + std::chrono::ceil<std::chrono::steady_clock::duration>(wait) + std::chrono::steady_clock::duration(1);
+}
@@ -0,0 +1,84 @@
+#ifndef CONGESTION_H
+#define CONGESTION_H
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+/// <summary>
+/// Congestion control of the reliable packets of a connection and pacing of its data messages
+/// </summary>
+struct CongestionSetting {
+	// Reliable packets in flight before the first congestion signal, the window doubles every round trip until then
+	size_t initialWindow = 16;
+	size_t minWindow = 4;
+	size_t maxWindow = 1024;
+	// The window is multiplied by this on a congestion signal, at most once per round trip
+	double decrease = 0.5;
+	// A round trip this much longer than the shortest one seen counts as congestion, 0 only reacts to losses
+	std::chrono::steady_clock::duration queueDelayThreshold = std::chrono::milliseconds(50);
+	// The pacer sends gain times the window per smoothed round trip, so it never holds back a window that is not full
+	double pacingGain = 2;
+	// Bytes per second sent in data messages and retransmissions at most, 0 only paces by the window
+	double maxBandwidth = 0;
+	// Bytes sent at once after the connection was idle
+	double pacingBurst = 16 * 1024;
+};
+
+/// <summary>
+/// AIMD congestion window counted in reliable packets. Grows by one packet per acknowledgement until the first
+/// congestion signal and by one packet per window afterwards. Losses and round trips that exceed the shortest one
+/// by the queue delay threshold shrink it, signals about packets sent before the last decrease are ignored.
+/// Not thread safe.
+/// </summary>
+class CongestionController {
+private:
+	CongestionSetting setting;
+	double window;
+	double threshold;
+	std::chrono::steady_clock::duration minRoundTrip = std::chrono::steady_clock::duration::max();
+	// Packets sent before the last decrease belong to the window that was already reduced
+	std::chrono::steady_clock::time_point recoveryStart = {};
+	uint64_t decreases = 0;
+
+	void Decrease(std::chrono::steady_clock::time_point sent, std::chrono::steady_clock::time_point now);
+public:
+	explicit CongestionController(const CongestionSetting& setting);
+
+	size_t Window() const;
+	uint64_t Decreases() const;
+
+	void OnAcknowledged(size_t packets);
+	void OnLoss(std::chrono::steady_clock::time_point sent, std::chrono::steady_clock::time_point now);
+	void OnRoundTrip(std::chrono::steady_clock::duration sample, std::chrono::steady_clock::time_point sent, std::chrono::steady_clock::time_point now);
+
+	/// <returns> Bytes per second the pacer should allow, 0 if the data is not paced </returns>
+	double PacingRate(std::chrono::steady_clock::duration smoothedRtt, size_t packetSize) const;
+};
+
+/// <summary>
+/// Byte budget refilled at a fixed rate. A send is allowed while the budget is positive and may take it below 0,
+/// so a message larger than the burst is delayed rather than blocked. Not thread safe.
+/// </summary>
+class TokenBucket {
+private:
+	double rate;
+	double burst;
+	double tokens;
+	std::chrono::steady_clock::time_point refilled;
+
+	void Refill(std::chrono::steady_clock::time_point now);
+public:
+	/// <param name="rate"> Tokens added per second, 0 never limits </param>
+	/// <param name="burst"> Tokens the bucket holds at most, it starts full </param>
+	TokenBucket(double rate, double burst, std::chrono::steady_clock::time_point now);
+
+	void SetRate(double rate, std::chrono::steady_clock::time_point now);
+	double Rate() const;
+
+	bool Ready(std::chrono::steady_clock::time_point now);
+	void Take(double amount, std::chrono::steady_clock::time_point now);
+
+	/// <returns> The earliest time Ready() returns true </returns>
+	std::chrono::steady_clock::time_point NextReady(std::chrono::steady_clock::time_point now);
+};
+#endif
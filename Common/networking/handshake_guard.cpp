@@ -0,0 +1,133 @@
+#include "handshake_guard.hpp"
+#include <algorithm>
+#include <random>
+#include <cstring>
+
+static uint64_t RotateLeft(uint64_t value, int count) {
+	return (value << count) | (value >> (64 - count));
+}
+
+static void SipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3) {
+	v0 += v1; v1 = RotateLeft(v1, 13); v1 ^= v0; v0 = RotateLeft(v0, 32);
+	v2 += v3; v3 = RotateLeft(v3, 16); v3 ^= v2;
+	v0 += v3; v3 = RotateLeft(v3, 21); v3 ^= v0;
+	v2 += v1; v1 = RotateLeft(v1, 17); v1 ^= v2; v2 = RotateLeft(v2, 32);
+}
+
+// Reads up to 8 bytes as a little endian word regardless of the host byte order
+static uint64_t ReadWord(const char* data, size_t count) {
+	uint64_t word = 0;
+	for (size_t i = 0; i < count; i++) {
+		word |= uint64_t(static_cast<uint8_t>(data[i])) << (8 * i);
+	}
+	return word;
+}
+
+uint64_t SipHash(const std::array<uint64_t, 2>& key, std::span<const char> data) {
+	uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+
+	size_t full = data.size() / 8 * 8;
+	for (size_t offset = 0; offset < full; offset += 8) {
+		uint64_t word = ReadWord(data.data() + offset, 8);
+		v3 ^= word;
+		SipRound(v0, v1, v2, v3);
+		SipRound(v0, v1, v2, v3);
+		v0 ^= word;
+	}
+	// The last word holds the remaining bytes and the length in its top byte
+	uint64_t last = ReadWord(data.data() + full, data.size() - full) | (uint64_t(data.size()) << 56);
+	v3 ^= last;
+	SipRound(v0, v1, v2, v3);
+	SipRound(v0, v1, v2, v3);
+	v0 ^= last;
+
+	v2 ^= 0xff;
+	for (int i = 0; i < 4; i++) {
+		SipRound(v0, v1, v2, v3);
+	}
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static std::array<uint64_t, 2> RandomKey() {
+	std::random_device device;
+	std::array<uint64_t, 2> key;
+	for (auto& word : key) {
+		word = (uint64_t(device()) << 32) | device();
+	}
+	return key;
+}
+
+// The address bytes hashed for a source, the port is left out by the limiter since it is free to choose
+static size_t WriteAddress(char* output, const sockaddr_in& address, bool withPort) {
+	memcpy(output, &address.sin_addr.s_addr, sizeof(address.sin_addr.s_addr));
+	if (!withPort) return sizeof(address.sin_addr.s_addr);
+	memcpy(output + sizeof(address.sin_addr.s_addr), &address.sin_port, sizeof(address.sin_port));
+	return sizeof(address.sin_addr.s_addr) + sizeof(address.sin_port);
+}
+
+HandshakeCookie::HandshakeCookie(std::chrono::steady_clock::duration lifetime)
+	: HandshakeCookie(lifetime, RandomKey()) {}
+
+HandshakeCookie::HandshakeCookie(std::chrono::steady_clock::duration lifetime, const std::array<uint64_t, 2>& key)
+	: key(key), lifetime(std::max<std::chrono::steady_clock::duration>(lifetime, std::chrono::milliseconds(1))) {}
+
+const std::array<uint64_t, 2>& HandshakeCookie::Key() const {
+	return key;
+}
+
+int64_t HandshakeCookie::Bucket(std::chrono::steady_clock::time_point now) const {
+	return now.time_since_epoch() / lifetime;
+}
+
+uint32_t HandshakeCookie::Compute(const sockaddr_in& address, uint32_t checksum, uint32_t features, int64_t bucket) const {
+	std::array<char, 32> message;
+	size_t size = WriteAddress(message.data(), address, true);
+	memcpy(message.data() + size, &checksum, sizeof(checksum));
+	size += sizeof(checksum);
+	memcpy(message.data() + size, &features, sizeof(features));
+	size += sizeof(features);
+	memcpy(message.data() + size, &bucket, sizeof(bucket));
+	size += sizeof(bucket);
+
+	auto hash = SipHash(key, std::span<const char>(message.data(), size));
+	auto cookie = static_cast<uint32_t>(hash ^ (hash >> 32));
+	// Session id 0 is reserved for SYNs
+	return cookie != 0 ? cookie : 1;
+}
+
+uint32_t HandshakeCookie::Issue(const sockaddr_in& address, uint32_t checksum, uint32_t features, std::chrono::steady_clock::time_point now) const {
+	return Compute(address, checksum, features, Bucket(now));
+}
+
+bool HandshakeCookie::Validate(uint32_t cookie, const sockaddr_in& address, uint32_t checksum, uint32_t features, std::chrono::steady_clock::time_point now) const {
+	auto bucket = Bucket(now);
+	// A cookie issued just before the bucket changed is still accepted
+	return cookie == Compute(address, checksum, features, bucket) || cookie == Compute(address, checksum, features, bucket - 1);
+}
+
+static size_t BucketCount(size_t count) {
+	size_t result = 1;
+	while (result < count) result <<= 1;
+	return result;
+}
+
+HandshakeLimiter::HandshakeLimiter(size_t numBuckets, double rate, double burst)
+	: key(RandomKey()), buckets(BucketCount(numBuckets), Bucket{ burst, {} }), mask(buckets.size() - 1), rate(rate), burst(burst) {}
+
+bool HandshakeLimiter::TryTake(const sockaddr_in& address, std::chrono::steady_clock::time_point now) {
+	std::array<char, 8> message;
+	size_t size = WriteAddress(message.data(), address, false);
+	auto& bucket = buckets[SipHash(key, std::span<const char>(message.data(), size)) & mask];
+
+	if (now > bucket.refilled) {
+		std::chrono::duration<double> elapsed = now - bucket.refilled;
+		bucket.tokens = std::min(burst, bucket.tokens + elapsed.count() * rate);
+		bucket.refilled = now;
+	}
+	if (bucket.tokens < 1) return false;
+	bucket.tokens -= 1;
+	return true;
+}
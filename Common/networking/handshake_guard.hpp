@@ -0,0 +1,71 @@
+#ifndef HANDSHAKE_GUARD_H
+#define HANDSHAKE_GUARD_H
+#include <array>
+#include <vector>
+#include <chrono>
+#include <span>
+#include <cstdint>
+#include <cstddef>
+#include "networking.hpp"
+
+/// <summary>
+/// SipHash-2-4 of the data under a 128 bit key, cheap enough to run for every handshake packet
+/// </summary>
+uint64_t SipHash(const std::array<uint64_t, 2>& key, std::span<const char> data);
+
+/// <summary>
+/// Stateless handshake cookies. The session id a server hands out in its SYN | ACK is a keyed hash of the client's address,
+/// the client's checksum, the negotiated features and the current time bucket. The client echoes the checksum and the features
+/// in its ACK, so the server keeps nothing about a handshake until the ACK proves the client received the SYN | ACK.
+/// </summary>
+class HandshakeCookie {
+private:
+	std::array<uint64_t, 2> key;
+	std::chrono::steady_clock::duration lifetime;
+
+	int64_t Bucket(std::chrono::steady_clock::time_point now) const;
+	uint32_t Compute(const sockaddr_in& address, uint32_t checksum, uint32_t features, int64_t bucket) const;
+public:
+	/// <param name="lifetime"> A cookie is accepted for at least this long and at most twice as long after it was issued </param>
+	explicit HandshakeCookie(std::chrono::steady_clock::duration lifetime);
+	/// <summary>
+	/// Uses the given key instead of a random one, so a replayed capture validates the cookies the recorded server handed out
+	/// </summary>
+	HandshakeCookie(std::chrono::steady_clock::duration lifetime, const std::array<uint64_t, 2>& key);
+
+	const std::array<uint64_t, 2>& Key() const;
+
+	/// <returns> A non zero cookie, the same for every SYN of the client within a time bucket </returns>
+	uint32_t Issue(const sockaddr_in& address, uint32_t checksum, uint32_t features, std::chrono::steady_clock::time_point now) const;
+
+	/// <returns> true if the cookie was issued to the address for the checksum and features within its lifetime </returns>
+	bool Validate(uint32_t cookie, const sockaddr_in& address, uint32_t checksum, uint32_t features, std::chrono::steady_clock::time_point now) const;
+};
+
+/// <summary>
+/// Token buckets limiting the handshake packets answered per source address. The buckets are a fixed array indexed by a keyed
+/// hash of the address, so a flood from spoofed addresses cannot grow memory, addresses sharing a bucket share its budget.
+/// Not thread safe.
+/// </summary>
+class HandshakeLimiter {
+private:
+	struct Bucket {
+		double tokens;
+		std::chrono::steady_clock::time_point refilled;
+	};
+
+	std::array<uint64_t, 2> key;
+	std::vector<Bucket> buckets;
+	size_t mask;
+	double rate;
+	double burst;
+public:
+	/// <param name="numBuckets"> Rounded up to a power of two </param>
+	/// <param name="rate"> Tokens added to a bucket per second </param>
+	/// <param name="burst"> Tokens a bucket holds at most, a new source starts with a full bucket </param>
+	HandshakeLimiter(size_t numBuckets, double rate, double burst);
+
+	/// <returns> true if a token was taken from the bucket of the address, false if the packet should be dropped </returns>
+	bool TryTake(const sockaddr_in& address, std::chrono::steady_clock::time_point now);
+};
+#endif
@@ -0,0 +1,94 @@
+#include "impairment.hpp"
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+
+Impairment::Impairment(const ImpairmentSetting& setting)
+	: setting(setting), random(setting.seed) {}
+
+bool Impairment::Later(const Held& a, const Held& b) {
+	return a.release != b.release ? a.release > b.release : a.order > b.order;
+}
+
+double Impairment::Uniform() {
+	return (random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+bool Impairment::Chance(double probability) {
+	// Nothing is drawn for disabled impairments, enabling one does not change the decisions of the others
+	return probability > 0 && Uniform() < probability;
+}
+
+std::chrono::steady_clock::duration Impairment::SampleDelay() {
+	if (setting.jitter == std::chrono::steady_clock::duration::zero()) return setting.latency;
+
+	double deviation;
+	if (setting.distribution == DelayDistribution::Normal) {
+		// Box-Muller, 1 - Uniform() is never 0
+		deviation = std::sqrt(-2 * std::log(1 - Uniform())) * std::cos(2 * std::numbers::pi * Uniform());
+	}
+	else {
+		deviation = 2 * Uniform() - 1;
+	}
+	auto delay = setting.latency + std::chrono::duration_cast<std::chrono::steady_clock::duration>(setting.jitter * deviation);
+	return std::max(delay, std::chrono::steady_clock::duration::zero());
+}
+
+void Impairment::Hold(std::chrono::steady_clock::time_point release, PacketSlot&& slot) {
+	held.push_back({ release, nextOrder++, std::move(slot) });
+	std::push_heap(held.begin(), held.end(), Later);
+}
+
+void Impairment::Admit(PacketSlot&& slot) {
+	stats.received++;
+	if (Chance(setting.lossRate)) {
+		stats.dropped++;
+		return;
+	}
+
+	auto arrival = slot.timeReceived;
+	if (setting.bandwidth != 0) {
+		// The link transmits one datagram at a time, the delay starts once it is through
+		auto start = std::max(linkFree, arrival);
+		if (start - arrival > setting.maxQueueDelay) {
+			stats.dropped++;
+			return;
+		}
+		std::chrono::duration<double> transmission(static_cast<double>(slot.size) / setting.bandwidth);
+		linkFree = start + std::chrono::round<std::chrono::steady_clock::duration>(transmission);
+		arrival = linkFree;
+	}
+
+	auto release = arrival + SampleDelay();
+	if (Chance(setting.reorderRate)) {
+		release += setting.reorderDelay;
+		stats.reordered++;
+	}
+	if (Chance(setting.duplicateRate)) {
+		// The copy shares the buffer, received datagrams are never written to
+		stats.duplicated++;
+		Hold(release, PacketSlot(slot));
+	}
+	Hold(release, std::move(slot));
+}
+
+size_t Impairment::Release(std::span<PacketSlot> slots, std::chrono::steady_clock::time_point now) {
+	size_t filled = 0;
+	while (filled < slots.size() && !held.empty() && held.front().release <= now) {
+		std::pop_heap(held.begin(), held.end(), Later);
+		auto& entry = held.back();
+		slots[filled] = std::move(entry.slot);
+		slots[filled].timeReceived = entry.release;
+		held.pop_back();
+		filled++;
+	}
+	return filled;
+}
+
+std::chrono::steady_clock::time_point Impairment::NextRelease() const {
+	return held.empty() ? std::chrono::steady_clock::time_point::max() : held.front().release;
+}
+
+const ImpairmentStats& Impairment::Stats() const {
+	return stats;
+}
@@ -0,0 +1,91 @@
+#ifndef IMPAIRMENT_H
+#define IMPAIRMENT_H
+#include <chrono>
+#include <random>
+#include <span>
+#include <vector>
+#include <cstdint>
+#include "socket.hpp"
+
+enum class DelayDistribution : uint8_t {
+	Uniform, // Between latency - jitter and latency + jitter
+	Normal // Centered on latency with jitter as the standard deviation
+};
+
+/// <summary>
+/// Simulated network conditions applied to received datagrams. Every decision is drawn from a generator seeded
+/// with seed, so the same sequence of arrivals is impaired the same way in every run.
+/// </summary>
+struct ImpairmentSetting {
+	// Probability that a datagram is dropped
+	double lossRate = 0;
+	// Probability that a datagram is delivered twice
+	double duplicateRate = 0;
+	// Probability that a datagram is held back by reorderDelay, so datagrams arriving after it overtake it
+	double reorderRate = 0;
+	std::chrono::steady_clock::duration reorderDelay = std::chrono::milliseconds(10);
+	// Delay of every datagram, samples below 0 are clamped to 0
+	std::chrono::steady_clock::duration latency = {};
+	std::chrono::steady_clock::duration jitter = {};
+	DelayDistribution distribution = DelayDistribution::Uniform;
+	// Bytes per second of the simulated link, 0 is unlimited. Datagrams wait for the link in the order they arrive.
+	size_t bandwidth = 0;
+	// Datagrams that would wait longer than this for the link are dropped
+	std::chrono::steady_clock::duration maxQueueDelay = std::chrono::milliseconds(200);
+	uint64_t seed = 1;
+};
+
+struct ImpairmentStats {
+	uint64_t received = 0;
+	// Lost and dropped by the bandwidth limit
+	uint64_t dropped = 0;
+	uint64_t duplicated = 0;
+	uint64_t reordered = 0;
+};
+
+/// <summary>
+/// Holds received datagrams until the simulated network would have delivered them
+/// </summary>
+class Impairment {
+private:
+	struct Held {
+		std::chrono::steady_clock::time_point release;
+		// Datagrams released at the same time keep their order
+		uint64_t order;
+		PacketSlot slot;
+	};
+
+	ImpairmentSetting setting;
+	std::mt19937_64 random;
+	// Min-heap by release time
+	std::vector<Held> held;
+	uint64_t nextOrder = 0;
+	std::chrono::steady_clock::time_point linkFree;
+	ImpairmentStats stats;
+
+	static bool Later(const Held& a, const Held& b);
+	// Uniform in [0, 1), computed here so runs are reproducible across standard libraries
+	double Uniform();
+	bool Chance(double probability);
+	std::chrono::steady_clock::duration SampleDelay();
+	void Hold(std::chrono::steady_clock::time_point release, PacketSlot&& slot);
+public:
+	explicit Impairment(const ImpairmentSetting& setting);
+
+	/// <summary>
+	/// Takes the datagram of a slot that arrived at its timeReceived, it is delivered later, more than once or never
+	/// </summary>
+	void Admit(PacketSlot&& slot);
+
+	/// <summary>
+	/// Moves the datagrams due by now into the slots, their timeReceived is the time they were due
+	/// </summary>
+	/// <returns> The number of slots filled from the front of the span </returns>
+	size_t Release(std::span<PacketSlot> slots, std::chrono::steady_clock::time_point now);
+
+	/// <returns> When the next held datagram is due, time_point::max() if none is held </returns>
+	std::chrono::steady_clock::time_point NextRelease() const;
+
+	const ImpairmentStats& Stats() const;
+};
+#endif
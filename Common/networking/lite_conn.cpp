@@ -1,42 +1,88 @@
 #include "lite_conn.hpp"
 #include "debug/log.hpp"
 #include <cassert>
+#include <algorithm>
+#include <bit>
 
 LiteConnResponse::LiteConnResponse(){}
 
 LiteConnResponse::LiteConnResponse(
 	std::weak_ptr<LiteConnConnection>&& connection, 
-	const uint64_t& id, 
-	std::future<std::optional<LiteConnMessage>>&& value
-) : connection(std::move(connection)), requestID(id), response(std::move(value))
+	const uint64_t& id
+) : connection(std::move(connection)), requestID(id), isValid(true)
+{ }
+
+LiteConnResponse::LiteConnResponse(LiteConnResponse&& other) noexcept
+	: connection(std::move(other.connection)), requestID(other.requestID), isValid(std::exchange(other.isValid, false))
 { }
 
+LiteConnResponse& LiteConnResponse::operator = (LiteConnResponse&& other) noexcept {
+	if (this != &other) {
+		Cancel();
+		connection = std::move(other.connection);
+		requestID = other.requestID;
+		isValid = std::exchange(other.isValid, false);
+	}
+	return *this;
+}
+
 LiteConnResponse::operator bool() {
-	return response.valid();
+	return isValid;
 }
 
 LiteConnResponse::~LiteConnResponse() {
-	if (response.valid()) {
-		auto ptr = connection.lock();
-		if (ptr) {
-			ptr->CloseRequest(requestID);
-		}
-	}
+	Cancel();
 }
 
 void LiteConnResponse::Cancel() {
-	if (response.valid()) {
-		auto ptr = connection.lock();
-		if (ptr) {
-			ptr->CloseRequest(requestID);
-		}
-		response = {};
+	if (!std::exchange(isValid, false)) return;
+	auto ptr = connection.lock();
+	if (ptr) {
+		ptr->CloseRequest(requestID);
 	}
 }
 
+bool LiteConnResponse::WaitFor(std::chrono::steady_clock::duration timeout) const {
+	if (!isValid) return true;
+	auto ptr = connection.lock();
+	if (!ptr) return true;
+	return ptr->WaitForResponse(requestID, timeout);
+}
+
 std::optional<LiteConnMessage> LiteConnResponse::GetResponse() {
-	if (!response.valid()) return {};
-	return response.get();
+	if (!std::exchange(isValid, false)) return {};
+	auto ptr = connection.lock();
+	if (!ptr) return {};
+	return ptr->TakeResponse(requestID);
+}
+
+LiteConnResponse::Awaiter LiteConnResponse::operator co_await() {
+	return Awaiter{ *this };
+}
+
+LiteConnResponse::Awaiter::~Awaiter() {
+	// The coroutine was destroyed while parked, the connection must not wake it anymore
+	if (!registered) return;
+	auto ptr = response.connection.lock();
+	if (ptr) {
+		ptr->ClearWaiter(response.requestID);
+	}
+}
+
+bool LiteConnResponse::Awaiter::await_ready() const {
+	return response.WaitFor({});
+}
+
+bool LiteConnResponse::Awaiter::await_suspend(std::coroutine_handle<Coroutine::promise_type> handle) {
+	auto ptr = response.connection.lock();
+	if (!ptr) return false;
+	registered = ptr->AwaitResponse(response.requestID, handle);
+	return registered;
+}
+
+std::optional<LiteConnMessage> LiteConnResponse::Awaiter::await_resume() {
+	registered = false;
+	return response.GetResponse();
 }
 
 LiteConnRequest::LiteConnRequest(
@@ -90,86 +136,781 @@ std::optional<LiteConnResponse> LiteConnRequest::Converse(const std::span<const
 
 
 LiteConnConnection::LiteConnConnection(
-	std::shared_ptr<UDPSocket> socket, size_t packetQueueCapacity, 
-	sockaddr_in peerAddr, uint32_t sessionID, TimeoutSetting setting
+	std::shared_ptr<UDPSocket> socket, std::shared_ptr<TimerQueue> timers, size_t packetQueueCapacity, 
+	sockaddr_in peerAddr, uint32_t sessionID, TimeoutSetting setting, size_t sendQueueCapacity, OverflowPolicy unreliableOverflow
 )
-	: peerAddr(peerAddr), queueCapacity(packetQueueCapacity), socket(std::move(socket)), 
-	lastReceived(std::chrono::steady_clock::now()), 
-	pktIndex(0), timeout(setting), sessionID(sessionID), latestReceivedIndex(0),
-	status(ConnectionStatus::Disconnected), heartBeatTime(std::chrono::steady_clock::now() + setting.connectionRetryInterval)
+	: socket(std::move(socket)), timers(std::move(timers)), pktIndex(0), sessionID(sessionID),
+	queueCapacity(packetQueueCapacity), unreliableOverflow(unreliableOverflow),
+	lastReceived(this->timers->Now()), heartBeatTime(this->timers->Now() + setting.connectionRetryInterval), latestReceivedIndex(0),
+	retransmitTimeout(setting.impRetryInterval), peerAddr(peerAddr), status(ConnectionStatus::Disconnected), outbound(sendQueueCapacity),
+	packetQueue(unreliableOverflow == OverflowPolicy::DropOldest ? packetQueueCapacity * 2 : packetQueueCapacity), timeout(setting)
 {
 
 }
 
 void LiteConnConnection::UpdateAddress(const LiteConnHeader& header, const sockaddr_in& address) {
 	if (int32_t(header.index) - int32_t(latestReceivedIndex) >= 0) {
-		peerAddr = address;
 		latestReceivedIndex = header.index;
+		// Without MIGRATE the newest packet decides the address
+		if (status != ConnectionStatus::Connected || !(features & LiteConnFeature::MIGRATE)) {
+			peerAddr = address;
+		}
+		else if (!SockAddrInEqual(address, peerAddr)) {
+			StartPathValidation(address);
+		}
 	}
-	lastReceived = std::chrono::steady_clock::now();
+	lastReceived = timers->Now();
 	heartBeatTime = lastReceived.load() + timeout.connectionRetryInterval;
 }
 
+void LiteConnConnection::StartPathValidation(const sockaddr_in& address) {
+	if (pathCandidate && SockAddrInEqual(*pathCandidate, address)) return;
+	// A later address replaces the one being validated, packets from either are still processed meanwhile
+	std::random_device device;
+	pathCandidate = address;
+	pathToken = (uint64_t(device()) << 32) | device();
+	// The offered id is kept until a validation succeeds, the peer may have switched to it already
+	if (rotateSession && nextSessionID == 0) {
+		while (nextSessionID == 0 || nextSessionID == sessionID) nextSessionID = device();
+		aliasSessionID = nextSessionID;
+	}
+	auto now = timers->Now();
+	pathDeadline = now + timeout.connectionTimeout;
+	SendPathChallenge(now);
+}
+
+void LiteConnConnection::SendPathChallenge(std::chrono::steady_clock::time_point now) {
+	LiteConnHeader challengeHeader = {
+		.sessionID = sessionID,
+		.index = pktIndex++,
+		.flag = LiteConnHeaderFlag::SYN | LiteConnHeaderFlag::HBT,
+		.id32 = nextSessionID,
+		.id64 = pathToken
+	};
+	std::array<char, LiteConnHeader::MaxSize> buffer;
+	Transmit(EncodeHeader(challengeHeader, buffer), *pathCandidate, true);
+	ScheduleTimer(TimerKind::PathChallenge, now + retransmitTimeout, pathToken);
+}
+
+bool LiteConnConnection::TryHandlePathValidation(const LiteConnHeader& header, const sockaddr_in& address) {
+	if (header.flag == (LiteConnHeaderFlag::SYN | LiteConnHeaderFlag::HBT)) {
+		// Echoed under the id the challenge was sent with, the peer only routes the offered id once it validated us
+		LiteConnHeader responseHeader = {
+			.sessionID = header.sessionID,
+			.index = pktIndex++,
+			.flag = LiteConnHeaderFlag::SYN | LiteConnHeaderFlag::HBT | LiteConnHeaderFlag::ACK,
+			.id32 = header.id32,
+			.id64 = header.id64
+		};
+		std::array<char, LiteConnHeader::MaxSize> buffer;
+		Transmit(EncodeHeader(responseHeader, buffer), peerAddr, true);
+		if (header.id32 != 0 && header.id32 != sessionID) {
+			aliasSessionID = sessionID;
+			sessionID = header.id32;
+		}
+		return true;
+	}
+	if (header.flag == (LiteConnHeaderFlag::SYN | LiteConnHeaderFlag::HBT | LiteConnHeaderFlag::ACK)) {
+		// Stale and forged answers are dropped, the token only reached the challenged address
+		if (!pathCandidate || header.id64 != pathToken || header.id32 != nextSessionID || !SockAddrInEqual(address, *pathCandidate)) return true;
+		Debug::Log("Peer address validated, migrating the connection");
+		peerAddr = address;
+		pathCandidate.reset();
+		if (nextSessionID != 0) {
+			aliasSessionID = sessionID;
+			sessionID = std::exchange(nextSessionID, 0);
+		}
+		return true;
+	}
+	return false;
+}
+
 void LiteConnConnection::AckReceival(const LiteConnHeader& header) {
+	SendAcknowledgement(header.id32);
+	auto expiry = timers->Now() + timeout.replyKeepDuration;
+	if (autoAcks.emplace(header.id32, expiry).second) {
+		ScheduleTimer(TimerKind::AckExpire, expiry, header.id32);
+	}
+}
+
+void LiteConnConnection::SendAcknowledgement(uint32_t id) {
+	if (features & LiteConnFeature::SACK) {
+		pendingAcks.push_back(id);
+		ScheduleFlush();
+		return;
+	}
 	LiteConnHeader replyHeader = {
 		.sessionID = sessionID,
 		.index = pktIndex++,
 		.flag = LiteConnHeaderFlag::ACK,
-		.id32 = header.id32,
+		.id32 = id,
 	};
-	auto reply = LiteConnHeader::Serialize(replyHeader);
-	socket->SendPacket(reply, peerAddr);
-	autoAcks.emplace(
-		header.id32,
-		std::chrono::steady_clock::now() + timeout.replyKeepDuration
-	);
+	std::array<char, LiteConnHeader::MaxSize> buffer;
+	Transmit(EncodeHeader(replyHeader, buffer), peerAddr, true);
+}
+
+void LiteConnConnection::FlushAcknowledgements() {
+	// Newest first in serial number order so every ACK anchors the bitmap on its highest id
+	std::sort(pendingAcks.begin(), pendingAcks.end(), [](uint32_t a, uint32_t b) { return int32_t(a - b) > 0; });
+	pendingAcks.erase(std::unique(pendingAcks.begin(), pendingAcks.end()), pendingAcks.end());
+
+	for (size_t i = 0; i < pendingAcks.size();) {
+		LiteConnHeader replyHeader = {
+			.sessionID = sessionID,
+			.index = pktIndex++,
+			.flag = LiteConnHeaderFlag::ACK,
+			.id32 = pendingAcks[i++],
+			.id64 = 0
+		};
+		// Bit n acknowledges id32 - (n + 1)
+		for (; i < pendingAcks.size(); i++) {
+			uint32_t distance = replyHeader.id32 - pendingAcks[i];
+			if (distance > 64) break;
+			replyHeader.id64 |= uint64_t(1) << (distance - 1);
+		}
+		std::array<char, LiteConnHeader::MaxSize> buffer;
+		auto reply = EncodeHeader(replyHeader, buffer);
+		if (!TryBundle(reply)) {
+			Transmit(reply, peerAddr, true);
+		}
+	}
+	pendingAcks.clear();
+}
+
+void LiteConnConnection::ScheduleFlush() {
+	if (!std::exchange(flushScheduled, true)) {
+		ScheduleTimer(TimerKind::Flush, timers->Now());
+	}
+}
+
+bool LiteConnConnection::TryBundle(const std::span<const char> packet, const std::span<const char> body) {
+	if (!(features & LiteConnFeature::BUNDLE) || status != ConnectionStatus::Connected) return false;
+
+	size_t size = packet.size() + body.size();
+	size_t needed = sizeof(uint16_t) + size;
+	if (MaxHeaderSize() + needed > frameCapacity) {
+		// The packet is sent on its own, the bundle goes first to keep the order
+		FlushFrame(queueSends);
+		return false;
+	}
+	if (frameSize + needed > frameCapacity) {
+		FlushFrame(queueSends);
+	}
+	if (frameMessages == 0) {
+		if (!frame) frame = socket->AcquireBuffer(frameCapacity);
+		frameSize = MaxHeaderSize();
+		ScheduleFlush();
+	}
+	auto length = htons(static_cast<uint16_t>(size));
+	auto base = frame.Data() + frameSize;
+	memcpy(base, &length, sizeof(uint16_t));
+	memcpy(base + sizeof(uint16_t), packet.data(), packet.size());
+	if (!body.empty()) memcpy(base + sizeof(uint16_t) + packet.size(), body.data(), body.size());
+	frameSize += needed;
+	frameMessages++;
+	return true;
+}
+
+void LiteConnConnection::FlushFrame(bool queue) {
+	if (frameMessages == 0) return;
+
+	std::span<const char> datagram;
+	if (frameMessages == 1) {
+		// A single packet does not need the bundle header
+		size_t skip = MaxHeaderSize() + sizeof(uint16_t);
+		datagram = { frame.Data() + skip, frameSize - skip };
+	}
+	else {
+		LiteConnHeader header = {
+			.sessionID = sessionID,
+			.index = pktIndex++,
+			.flag = LiteConnHeaderFlag::BUNDLE
+		};
+		// The bundle header ends where the reserved space does, a compact one leaves unused space in front
+		std::array<char, LiteConnHeader::MaxSize> buffer;
+		auto encoded = EncodeHeader(header, buffer);
+		auto start = MaxHeaderSize() - encoded.size();
+		std::copy(encoded.begin(), encoded.end(), frame.Data() + start);
+		datagram = { frame.Data() + start, frameSize - start };
+	}
+	Transmit(datagram, peerAddr, queue);
+	frameSize = 0;
+	frameMessages = 0;
+}
+
+bool LiteConnConnection::SendFragmented(const OutboundMessage& message) {
+	std::span<const char> data = message.payload;
+	size_t chunk = frameCapacity - MaxHeaderSize();
+	size_t count = (data.size() + chunk - 1) / chunk;
+	if (data.size() > maxMessageSize || count > UINT16_MAX) return false;
+
+	// id64 holds the message id, the fragment index and the fragment count
+	uint64_t messageID = messageIndex++;
+	for (size_t i = 0; i < count; i++) {
+		auto part = data.subspan(i * chunk, std::min(chunk, data.size() - i * chunk));
+		auto payload = AllocatePayload(part.size());
+		std::copy(part.begin(), part.end(), payload.begin());
+		Admit(OutboundMessage{
+			.payload = std::move(payload),
+			.channel = message.channel,
+			.reliable = true,
+			.flag = LiteConnHeaderFlag::IMP | LiteConnHeaderFlag::DATA,
+			.id64 = (messageID << 32) | (uint64_t(i) << 16) | count
+		});
+	}
+	return true;
+}
+
+bool LiteConnConnection::StoreFragment(const LiteConnHeader& header, PacketView& data) {
+	uint32_t messageID = static_cast<uint32_t>(header.id64 >> 32);
+	size_t index = (header.id64 >> 16) & UINT16_MAX;
+	size_t count = header.id64 & UINT16_MAX;
+	if (count < 2 || index >= count) {
+		Debug::LogError("Error: Received a fragment with an invalid index");
+		return true;
+	}
+
+	auto now = timers->Now();
+	auto entry = partialMessages.find(messageID);
+	if (entry == partialMessages.end()) {
+		// Every fragment but the last has the sender's fragment size, none is larger than a datagram
+		size_t chunk = index + 1 < count ? data.size() : socket->MaxPacketSize();
+		size_t reserved = std::min(count * chunk, maxMessageSize);
+		// The peer retransmits the fragment until there is room for the whole message
+		if (partialBytes + reserved > maxMessageSize) return false;
+		entry = partialMessages.try_emplace(messageID).first;
+		entry->second.fragments.resize(count);
+		entry->second.reserved = reserved;
+		partialBytes += reserved;
+		ScheduleTimer(TimerKind::Reassembly, now + timeout.reassemblyTimeout, messageID);
+	}
+	else if (entry->second.fragments.size() != count) {
+		Debug::LogError("Error: Received a fragment with a mismatching fragment count");
+		return true;
+	}
+	auto& message = entry->second;
+	auto& fragment = message.fragments[index];
+	if (fragment.Buffer()) {
+		message.expiry = now + timeout.reassemblyTimeout;
+		return true;
+	}
+	// Only a message larger than maxMessageSize exceeds its reservation, it expires and closes the connection
+	if (message.bytes + data.size() > message.reserved) return false;
+
+	message.expiry = now + timeout.reassemblyTimeout;
+	message.bytes += data.size();
+	message.received++;
+	fragment = std::move(data);
+	if (message.received < count) return true;
+
+	auto assembled = PacketView(socket->AcquireBuffer(message.bytes), 0, message.bytes);
+	auto base = assembled.data();
+	for (auto& part : message.fragments) {
+		base = std::copy(part.begin(), part.end(), base);
+	}
+	partialBytes -= message.reserved;
+	partialMessages.erase(entry);
+	DeliverMessage(std::move(assembled), true);
+	return true;
+}
+
+void LiteConnConnection::ClearReceiveBuffers() {
+	partialMessages.clear();
+	partialBytes = 0;
+	for (auto& channel : channels) {
+		channel.reordered.clear();
+	}
+	reorderedMessages = 0;
+}
+
+std::span<const char> LiteConnConnection::NoChannelEnvelope() const {
+	static constexpr char envelope[] = { static_cast<char>(NO_CHANNEL) };
+	if (!(features & LiteConnFeature::CHANNEL)) return {};
+	return envelope;
+}
+
+void LiteConnConnection::CompressPayload(PacketView& payload) {
+	// The marker is followed by the original size when the payload is compressed
+	constexpr size_t markerSize = sizeof(uint8_t) + sizeof(uint32_t);
+	if (payload.size() >= compressionThreshold) {
+		auto start = std::chrono::steady_clock::now();
+		auto compressed = AllocatePayload(PayloadCodec::Bound(payload.size()));
+		size_t size = codec->Compress(payload, compressed);
+		compressionTime += std::chrono::steady_clock::now() - start;
+		if (size != 0 && size + markerSize < payload.size()) {
+			compressedMessages++;
+			uncompressedBytes += payload.size();
+			compressedBytes += size + markerSize;
+
+			auto originalSize = htonl(static_cast<uint32_t>(payload.size()));
+			payload = compressed.Slice(0, size);
+			bool expanded = payload.ExpandFront(markerSize);
+			assert(expanded);
+			payload.data()[0] = static_cast<char>(CompressionMarker::Compressed);
+			memcpy(payload.data() + sizeof(uint8_t), &originalSize, sizeof(uint32_t));
+			return;
+		}
+	}
+	bool expanded = payload.ExpandFront(sizeof(uint8_t));
+	assert(expanded);
+	payload.data()[0] = static_cast<char>(CompressionMarker::Uncompressed);
+}
+
+bool LiteConnConnection::DecompressPayload(PacketView& payload) {
+	if (payload.empty()) {
+		Debug::LogError("Error: Received a message without a compression marker");
+		return false;
+	}
+	auto marker = static_cast<CompressionMarker>(payload.data()[0]);
+	payload.RemovePrefix(sizeof(uint8_t));
+	if (marker == CompressionMarker::Uncompressed) return true;
+
+	uint32_t originalSize;
+	if (marker != CompressionMarker::Compressed || payload.size() < sizeof(uint32_t)) {
+		Debug::LogError("Error: Received a message with an invalid compression marker");
+		return false;
+	}
+	memcpy(&originalSize, payload.data(), sizeof(uint32_t));
+	originalSize = ntohl(originalSize);
+	payload.RemovePrefix(sizeof(uint32_t));
+	// The size is checked before allocating so a small message cannot claim a huge buffer
+	if (originalSize > maxMessageSize) {
+		Debug::LogError("Error: Received a compressed message of ", originalSize, " bytes, which exceeds the maximum message size");
+		return false;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	auto decompressed = PacketView(socket->AcquireBuffer(originalSize), 0, originalSize);
+	bool valid = codec->Decompress(payload, decompressed);
+	decompressionTime += std::chrono::steady_clock::now() - start;
+	if (!valid) {
+		Debug::LogError("Error: Received a malformed compressed message");
+		return false;
+	}
+	payload = std::move(decompressed);
+	return true;
+}
+
+uint64_t LiteConnConnection::OfferedFeatures() const {
+	return (uint64_t(codec->DictionaryID()) << 32) | features;
+}
+
+void LiteConnConnection::DeliverMessage(PacketView&& data, bool reliable) {
+	if ((features & LiteConnFeature::COMPRESS) && !DecompressPayload(data)) return;
+	if (!(features & LiteConnFeature::CHANNEL)) {
+		Enqueue({ std::move(data), std::nullopt, NO_CHANNEL, reliable });
+		return;
+	}
+	if (data.empty()) {
+		Debug::LogError("Error: Received a message without a channel");
+		return;
+	}
+	uint8_t channelID = static_cast<uint8_t>(data.data()[0]);
+	data.RemovePrefix(sizeof(uint8_t));
+	if (channelID == NO_CHANNEL) {
+		Enqueue({ std::move(data), std::nullopt, NO_CHANNEL, reliable });
+		return;
+	}
+	if (channelID >= channels.size()) {
+		Debug::LogError("Error: Received a message on unknown channel ", static_cast<int>(channelID));
+		return;
+	}
+
+	auto& channel = channels[channelID];
+	if (channel.type == ChannelType::Unreliable || channel.type == ChannelType::ReliableUnordered) {
+		Enqueue({ std::move(data), std::nullopt, channelID, reliable });
+		return;
+	}
+
+	if (data.size() < sizeof(uint32_t)) {
+		Debug::LogError("Error: Received a message without a sequence number");
+		return;
+	}
+	uint32_t sequence;
+	memcpy(&sequence, data.data(), sizeof(uint32_t));
+	sequence = ntohl(sequence);
+	data.RemovePrefix(sizeof(uint32_t));
+
+	// Serial number arithmetic, sequence numbers wrap around
+	int32_t distance = static_cast<int32_t>(sequence - channel.nextReceive);
+	if (distance < 0) return;
+
+	if (channel.type == ChannelType::UnreliableSequenced) {
+		channel.nextReceive = sequence + 1;
+		Enqueue({ std::move(data), std::nullopt, channelID, reliable });
+		return;
+	}
+
+	// Reliable ordered, only this channel waits for the missing message
+	if (distance > 0) {
+		if (channel.reordered.emplace(sequence, std::move(data)).second) reorderedMessages++;
+		return;
+	}
+	Enqueue({ std::move(data), std::nullopt, channelID, reliable });
+	channel.nextReceive++;
+	for (auto next = channel.reordered.find(channel.nextReceive); next != channel.reordered.end(); next = channel.reordered.find(channel.nextReceive)) {
+		Enqueue({ std::move(next->second), std::nullopt, channelID, reliable });
+		channel.reordered.erase(next);
+		reorderedMessages--;
+		channel.nextReceive++;
+	}
+}
+
+void LiteConnConnection::Enqueue(LiteConnMessage&& message) {
+	bool replaces = !message.reliable && unreliableOverflow == OverflowPolicy::DropOldest && QueuedMessages() >= queueCapacity;
+	if (!packetQueue.TryPush(std::move(message))) {
+		queueFullDrops.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	// The message is pushed first, so the consumer always finds as many unreliable messages as are stale
+	if (replaces) {
+		staleMessages.fetch_add(1, std::memory_order_release);
+		queueFullDrops.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+size_t LiteConnConnection::QueuedMessages() const {
+	// The consumer may pop between the loads, the result is only ever an estimate for it
+	auto stale = staleMessages.load(std::memory_order_acquire);
+	auto size = packetQueue.Size();
+	return (size > stale ? size - stale : 0) + reorderedMessages.load(std::memory_order_relaxed);
+}
+
+size_t LiteConnConnection::SkipStale(std::span<LiteConnMessage> messages) {
+	if (staleMessages.load(std::memory_order_acquire) == 0) return messages.size();
+	size_t kept = 0;
+	for (auto& message : messages) {
+		// Only the consumer decrements, so a count read as positive stays positive
+		if (!message.reliable && staleMessages.load(std::memory_order_relaxed) > 0) {
+			staleMessages.fetch_sub(1, std::memory_order_relaxed);
+			message = {};
+			continue;
+		}
+		if (&messages[kept] != &message) messages[kept] = std::exchange(message, {});
+		kept++;
+	}
+	return kept;
 }
 
-void LiteConnConnection::SendPacket(LiteConnHeader& header, const std::span<const char> data) {
+uint32_t LiteConnConnection::ReceiveLimit() const {
+	size_t queued = QueuedMessages();
+	return reliableReceived.load(std::memory_order_relaxed) + static_cast<uint32_t>(queued < queueCapacity ? queueCapacity - queued : 0);
+}
+
+void LiteConnConnection::CheckReceiveWindow() {
+	// features is written before the status while connecting
+	if (status != ConnectionStatus::Connected || !(features & LiteConnFeature::FLOW)) return;
+	// Advertised once half of the queue was freed, the periodic heartbeats advertise smaller changes
+	if (int32_t(ReceiveLimit() - advertisedLimit.load(std::memory_order_relaxed)) < static_cast<int32_t>(std::max<size_t>(queueCapacity / 2, 1))) return;
+	if (windowUpdateScheduled.exchange(true)) return;
+	ScheduleTimer(TimerKind::WindowUpdate, timers->Now());
+}
+
+uint32_t LiteConnConnection::AdvertiseWindow() {
+	if (!(features & LiteConnFeature::FLOW)) return 0;
+	auto limit = ReceiveLimit();
+	advertisedLimit.store(limit, std::memory_order_relaxed);
+	return limit;
+}
+
+bool LiteConnConnection::HasSendCredit() const {
+	if (congestion && autoResendEntries.size() + pacedReliable >= congestion->Window()) return false;
+	if (!(features & LiteConnFeature::FLOW) || !peerWindowKnown) return true;
+	return int32_t(peerLimit - reliableSent - static_cast<uint32_t>(pacedReliable)) > 0;
+}
+
+void LiteConnConnection::UpdatePeerWindow(uint32_t limit) {
+	if (!(features & LiteConnFeature::FLOW)) return;
+	peerLimit = limit;
+	peerWindowKnown = true;
+	ReleaseHeldMessages();
+}
+
+void LiteConnConnection::SendOrHold(OutboundMessage&& message) {
+	// Requests and responses are never held or paced, they only count as in flight
+	if (message.flag != 0) {
+		SendOutbound(std::move(message));
+		return;
+	}
+	EncodeOutbound(message);
+	// Fragments count against the windows and the pacer one at a time, so a large message does not leave as one burst
+	if (message.reliable && MaxHeaderSize() + message.payload.size() > frameCapacity && (features & LiteConnFeature::FRAGMENT)) {
+		if (!SendFragmented(message)) {
+			Debug::LogError("Attempting to send a message of ", message.payload.size(), " bytes, which exceeds the maximum message size");
+		}
+		return;
+	}
+	Admit(std::move(message));
+}
+
+void LiteConnConnection::Admit(OutboundMessage&& message) {
+	// Later reliable messages wait behind the held ones to keep their order
+	if (message.reliable && (!heldMessages.empty() || !HasSendCredit())) {
+		heldMessages.push_back(std::move(message));
+		return;
+	}
+	Pace(std::move(message));
+}
+
+void LiteConnConnection::ReleaseHeldMessages() {
+	while (!heldMessages.empty() && HasSendCredit()) {
+		auto message = std::move(heldMessages.front());
+		heldMessages.pop_front();
+		Pace(std::move(message));
+	}
+}
+
+void LiteConnConnection::Pace(OutboundMessage&& message) {
+	if (pacer) {
+		auto now = timers->Now();
+		if (!pacedMessages.empty() || !pacer->Ready(now)) {
+			if (message.reliable) pacedReliable++;
+			pacedMessages.push_back(std::move(message));
+			SchedulePacing(now);
+			return;
+		}
+		pacer->Take(static_cast<double>(MaxHeaderSize() + message.payload.size()), now);
+	}
+	SendOutbound(std::move(message));
+}
+
+void LiteConnConnection::ReleasePacedMessages(std::chrono::steady_clock::time_point now) {
+	while (!pacedMessages.empty() && pacer->Ready(now)) {
+		auto message = std::move(pacedMessages.front());
+		pacedMessages.pop_front();
+		if (message.reliable) pacedReliable--;
+		pacer->Take(static_cast<double>(MaxHeaderSize() + message.payload.size()), now);
+		SendOutbound(std::move(message));
+	}
+	if (!pacedMessages.empty()) SchedulePacing(now);
+}
+
+void LiteConnConnection::SchedulePacing(std::chrono::steady_clock::time_point now) {
+	if (!std::exchange(paceScheduled, true)) {
+		ScheduleTimer(TimerKind::Pace, pacer->NextReady(now));
+	}
+}
+
+void LiteConnConnection::UpdatePacingRate(std::chrono::steady_clock::time_point now) {
+	if (!congestion) return;
+	pacer->SetRate(congestion->PacingRate(rttMeasured ? smoothedRtt : std::chrono::steady_clock::duration::zero(), frameCapacity), now);
+}
+
+bool LiteConnConnection::FitsDatagram(size_t size) const {
+	if (MaxHeaderSize() + size <= socket->MaxPacketSize()) return true;
+	Debug::LogError("Attempting to send a request or response of ", size, " bytes, which exceeds the maximum packet size");
+	return false;
+}
+
+PacketView LiteConnConnection::AllocatePayload(size_t size) {
+	return PacketView(socket->AcquireBuffer(PACKET_HEADROOM + size), PACKET_HEADROOM, size);
+}
+
+void LiteConnConnection::WriteHeader(const LiteConnHeader& header, PacketView& packet) {
+	bool expanded = packet.ExpandFront(compactHeaders ? LiteConnHeader::CompactSize(header) : LiteConnHeader::Size);
+	assert(expanded);
+	EncodeHeader(header, packet);
+}
+
+std::span<const char> LiteConnConnection::EncodeHeader(const LiteConnHeader& header, std::span<char> buffer) const {
+	if (compactHeaders) {
+		return buffer.first(LiteConnHeader::SerializeCompact(header, buffer));
+	}
+	LiteConnHeader::Serialize(header, buffer);
+	return buffer.first(LiteConnHeader::Size);
+}
+
+std::optional<std::pair<LiteConnHeader, size_t>> LiteConnConnection::ReadHeader(std::span<const char> packet) const {
+	// Without COMPACT an index with its top bit set would be mistaken for the compact marker
+	if (compactHeaders) return LiteConnHeader::DeserializeCompact(packet);
+	auto header = LiteConnHeader::Deserialize(packet);
+	if (!header) return {};
+	return std::make_pair(header.value(), LiteConnHeader::Size);
+}
+
+size_t LiteConnConnection::MaxHeaderSize() const {
+	return compactHeaders ? LiteConnHeader::MaxCompactSize : LiteConnHeader::Size;
+}
+
+void LiteConnConnection::QueuePacket(LiteConnHeader& header, const std::span<const char> data) {
 	header.sessionID = sessionID;
 	header.index = pktIndex++;
-	auto payload = LiteConnHeader::Serialize(header);
-	payload.insert(payload.end(), data.begin(), data.end());
-	socket->SendPacket(payload, peerAddr);
+	auto packet = AllocatePayload(data.size());
+	std::copy(data.begin(), data.end(), packet.begin());
+	WriteHeader(header, packet);
+	Transmit(packet, peerAddr, true);
 }
 
 void LiteConnConnection::SendPacketReliable(LiteConnHeader& header, const std::span<const char> data) {
+	auto payload = AllocatePayload(data.size());
+	std::copy(data.begin(), data.end(), payload.begin());
+	SendPayloadReliable(header, std::move(payload));
+}
+
+void LiteConnConnection::SendPayloadReliable(LiteConnHeader& header, PacketView&& payload, PacketView&& body) {
 	header.sessionID = sessionID;
 	header.index = pktIndex++;
 	header.id32 = impIndex++;
-	auto payload = LiteConnHeader::Serialize(header);
-	payload.insert(payload.end(), data.begin(), data.end());
-	socket->SendPacket(payload, peerAddr);
-	auto pair = autoResendEntries.emplace(
+	// Counted against the peer's receive window, see ReceiveLimit()
+	if (header.flag == (LiteConnHeaderFlag::IMP | LiteConnHeaderFlag::DATA)) reliableSent++;
+	WriteHeader(header, payload);
+	if (!TryBundle(payload, body)) {
+		SendDatagram(payload, body);
+	}
+	auto now = timers->Now();
+	auto resend = now + retransmitTimeout;
+	autoResendEntries.emplace(
 		header.id32,
 		AutoResendEntry{
 			.packet = std::move(payload),
-			.resend = std::chrono::steady_clock::now() + timeout.impRetryInterval
+			.body = std::move(body),
+			.sent = now,
+			.resend = resend,
+			.interval = retransmitTimeout
 		}
 	);
+	ScheduleTimer(TimerKind::Resend, resend, header.id32);
 }
 
-void LiteConnConnection::CloseRequest(uint64_t index) {
+void LiteConnConnection::SendDatagram(const std::span<const char> datagram, const std::span<const char> body) {
+	std::array<std::span<const char>, 2> parts = { datagram, body };
+	auto gathered = std::span<const std::span<const char>>(parts).first(body.empty() ? 1 : 2);
+	Transmit(gathered, peerAddr, queueSends);
+}
+
+void LiteConnConnection::Transmit(std::span<const std::span<const char>> parts, const sockaddr_in& address, bool queue) {
+	size_t size = 0;
+	for (auto& part : parts) {
+		size += part.size();
+	}
+	packetsSent.fetch_add(1, std::memory_order_relaxed);
+	bytesSent.fetch_add(size, std::memory_order_relaxed);
+	if (queue) {
+		socket->QueuePacket(parts, address);
+	}
+	else {
+		socket->SendPacket(parts, address);
+	}
+}
+
+void LiteConnConnection::Transmit(const std::span<const char> datagram, const sockaddr_in& address, bool queue) {
+	Transmit(std::span(&datagram, 1), address, queue);
+}
+
+void LiteConnConnection::SampleRoundTrip(std::chrono::steady_clock::duration sample) {
+	// Jacobson/Karels estimation with the gains of RFC 6298
+	if (!rttMeasured) {
+		smoothedRtt = sample;
+		rttVariance = sample / 2;
+		rttMeasured = true;
+	}
+	else {
+		auto error = smoothedRtt > sample ? smoothedRtt - sample : sample - smoothedRtt;
+		rttVariance = (rttVariance * 3 + error) / 4;
+		smoothedRtt = (smoothedRtt * 7 + sample) / 8;
+	}
+	retransmitTimeout = std::clamp(smoothedRtt + rttVariance * 4, timeout.minRetryInterval, timeout.maxRetryInterval);
+	roundTrips.Record(sample);
+}
+
+void LiteConnConnection::ScheduleTimer(TimerKind kind, std::chrono::steady_clock::time_point deadline, uint64_t id) {
+	if (timers->Schedule(TimerEvent{ deadline, weak_from_this(), kind, id })) {
+		// The routing thread may be sleeping past the new deadline
+		socket->Wake();
+	}
+}
+
+void LiteConnConnection::StartTimers() {
 	std::lock_guard<std::mutex> guard(lock);
+	ScheduleTimer(TimerKind::Heartbeat, heartBeatTime.load());
+	ScheduleTimer(TimerKind::Timeout, lastReceived.load() + timeout.connectionTimeout);
+}
+
+void LiteConnConnection::CloseRequest(uint64_t index) {
+	// A response that was never taken is dropped after the lock is released, as its request handle takes the lock to reject itself
+	std::optional<LiteConnMessage> dropped;
+	std::unique_lock<std::mutex> guard(lock);
 	auto requestEntry = requestHandles.find(index);
 	if (requestEntry == requestHandles.end()) return;
+	if (requestEntry->second.completed) {
+		dropped = std::move(requestEntry->second.response);
+		requestHandles.erase(requestEntry);
+		return;
+	}
 	autoResendEntries.erase(index);
-	requestEntry->second.set_value(std::nullopt);
 	requestHandles.erase(requestEntry);
+	guard.unlock();
 
-	LiteConnHeader replyHeader = {
-		.sessionID = sessionID,
-		.index = pktIndex++,
-		.flag = LiteConnHeaderFlag::CXL,
-		.id64 = index,
+	// Queued behind the request in case the routing thread has not sent it yet
+	EnqueueControl(LiteConnHeaderFlag::CXL, index, AllocatePayload(0));
+}
+
+bool LiteConnConnection::WaitForResponse(uint64_t index, std::chrono::steady_clock::duration timeout) {
+	std::unique_lock<std::mutex> guard(lock);
+	auto predicate = [&]() {
+		auto entry = requestHandles.find(index);
+		return entry == requestHandles.end() || entry->second.completed;
 	};
-	SendPacketReliable(replyHeader, {});
+	return cv.wait_for(guard, timeout, predicate);
 }
 
-void LiteConnConnection::RejectRequest(uint64_t index) {
+std::optional<LiteConnMessage> LiteConnConnection::TakeResponse(uint64_t index) {
+	std::unique_lock<std::mutex> guard(lock);
+	// Looked up again after every wake up, other requests may rehash the map meanwhile
+	auto entry = requestHandles.end();
+	cv.wait(guard, [&]() {
+		entry = requestHandles.find(index);
+		return entry == requestHandles.end() || entry->second.completed;
+	});
+	if (entry == requestHandles.end()) return {};
+	auto result = std::move(entry->second.response);
+	requestHandles.erase(entry);
+	return result;
+}
+
+bool LiteConnConnection::AwaitResponse(uint64_t index, std::coroutine_handle<Coroutine::promise_type> handle) {
 	std::lock_guard<std::mutex> guard(lock);
-	if (!pendingResponses.erase(index)) return;
-	
+	auto entry = requestHandles.find(index);
+	if (entry == requestHandles.end() || entry->second.completed) return false;
+	Coroutine::Park(handle);
+	entry->second.waiter = handle;
+	return true;
+}
+
+void LiteConnConnection::ClearWaiter(uint64_t index) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto entry = requestHandles.find(index);
+	if (entry != requestHandles.end()) {
+		entry->second.waiter = {};
+	}
+}
+
+void LiteConnConnection::CompleteRequest(PendingRequest& request, std::optional<LiteConnMessage>&& response) {
+	request.response = std::move(response);
+	request.completed = true;
+	if (auto waiter = std::exchange(request.waiter, {})) {
+		Coroutine::Wake(waiter);
+	}
+	cv.notify_all();
+}
+
+void LiteConnConnection::CancelRequests() {
+	for (auto& request : requestHandles) {
+		if (!request.second.completed) {
+			CompleteRequest(request.second, std::nullopt);
+		}
+	}
+}
+
+void LiteConnConnection::RejectRequest(uint64_t index) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (!pendingResponses.erase(index)) return;
+	}
+	EnqueueControl(LiteConnHeaderFlag::ACK | LiteConnHeaderFlag::CXL, index, AllocatePayload(0));
+}
+
+void LiteConnConnection::SendRejection(uint64_t index) {
 	LiteConnHeader header = {
 		.sessionID = sessionID,
 		.index = pktIndex++,
@@ -181,64 +922,82 @@ void LiteConnConnection::RejectRequest(uint64_t index) {
 }
 
 void LiteConnConnection::Respond(uint64_t index, const std::span<const char>& data) {
-	std::lock_guard<std::mutex> guard(lock);
-	if (!pendingResponses.erase(index)) return;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (!pendingResponses.erase(index)) return;
+	}
+	// The peer's response completes empty instead of waiting for one that never arrives
+	if (!FitsDatagram(data.size())) {
+		EnqueueControl(LiteConnHeaderFlag::ACK | LiteConnHeaderFlag::CXL, index, AllocatePayload(0));
+		return;
+	}
 
-	LiteConnHeader replyHeader = {
-		.flag = LiteConnHeaderFlag::DATA | LiteConnHeaderFlag::ACK,
-		.id64 = index,
-	};
-	SendPacketReliable(replyHeader, data);
+	auto payload = AllocatePayload(data.size());
+	std::copy(data.begin(), data.end(), payload.begin());
+	EnqueueControl(LiteConnHeaderFlag::DATA | LiteConnHeaderFlag::ACK, index, std::move(payload));
 }
 
 std::optional<LiteConnResponse> LiteConnConnection::Converse(uint64_t index, const std::span<const char>& data){
-	std::lock_guard<std::mutex> guard(lock);
-	if (!pendingResponses.erase(index)) return {};
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (!pendingResponses.erase(index)) return {};
+	}
+	if (!FitsDatagram(sizeof(uint64_t) + data.size())) {
+		EnqueueControl(LiteConnHeaderFlag::ACK | LiteConnHeaderFlag::CXL, index, AllocatePayload(0));
+		return {};
+	}
+	// Registered before the reply is queued, the follow up's response cannot arrive earlier
+	auto requestID = RegisterRequest();
+	if (!requestID) return {};
 
-	LiteConnHeader replyHeader = {
-		.flag = LiteConnHeaderFlag::DATA | LiteConnHeaderFlag::ACK | LiteConnHeaderFlag::REQ,
-		.id64 = index,
-	};
-	std::vector<char> payload(sizeof(uint64_t) + data.size());
-	uint64_t requestID = reqIndex++;
+	auto payload = AllocatePayload(sizeof(uint64_t) + data.size());
 	auto ptr = payload.data();
-	auto serializedID = htonll(requestID);
+	auto serializedID = htonll(requestID.value());
 	memcpy(std::exchange(ptr, ptr + sizeof(serializedID)), &serializedID, sizeof(uint64_t));
 	memcpy(ptr, data.data(), data.size());
+	EnqueueControl(LiteConnHeaderFlag::DATA | LiteConnHeaderFlag::ACK | LiteConnHeaderFlag::REQ, index, std::move(payload));
+	return LiteConnResponse{ weak_from_this(), requestID.value() };
+}
 
-	SendPacketReliable(replyHeader, payload);
-	auto entry = requestHandles.emplace(requestID, std::promise<std::optional<LiteConnMessage>>{});
-	assert(entry.second);
-	auto& kwp = entry.first;
-	return LiteConnResponse{ weak_from_this(), kwp->first, kwp->second.get_future() };
+void LiteConnConnection::EnqueueControl(uint8_t flag, uint64_t id64, PacketView&& payload, PacketView&& body) {
+	EnqueueMessage(OutboundMessage{
+		.payload = std::move(payload),
+		.reliable = true,
+		.flag = flag,
+		.id64 = id64,
+		.body = std::move(body)
+	});
 }
 
 #pragma warning(push)
 #pragma warning(disable: 26813)
-bool LiteConnConnection::TryHandleMissedHandshake(const LiteConnHeader& header, const std::vector<char>& data) {
+bool LiteConnConnection::TryHandleMissedHandshake(const LiteConnHeader& header, const PacketView& data) {
 	if (header.flag == LiteConnHeaderFlag::SYN) {
-		LiteConnHeader replyHeader = {
-			.sessionID = sessionID,
-			.flag = LiteConnHeaderFlag::ACK,
-		};
 		Debug::Log("Client retransmit syn-ack message");
-		auto reply = LiteConnHeader::Serialize(replyHeader);
-		socket->SendPacket(reply, peerAddr);
+		SendHandshakeAcknowledgement();
 		return true;
 	}
 	return false;
 }
 
+bool LiteConnConnection::TryHandleRepeatedHandshake(const LiteConnHeader& header) {
+	// A handshake ACK the client sent again before it heard from the server, it acknowledges no packet.
+	// Once the client sent anything else it has stopped repeating, so later ACKs are never mistaken for one.
+	return handshakeRepeatable && header.flag == LiteConnHeaderFlag::ACK && header.index == 0 && header.id32 == clientChecksum && header.id64 == features;
+}
+
 bool LiteConnConnection::TryHandleDisconnect(const LiteConnHeader& header) {
 	if (header.flag & LiteConnHeaderFlag::FIN) {
 		Debug::Log("Received FIN signal from peer, closing connection");
 		status = ConnectionStatus::Disconnected;
-		for (auto& promise : requestHandles) {
-			promise.second.set_value(std::nullopt);
-		}
-		requestHandles.clear();
+		CancelRequests();
+		pendingResponses.clear();
 		autoResendEntries.clear();
-		packetQueue.clear();
+		heldMessages.clear();
+		pacedMessages.clear();
+		pacedReliable = 0;
+		ClearReceiveBuffers();
+		cv.notify_all();
 		return true;
 	}
 	return false;
@@ -248,28 +1007,47 @@ bool LiteConnConnection::TryHandleDuplicates(const LiteConnHeader& header) {
 	if (header.flag & (LiteConnHeaderFlag::CXL | LiteConnHeaderFlag::IMP | LiteConnHeaderFlag::REQ)) {
 		auto ackEntry = autoAcks.find(header.id32);
 		if (ackEntry != autoAcks.end()) {
-			ackEntry->second = std::chrono::steady_clock::now() + timeout.replyKeepDuration;
-			LiteConnHeader replyHeader = {
-				.sessionID = sessionID,
-				.index = pktIndex++,
-				.flag = LiteConnHeaderFlag::ACK,
-				.id32 = header.id32
-			};
-			SendPacket(replyHeader, {});
+			ackEntry->second = timers->Now() + timeout.replyKeepDuration;
+			SendAcknowledgement(header.id32);
 			return true;
 		}
 	}
 	return false;
 }
 
-bool LiteConnConnection::TryHandleAcknowledgement(const LiteConnHeader& header, std::vector<char>& data) {
+bool LiteConnConnection::TryHandleAcknowledgement(const LiteConnHeader& header, PacketView& data) {
 	if (header.flag & LiteConnHeaderFlag::ACK) {
 		if (!(header.flag & LiteConnHeaderFlag::DATA)) { 
-			autoResendEntries.erase(header.id32);
+			auto now = timers->Now();
+			size_t acknowledged = 0;
+			auto entry = autoResendEntries.find(header.id32);
+			if (entry != autoResendEntries.end()) {
+				// Karn's rule, an ACK of a retransmitted packet may belong to any of its copies
+				if (!entry->second.retransmitted) {
+					auto sample = now - entry->second.sent;
+					SampleRoundTrip(sample);
+					if (congestion) congestion->OnRoundTrip(sample, entry->second.sent, now);
+				}
+				autoResendEntries.erase(entry);
+				acknowledged++;
+			}
+			// A selective ACK also covers the ids marked in its bitmap
+			if (header.flag == LiteConnHeaderFlag::ACK && (features & LiteConnFeature::SACK)) {
+				for (auto bitmap = header.id64; bitmap; bitmap &= bitmap - 1) {
+					acknowledged += autoResendEntries.erase(header.id32 - uint32_t(std::countr_zero(bitmap) + 1));
+				}
+			}
+			if (congestion && acknowledged > 0) {
+				congestion->OnAcknowledged(acknowledged);
+				UpdatePacingRate(now);
+				ReleaseHeldMessages();
+			}
 			return true; 
 		}
 
 		auto result = requestHandles.find(header.id64);
+		// A response to a request that was already completed is a late copy, or arrived after the peer cancelled it
+		if (result != requestHandles.end() && result->second.completed) return true;
 		if (result == requestHandles.end()) {
 			// Tells the peer the REQ has expired or not exist
 			LiteConnHeader reply = {
@@ -291,62 +1069,110 @@ bool LiteConnConnection::TryHandleAcknowledgement(const LiteConnHeader& header,
 
 			AckReceival(header);
 			pendingResponses.emplace(id);
-			data.erase(data.begin(), data.begin() + sizeof(uint64_t));
-			result->second.set_value(LiteConnMessage{ std::move(data), LiteConnRequest{weak_from_this(), id} } );
+			data.RemovePrefix(sizeof(uint64_t));
+			CompleteRequest(result->second, LiteConnMessage{ std::move(data), LiteConnRequest{weak_from_this(), id} });
 		}
 		else {
-			result->second.set_value(LiteConnMessage{ std::move(data), std::nullopt });
+			CompleteRequest(result->second, LiteConnMessage{ std::move(data), std::nullopt });
 		}
-		requestHandles.erase(result);
 		return true;
 	}
 	return false;
 }
 
-bool LiteConnConnection::TryHandleData(const LiteConnHeader& header, std::vector<char>& data) {
+bool LiteConnConnection::TryHandleData(const LiteConnHeader& header, PacketView& data) {
 	if (header.flag & LiteConnHeaderFlag::DATA) {
-		if (packetQueue.size() < queueCapacity) {
-			if (header.flag & LiteConnHeaderFlag::IMP) {
-				AckReceival(header);
-				packetQueue.emplace_back(std::move(data), std::nullopt);
+		// Reordered messages are counted so releasing them never overflows the queue
+		bool full = QueuedMessages() >= queueCapacity;
+		if (header.flag & LiteConnHeaderFlag::IMP) {
+			// Not acknowledged, the peer backs off and sends it again once the application caught up
+			if (full) {
+				queueFullDrops.fetch_add(1, std::memory_order_relaxed);
+				// The peer is still sending, a partial message only expires once its fragments stop arriving
+				if (header.id64 != 0 && (features & LiteConnFeature::FRAGMENT)) {
+					auto partial = partialMessages.find(static_cast<uint32_t>(header.id64 >> 32));
+					if (partial != partialMessages.end()) partial->second.expiry = timers->Now() + timeout.reassemblyTimeout;
+				}
+				return true;
 			}
-			else if (header.flag & LiteConnHeaderFlag::REQ) {
+			// Plain reliable packets leave id64 at 0
+			if (header.id64 != 0 && (features & LiteConnFeature::FRAGMENT)) {
+				if (!StoreFragment(header, data)) return true;
 				AckReceival(header);
-				pendingResponses.emplace(header.id64);
-				packetQueue.emplace_back(std::move(data), LiteConnRequest{ weak_from_this(), header.id64 });
+				reliableReceived.fetch_add(1, std::memory_order_relaxed);
+				// Stored fragments take no room in the queue, the peer's window is moved on without waiting for the application
+				CheckReceiveWindow();
 			}
 			else {
-				packetQueue.emplace_back(std::move(data), std::nullopt);
+				AckReceival(header);
+				DeliverMessage(std::move(data), true);
+				reliableReceived.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+		else if (header.flag & LiteConnHeaderFlag::REQ) {
+			if (full) {
+				queueFullDrops.fetch_add(1, std::memory_order_relaxed);
+				// The acknowledgement turns a retransmission of the request into a duplicate, the rejection is sent once
+				if (requestOverflow == OverflowPolicy::Reject) {
+					AckReceival(header);
+					SendRejection(header.id64);
+				}
+				return true;
+			}
+			AckReceival(header);
+			pendingResponses.emplace(header.id64);
+			Enqueue({ std::move(data), LiteConnRequest{ weak_from_this(), header.id64 }, NO_CHANNEL, true });
+		}
+		else {
+			if (full && unreliableOverflow != OverflowPolicy::DropOldest) {
+				queueFullDrops.fetch_add(1, std::memory_order_relaxed);
+				return true;
 			}
-			cv.notify_one();
+			DeliverMessage(std::move(data), false);
 		}
+		cv.notify_one();
 		return true;
 	}
 	return false;
 }
 
-bool LiteConnConnection::TryHandleHeartBeat(const LiteConnHeader& header, const std::vector<char>& data) {
+bool LiteConnConnection::TryHandleHeartBeat(const LiteConnHeader& header, const PacketView& data) {
 	// Acknowledge heartbeat packets
 	if (header.flag == LiteConnHeaderFlag::HBT) {
+		// The send time in id64 is echoed back so the peer can measure the round trip
 		LiteConnHeader replyHeader = {
 			.sessionID = sessionID,
 			.index = pktIndex++,
-			.flag = LiteConnHeaderFlag::ACK | LiteConnHeaderFlag::HBT
+			.flag = LiteConnHeaderFlag::ACK | LiteConnHeaderFlag::HBT,
+			.id32 = AdvertiseWindow(),
+			.id64 = header.id64
 		};
-		auto reply = LiteConnHeader::Serialize(replyHeader);
-		socket->SendPacket(reply, peerAddr);
+		std::array<char, LiteConnHeader::MaxSize> buffer;
+		Transmit(EncodeHeader(replyHeader, buffer), peerAddr, true);
+		UpdatePeerWindow(header.id32);
+		return true;
+	}
+	if (header.flag == (LiteConnHeaderFlag::ACK | LiteConnHeaderFlag::HBT)) {
+		UpdatePeerWindow(header.id32);
+		// Peers that do not echo the send time reply with 0
+		if (header.id64 != 0) {
+			auto sent = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(header.id64));
+			auto sample = timers->Now() - sent;
+			if (sample >= std::chrono::steady_clock::duration::zero() && sample <= timeout.connectionTimeout) {
+				SampleRoundTrip(sample);
+			}
+		}
 		return true;
 	}
 	return false;
 }
 
-bool LiteConnConnection::TryHandleRequestCancellation(const LiteConnHeader& header, const std::vector<char>& data){
+bool LiteConnConnection::TryHandleRequestCancellation(const LiteConnHeader& header, const PacketView& data){
 	if (header.flag & LiteConnHeaderFlag::CXL) {
 		if (header.flag & LiteConnHeaderFlag::ACK) { // Peer cancels request that was sent
 			auto entry = requestHandles.find(header.id64);
-			if (entry != requestHandles.end()) {
-				entry->second.set_value(std::nullopt);
-				requestHandles.erase(entry);
+			if (entry != requestHandles.end() && !entry->second.completed) {
+				CompleteRequest(entry->second, std::nullopt);
 			}
 		}
 		else { // Peer cancels their own request
@@ -358,74 +1184,100 @@ bool LiteConnConnection::TryHandleRequestCancellation(const LiteConnHeader& head
 	return false;
 }
 
-void LiteConnConnection::HandleServerAcknowledgement(const LiteConnHeader& header, const std::vector<char>& data) {
+void LiteConnConnection::HandleServerAcknowledgement(const LiteConnHeader& header, const PacketView& data) {
 	if (header.flag == (LiteConnHeaderFlag::SYN | LiteConnHeaderFlag::ACK)) {
 		sessionID = header.id32;
+		// The server replies with the subset of the offered features it accepted
+		features &= static_cast<uint32_t>(header.id64);
+		compactHeaders = features & LiteConnFeature::COMPACT;
 		status = ConnectionStatus::Connected;
-		LiteConnHeader replyHeader = {
-			.sessionID = sessionID,
-			.flag = LiteConnHeaderFlag::ACK,
-		};
+		handshakeConfirmed = false;
 		Debug::Log("Client acknowledge session id ", sessionID);
-		auto reply = LiteConnHeader::Serialize(replyHeader);
-		socket->SendPacket(reply, peerAddr);
+		SendHandshakeAcknowledgement();
 
 		cv.notify_all();
 	}
 }
 
-bool LiteConnConnection::TryHandleMissedAcknowledgement(const LiteConnHeader& header, const std::vector<char>& data) {
-	// Client did not receive the packet
-	if (header.flag == LiteConnHeaderFlag::SYN && header.sessionID == 0) { 
-		LiteConnHeader syncHeader = {
-			.sessionID = clientChecksum,
-			.flag = LiteConnHeaderFlag::SYN | LiteConnHeaderFlag::ACK,
-			.id32 = sessionID,
-		};
-		auto synMessage = LiteConnHeader::Serialize(syncHeader);
-		socket->SendPacket(synMessage, peerAddr);
-		return true;
-	}
-	return false;
+void LiteConnConnection::SendHandshakeAcknowledgement() {
+	LiteConnHeader replyHeader = {
+		.sessionID = sessionID,
+		.flag = LiteConnHeaderFlag::ACK,
+		.id32 = clientChecksum,
+		.id64 = features,
+	};
+	auto reply = LiteConnHeader::Serialize(replyHeader);
+	Transmit(reply, peerAddr, true);
 }
 
-void LiteConnConnection::HandleClientAcknowledgement(const LiteConnHeader& header, const std::vector<char>& data) {
-	// Received client ack, connection established
-	if (header.flag == LiteConnHeaderFlag::ACK && data.size() == 0)
-	{
-		Debug::Log("Server connected");
-		status = ConnectionStatus::Connected;
-		cv.notify_all();
-		return;
+void LiteConnConnection::ParseBundle(const PacketView& data) {
+	size_t offset = 0;
+	while (data.size() - offset >= sizeof(uint16_t)) {
+		uint16_t length;
+		memcpy(&length, data.data() + offset, sizeof(uint16_t));
+		length = ntohs(length);
+		offset += sizeof(uint16_t);
+		if (length > data.size() - offset) {
+			Debug::LogError("Error: Truncated packet in bundle");
+			return;
+		}
+
+		// Every packet keeps a view into the shared datagram
+		auto packet = data.Slice(offset, length);
+		offset += length;
+		auto header = ReadHeader(packet);
+		if (!header || header->first.flag == LiteConnHeaderFlag::BUNDLE) continue;
+		packet.RemovePrefix(header->second);
+		DispatchPacket(header->first, packet);
+		if (status == ConnectionStatus::Disconnected) return;
 	}
 }
 
-void LiteConnConnection::ParsePacket(const LiteConnHeader& header, std::vector<char>&& data, const sockaddr_in& address) {
+void LiteConnConnection::ParsePacket(PacketView&& datagram, const sockaddr_in& address) {
 	std::lock_guard<std::mutex> guard(lock);
 
 	if (status == ConnectionStatus::Disconnected) {
 		Debug::Log("A packet is routed to a closed UDPConnection");
 		return;
 	}
+	packetsReceived.fetch_add(1, std::memory_order_relaxed);
+	bytesReceived.fetch_add(datagram.size(), std::memory_order_relaxed);
+	auto parsed = ReadHeader(datagram);
+	if (!parsed) return;
+	const auto& header = parsed->first;
+	PacketView data = std::move(datagram);
+	data.RemovePrefix(parsed->second);
 
 	UpdateAddress(header, address);
+	// Path validation packets are never bundled, the address they came from matters
+	if (status == ConnectionStatus::Connected && TryHandlePathValidation(header, address)) return;
+
+	if (header.flag == LiteConnHeaderFlag::BUNDLE) {
+		ParseBundle(data);
+		return;
+	}
+	DispatchPacket(header, data);
+}
 
+void LiteConnConnection::DispatchPacket(const LiteConnHeader& header, PacketView& data) {
 	if (TryHandleDisconnect(header)) return;
 
 	switch (status) {
-	case ConnectionStatus::Pending:
-		if (TryHandleMissedAcknowledgement(header, data)) return;
-		HandleClientAcknowledgement(header, data);
-		return;
-
 	case ConnectionStatus::Connecting:
 		HandleServerAcknowledgement(header, data);
 		return;
 
 	case ConnectionStatus::Connected:
 		if (TryHandleMissedHandshake(header, data)) return;
+		if (TryHandleRepeatedHandshake(header)) return;
+		// Any other packet proves the peer completed the handshake
+		handshakeConfirmed = true;
+		handshakeRepeatable = false;
 		if (TryHandleHeartBeat(header, data)) return;
-		if (TryHandleDuplicates(header)) return;
+		if (TryHandleDuplicates(header)) {
+			duplicatesDropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
 		if (TryHandleRequestCancellation(header, data)) return;
 		if (TryHandleAcknowledgement(header, data)) return;
 		if (TryHandleData(header, data)) return;
@@ -433,134 +1285,389 @@ void LiteConnConnection::ParsePacket(const LiteConnHeader& header, std::vector<c
 	}
 }
 
-#pragma warning(pop)
+#pragma warning(pop)
+
+bool LiteConnConnection::IsConnected() { 
+	return status == ConnectionStatus::Connected; 
+}
+
+bool LiteConnConnection::IsDisconnected() {
+	return status == ConnectionStatus::Disconnected;
+}
+
+sockaddr_in LiteConnConnection::PeerAddr() { 
+	std::lock_guard<std::mutex> guard(lock); return peerAddr; 
+}
+
+LiteConnConnection::ConnectionStats LiteConnConnection::Stats() {
+	std::lock_guard<std::mutex> guard(lock);
+	return ConnectionStats{
+		.smoothedRtt = smoothedRtt,
+		.rttVariance = rttVariance,
+		.retransmitTimeout = retransmitTimeout,
+		.retransmissions = retransmissions,
+		.unacknowledged = autoResendEntries.size(),
+		.compressedMessages = compressedMessages,
+		.uncompressedBytes = uncompressedBytes,
+		.compressedBytes = compressedBytes,
+		.compressionTime = compressionTime,
+		.decompressionTime = decompressionTime,
+		.packetsSent = packetsSent.load(std::memory_order_relaxed),
+		.bytesSent = bytesSent.load(std::memory_order_relaxed),
+		.packetsReceived = packetsReceived.load(std::memory_order_relaxed),
+		.bytesReceived = bytesReceived.load(std::memory_order_relaxed),
+		.duplicatesDropped = duplicatesDropped.load(std::memory_order_relaxed),
+		.queueFullDrops = queueFullDrops.load(std::memory_order_relaxed),
+		.heldMessages = heldMessages.size() + pacedMessages.size(),
+		.congestionWindow = congestion ? congestion->Window() : 0,
+		.pacingRate = pacer ? pacer->Rate() : 0,
+		.roundTrips = roundTrips.Read()
+	};
+}
+
+std::optional<LiteConnMessage> LiteConnConnection::Receive() {
+	// No peer connected, drop what is left so the buffers return to the pool
+	if (status == ConnectionStatus::Disconnected) {
+		DiscardReceived();
+		return {};
+	}
+	auto message = packetQueue.TryPop();
+	while (message && SkipStale(std::span(&message.value(), 1)) == 0) {
+		message = packetQueue.TryPop();
+	}
+	CheckReceiveWindow();
+	return message;
+}
+
+size_t LiteConnConnection::ReceiveAll(std::span<LiteConnMessage> messages) {
+	if (status == ConnectionStatus::Disconnected) {
+		DiscardReceived();
+		return 0;
+	}
+	size_t count = 0;
+	while (count < messages.size()) {
+		size_t popped = packetQueue.PopBatch(messages.subspan(count));
+		size_t kept = SkipStale(messages.subspan(count, popped));
+		count += kept;
+		// Stale messages left room for more
+		if (kept == popped) break;
+	}
+	CheckReceiveWindow();
+	return count;
+}
+
+void LiteConnConnection::DiscardReceived() {
+	// Requests reject themselves when destroyed, which is skipped once disconnected
+	while (packetQueue.TryPop()) {}
+}
+
+void LiteConnConnection::CloseOnTimeout() {
+	Debug::Log("Connection timed out!");
+	status = ConnectionStatus::Disconnected;
+	CancelRequests();
+	pendingResponses.clear();
+	autoResendEntries.clear();
+	heldMessages.clear();
+	pacedMessages.clear();
+	pacedReliable = 0;
+	ClearReceiveBuffers();
+	cv.notify_all();
+}
+
+void LiteConnConnection::SendHeartbeat(std::chrono::steady_clock::time_point now) {
+	heartBeatTime = now + timeout.connectionRetryInterval;
+	ScheduleTimer(TimerKind::Heartbeat, heartBeatTime.load());
+
+	if (status == ConnectionStatus::Connected) {
+		SendHeartbeatPacket(now);
+		if (!handshakeConfirmed) SendHandshakeAcknowledgement();
+	}
+	else if (status == ConnectionStatus::Connecting) {
+		LiteConnHeader resyncHeader = {
+			.sessionID = 0,
+			.flag = LiteConnHeaderFlag::SYN,
+			.id32 = sessionID,
+			.id64 = OfferedFeatures(),
+		};
+		auto resync = LiteConnHeader::Serialize(resyncHeader);
+		Transmit(resync, peerAddr, true);
+	}
+}
+
+void LiteConnConnection::SendHeartbeatPacket(std::chrono::steady_clock::time_point now) {
+	LiteConnHeader hbtHeader = {
+		.sessionID = sessionID,
+		.index = pktIndex++,
+		.flag = LiteConnHeaderFlag::HBT,
+		.id32 = AdvertiseWindow(),
+		.id64 = static_cast<uint64_t>(now.time_since_epoch().count())
+	};
+	std::array<char, LiteConnHeader::MaxSize> buffer;
+	Transmit(EncodeHeader(hbtHeader, buffer), peerAddr, true);
+}
+
+bool LiteConnConnection::HandleTimer(TimerKind kind, uint64_t id, std::chrono::steady_clock::time_point now) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (status == ConnectionStatus::Disconnected) return false;
+
+	// Deadlines are pushed back without touching the queue, so a timer may fire early and is rescheduled
+	switch (kind) {
+	case TimerKind::Timeout: {
+		auto deadline = lastReceived.load() + timeout.connectionTimeout;
+		if (now < deadline) {
+			ScheduleTimer(TimerKind::Timeout, deadline);
+			return true;
+		}
+		CloseOnTimeout();
+		return false;
+	}
+	case TimerKind::Heartbeat: {
+		auto deadline = heartBeatTime.load();
+		// While messages are held the heartbeat keeps probing the peer's window, as its updates may be lost
+		if (now < deadline && heldMessages.empty()) {
+			ScheduleTimer(TimerKind::Heartbeat, deadline);
+			return true;
+		}
+		SendHeartbeat(now);
+		return true;
+	}
+	case TimerKind::Resend: {
+		auto i = autoResendEntries.find(id);
+		// Already acknowledged
+		if (i == autoResendEntries.end()) return true;
+		auto& entry = i->second;
+		// Retransmissions wait for the pacer as well, the wait does not count as a loss
+		if (now >= entry.resend && pacer && !pacer->Ready(now)) {
+			entry.resend = pacer->NextReady(now);
+		}
+		else if (now >= entry.resend) {
+			auto header = ReadHeader(entry.packet);
+			assert(header);
+			auto& hd = header->first;
+			assert(hd.id32 == i->first);
+			// The session id may have been rotated since the packet was first sent, a compact header may change its size
+			hd.sessionID = sessionID;
+			hd.index = pktIndex++;
+			entry.packet.RemovePrefix(header->second);
+			WriteHeader(hd, entry.packet);
+			std::array<std::span<const char>, 2> parts = { entry.packet, entry.body };
+			Transmit(parts, peerAddr, true);
+			// Exponential backoff keeps a slow or dead link from being flooded
+			entry.retransmitted = true;
+			entry.interval = std::min<std::chrono::steady_clock::duration>(entry.interval * 2, timeout.maxRetryInterval);
+			entry.resend = now + entry.interval;
+			retransmissions++;
+			if (congestion) {
+				// Later timeouts of the packet fall into the recovery that started with its first one
+				congestion->OnLoss(entry.sent, now);
+				pacer->Take(static_cast<double>(entry.packet.size() + entry.body.size()), now);
+				UpdatePacingRate(now);
+			}
+		}
+		ScheduleTimer(TimerKind::Resend, entry.resend, id);
+		return true;
+	}
+	case TimerKind::AckExpire: {
+		auto i = autoAcks.find(static_cast<uint32_t>(id));
+		if (i == autoAcks.end()) return true;
+		if (now < i->second) {
+			// The acknowledgement was refreshed by a duplicate
+			ScheduleTimer(TimerKind::AckExpire, i->second, id);
+		}
+		else {
+			autoAcks.erase(i);
+		}
+		return true;
+	}
+	case TimerKind::Reassembly: {
+		auto i = partialMessages.find(static_cast<uint32_t>(id));
+		if (i == partialMessages.end()) return true;
+		if (now < i->second.expiry) {
+			ScheduleTimer(TimerKind::Reassembly, i->second.expiry, id);
+			return true;
+		}
+		// The received fragments were acknowledged and are never sent again, the message cannot be completed
+		Debug::Log("Partially received message ", id, " stalled, closing connection");
+		LiteConnHeader header = {
+			.sessionID = sessionID,
+			.index = pktIndex,
+			.flag = LiteConnHeaderFlag::FIN
+		};
+		std::array<char, LiteConnHeader::MaxSize> buffer;
+		Transmit(EncodeHeader(header, buffer), peerAddr, true);
+		CloseOnTimeout();
+		return false;
+	}
+	case TimerKind::PathChallenge:
+		// Stale unless the challenge with the token is still unanswered
+		if (!pathCandidate || pathToken != id) return true;
+		if (now >= pathDeadline) {
+			Debug::Log("Path challenge was not answered, keeping the previous peer address");
+			pathCandidate.reset();
+			return true;
+		}
+		SendPathChallenge(now);
+		return true;
+	case TimerKind::Flush:
+		FlushAcknowledgements();
+		FlushFrame(true);
+		// Cleared last so the ACKs bundled above do not schedule another flush
+		flushScheduled = false;
+		return true;
+	case TimerKind::Pace:
+		paceScheduled = false;
+		// Sent with the other packets of the iteration, like the messages of FlushOutbound()
+		queueSends = true;
+		ReleasePacedMessages(now);
+		ReleaseHeldMessages();
+		queueSends = false;
+		return true;
+	case TimerKind::WindowUpdate:
+		// Cleared first so space freed while sending schedules another update
+		windowUpdateScheduled = false;
+		if (status == ConnectionStatus::Connected) SendHeartbeatPacket(now);
+		return true;
+	}
+	return true;
+}
+
+void LiteConnConnection::SendData(const std::span<const char> data) {
+	// No peer connected, do nothing
+	if (status != ConnectionStatus::Connected) {
+		Debug::Log("Attempting to send data via unconnected connection");
+		return;
+	}
 
-bool LiteConnConnection::IsConnected() { 
-	std::lock_guard<std::mutex> guard(lock);
-	return status == ConnectionStatus::Connected; 
+	auto payload = AllocatePayload(data.size());
+	std::copy(data.begin(), data.end(), payload.begin());
+	EnqueueMessage(OutboundMessage{ .payload = std::move(payload), .reliable = false });
 }
 
-bool LiteConnConnection::IsDisconnected() {
-	std::lock_guard<std::mutex> guard(lock);
-	return status == ConnectionStatus::Disconnected;
-}
+void LiteConnConnection::SendReliableData(const std::span<const char> data) {
+	// No peer connected, do nothing
+	if (status != ConnectionStatus::Connected) {
+		Debug::LogError("Attempting to send data via unconnected connection");
+		return;
+	}
 
-sockaddr_in LiteConnConnection::PeerAddr() { 
-	std::lock_guard<std::mutex> guard(lock); return peerAddr; 
+	auto payload = AllocatePayload(data.size());
+	std::copy(data.begin(), data.end(), payload.begin());
+	EnqueueMessage(OutboundMessage{ .payload = std::move(payload), .reliable = true });
 }
 
-std::optional<LiteConnMessage> LiteConnConnection::Receive() {
-	// No peer connected, do nothing
-	std::lock_guard<std::mutex> guard(lock);
-	if (status == ConnectionStatus::Disconnected) {
-		return {};
+void LiteConnConnection::Send(uint8_t channelID, const std::span<const char> data) {
+	if (status != ConnectionStatus::Connected) {
+		Debug::LogError("Attempting to send data via unconnected connection");
+		return;
 	}
-	if (packetQueue.empty()) {
-		return {};
+	// The features and the channel layout no longer change once connected
+	if (!(features & LiteConnFeature::CHANNEL) || channelID >= channels.size()) {
+		Debug::LogError("Attempting to send data on channel ", static_cast<int>(channelID), ", which is not configured on both peers");
+		return;
 	}
-	LiteConnMessage msg = std::move(packetQueue.front());
-	packetQueue.pop_front();
-	return msg;
+
+	auto type = channels[channelID].type;
+	auto payload = AllocatePayload(data.size());
+	std::copy(data.begin(), data.end(), payload.begin());
+	EnqueueMessage(OutboundMessage{
+		.payload = std::move(payload),
+		.channel = channelID,
+		.reliable = type == ChannelType::ReliableUnordered || type == ChannelType::ReliableOrdered
+	});
 }
 
-bool LiteConnConnection::UpdateTimeout() {
-	std::lock_guard<std::mutex> guard(lock);
-	if (std::chrono::steady_clock::now() - lastReceived.load() > timeout.connectionTimeout) {
-		Debug::Log("Connection timed out!");
-		status = ConnectionStatus::Disconnected;
-		for (auto& promise : requestHandles) {
-			promise.second.set_value(std::nullopt);
+void LiteConnConnection::EnqueueMessage(OutboundMessage&& message) {
+	if (outbound.TryPush(std::move(message))) {
+		// Only the first message since the last drain hands the connection to the routing thread
+		if (outboundScheduled.exchange(true)) return;
+		if (sendReady && sendReady->TryPush(weak_from_this())) {
+			socket->Wake();
+			return;
 		}
-		// Invalidate all existing request handles to prevent deadlock
-		for (auto& msg : packetQueue) {
-			if (msg.requestHandle) {
-				msg.requestHandle->isValid = false;
-			}
-		}
-		pendingResponses.clear();
-		requestHandles.clear();
-		autoResendEntries.clear();
-		packetQueue.clear();
-		cv.notify_all();
-		return false;
+		outboundScheduled = false;
+		std::lock_guard<std::mutex> guard(lock);
+		DrainOutbound();
+		return;
 	}
 
+	// The routing thread fell behind, the queued messages go first to keep the order
+	std::lock_guard<std::mutex> guard(lock);
+	DrainOutbound();
 	if (status == ConnectionStatus::Connected) {
-		for (auto i = autoResendEntries.begin(); i != autoResendEntries.end(); ++i) {
-			auto& entry = i->second;
-			if (std::chrono::steady_clock::now() > entry.resend) {
-				auto header = LiteConnHeader::Deserialize(entry.packet);
-				assert(header);
-				auto& hd = header.value();
-				assert(hd.id32 == i->first);
-				hd.index = pktIndex++;
-				LiteConnHeader::Serialize(hd, entry.packet);
-				socket->SendPacket(entry.packet, peerAddr);
-				entry.resend = std::chrono::steady_clock::now() + timeout.impRetryInterval;
-			}
-		}
-		for (auto i = autoAcks.begin(); i != autoAcks.end();) {
-			if (std::chrono::steady_clock::now() > i->second) {
-				i = autoAcks.erase(i);
-			}
-			else {
-				++i;
-			}
-		}
+		SendOrHold(std::move(message));
+	}
+}
 
-		if (std::chrono::steady_clock::now() > heartBeatTime.load()) {
-			LiteConnHeader hbtHeader = {
-				.sessionID = sessionID,
-				.index = pktIndex++,
-				.flag = LiteConnHeaderFlag::HBT
-			};
-			auto heartbeat = LiteConnHeader::Serialize(hbtHeader);
-			heartBeatTime = std::chrono::steady_clock::now() + timeout.connectionRetryInterval;
-			socket->SendPacket(heartbeat, peerAddr);
-		}
+void LiteConnConnection::DrainOutbound() {
+	while (auto message = outbound.TryPop()) {
+		// Messages sent right before the connection closed are dropped
+		if (status != ConnectionStatus::Connected) continue;
+		SendOrHold(std::move(message.value()));
 	}
-	else if (status == ConnectionStatus::Pending) {
-		if (std::chrono::steady_clock::now() > heartBeatTime.load()) {
-			// Case 1: Client received the packet but the ack packet is lost
-			LiteConnHeader resyncHeader = {
-				.sessionID = sessionID,
-				.flag = LiteConnHeaderFlag::SYN
-			};
-			auto resync = LiteConnHeader::Serialize(resyncHeader);
-			heartBeatTime = std::chrono::steady_clock::now() + timeout.connectionRetryInterval;
-			socket->SendPacket(resync, peerAddr);
+}
 
-			// Case 2: Client did not receive the packet, so retransmit the original message
-			LiteConnHeader resyncHeader2 = {
-				.sessionID = clientChecksum,
-				.flag = LiteConnHeaderFlag::SYN | LiteConnHeaderFlag::ACK,
-				.id32 = sessionID,
-			};
-			auto resync2 = LiteConnHeader::Serialize(resyncHeader2);
-			heartBeatTime = std::chrono::steady_clock::now() + timeout.connectionRetryInterval;
-			socket->SendPacket(resync2, peerAddr);
-		}
+void LiteConnConnection::FlushOutbound() {
+	std::lock_guard<std::mutex> guard(lock);
+	// Cleared before draining so a message pushed meanwhile either is drained now or enqueues the connection again
+	outboundScheduled = false;
+	// Bundled messages wait for the flush timer, the rest is sent with the other packets of the iteration
+	queueSends = true;
+	DrainOutbound();
+	queueSends = false;
+}
+
+void LiteConnConnection::EncodeOutbound(OutboundMessage& message) {
+	std::array<char, sizeof(uint8_t) + sizeof(uint32_t)> envelope;
+	size_t envelopeSize = 0;
+	if (message.channel == NO_CHANNEL) {
+		auto noChannel = NoChannelEnvelope();
+		envelopeSize = noChannel.size();
+		std::copy(noChannel.begin(), noChannel.end(), envelope.begin());
 	}
-	else if (status == ConnectionStatus::Connecting) {
-		if (std::chrono::steady_clock::now() > heartBeatTime.load()) {
-			LiteConnHeader resyncHeader = {
-				.sessionID = 0,
-				.flag = LiteConnHeaderFlag::SYN,
-				.id32 = sessionID,
-			};
-			auto resync = LiteConnHeader::Serialize(resyncHeader);
-			heartBeatTime = std::chrono::steady_clock::now() + timeout.connectionRetryInterval;
-			socket->SendPacket(resync, peerAddr);
+	else {
+		auto& channel = channels[message.channel];
+		envelope[0] = static_cast<char>(message.channel);
+		envelopeSize = sizeof(uint8_t);
+		if (channel.type == ChannelType::UnreliableSequenced || channel.type == ChannelType::ReliableOrdered) {
+			auto sequence = htonl(channel.nextSend++);
+			memcpy(envelope.data() + envelopeSize, &sequence, sizeof(uint32_t));
+			envelopeSize += sizeof(uint32_t);
 		}
 	}
-	return true;
+
+	auto& payload = message.payload;
+	bool expanded = payload.ExpandFront(envelopeSize);
+	assert(expanded);
+	std::copy(envelope.begin(), envelope.begin() + envelopeSize, payload.begin());
+	if (features & LiteConnFeature::COMPRESS) {
+		CompressPayload(payload);
+	}
 }
 
-void LiteConnConnection::SendData(const std::span<const char> data) {
-	// No peer connected, do nothing
-	std::lock_guard<std::mutex> guard(lock);
-	if (status != ConnectionStatus::Connected) {
-		Debug::Log("Attempting to send data via unconnected connection");
+void LiteConnConnection::SendOutbound(OutboundMessage&& message) {
+	if (message.flag != 0) {
+		LiteConnHeader header = {
+			.flag = message.flag,
+			.id64 = message.id64
+		};
+		SendPayloadReliable(header, std::move(message.payload), std::move(message.body));
+		return;
+	}
+	SendMessage(std::move(message.payload), message.reliable);
+}
+
+void LiteConnConnection::SendMessage(PacketView&& payload, bool reliable) {
+	size_t size = payload.size();
+	if (MaxHeaderSize() + size > socket->MaxPacketSize()) {
+		Debug::LogError("Attempting to send a message of ", size, " bytes, which exceeds the maximum packet size");
+		return;
+	}
+
+	if (reliable) {
+		LiteConnHeader header = {
+			.flag = LiteConnHeaderFlag::IMP | LiteConnHeaderFlag::DATA
+		};
+		SendPayloadReliable(header, std::move(payload));
 		return;
 	}
 
@@ -570,44 +1677,44 @@ void LiteConnConnection::SendData(const std::span<const char> data) {
 		.flag = LiteConnHeaderFlag::DATA,
 		.id32 = 0,
 	};
-	auto payload = LiteConnHeader::Serialize(header);
-	payload.insert(payload.end(), data.begin(), data.end());
-	socket->SendPacket(std::span<const char> {payload.data(), payload.size()}, peerAddr);
+	WriteHeader(header, payload);
+	if (!TryBundle(payload)) {
+		SendDatagram(payload);
+	}
 }
 
-void LiteConnConnection::SendReliableData(const std::span<const char> data) {
-	// No peer connected, do nothing
-	std::lock_guard<std::mutex> guard(lock);
-	if (status != ConnectionStatus::Connected) {
-		Debug::LogError("Attempting to send data via unconnected connection");
-		return;
-	}
+std::optional<LiteConnResponse> LiteConnConnection::SendRequest(const std::span<const char> data) {
+	if (!FitsDatagram(data.size())) return {};
+	auto requestID = RegisterRequest();
+	if (!requestID) return {};
+
+	auto payload = AllocatePayload(data.size());
+	std::copy(data.begin(), data.end(), payload.begin());
+	EnqueueControl(LiteConnHeaderFlag::REQ | LiteConnHeaderFlag::DATA, requestID.value(), std::move(payload));
+	return LiteConnResponse{ weak_from_this(), requestID.value() };
+}
 
-	LiteConnHeader header = {
-		.flag = LiteConnHeaderFlag::IMP | LiteConnHeaderFlag::DATA
-	};
-	
-	SendPacketReliable(header, data);
+std::optional<LiteConnResponse> LiteConnConnection::SendSharedRequest(const PacketView& payload) {
+	if (!FitsDatagram(payload.size())) return {};
+	auto requestID = RegisterRequest();
+	if (!requestID) return {};
+
+	// The header is written into the headroom of an empty payload of its own, the shared payload is never written to
+	EnqueueControl(LiteConnHeaderFlag::REQ | LiteConnHeaderFlag::DATA, requestID.value(), AllocatePayload(0), PacketView(payload));
+	return LiteConnResponse{ weak_from_this(), requestID.value() };
 }
 
-std::optional<LiteConnResponse> LiteConnConnection::SendRequest(const std::span<const char> data) {
-	// No peer connected, do nothing
+std::optional<uint64_t> LiteConnConnection::RegisterRequest() {
+	// Checked under the lock, a connection closing later completes the request
 	std::lock_guard<std::mutex> guard(lock);
 	if (status != ConnectionStatus::Connected) {
 		Debug::LogError("Attempting to send data via unconnected connection");
 		return {};
 	}
-
-	LiteConnHeader header = {
-		.flag = LiteConnHeaderFlag::REQ | LiteConnHeaderFlag::DATA,
-		.id64 = reqIndex++,
-	};
-
-	SendPacketReliable(header, data);
-	auto entry = requestHandles.emplace(header.id64, std::promise<std::optional<LiteConnMessage>>{});
+	uint64_t requestID = reqIndex++;
+	auto entry = requestHandles.emplace(requestID, PendingRequest{});
 	assert(entry.second);
-	auto& kwp = entry.first;
-	return LiteConnResponse{ weak_from_this(), kwp->first, kwp->second.get_future() };
+	return requestID;
 }
 
 void LiteConnConnection::Disconnect() {
@@ -616,19 +1723,19 @@ void LiteConnConnection::Disconnect() {
 		return;
 	}
 	Debug::Log("Closing connection.");
+	// Messages the routing thread has not sent yet still reach the peer ahead of the FIN
+	DrainOutbound();
 	status = ConnectionStatus::Disconnected;
-	for (auto i = requestHandles.begin(); i != requestHandles.end();) {
-		i->second.set_value(std::nullopt);
-		i = requestHandles.erase(i);
-	}
-	// Invalidate all existing request handles to prevent deadlock
-	for (auto& msg : packetQueue) {
-		if (msg.requestHandle) {
-			msg.requestHandle->isValid = false;
-		}
-	}
-	packetQueue.clear();
+	CancelRequests();
+	// The peer cancels its outstanding requests once it receives the FIN, received ones are dropped without a reply
+	pendingResponses.clear();
+	heldMessages.clear();
+	pacedMessages.clear();
+	pacedReliable = 0;
+	ClearReceiveBuffers();
 	autoAcks.clear();
+	// Packets sent before disconnecting still reach the peer ahead of the FIN
+	FlushFrame(false);
 
 	LiteConnHeader header = {
 		.sessionID = sessionID,
@@ -636,9 +1743,8 @@ void LiteConnConnection::Disconnect() {
 		.flag = LiteConnHeaderFlag::FIN
 	};
 
-	auto packet = LiteConnHeader::Serialize(header);
-
-	socket->SendPacket(packet, peerAddr);
+	std::array<char, LiteConnHeader::MaxSize> buffer;
+	Transmit(EncodeHeader(header, buffer), peerAddr, false);
 	cv.notify_all();
 }
 
@@ -657,9 +1763,9 @@ bool LiteConnConnection::WaitForDataPacket() {
 	std::unique_lock<std::mutex> guard(lock);
 	if (status != ConnectionStatus::Connected) return false;
 
-	auto predicate = [&]() { return status == ConnectionStatus::Disconnected || !packetQueue.empty(); };
+	auto predicate = [&]() { return status == ConnectionStatus::Disconnected || !packetQueue.Empty(); };
 	cv.wait(guard, predicate);
-	return status == ConnectionStatus::Connected && !packetQueue.empty();
+	return status == ConnectionStatus::Connected && !packetQueue.Empty();
 }
 
 LiteConnConnection::~LiteConnConnection() {
@@ -667,13 +1773,13 @@ LiteConnConnection::~LiteConnConnection() {
 		return;
 	}
 	Debug::Log("Closing connection.");
+	// Messages the routing thread has not sent yet still reach the peer ahead of the FIN
+	DrainOutbound();
 	status = ConnectionStatus::Disconnected;
-	for (auto i = requestHandles.begin(); i != requestHandles.end();) {
-		i->second.set_value(std::nullopt);
-		i = requestHandles.erase(i);
-	}
-	packetQueue.clear();
+	CancelRequests();
+	ClearReceiveBuffers();
 	autoAcks.clear();
+	FlushFrame(false);
 
 	LiteConnHeader header = {
 		.sessionID = sessionID,
@@ -681,29 +1787,172 @@ LiteConnConnection::~LiteConnConnection() {
 		.flag = LiteConnHeaderFlag::FIN
 	};
 
-	auto packet = LiteConnHeader::Serialize(header);
-
-	socket->SendPacket(packet, peerAddr);
+	std::array<char, LiteConnHeader::MaxSize> buffer;
+	Transmit(EncodeHeader(header, buffer), peerAddr, false);
 	cv.notify_all();
 }
 
+LiteConnManager::Shard::Shard(size_t id, std::shared_ptr<UDPSocket> socket, size_t numConnections, const LiteConnSetting& setting, std::shared_ptr<const VirtualClock> clock)
+	: id(id), socket(std::move(socket)), timers(std::make_shared<TimerQueue>(std::move(clock))), connections(numConnections), sessions(numConnections),
+	slotSessions(numConnections, SessionTable::EMPTY), slotAliases(numConnections, SessionTable::EMPTY), sendReady(std::make_shared<MpscRing<std::weak_ptr<LiteConnConnection>>>(numConnections)),
+	receiveSlots(RECEIVE_BATCH_SIZE), limiter(HANDSHAKE_BUCKETS, setting.handshakeRate, setting.handshakeBurst)
+{
+
+}
+
+// Channels are only offered when configured, the peer reads the envelope with its own channel layout
+static uint32_t ManagerFeatures(const LiteConnSetting& setting) {
+	uint32_t features = setting.features;
+	if (setting.compressionThreshold == 0) {
+		features &= ~static_cast<uint32_t>(LiteConnFeature::COMPRESS);
+	}
+	if (setting.channels.size() > NO_CHANNEL) {
+		Debug::LogError("[Error] At most ", static_cast<int>(NO_CHANNEL), " channels can be configured, channels are disabled");
+	}
+	if (setting.channels.empty() || setting.channels.size() > NO_CHANNEL) {
+		features &= ~static_cast<uint32_t>(LiteConnFeature::CHANNEL);
+	}
+	return features;
+}
+
 uint32_t LiteConnManager::GenerateChecksum() {
 	checksumGenerator.seed(std::random_device{}());
-	return std::uniform_int_distribution<uint32_t>{1, UINT32_MAX}(checksumGenerator);
+	std::shared_lock<std::shared_mutex> guard(directoryLock);
+	uint32_t checksum;
+	// Session ids must be unique within the manager for routing
+	do {
+		checksum = std::uniform_int_distribution<uint32_t>{1, UINT32_MAX}(checksumGenerator);
+	} while (directory.Contains(checksum));
+	return checksum;
 }
 
-LiteConnManager::LiteConnManager(USHORT port, size_t numConnections, size_t packetQueueCapacity, DWORD maxPacketSize, std::chrono::steady_clock::duration updateInterval)
-	: socket(std::make_shared<UDPSocket>(port, maxPacketSize)), numConnections(numConnections), connections(numConnections), updateInterval(updateInterval), queueCapacity(packetQueueCapacity),
-	routeThread(&LiteConnManager::RouteAndTimeout, this)
-{
+size_t LiteConnManager::FindFreeSlot() {
+	for (size_t i = 0; i < numConnections; i++) {
+		auto ptr = connections[i].lock();
+		if (!ptr || ptr->IsDisconnected()) {
+			return i;
+		}
+	}
+	return numConnections;
+}
+
+void LiteConnManager::AssignSlot(size_t index, size_t shard, const std::shared_ptr<LiteConnConnection>& connection) {
+	ReleaseSlot(index);
+	connections[index] = connection;
+	slotShards[index] = shard;
 
+	std::lock_guard<std::mutex> guard(shards[shard]->lock);
+	RegisterSession(*shards[shard], index, connection);
 }
 
-LiteConnManager::LiteConnManager(size_t packetQueueCapacity, size_t numConnections, DWORD maxPacketSize, std::chrono::steady_clock::duration updateInterval)
-	: socket(std::make_shared<UDPSocket>(maxPacketSize)), numConnections(numConnections), connections(numConnections), updateInterval(updateInterval), queueCapacity(packetQueueCapacity),
-	routeThread(&LiteConnManager::RouteAndTimeout, this)
+void LiteConnManager::ReleaseSlot(size_t index) {
+	auto& shard = *shards[slotShards[index]];
+	{
+		std::lock_guard<std::mutex> guard(shard.lock);
+		UnregisterSession(shard, index);
+	}
+	connections[index].reset();
+}
+
+void LiteConnManager::RegisterSession(Shard& shard, size_t index, const std::shared_ptr<LiteConnConnection>& connection) {
+	UnregisterSession(shard, index);
+	shard.connections[index] = connection;
+	shard.slotSessions[index] = connection->sessionID;
+	shard.sessions.Assign(connection->sessionID, static_cast<uint32_t>(index));
+	// A connection migrating with a new session id is reached by both ids until the next rotation
+	auto alias = connection->aliasSessionID;
+	if (alias != SessionTable::EMPTY && alias != connection->sessionID) {
+		shard.slotAliases[index] = alias;
+		shard.sessions.Assign(alias, static_cast<uint32_t>(index));
+	}
+
+	std::unique_lock<std::shared_mutex> guard(directoryLock);
+	directory.Assign(connection->sessionID, static_cast<uint32_t>(shard.id));
+	if (shard.slotAliases[index] != SessionTable::EMPTY) {
+		directory.Assign(shard.slotAliases[index], static_cast<uint32_t>(shard.id));
+	}
+}
+
+void LiteConnManager::UnregisterSession(Shard& shard, size_t index) {
+	for (auto sessionID : { shard.slotSessions[index], shard.slotAliases[index] }) {
+		// The id may have been taken over by another slot, only remove the mappings owned by this one
+		if (sessionID == SessionTable::EMPTY || shard.sessions.Find(sessionID) != index) continue;
+		shard.sessions.Erase(sessionID);
+
+		std::unique_lock<std::shared_mutex> guard(directoryLock);
+		if (directory.Find(sessionID) == shard.id) {
+			directory.Erase(sessionID);
+		}
+	}
+	shard.slotSessions[index] = SessionTable::EMPTY;
+	shard.slotAliases[index] = SessionTable::EMPTY;
+	shard.connections[index].reset();
+}
+
+void LiteConnManager::StartShards(USHORT port, DWORD maxPacketSize, const LiteConnSetting& setting, std::shared_ptr<const VirtualClock> clock) {
+	size_t numWorkers = setting.numWorkers;
+#ifndef SO_REUSEPORT
+	if (numWorkers > 1) {
+		Debug::Log("[Warning] SO_REUSEPORT is not supported on this platform, using a single routing thread");
+	}
+	numWorkers = 1;
+#endif
+	numWorkers = clock ? 1 : std::max<size_t>(numWorkers, 1);
+	// The sockets share one capture, its metadata is the cookie key a replay needs to accept the recorded handshakes
+	std::shared_ptr<PacketRecorder> recorder;
+	if (!setting.capturePath.empty()) {
+		auto& key = cookies.Key();
+		recorder = std::make_shared<PacketRecorder>(setting.capturePath, std::span(reinterpret_cast<const char*>(key.data()), sizeof(key)));
+		if (!recorder->Good()) {
+			Debug::LogError("[Error] Failed to open the capture file ", setting.capturePath);
+			recorder.reset();
+		}
+	}
+	for (size_t i = 0; i < numWorkers; i++) {
+		auto socket = std::make_shared<UDPSocket>(port, maxPacketSize, numWorkers > 1);
+		if (socket->IsClosed() && !shards.empty()) {
+			Debug::LogError("[Error] Failed to open the socket of routing thread ", i);
+			break;
+		}
+		if (setting.impairment) {
+			auto impairment = *setting.impairment;
+			impairment.seed += i;
+			socket->SetImpairment(impairment);
+		}
+		if (recorder) socket->SetRecorder(recorder);
+		socket->SetMuted(clock != nullptr);
+		// Every worker binds the port resolved by the first socket when an ephemeral port was requested
+		port = ntohs(socket->Port());
+		shards.emplace_back(std::make_unique<Shard>(i, std::move(socket), numConnections, setting, clock));
+	}
+	if (clock) return;
+	for (auto& shard : shards) {
+		shard->thread = std::thread(&LiteConnManager::RouteAndTimeout, this, std::ref(*shard));
+	}
+}
+
+LiteConnManager::LiteConnManager(USHORT port, size_t numConnections, size_t packetQueueCapacity, DWORD maxPacketSize, std::chrono::steady_clock::duration updateInterval, LiteConnSetting setting)
+	: numConnections(numConnections), features(ManagerFeatures(setting)), maxFrameSize(setting.maxFrameSize), maxMessageSize(setting.maxMessageSize), channels(setting.channels), sendQueueCapacity(setting.sendQueueCapacity), unreliableOverflow(setting.unreliableOverflow), requestOverflow(setting.requestOverflow), congestion(setting.congestion), acceptBacklog(std::max<size_t>(setting.acceptBacklog, 1)), cookies(setting.cookieLifetime), rotateSessionOnMigration(setting.rotateSessionOnMigration),
+	codec(std::make_shared<PayloadCodec>(setting.compressionDictionary)), compressionThreshold(setting.compressionThreshold), metricsInterval(setting.metricsInterval), metricsSink(setting.metricsSink),
+	queueCapacity(packetQueueCapacity), updateInterval(updateInterval), connections(numConnections), slotShards(numConnections, 0), directory(numConnections)
 {
+	StartShards(port, maxPacketSize, setting);
+}
+
+LiteConnManager::LiteConnManager(size_t packetQueueCapacity, size_t numConnections, DWORD maxPacketSize, std::chrono::steady_clock::duration updateInterval, LiteConnSetting setting)
+	: numConnections(numConnections), features(ManagerFeatures(setting)), maxFrameSize(setting.maxFrameSize), maxMessageSize(setting.maxMessageSize), channels(setting.channels), sendQueueCapacity(setting.sendQueueCapacity), unreliableOverflow(setting.unreliableOverflow), requestOverflow(setting.requestOverflow), congestion(setting.congestion), acceptBacklog(std::max<size_t>(setting.acceptBacklog, 1)), cookies(setting.cookieLifetime), rotateSessionOnMigration(setting.rotateSessionOnMigration),
+	codec(std::make_shared<PayloadCodec>(setting.compressionDictionary)), compressionThreshold(setting.compressionThreshold), metricsInterval(setting.metricsInterval), metricsSink(setting.metricsSink),
+	queueCapacity(packetQueueCapacity), updateInterval(updateInterval), connections(numConnections), slotShards(numConnections, 0), directory(numConnections)
+{
+	StartShards(0, maxPacketSize, setting);
+}
 
+LiteConnManager::LiteConnManager(std::shared_ptr<VirtualClock> clock, const std::array<uint64_t, 2>& cookieKey, size_t packetQueueCapacity, size_t numConnections, DWORD maxPacketSize, std::chrono::steady_clock::duration updateInterval, LiteConnSetting setting)
+	: numConnections(numConnections), features(ManagerFeatures(setting)), maxFrameSize(setting.maxFrameSize), maxMessageSize(setting.maxMessageSize), channels(setting.channels), sendQueueCapacity(setting.sendQueueCapacity), unreliableOverflow(setting.unreliableOverflow), requestOverflow(setting.requestOverflow), congestion(setting.congestion), acceptBacklog(std::max<size_t>(setting.acceptBacklog, 1)), cookies(setting.cookieLifetime, cookieKey), rotateSessionOnMigration(setting.rotateSessionOnMigration),
+	codec(std::make_shared<PayloadCodec>(setting.compressionDictionary)), compressionThreshold(setting.compressionThreshold), metricsInterval(setting.metricsInterval), metricsSink(setting.metricsSink),
+	queueCapacity(packetQueueCapacity), updateInterval(updateInterval), connections(numConnections), slotShards(numConnections, 0), directory(numConnections)
+{
+	StartShards(0, maxPacketSize, setting, std::move(clock));
 }
 
 LiteConnManager::~LiteConnManager() {
@@ -716,124 +1965,340 @@ LiteConnManager::~LiteConnManager() {
 				ptr->Disconnect();
 			}
 		}
-		socket->Close();
+		for (auto& shard : shards) {
+			shard->socket->Close();
+		}
 	}
 
-	if (routeThread.joinable()) routeThread.join();
+	for (auto& shard : shards) {
+		if (shard->thread.joinable()) shard->thread.join();
+	}
 }
 
-void LiteConnManager::RouteAndTimeout() {
-	while (true) { 
-		auto currentTime = std::chrono::steady_clock::now();
+size_t LiteConnManager::NumWorkers() const { return shards.size(); }
+
+void LiteConnManager::RoutePacket(Shard& shard, PacketSlot& slot, bool allowForward) {
+	auto& address = slot.address;
+	// Both header formats start with the session id, the rest is only read by the connection that knows its format
+	auto payload = slot.Payload();
+	if (payload.size() < sizeof(uint32_t)) return;
+	uint32_t sessionID;
+	memcpy(&sessionID, payload.data(), sizeof(uint32_t));
+	sessionID = ntohl(sessionID);
+	// Debug::Log("Host received packet with sessionID ", sessionID);
+
+	auto index = shard.sessions.Find(sessionID);
+	auto temp = index != SessionTable::NO_SLOT ? shard.connections[index].lock() : nullptr;
+	if (temp) {
+		// Debug::Log("Routed to connection with sessionID ", temp->sessionID);
+		// The datagram is handed over as a view, the receive slot gets a fresh buffer on the next read
+		temp->ParsePacket(PacketView(std::move(slot.buffer), 0, slot.size), address);
+		// A client connection switches to the server assigned session id when the handshake completes,
+		// and a migrating connection gains an alias for the id it rotates to
+		if (temp->sessionID != shard.slotSessions[index] || temp->aliasSessionID != shard.slotAliases[index]) {
+			RegisterSession(shard, index, temp);
+		}
+		return;
+	}
+
+	// The kernel picks the receiving socket by source address, so a peer whose address changed may reach another shard
+	if (sessionID != 0 && allowForward && shards.size() > 1) {
+		uint32_t owner;
 		{
-			std::lock_guard<std::mutex> guard(lock);
-			
-			if (socket->IsClosed()) break;
-
-			auto packet = socket->Read();
-			while (packet) {
-				auto& payload = packet.value().payload;
-				auto address = packet.value().address;
-				auto hd = LiteConnHeader::Deserialize(payload);
-
-				if (hd) {
-					const LiteConnHeader& header = hd.value();
-					bool routed = false;
-					// Debug::Log("Host received packet with sessionID ", header.sessionID);
-
-					for (auto i = 0; i < numConnections; i++) {
-						auto temp = connections[i].lock();
-						if (temp && !temp->IsDisconnected() && header.sessionID == temp->sessionID) {
-							// Debug::Log("Routed to connection with sessionID ", tempConnections[i]->sessionID);
-							routed = true;
-							payload.erase(payload.begin(), payload.begin() + LiteConnHeader::Size);
-							temp->ParsePacket(header, std::move(payload), address);
-							break;
-						}
-					}
+			std::shared_lock<std::shared_mutex> guard(directoryLock);
+			owner = directory.Find(sessionID);
+		}
+		if (owner != SessionTable::NO_SLOT && owner != shard.id) {
+			auto& target = *shards[owner];
+			{
+				std::lock_guard<std::mutex> guard(target.inboxLock);
+				target.inbox.emplace_back(std::move(slot));
+			}
+			target.socket->Wake();
+			return;
+		}
+	}
 
-					// Packet was not delivered to any opened connections, could be a request to open new connection
-					if (!routed && isListening) {
-						if (header.sessionID == 0 && header.flag & LiteConnHeaderFlag::SYN) {
-							connectionRequests.emplace_back(
-								ConnectionRequest {
-									.address = address,
-									.checksum = header.id32
-								}
-							);
-							cv.notify_one();
-						}
-					}
-				}
+	// Packet was not delivered to any opened connections, could be a request to open new connection.
+	// Handshakes always use the fixed header format
+	auto hd = LiteConnHeader::Deserialize(payload);
+	if (!hd) return;
+	const LiteConnHeader& header = hd.value();
+	if (header.sessionID == 0) {
+		if (isListening && header.flag == LiteConnHeaderFlag::SYN) {
+			RouteHandshake(shard, header, slot);
+		}
+		return;
+	}
+
+	// The session of a handshake ACK only exists once its cookie is validated
+	if (isListening && header.flag == LiteConnHeaderFlag::ACK && slot.size == LiteConnHeader::Size) {
+		RouteHandshake(shard, header, slot);
+	}
+}
+
+void LiteConnManager::RouteHandshake(Shard& shard, const LiteConnHeader& header, const PacketSlot& slot) {
+	// Both queues are drained once per loop
+	auto& queue = header.sessionID == 0 ? shard.newHandshakes : shard.newRequests;
+	auto bound = header.sessionID == 0 ? MAX_HANDSHAKES_PER_LOOP : acceptBacklog;
+	if (queue.size() >= bound || !shard.limiter.TryTake(slot.address, slot.timeReceived)) return;
+
+	ConnectionRequest request = {
+		.address = slot.address,
+		.checksum = header.id32,
+		.features = static_cast<uint32_t>(header.id64) & features,
+		.shard = shard.id
+	};
+	// Compression needs the same dictionary on both peers, its id is offered in the upper half of id64
+	if (header.sessionID == 0 && (header.id64 >> 32) != codec->DictionaryID()) {
+		request.features &= ~static_cast<uint32_t>(LiteConnFeature::COMPRESS);
+	}
+	if (header.sessionID != 0) {
+		// The ACK echoes the features negotiated in the SYN | ACK, which are covered by the cookie
+		if (!cookies.Validate(header.sessionID, slot.address, request.checksum, request.features, slot.timeReceived)) return;
+		request.sessionID = header.sessionID;
+	}
+	queue.emplace_back(request);
+}
+
+void LiteConnManager::AdmitHandshakes(Shard& shard) {
+	// SYNs are only answered while a completed handshake would be accepted, the client keeps retrying otherwise
+	bool open = connectionRequests.size() < acceptBacklog && FindFreeSlot() != numConnections;
+	if (open) {
+		auto now = shard.timers->Now();
+		for (auto& request : shard.newHandshakes) {
+			LiteConnHeader header = {
+				.sessionID = request.checksum,
+				.flag = LiteConnHeaderFlag::SYN | LiteConnHeaderFlag::ACK,
+				.id32 = cookies.Issue(request.address, request.checksum, request.features, now),
+				.id64 = request.features,
+			};
+			auto synMessage = LiteConnHeader::Serialize(header);
+			shard.socket->QueuePacket(synMessage, request.address);
+		}
+	}
+	shard.newHandshakes.clear();
+
+	for (auto& request : shard.newRequests) {
+		if (connectionRequests.size() >= acceptBacklog) break;
+		// The client repeats its ACK until it hears from the server, so the handshake may already be queued
+		bool queued = std::any_of(connectionRequests.begin(), connectionRequests.end(),
+			[&](const ConnectionRequest& other) { return other.sessionID == request.sessionID; });
+		if (!queued) connectionRequests.push_back(request);
+	}
+	shard.newRequests.clear();
+	cv.notify_all();
+}
+
+void LiteConnManager::RouteAndTimeout(Shard& shard) {
+	// Timers are processed at most once per updateInterval, due timers are handled together
+	auto nextTimerRun = shard.timers->Now();
+	bool dumpsMetrics = shard.id == 0 && metricsInterval > std::chrono::steady_clock::duration::zero();
+	auto nextMetricsDump = dumpsMetrics ? std::chrono::steady_clock::now() + metricsInterval : std::chrono::steady_clock::time_point::max();
+	while (RouteOnce(shard, nextTimerRun, true)) {
+		auto now = std::chrono::steady_clock::now();
+		if (now >= nextMetricsDump) {
+			nextMetricsDump = now + metricsInterval;
+			DumpMetrics();
+		}
+		// Sleep until a datagram arrives, the next timer or the next metrics dump is due
+		shard.socket->WaitReadable(std::min(std::max(shard.timers->NextDeadline(), nextTimerRun), nextMetricsDump));
+	}
+}
+
+bool LiteConnManager::RouteOnce(Shard& shard, std::chrono::steady_clock::time_point& nextTimerRun, bool readSocket) {
+	auto& socket = shard.socket;
+	auto iterationStart = std::chrono::steady_clock::now();
+	{
+		std::lock_guard<std::mutex> guard(shard.lock);
+		
+		if (socket->IsClosed()) return false;
 
-				packet = socket->Read();
+		// Packets handed over by other shards are never forwarded again
+		{
+			std::lock_guard<std::mutex> inboxGuard(shard.inboxLock);
+			shard.forwarded.swap(shard.inbox);
+		}
+		for (auto& packet : shard.forwarded) {
+			RoutePacket(shard, packet, false);
+		}
+		shard.forwarded.clear();
+
+		// Drain the socket a batch at a time, a partially filled batch means the socket is empty
+		size_t count = 0;
+		while (readSocket) {
+			count = socket->ReadBatch(shard.receiveSlots);
+			for (size_t slot = 0; slot < count; slot++) {
+				RoutePacket(shard, shard.receiveSlots[slot], true);
 			}
+			if (count < shard.receiveSlots.size()) break;
+		}
 
-			// Ask active connections to process timeouts and remove closed connections
-			for (auto i = 0; i < numConnections; i++) {
-				auto temp = connections[i].lock();
-				if (temp &&
-					(temp->IsDisconnected() || !temp->UpdateTimeout())
-					)
-				{
-					connections[i].reset();
+		// Fire due timers and remove connections that closed
+		auto currentTime = shard.timers->Now();
+		if (currentTime >= nextTimerRun) {
+			nextTimerRun = currentTime + updateInterval;
+			shard.timers->PopExpired(currentTime, shard.expired);
+			for (auto& event : shard.expired) {
+				auto temp = event.connection.lock();
+				if (temp && !temp->HandleTimer(event.kind, event.id, currentTime)) {
+					auto index = shard.sessions.Find(temp->sessionID);
+					if (index != SessionTable::NO_SLOT && shard.connections[index].lock() == temp) {
+						UnregisterSession(shard, index);
+					}
 				}
 			}
+			shard.expired.clear();
 		}
-		std::this_thread::sleep_until(currentTime + updateInterval);
+
+		// Send the messages queued by the application since the last iteration
+		while (auto ready = shard.sendReady->TryPop()) {
+			if (auto temp = ready->lock()) temp->FlushOutbound();
+		}
+	}
+	// Handshakes are handed over after the shard lock is released to keep the lock order
+	if (!shard.newHandshakes.empty() || !shard.newRequests.empty()) {
+		std::lock_guard<std::mutex> guard(lock);
+		AdmitHandshakes(shard);
+	}
+	// Replies and retransmissions produced while routing are sent together
+	socket->Flush();
+	shard.routingLoop.Record(std::chrono::steady_clock::now() - iterationStart);
+	return true;
+}
+
+void LiteConnManager::DumpMetrics() {
+	auto stats = Stats();
+	if (metricsSink) {
+		metricsSink(stats);
 	}
+	else {
+		std::clog << stats << std::endl;
+	}
+}
+
+std::shared_ptr<LiteConnConnection> LiteConnManager::CreateConnection(Shard& shard, sockaddr_in peerAddr, uint32_t sessionID, TimeoutSetting timeout) {
+	auto result = std::make_shared<LiteConnConnection>(shard.socket, shard.timers, queueCapacity, peerAddr, sessionID, timeout, sendQueueCapacity, unreliableOverflow);
+	result->requestOverflow = requestOverflow;
+	if (congestion) {
+		result->congestion.emplace(*congestion);
+		result->pacer.emplace(congestion->maxBandwidth, congestion->pacingBurst, shard.timers->Now());
+	}
+	result->sendReady = shard.sendReady;
+	result->frameCapacity = std::min<size_t>(maxFrameSize, shard.socket->MaxPacketSize());
+	result->maxMessageSize = maxMessageSize;
+	result->rotateSession = rotateSessionOnMigration;
+	result->codec = codec;
+	result->compressionThreshold = compressionThreshold;
+	for (auto type : channels) {
+		result->channels.push_back(LiteConnConnection::Channel{ .type = type });
+	}
+	return result;
 }
 
 std::shared_ptr<LiteConnConnection> LiteConnManager::Accept(TimeoutSetting timeout, std::optional<std::chrono::steady_clock::duration> waitTime) {
-	if (socket->IsClosed()) return {};
+	if (!Good()) return {};
 
 	// Only accept connection when there's spot available
 	std::unique_lock<std::mutex> guard(lock);
 	if (!isListening && connectionRequests.empty()) return {};
 
-	size_t index = numConnections;
-
-	for (size_t i = 0; i < numConnections; i++) {
-		auto ptr = connections[i].lock();
-		if (!ptr || ptr->IsDisconnected()) {
-			index = i;
-			break;
-		}
-	}
+	size_t index = FindFreeSlot();
 	if (index == numConnections) return {};
 
 	auto predicate = [&]() { return !connectionRequests.empty(); };
-	if (waitTime) {
-		if (!cv.wait_for(guard, waitTime.value(), predicate)) return {};
-	}
-	else {
-		cv.wait(guard, predicate);
-	}
+	auto deadline = std::chrono::steady_clock::now() + waitTime.value_or(std::chrono::steady_clock::duration::zero());
+	std::optional<ConnectionRequest> request;
+	while (!request) {
+		if (waitTime) {
+			if (!cv.wait_until(guard, deadline, predicate)) return {};
+		}
+		else {
+			cv.wait(guard, predicate);
+		}
 
-	ConnectionRequest request = connectionRequests.front();
-	connectionRequests.pop_front();
+		// The lock was released while waiting, the slot found earlier may have been taken
+		index = FindFreeSlot();
+		if (index == numConnections) return {};
 
-	uint32_t checksum = GenerateChecksum();
-	auto result = std::make_shared<LiteConnConnection>(socket, queueCapacity, request.address, checksum, timeout);
-	result->status = LiteConnConnection::ConnectionStatus::Pending;
-	result->clientChecksum = request.checksum;
-	connections[index] = result;
+		request = connectionRequests.front();
+		connectionRequests.pop_front();
+		// A repeated ACK may queue a handshake again while it is being accepted, a cookie may also collide with a live session
+		std::shared_lock<std::shared_mutex> directoryGuard(directoryLock);
+		if (directory.Contains(request->sessionID)) request.reset();
+	}
+
+	// The connection is served by the shard that received its handshake so packets leave from the socket the client reached
+	auto& shard = *shards[request->shard];
+	auto result = CreateConnection(shard, request->address, request->sessionID, timeout);
+	result->status = LiteConnConnection::ConnectionStatus::Connected;
+	result->clientChecksum = request->checksum;
+	result->features = request->features;
+	result->compactHeaders = request->features & LiteConnFeature::COMPACT;
+	result->handshakeRepeatable = true;
+	AssignSlot(index, request->shard, result);
+	result->StartTimers();
 	guard.unlock();
 
-	Debug::Log("Received client number ", request.checksum);
-	Debug::Log("Server using number ", checksum);
-	LiteConnHeader header = {
-		.sessionID = request.checksum,
-		.flag = LiteConnHeaderFlag::SYN | LiteConnHeaderFlag::ACK,
-		.id32 = checksum,
-	};
-	auto synMessage = LiteConnHeader::Serialize(header);
-	socket->SendPacket(synMessage, request.address);
+	Debug::Log("Accepted client number ", request->checksum, " with session id ", request->sessionID);
+	return result;
+}
+
+bool LiteConnManager::Good() const { 
+	return std::all_of(shards.begin(), shards.end(), [](const auto& shard) { return !shard->socket->IsClosed(); });
+}
+
+LiteConnManagerStats LiteConnManager::Stats() {
+	std::vector<std::shared_ptr<LiteConnConnection>> open;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto& connection : connections) {
+			auto ptr = connection.lock();
+			if (ptr && !ptr->IsDisconnected()) open.push_back(std::move(ptr));
+		}
+	}
 
+	// Connection locks are taken after the manager lock is released, so a routing thread may take the snapshot
+	LiteConnManagerStats result = { .connections = open.size() };
+	for (auto& connection : open) {
+		auto stats = connection->Stats();
+		result.packetsSent += stats.packetsSent;
+		result.bytesSent += stats.bytesSent;
+		result.packetsReceived += stats.packetsReceived;
+		result.bytesReceived += stats.bytesReceived;
+		result.retransmissions += stats.retransmissions;
+		result.duplicatesDropped += stats.duplicatesDropped;
+		result.queueFullDrops += stats.queueFullDrops;
+		result.unacknowledged += stats.unacknowledged;
+		result.roundTrips += stats.roundTrips;
+	}
+	for (auto& shard : shards) {
+		auto socketStats = shard->socket->Stats();
+		result.sockets.packetsSent += socketStats.packetsSent;
+		result.sockets.bytesSent += socketStats.bytesSent;
+		result.sockets.packetsReceived += socketStats.packetsReceived;
+		result.sockets.bytesReceived += socketStats.bytesReceived;
+		result.sockets.sendErrors += socketStats.sendErrors;
+		result.sockets.receiveErrors += socketStats.receiveErrors;
+		result.routingLoop += shard->routingLoop.Read();
+	}
 	return result;
 }
 
-bool LiteConnManager::Good() const { return !socket->IsClosed(); }
+std::ostream& operator << (std::ostream& stream, const LiteConnManagerStats& stats) {
+	return stream << "[Metrics] connections=" << stats.connections
+		<< " sent=" << stats.packetsSent << "/" << stats.bytesSent << "B"
+		<< " received=" << stats.packetsReceived << "/" << stats.bytesReceived << "B"
+		<< " retransmissions=" << stats.retransmissions
+		<< " duplicates=" << stats.duplicatesDropped
+		<< " queueFull=" << stats.queueFullDrops
+		<< " unacknowledged=" << stats.unacknowledged
+		<< " rtt_p50=" << stats.roundTrips.Percentile(0.5).count() << "us"
+		<< " rtt_p99=" << stats.roundTrips.Percentile(0.99).count() << "us"
+		<< " loop_p50=" << stats.routingLoop.Percentile(0.5).count() << "us"
+		<< " loop_p99=" << stats.routingLoop.Percentile(0.99).count() << "us"
+		<< " socket_errors=" << stats.sockets.sendErrors << "/" << stats.sockets.receiveErrors;
+}
 
 size_t LiteConnManager::Count() {
 	std::lock_guard<std::mutex> guard(lock);
@@ -841,26 +2306,31 @@ size_t LiteConnManager::Count() {
 	for (size_t i = 0; i < numConnections; i++) {
 		auto ptr = connections[i].lock();
 		if (ptr) {
-			if (ptr->IsDisconnected()) connections[i].reset();
+			if (ptr->IsDisconnected()) ReleaseSlot(i);
 			else { ++count; }
 		}
 	}
 	return count;
 }
 
+std::vector<std::optional<LiteConnResponse>> LiteConnManager::BroadcastRequest(std::span<const std::shared_ptr<LiteConnConnection>> connections, const std::span<const char> data) {
+	std::vector<std::optional<LiteConnResponse>> responses(connections.size());
+	// Any shard's pool will do, the buffer returns to the pool it came from
+	PacketView payload(shards.front()->socket->AcquireBuffer(data.size()), 0, data.size());
+	std::copy(data.begin(), data.end(), payload.begin());
+	for (size_t i = 0; i < connections.size(); i++) {
+		if (!connections[i]) continue;
+		responses[i] = connections[i]->SendSharedRequest(payload);
+	}
+	return responses;
+}
+
 std::shared_ptr<LiteConnConnection> LiteConnManager::ConnectPeer(sockaddr_in peerAddr, TimeoutSetting timeout) {
 	// Do nothing if socket is closed
-	if (socket->IsClosed()) return {};
+	if (!Good()) return {};
 
 	std::lock_guard<std::mutex> guard(lock);
-	size_t index = numConnections;
-	for (size_t i = 0; i < numConnections; i++) {
-		auto ptr = connections[i].lock();
-		if (!ptr || ptr->IsDisconnected()) {
-			index = i;
-			break;
-		}
-	}
+	size_t index = FindFreeSlot();
 	// No available spots left for new connections
 	if (index == numConnections) return {};
 
@@ -870,14 +2340,20 @@ std::shared_ptr<LiteConnConnection> LiteConnManager::ConnectPeer(sockaddr_in pee
 		.sessionID = 0,
 		.flag = LiteConnHeaderFlag::SYN,
 		.id32 = checksum,
+		.id64 = (uint64_t(codec->DictionaryID()) << 32) | features,
 	};
 	auto packet = LiteConnHeader::Serialize(header);
 
-	auto result = std::make_shared<LiteConnConnection>(socket, queueCapacity, peerAddr, checksum, timeout);
+	// Outgoing connections are spread over the shards in turn
+	size_t shard = nextShard++ % shards.size();
+	auto result = CreateConnection(*shards[shard], peerAddr, checksum, timeout);
 	result->status = LiteConnConnection::ConnectionStatus::Connecting;
-	connections[index] = result;
+	result->clientChecksum = checksum;
+	result->features = features;
+	AssignSlot(index, shard, result);
+	result->StartTimers();
 
-	socket->SendPacket(packet, peerAddr);
+	result->Transmit(packet, peerAddr, false);
 
 	return result;
-}
\ No newline at end of file
+}
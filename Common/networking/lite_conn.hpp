@@ -2,16 +2,32 @@
 #define LITE_CONN_H
 #include <random>
 #include <chrono>
-#include <future>
 #include <utility>
 #include <unordered_set>
+#include <deque>
+#include <array>
+#include <algorithm>
+#include <shared_mutex>
 #include "socket.hpp"
+#include "session_table.hpp"
+#include "timer_queue.hpp"
+#include "spsc_ring.hpp"
+#include "mpsc_ring.hpp"
+#include "handshake_guard.hpp"
+#include "payload_codec.hpp"
+#include "impairment.hpp"
+#include "metrics.hpp"
+#include "congestion.hpp"
+#include "capture.hpp"
+#include "virtual_clock.hpp"
 #include "debug/log.hpp"
+#include "infrastructure/coroutine.hpp"
 
 // Forward declarations
 class LiteConnManager;
 class LiteConnConnection;
 class LiteConnResponse;
+class LiteConnReplay;
 
 class LiteConnRequest {
 	friend class LiteConnConnection;
@@ -34,23 +50,49 @@ public:
 	std::optional<LiteConnResponse> Converse(const std::span<const char> data);
 };
 
+// Channel of messages sent without a channel, such as SendData() and SendReliableData()
+constexpr uint8_t NO_CHANNEL = UINT8_MAX;
+
 struct LiteConnMessage {
-	std::vector<char> data;
+	// Points into the received datagram, the buffer returns to the pool when the message is destroyed
+	PacketView data;
 	std::optional<LiteConnRequest> requestHandle;
+	uint8_t channel = NO_CHANNEL;
+	// Set for messages sent reliably, see OverflowPolicy::DropOldest
+	bool reliable = false;
 };
 
+/// <summary>
+/// The pending response of a request. The response is stored by the connection until it is taken, so no shared state is allocated per request.
+/// </summary>
 class LiteConnResponse {
 private:
 	std::weak_ptr<LiteConnConnection> connection;
 	uint64_t requestID = 0;
-	std::future<std::optional<LiteConnMessage>> response;
+	bool isValid = false;
+
+	bool WaitFor(std::chrono::steady_clock::duration timeout) const;
 public:
+	/// <summary>
+	/// Returned by co_await in a Coroutine. The coroutine is parked until the response arrives or the request is closed,
+	/// then it is resumed by its CoroutineManager on the thread running it.
+	/// </summary>
+	struct Awaiter {
+		LiteConnResponse& response;
+		bool registered = false;
+
+		~Awaiter();
+		bool await_ready() const;
+		bool await_suspend(std::coroutine_handle<Coroutine::promise_type> handle);
+		std::optional<LiteConnMessage> await_resume();
+	};
+
 	LiteConnResponse();
-	LiteConnResponse(std::weak_ptr<LiteConnConnection>&& connection, const uint64_t& id, std::future<std::optional<LiteConnMessage>>&& value);
+	LiteConnResponse(std::weak_ptr<LiteConnConnection>&& connection, const uint64_t& id);
 	LiteConnResponse(const LiteConnResponse&) = delete;
-	LiteConnResponse(LiteConnResponse&&) noexcept = default;
+	LiteConnResponse(LiteConnResponse&& other) noexcept;
 	LiteConnResponse& operator = (const LiteConnResponse&) noexcept = delete;
-	LiteConnResponse& operator = (LiteConnResponse&&) noexcept = default;
+	LiteConnResponse& operator = (LiteConnResponse&& other) noexcept;
 	~LiteConnResponse();
 
 	void Cancel();
@@ -59,16 +101,20 @@ public:
 
 	template<typename Rep, typename Period>
 	bool WaitForResponse(std::chrono::duration<Rep, Period> timeout = {}) const {
-		if (!response.valid()) return true;
-
-		return response.wait_for(timeout) == std::future_status::ready;
+		return WaitFor(std::chrono::ceil<std::chrono::steady_clock::duration>(timeout));
 	}
+	/// <summary>
+	/// Blocks until the response arrives, empty if the request was rejected, cancelled or the connection closed
+	/// </summary>
 	std::optional<LiteConnMessage> GetResponse();
+
+	Awaiter operator co_await();
 };
 
 class LiteConnHeaderFlag {
 public:
 	enum Flag : uint8_t {
+		BUNDLE = 0,      // No flag set, the payload is a sequence of packets each prefixed by its 16 bit length
 		DATA = 1,        // Indicate this packet contains data
 		ACK = 1 << 1,     // Acknowledgement of receival
 		REQ = 1 << 2,    // Indicates this packet is a question that expects response
@@ -86,8 +132,60 @@ public:
 	}
 };
 
+/// <summary>
+/// Optional protocol extensions. The client offers a set in the id64 field of its SYN, the server replies with the
+/// accepted subset in the id64 field of the SYN | ACK. Peers that predate a feature send 0 and never enable it.
+/// </summary>
+class LiteConnFeature {
+public:
+	enum Feature : uint32_t {
+		SACK = 1,	// ACKs are coalesced once per update and carry the 64 ids before id32 as a bitmap in id64
+		BUNDLE = 1 << 1,	// Packets sent within an update are packed into shared datagrams
+		FRAGMENT = 1 << 2,	// Reliable messages larger than a frame are split into fragments and reassembled by the peer
+		CHANNEL = 1 << 3,	// Data payloads start with a channel envelope, only offered when channels are configured
+		MIGRATE = 1 << 4,	// A new peer address is only used once the peer answered a path challenge sent to it
+		COMPRESS = 1 << 5,	// Data payloads start with a compression marker, only offered when compression is enabled
+		COMPACT = 1 << 6,	// Packets after the handshake use the variable length header encoding
+		FLOW = 1 << 7,	// Heartbeats advertise the receive window in id32, reliable data beyond the peer's window is held back
+	};
+	static constexpr uint32_t ALL = SACK | BUNDLE | FRAGMENT | CHANNEL | MIGRATE | COMPRESS | COMPACT | FLOW;
+};
+
+/// <summary>
+/// Delivery guarantees of a channel, both peers must configure the same channels
+/// </summary>
+enum class ChannelType : uint8_t {
+	Unreliable, // May be lost, duplicated or reordered
+	UnreliableSequenced, // May be lost, messages older than the newest received one are dropped
+	ReliableUnordered, // Delivered once in the order of arrival
+	ReliableOrdered // Delivered once in the order of sending, later messages wait for missing ones of the same channel
+};
+
+/// <summary>
+/// What a connection does with a message that arrives while its receive queue is full.
+/// Reliable data is never acknowledged while the queue is full, so the peer backs off and sends it again.
+/// </summary>
+enum class OverflowPolicy : uint8_t {
+	DropNewest, // The arriving message is dropped, a request is not acknowledged and arrives again
+	DropOldest, // Unreliable data only, the arriving message replaces the oldest queued unreliable message
+	Reject // Requests only, the request is acknowledged and rejected with CXL so the peer's response completes empty
+};
+
+/// <summary>
+/// The packet header. The fixed format is always used for handshakes and with peers that did not negotiate COMPACT.
+/// The compact format keeps the session id in front, followed by a presence byte, the flag and the varint encoded index.
+/// id32 and id64 are only written when they are not 0, an id64 too large for 8 varint bytes is written as is.
+/// The presence byte always has its top bit set, which is the top bit of the index in the fixed format.
+/// </summary>
 struct LiteConnHeader {
 	static constexpr size_t Size = sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(LiteConnHeaderFlag);
+	static constexpr uint8_t COMPACT_MARKER = 0x80;
+	static constexpr uint8_t HAS_ID32 = 1;
+	static constexpr uint8_t HAS_ID64 = 1 << 1;
+	static constexpr uint8_t HAS_FIXED_ID64 = 1 << 2;
+	static constexpr size_t MaxCompactSize = sizeof(uint32_t) + sizeof(uint8_t) + sizeof(LiteConnHeaderFlag) + 5 + 5 + sizeof(uint64_t);
+	// Space that fits a header of either format
+	static constexpr size_t MaxSize = std::max(Size, MaxCompactSize);
 
 	uint32_t sessionID;     // Connection/session identifier
 	uint32_t index;         // Transport-level sequencing
@@ -135,9 +233,8 @@ struct LiteConnHeader {
 		std::memcpy(std::exchange(base, base + sizeof(uint32_t)), &extra, sizeof(uint32_t));
 		std::memcpy(base, &extra64, sizeof(uint64_t));
 	}
-	static std::vector<char> Serialize(const LiteConnHeader& header) {
-		std::vector<char> buffer;
-		buffer.resize(Size);
+	static std::array<char, Size> Serialize(const LiteConnHeader& header) {
+		std::array<char, Size> buffer;
 		auto index = htonl(header.index);
 		auto extra = htonl(header.id32);
 		auto extra64 = htonll(header.id64);
@@ -152,6 +249,103 @@ struct LiteConnHeader {
 		return buffer;
 	}
 
+	static size_t VarintSize(uint64_t value) {
+		size_t size = 1;
+		for (; value >= 0x80; value >>= 7) size++;
+		return size;
+	}
+	static char* WriteVarint(char* base, uint64_t value) {
+		for (; value >= 0x80; value >>= 7) {
+			*base++ = static_cast<char>((value & 0x7f) | 0x80);
+		}
+		*base++ = static_cast<char>(value);
+		return base;
+	}
+	static bool ReadVarint(const char*& base, const char* end, size_t maxBytes, uint64_t& value) {
+		value = 0;
+		for (size_t i = 0; i < maxBytes && base != end; i++) {
+			auto byte = static_cast<uint8_t>(*base++);
+			value |= uint64_t(byte & 0x7f) << (7 * i);
+			if (!(byte & 0x80)) return true;
+		}
+		return false;
+	}
+
+	static size_t CompactSize(const LiteConnHeader& header) {
+		size_t size = sizeof(uint32_t) + sizeof(uint8_t) + sizeof(LiteConnHeaderFlag) + VarintSize(header.index);
+		if (header.id32 != 0) size += VarintSize(header.id32);
+		if (header.id64 != 0) size += std::min(VarintSize(header.id64), sizeof(uint64_t));
+		return size;
+	}
+	/// <returns> The number of bytes written, 0 if the buffer is too small </returns>
+	static size_t SerializeCompact(const LiteConnHeader& header, std::span<char> buffer) {
+		size_t size = CompactSize(header);
+		if (buffer.size() < size) {
+			Debug::Log("Size of buffer too small for UDPHeader");
+			return 0;
+		}
+		auto sessionID = htonl(header.sessionID);
+		auto base = buffer.data();
+		std::memcpy(std::exchange(base, base + sizeof(uint32_t)), &sessionID, sizeof(uint32_t));
+
+		uint8_t presence = COMPACT_MARKER;
+		bool fixedID64 = VarintSize(header.id64) > sizeof(uint64_t);
+		if (header.id32 != 0) presence |= HAS_ID32;
+		if (header.id64 != 0) presence |= fixedID64 ? HAS_FIXED_ID64 : HAS_ID64;
+		*base++ = static_cast<char>(presence);
+		std::memcpy(std::exchange(base, base + sizeof(flag)), &header.flag, sizeof(flag));
+		base = WriteVarint(base, header.index);
+		if (presence & HAS_ID32) base = WriteVarint(base, header.id32);
+		if (presence & HAS_ID64) base = WriteVarint(base, header.id64);
+		if (presence & HAS_FIXED_ID64) {
+			auto extra64 = htonll(header.id64);
+			std::memcpy(base, &extra64, sizeof(uint64_t));
+		}
+		return size;
+	}
+	/// <summary>
+	/// Reads a header in either format, packets without the compact marker are read in the fixed format
+	/// </summary>
+	/// <returns> The header and the number of bytes it took </returns>
+	static std::optional<std::pair<LiteConnHeader, size_t>> DeserializeCompact(std::span<const char> buffer) {
+		constexpr size_t prefix = sizeof(uint32_t) + sizeof(uint8_t) + sizeof(LiteConnHeaderFlag);
+		if (buffer.size() < prefix) return {};
+		auto presence = static_cast<uint8_t>(buffer[sizeof(uint32_t)]);
+		if (!(presence & COMPACT_MARKER)) {
+			auto header = Deserialize(buffer);
+			if (!header) return {};
+			return std::make_pair(header.value(), Size);
+		}
+		if ((presence & HAS_ID64) && (presence & HAS_FIXED_ID64)) return {};
+
+		auto base = buffer.data();
+		auto end = buffer.data() + buffer.size();
+		uint32_t sessionID;
+		memcpy(&sessionID, std::exchange(base, base + sizeof(uint32_t)), sizeof(uint32_t));
+		base++;
+		uint8_t flag;
+		memcpy(&flag, std::exchange(base, base + sizeof(uint8_t)), sizeof(uint8_t));
+
+		uint64_t index = 0, extra = 0, extra64 = 0;
+		if (!ReadVarint(base, end, 5, index) || index > UINT32_MAX) return {};
+		if ((presence & HAS_ID32) && (!ReadVarint(base, end, 5, extra) || extra > UINT32_MAX)) return {};
+		if ((presence & HAS_ID64) && !ReadVarint(base, end, sizeof(uint64_t), extra64)) return {};
+		if (presence & HAS_FIXED_ID64) {
+			if (static_cast<size_t>(end - base) < sizeof(uint64_t)) return {};
+			memcpy(&extra64, std::exchange(base, base + sizeof(uint64_t)), sizeof(uint64_t));
+			extra64 = ntohll(extra64);
+		}
+
+		LiteConnHeader header = {
+			.sessionID = ntohl(sessionID),
+			.index = static_cast<uint32_t>(index),
+			.flag = static_cast<LiteConnHeaderFlag>(flag),
+			.id32 = static_cast<uint32_t>(extra),
+			.id64 = extra64
+		};
+		return std::make_pair(header, static_cast<size_t>(base - buffer.data()));
+	}
+
 	bool operator == (const LiteConnHeader&) const = default;
 };
 
@@ -159,8 +353,96 @@ struct TimeoutSetting {
 	std::chrono::steady_clock::duration connectionTimeout;
 	std::chrono::steady_clock::duration connectionRetryInterval;
 
+	// Retransmission timeout of reliable packets until the first round trip is measured
 	std::chrono::steady_clock::duration impRetryInterval;
 	std::chrono::steady_clock::duration replyKeepDuration;
+
+	// Bounds of the retransmission timeout derived from the measured round trip time, and of its backoff
+	std::chrono::steady_clock::duration minRetryInterval = std::chrono::milliseconds(20);
+	std::chrono::steady_clock::duration maxRetryInterval = std::chrono::seconds(2);
+
+	// The connection is closed if none of the fragments of a partially received message arrived for this long.
+	// Its fragments were acknowledged, so dropping the message would lose it. Should exceed maxRetryInterval.
+	std::chrono::steady_clock::duration reassemblyTimeout = std::chrono::seconds(5);
+};
+
+/// <summary>
+/// A snapshot of the metrics of a manager, see LiteConnManager::Stats()
+/// </summary>
+struct LiteConnManagerStats {
+	size_t connections = 0;
+	// Totals of the connections open when the snapshot was taken, see LiteConnConnection::ConnectionStats
+	uint64_t packetsSent = 0;
+	uint64_t bytesSent = 0;
+	uint64_t packetsReceived = 0;
+	uint64_t bytesReceived = 0;
+	uint64_t retransmissions = 0;
+	uint64_t duplicatesDropped = 0;
+	uint64_t queueFullDrops = 0;
+	size_t unacknowledged = 0;
+	Histogram::Snapshot roundTrips;
+	// Summed over the sockets of the routing threads, including handshakes and datagrams of unknown sessions
+	SocketStats sockets;
+	// Time spent by each iteration of a routing loop, waiting for datagrams excluded
+	Histogram::Snapshot routingLoop;
+};
+
+// Writes the snapshot as a single line, the format of the default metrics sink
+std::ostream& operator << (std::ostream& stream, const LiteConnManagerStats& stats);
+
+/// <summary>
+/// Options that apply to every connection of a LiteConnManager
+/// </summary>
+struct LiteConnSetting {
+	// Number of routing threads, each owns a socket bound to the manager's port with SO_REUSEPORT.
+	// Clamped to 1 on platforms without SO_REUSEPORT.
+	size_t numWorkers = 1;
+	// Protocol extensions offered to and accepted from peers, see LiteConnFeature
+	uint32_t features = LiteConnFeature::ALL;
+	// Upper bound of a bundled datagram, clamped to the socket's maximum packet size.
+	// Reliable messages that do not fit are fragmented when FRAGMENT is negotiated.
+	size_t maxFrameSize = 1200;
+	// Largest message that is fragmented, the partially received messages of a connection hold at most this many bytes together
+	size_t maxMessageSize = 1 << 20;
+	// Channels available to LiteConnConnection::Send(), indexed by channel number. At most NO_CHANNEL channels.
+	std::vector<ChannelType> channels = {};
+	// Messages each connection holds for its routing thread, rounded up to a power of two.
+	// The sending thread sends on its own while the queue is full.
+	size_t sendQueueCapacity = 256;
+	// Handling of unreliable data and requests received while the receive queue is full, see OverflowPolicy.
+	// DropOldest reserves as many extra slots as the queue capacity for the replaced messages.
+	OverflowPolicy unreliableOverflow = OverflowPolicy::DropNewest;
+	OverflowPolicy requestOverflow = OverflowPolicy::Reject;
+	// Handshake packets answered per second from one source address, SYNs and handshake ACKs above the rate are dropped
+	double handshakeRate = 20;
+	// Handshake packets answered at once from a source address that was quiet
+	double handshakeBurst = 40;
+	// Completed handshakes waiting for Accept(), SYNs are not answered while the backlog is full
+	size_t acceptBacklog = 64;
+	// How long the session id handed out in a SYN | ACK is accepted in the client's ACK
+	std::chrono::steady_clock::duration cookieLifetime = std::chrono::seconds(5);
+	// Hands out a new session id when a peer is validated on a new address, so the id does not link its old and new path.
+	// Only used with MIGRATE, the previous id keeps routing the packets still in flight.
+	bool rotateSessionOnMigration = false;
+	// Data messages of at least this many bytes, including their channel envelope, are compressed when COMPRESS is negotiated.
+	// 0 disables compression, it is only negotiated when both peers enable it.
+	size_t compressionThreshold = 0;
+	// Preset dictionary of the compressor, typically a few recorded messages. COMPRESS is only negotiated with peers using
+	// the same dictionary.
+	std::vector<char> compressionDictionary = {};
+	// Limits the reliable packets each connection keeps in flight and paces its data messages, see CongestionController.
+	// Only the sending side needs it, nothing is negotiated.
+	std::optional<CongestionSetting> congestion = {};
+	// Simulated network conditions applied to the datagrams every routing thread receives, for testing.
+	// The seed is offset by the index of the routing thread.
+	std::optional<ImpairmentSetting> impairment = {};
+	// Interval at which the first routing thread passes LiteConnManager::Stats() to metricsSink, 0 disables the dump
+	std::chrono::steady_clock::duration metricsInterval = {};
+	// Called on the routing thread and should return quickly, the snapshot is written to std::clog when empty
+	std::function<void(const LiteConnManagerStats&)> metricsSink = {};
+	// Records every datagram of the routing threads to this file for LiteConnReplay, empty disables the capture.
+	// The capture holds the key of the handshake cookies so it can be replayed, it should be kept as private as the traffic.
+	std::string capturePath = {};
 };
 
 class LiteConnConnection : public std::enable_shared_from_this<LiteConnConnection> {
@@ -172,26 +454,130 @@ private:
 	/// Represents a packet that needs to be acknowledged
 	/// </summary>
 	struct AutoResendEntry {
-		std::vector<char> packet;
+		PacketView packet;
+		// A payload shared with other connections, sent after packet which then only holds the header
+		PacketView body = {};
+		std::chrono::steady_clock::time_point sent;
 		std::chrono::steady_clock::time_point resend;
+		// Doubled on every retransmission
+		std::chrono::steady_clock::duration interval;
+		// Acknowledgements of retransmitted packets are ambiguous and not used as round trip samples
+		bool retransmitted = false;
+	};
+
+	/// <summary>
+	/// The fragments of a message received so far, each a view into its datagram
+	/// </summary>
+	struct PartialMessage {
+		std::vector<PacketView> fragments;
+		size_t received = 0;
+		size_t bytes = 0;
+		// Taken from the reassembly budget when the first fragment arrives, so the rest of the message always fits
+		size_t reserved = 0;
+		std::chrono::steady_clock::time_point expiry;
+	};
+
+	/// <summary>
+	/// A request sent by this side, completed by the response, a rejection or the connection closing.
+	/// Kept until the LiteConnResponse takes the response or is destroyed.
+	/// </summary>
+	struct PendingRequest {
+		std::optional<LiteConnMessage> response = {};
+		bool completed = false;
+		// The coroutine awaiting the response, woken on completion
+		std::coroutine_handle<Coroutine::promise_type> waiter = {};
+	};
+
+	struct Channel {
+		ChannelType type;
+		uint32_t nextSend = 0;
+		// The sequence number expected next, older ones are dropped
+		uint32_t nextReceive = 0;
+		// Messages of an ordered channel received ahead of nextReceive
+		std::unordered_map<uint32_t, PacketView> reordered = {};
+	};
+
+	// First byte of data payloads when COMPRESS is negotiated, a compressed payload continues with its original size
+	enum class CompressionMarker : uint8_t {
+		Uncompressed,
+		Compressed
+	};
+
+	/// <summary>
+	/// A message handed from the sending thread to the routing thread, the envelope and the header are written into the headroom of the payload
+	/// </summary>
+	struct OutboundMessage {
+		PacketView payload;
+		uint8_t channel = NO_CHANNEL;
+		bool reliable = false;
+		// 0 for a data message. Fragments, requests, responses, rejections and cancellations are sent reliably with this flag and id64.
+		uint8_t flag = 0;
+		uint64_t id64 = 0;
+		// Sent after the payload, the payload of a request shared with other connections
+		PacketView body = {};
 	};
 
 public:
 	enum class ConnectionStatus {
-		Pending, // Server has sent back response to client request, waiting for client acknoledgement
 		Connecting, // Client has sent initial connection request, waiting for server response
 		Connected, // Connection established
 		Disconnected // Connection closed
 	};
 
+	struct ConnectionStats {
+		// Zero until the first round trip is measured
+		std::chrono::steady_clock::duration smoothedRtt;
+		std::chrono::steady_clock::duration rttVariance;
+		// The timeout used for newly sent reliable packets
+		std::chrono::steady_clock::duration retransmitTimeout;
+		uint64_t retransmissions;
+		size_t unacknowledged;
+		// Data messages sent compressed, their size before and after compression, and the time spent on the codec
+		// including messages that did not shrink
+		uint64_t compressedMessages;
+		uint64_t uncompressedBytes;
+		uint64_t compressedBytes;
+		std::chrono::steady_clock::duration compressionTime;
+		std::chrono::steady_clock::duration decompressionTime;
+		// Datagrams exchanged with the peer, including bundles, acknowledgements and heartbeats
+		uint64_t packetsSent;
+		uint64_t bytesSent;
+		uint64_t packetsReceived;
+		uint64_t bytesReceived;
+		// Reliable packets received again after they were handled
+		uint64_t duplicatesDropped;
+		// Messages dropped or replaced because the receive queue was full, reliable ones are not acknowledged and arrive again
+		uint64_t queueFullDrops;
+		// Messages waiting for the peer's receive window when FLOW is negotiated, for the congestion window or for the pacer.
+		// Every fragment of a fragmented message counts as one.
+		size_t heldMessages;
+		// Reliable packets allowed in flight and bytes per second allowed by the pacer, both 0 without congestion control
+		size_t congestionWindow;
+		double pacingRate;
+		Histogram::Snapshot roundTrips;
+	};
+
 private:
 	std::shared_ptr<UDPSocket> socket;
+	std::shared_ptr<TimerQueue> timers;
 	std::atomic<uint32_t> pktIndex;
 	std::atomic<uint32_t> impIndex;
 	std::atomic<uint64_t> reqIndex;
 	uint32_t sessionID;
+	// The session id the client used before the handshake, echoed in its handshake ACK
 	uint32_t clientChecksum = 0;
+	// Cleared by a client when it completes the handshake. The server keeps no state until the handshake ACK arrives,
+	// so the client repeats the ACK with every heartbeat until it hears from the server.
+	bool handshakeConfirmed = true;
+	// Set by a server on accepting, the client may repeat its handshake ACK until the server receives anything else
+	bool handshakeRepeatable = false;
+	// Offered features while connecting, negotiated features once the SYN | ACK is sent or received
+	uint32_t features = 0;
+	// Set once COMPACT is negotiated, the handshake itself always uses the fixed header format
+	bool compactHeaders = false;
 	size_t queueCapacity;
+	const OverflowPolicy unreliableOverflow;
+	OverflowPolicy requestOverflow = OverflowPolicy::Reject;
 	std::condition_variable cv;
 
 	// Used by timeout
@@ -203,50 +589,260 @@ private:
 	std::mutex lock;
 	std::unordered_map<uint64_t, AutoResendEntry> autoResendEntries;
 	std::unordered_map<uint32_t, std::chrono::steady_clock::time_point> autoAcks;
-	std::unordered_map<uint64_t, std::promise<std::optional<LiteConnMessage>>> requestHandles;
+	// Ids waiting for the next coalesced ACK when SACK is negotiated
+	std::vector<uint32_t> pendingAcks;
+	bool flushScheduled = false;
+	// The bundle being filled when BUNDLE is negotiated, the space for its header is reserved at the front
+	size_t frameCapacity = 0;
+	PacketBuffer frame;
+	size_t frameSize = 0;
+	size_t frameMessages = 0;
+	// Fragmentation, messages are identified by the upper 32 bits of id64
+	size_t maxMessageSize = 0;
+	uint32_t messageIndex = 0;
+	std::unordered_map<uint32_t, PartialMessage> partialMessages;
+	// Bytes reserved by the partial messages
+	size_t partialBytes = 0;
+	std::vector<Channel> channels;
+	// Messages waiting in reorder buffers count towards the queue capacity, read by the consumer of packetQueue
+	std::atomic<size_t> reorderedMessages = 0;
+	std::unordered_map<uint64_t, PendingRequest> requestHandles;
 	std::unordered_set<uint64_t> pendingResponses;
-	std::list<LiteConnMessage> packetQueue;
+	// Round trip estimation, sampled from ACKs of packets sent once and from heartbeat echoes
+	std::chrono::steady_clock::duration smoothedRtt = {};
+	std::chrono::steady_clock::duration rttVariance = {};
+	std::chrono::steady_clock::duration retransmitTimeout;
+	bool rttMeasured = false;
+	uint64_t retransmissions = 0;
+	// Compression, shared by the connections of the manager and only used when COMPRESS is negotiated
+	std::shared_ptr<const PayloadCodec> codec;
+	size_t compressionThreshold = 0;
+	uint64_t compressedMessages = 0;
+	uint64_t uncompressedBytes = 0;
+	uint64_t compressedBytes = 0;
+	std::chrono::steady_clock::duration compressionTime = {};
+	std::chrono::steady_clock::duration decompressionTime = {};
 	sockaddr_in peerAddr;
-	ConnectionStatus status;
+	// Metrics, updated without lock by whichever thread sends or receives
+	std::atomic<uint64_t> packetsSent = 0;
+	std::atomic<uint64_t> bytesSent = 0;
+	std::atomic<uint64_t> packetsReceived = 0;
+	std::atomic<uint64_t> bytesReceived = 0;
+	std::atomic<uint64_t> duplicatesDropped = 0;
+	std::atomic<uint64_t> queueFullDrops = 0;
+	Histogram roundTrips;
+	// Path validation when MIGRATE is negotiated. A newer packet from another address is answered with a challenge
+	// sent to that address, peerAddr only moves there once the peer echoes the token from it.
+	std::optional<sockaddr_in> pathCandidate;
+	uint64_t pathToken = 0;
+	std::chrono::steady_clock::time_point pathDeadline;
+	// Set by the manager's rotateSessionOnMigration
+	bool rotateSession = false;
+	// The session id offered with the challenges until a validation succeeds, 0 keeps the session id
+	uint32_t nextSessionID = 0;
+	// A second id routed to the connection, the offered id while validating or the replaced id after rotating
+	uint32_t aliasSessionID = 0;
+	// Flow control when FLOW is negotiated. The receive limit is the number of reliable data packets received so far
+	// plus the free space of the queue, the peer sends reliable data until its own count reaches the advertised limit.
+	std::atomic<uint32_t> reliableReceived = 0;
+	std::atomic<uint32_t> advertisedLimit = 0;
+	// Set by the consumer of packetQueue when it freed enough space to advertise, cleared by the timer sending the update
+	std::atomic<bool> windowUpdateScheduled = false;
+	uint32_t reliableSent = 0;
+	uint32_t peerLimit = 0;
+	// Nothing is held back until the peer advertised its first window
+	bool peerWindowKnown = false;
+	std::deque<OutboundMessage> heldMessages;
+	// Congestion control when LiteConnSetting::congestion is set. Messages that fit into the windows wait in pacedMessages
+	// while the pacer has no budget, their reliable ones count as in flight.
+	std::optional<CongestionController> congestion;
+	std::optional<TokenBucket> pacer;
+	std::deque<OutboundMessage> pacedMessages;
+	size_t pacedReliable = 0;
+	bool paceScheduled = false;
+	// Written while holding lock, read without it
+	std::atomic<ConnectionStatus> status;
+
+	// Messages sent by the application, pushed without lock and popped while holding it
+	MpscRing<OutboundMessage> outbound;
+	// Set while the connection waits in sendReady, the first message pushed after it was cleared enqueues the connection
+	std::atomic<bool> outboundScheduled = false;
+	// Connections of the routing thread with messages in outbound, shared by the connections of the shard
+	std::shared_ptr<MpscRing<std::weak_ptr<LiteConnConnection>>> sendReady;
+	// Set while the routing thread sends the outbound messages, packets are queued on the socket instead of sent
+	bool queueSends = false;
+
+	// Received messages, pushed while holding lock and popped by the thread calling Receive() without it.
+	// Messages left in the queue after disconnecting are dropped by the next Receive() call or by the destructor.
+	SpscRing<LiteConnMessage> packetQueue;
+	// Unreliable messages replaced under OverflowPolicy::DropOldest, the consumer skips this many of the oldest ones
+	std::atomic<size_t> staleMessages = 0;
 
 	// Called by request handles
 	void CloseRequest(uint64_t index);
 	void RejectRequest(uint64_t index);
+	// Assumes lock is acquired, tells the peer its request was rejected
+	void SendRejection(uint64_t index);
+	// Hands a request, response, rejection or cancellation to the routing thread like a data message
+	void EnqueueControl(uint8_t flag, uint64_t id64, PacketView&& payload, PacketView&& body = {});
 	void Respond(uint64_t index, const std::span<const char>& data);
 	std::optional<LiteConnResponse> Converse(uint64_t index, const std::span<const char>& data);
 
+	// Called by responses
+	bool WaitForResponse(uint64_t index, std::chrono::steady_clock::duration timeout);
+	std::optional<LiteConnMessage> TakeResponse(uint64_t index);
+	// Returns false without parking the coroutine if the request is already completed
+	bool AwaitResponse(uint64_t index, std::coroutine_handle<Coroutine::promise_type> handle);
+	void ClearWaiter(uint64_t index);
+
+	// Assumes lock is acquired, stores the response and wakes whoever waits for it
+	void CompleteRequest(PendingRequest& request, std::optional<LiteConnMessage>&& response);
+	// Assumes lock is acquired, completes every pending request without a response when the connection closes
+	void CancelRequests();
+
 	/// <summary>
-	/// Called by UDPConnectionManager to remove await entries that have expired
+	/// Called by the routing thread when one of the connection's timers is due
 	/// </summary>
-	bool UpdateTimeout();
-	void ParsePacket(const LiteConnHeader& header, std::vector<char>&& data, const sockaddr_in& address);
+	/// <returns> false if the connection is closed and should be removed from the manager </returns>
+	bool HandleTimer(TimerKind kind, uint64_t id, std::chrono::steady_clock::time_point now);
+	// Schedules the heartbeat and timeout timers, called once the connection is owned by a shared_ptr
+	void StartTimers();
+	// Parses a datagram starting with the header, which is read in the connection's format
+	void ParsePacket(PacketView&& datagram, const sockaddr_in& address);
+	// Assumes lock is acquired, handles one packet after the address of the datagram was processed
+	void DispatchPacket(const LiteConnHeader& header, PacketView& data);
+	void ParseBundle(const PacketView& data);
 	
-	// Assumes lock is acquired
+	// Assumes lock is acquired, packets sent from the routing thread are queued on the socket and flushed once per loop
 	void AckReceival(const LiteConnHeader& index);
-	void SendPacket(LiteConnHeader& header, const std::span<const char> data);
+	// Sends an ACK for the id now, or defers it to the next coalesced ACK when SACK is negotiated
+	void SendAcknowledgement(uint32_t id);
+	// Sends the deferred ids as few ACKs as possible, each covering the 64 ids below its id32
+	void FlushAcknowledgements();
+	// Schedules the flush of coalesced ACKs and the current bundle on the routing thread
+	void ScheduleFlush();
+	// Appends a complete packet, followed by its shared body if any, to the current bundle, returns false if the packet has to be sent on its own
+	bool TryBundle(const std::span<const char> packet, const std::span<const char> body = {});
+	// Sends the current bundle, queued on the socket when called by the routing thread
+	void FlushFrame(bool queue);
+	// Splits a reliable message that does not fit into a frame into fragments that are held and paced one at a time,
+	// returns false if the message is too large
+	bool SendFragmented(const OutboundMessage& message);
+	// Stores a received fragment and queues the message once complete, returns false if the fragment was not accepted and must not be acknowledged
+	bool StoreFragment(const LiteConnHeader& header, PacketView& data);
+	// Drops messages that are not complete or not yet in order
+	void ClearReceiveBuffers();
+	// Called by the consumer of packetQueue once disconnected, outside of lock as dropped requests take it to reject themselves
+	void DiscardReceived();
+	// Hands a message to the routing thread, or sends it right away if the routing thread fell behind
+	void EnqueueMessage(OutboundMessage&& message);
+	// Assumes lock is acquired, sends every message in outbound
+	void DrainOutbound();
+	// Called by the routing thread when the connection was taken from sendReady
+	void FlushOutbound();
+	// Writes the channel envelope in front of the payload and compresses it
+	void EncodeOutbound(OutboundMessage& message);
+	// Sends an encoded message or fragment
+	void SendOutbound(OutboundMessage&& message);
+	// Sends a data message whose payload starts with its envelope
+	void SendMessage(PacketView&& payload, bool reliable);
+	// Every datagram of the connection goes through Transmit() so it is counted, it is queued on the socket or sent right away
+	void Transmit(std::span<const std::span<const char>> parts, const sockaddr_in& address, bool queue);
+	void Transmit(const std::span<const char> datagram, const sockaddr_in& address, bool queue);
+	// Queues a received message, counting it as dropped if the queue is full. An unreliable message arriving at a full
+	// queue under DropOldest is queued in the extra slots and marks the oldest unreliable message as stale.
+	void Enqueue(LiteConnMessage&& message);
+	// Messages in packetQueue that are not stale plus the ones held in reorder buffers
+	size_t QueuedMessages() const;
+	// Called by the consumer of packetQueue, drops the stale messages and returns the number kept at the front
+	size_t SkipStale(std::span<LiteConnMessage> messages);
+	// Reliable data packets received so far plus the free space of the queue
+	uint32_t ReceiveLimit() const;
+	// Called by the consumer of packetQueue, schedules a window update once the limit moved far from the advertised one
+	void CheckReceiveWindow();
+	// The id32 of heartbeats, the receive limit when FLOW is negotiated, which is remembered as advertised
+	uint32_t AdvertiseWindow();
+	// Reliable data may be sent unless the peer's advertised limit or the congestion window is reached
+	bool HasSendCredit() const;
+	// Takes the limit advertised in a heartbeat and sends the held messages it has room for
+	void UpdatePeerWindow(uint32_t limit);
+	// Encodes a data message and sends it, or holds it back behind the peer's receive window. Other messages are sent right away.
+	void SendOrHold(OutboundMessage&& message);
+	// Sends an encoded message or fragment, or holds it back behind the peer's receive window
+	void Admit(OutboundMessage&& message);
+	// Sends the held messages in order while the windows have room
+	void ReleaseHeldMessages();
+	// Sends a message that fits into the windows, or queues it until the pacer has budget
+	void Pace(OutboundMessage&& message);
+	// Sends the paced messages the pacer has budget for and schedules the rest
+	void ReleasePacedMessages(std::chrono::steady_clock::time_point now);
+	void SchedulePacing(std::chrono::steady_clock::time_point now);
+	// Derives the pacing rate from the congestion window and the round trip estimation
+	void UpdatePacingRate(std::chrono::steady_clock::time_point now);
+	// Queues the datagram on the socket while queueSends is set, sends it right away otherwise, the body is gathered after the datagram
+	void SendDatagram(const std::span<const char> datagram, const std::span<const char> body = {});
+	// Removes the channel envelope and queues the message, or holds it back until it is in order
+	void DeliverMessage(PacketView&& data, bool reliable);
+	// Prefixes the compression marker, compressing the payload first if it is large enough and shrinks
+	void CompressPayload(PacketView& payload);
+	// Removes the compression marker and decompresses the payload if needed, returns false if it is malformed
+	bool DecompressPayload(PacketView& payload);
+	// The features offered in a SYN, with the id of the compression dictionary in the upper half
+	uint64_t OfferedFeatures() const;
+	// The envelope of messages sent without a channel, empty unless CHANNEL is negotiated
+	std::span<const char> NoChannelEnvelope() const;
+	void QueuePacket(LiteConnHeader& header, const std::span<const char> data);
 	void SendPacketReliable(LiteConnHeader& header, const std::span<const char> data);
+	// Sends a payload built with AllocatePayload() without copying it, followed by the body if it is shared with other connections
+	void SendPayloadReliable(LiteConnHeader& header, PacketView&& payload, PacketView&& body = {});
+	// Sends a request whose payload is shared with other connections, only the header is written by this connection
+	std::optional<LiteConnResponse> SendSharedRequest(const PacketView& payload);
+	// Requests and responses are never fragmented, logs an error if the payload does not fit into a datagram
+	bool FitsDatagram(size_t size) const;
+	// Adds a pending request unless the connection is closed, the request is queued afterwards
+	std::optional<uint64_t> RegisterRequest();
+	// Returns a view of the given size with headroom in front for the header
+	PacketView AllocatePayload(size_t size);
+	// Writes the header into the headroom in front of the payload
+	void WriteHeader(const LiteConnHeader& header, PacketView& packet);
+	// Encodes a header in the negotiated format, returns the written part of the buffer
+	std::span<const char> EncodeHeader(const LiteConnHeader& header, std::span<char> buffer) const;
+	std::optional<std::pair<LiteConnHeader, size_t>> ReadHeader(std::span<const char> packet) const;
+	// The most space a header can take in the negotiated format
+	size_t MaxHeaderSize() const;
+	void ScheduleTimer(TimerKind kind, std::chrono::steady_clock::time_point deadline, uint64_t id = 0);
+	void SendHeartbeat(std::chrono::steady_clock::time_point now);
+	// Sends a heartbeat carrying the receive window without moving the heartbeat schedule
+	void SendHeartbeatPacket(std::chrono::steady_clock::time_point now);
+	// Updates the round trip estimation and the retransmission timeout derived from it
+	void SampleRoundTrip(std::chrono::steady_clock::duration sample);
+	void CloseOnTimeout();
 
 	// Packet handlers when status is connected
 	void UpdateAddress(const LiteConnHeader& header, const sockaddr_in& address);
+	// Challenges the address unless it is already being validated
+	void StartPathValidation(const sockaddr_in& address);
+	void SendPathChallenge(std::chrono::steady_clock::time_point now);
+	// Answers a path challenge of the peer, or moves to the address an answer to our challenge came from
+	bool TryHandlePathValidation(const LiteConnHeader& header, const sockaddr_in& address);
 	bool TryHandleDisconnect(const LiteConnHeader& header);
-	bool TryHandleMissedHandshake(const LiteConnHeader& header, const std::vector<char>& data);
+	bool TryHandleMissedHandshake(const LiteConnHeader& header, const PacketView& data);
+	bool TryHandleRepeatedHandshake(const LiteConnHeader& header);
 	bool TryHandleDuplicates(const LiteConnHeader& header);
-	bool TryHandleAcknowledgement(const LiteConnHeader& header, std::vector<char>& data);
-	bool TryHandleRequestCancellation(const LiteConnHeader& header, const std::vector<char>& data);
-	bool TryHandleData(const LiteConnHeader& header, std::vector<char>& data);
-	bool TryHandleHeartBeat(const LiteConnHeader& header, const std::vector<char>& data);
+	bool TryHandleAcknowledgement(const LiteConnHeader& header, PacketView& data);
+	bool TryHandleRequestCancellation(const LiteConnHeader& header, const PacketView& data);
+	bool TryHandleData(const LiteConnHeader& header, PacketView& data);
+	bool TryHandleHeartBeat(const LiteConnHeader& header, const PacketView& data);
 	
 	// Packet handlers when status is connecting
-	void HandleServerAcknowledgement(const LiteConnHeader& header, const std::vector<char>& data);
-
-	// Packet handlers when status is pending
-	bool TryHandleMissedAcknowledgement(const LiteConnHeader& header, const std::vector<char>& data);
-	void HandleClientAcknowledgement(const LiteConnHeader& header, const std::vector<char>& data);
+	void HandleServerAcknowledgement(const LiteConnHeader& header, const PacketView& data);
+	// The third message of the handshake, carries the client checksum and the negotiated features the server's cookie is checked against
+	void SendHandshakeAcknowledgement();
 
 public:
 	const TimeoutSetting timeout;
 
-	LiteConnConnection(std::shared_ptr<UDPSocket> socket, size_t packetQueueCapacity, sockaddr_in peerAddr, uint32_t sessionID, TimeoutSetting setting);
+	LiteConnConnection(std::shared_ptr<UDPSocket> socket, std::shared_ptr<TimerQueue> timers, size_t packetQueueCapacity, sockaddr_in peerAddr, uint32_t sessionID, TimeoutSetting setting, size_t sendQueueCapacity = 256, OverflowPolicy unreliableOverflow = OverflowPolicy::DropNewest);
 	LiteConnConnection(LiteConnConnection&& other) = delete;
 	LiteConnConnection(const LiteConnConnection& other) = delete;
 	LiteConnConnection& operator = (LiteConnConnection&& other) = delete;
@@ -265,9 +861,9 @@ public:
 	bool WaitForDataPacket(std::chrono::duration<Rep, Period> timeout) {
 		std::unique_lock<std::mutex> guard(lock);
 		if (status != ConnectionStatus::Connected) return false;
-		auto pred = [&]() { return status == ConnectionStatus::Disconnected || !packetQueue.empty(); };
+		auto pred = [&]() { return status == ConnectionStatus::Disconnected || !packetQueue.Empty(); };
 		cv.wait_for(guard, timeout, pred);
-		return status == ConnectionStatus::Connected && !packetQueue.empty();
+		return status == ConnectionStatus::Connected && !packetQueue.Empty();
 	}
 
 	bool WaitForConnectionComplete();
@@ -275,56 +871,183 @@ public:
 	bool IsConnected();
 	bool IsDisconnected();
 	sockaddr_in PeerAddr();
+	ConnectionStats Stats();
 	void Disconnect();
 
+	/// <summary>
+	/// The data messages below are copied into a queue that the routing thread sends from, they do not wait for the connection lock or the socket.
+	/// Messages sent from one thread keep their order.
+	/// </summary>
 	void SendData(const std::span<const char> data);
 	void SendReliableData(const std::span<const char> data);
+	/// <summary>
+	/// Sends a message on one of the channels configured in LiteConnSetting, with the guarantees of its ChannelType
+	/// </summary>
+	void Send(uint8_t channel, const std::span<const char> data);
+	/// <summary>
+	/// Sends a request, the response is taken from the returned LiteConnResponse. Requests and responses are not fragmented,
+	/// a request whose payload does not fit into a datagram is refused with an error.
+	/// </summary>
 	std::optional<LiteConnResponse> SendRequest(const std::span<const char> data);
 	std::optional<LiteConnMessage> Receive();
+	/// <summary>
+	/// Moves as many received messages as fit into the output, cheaper than calling Receive() once per message.
+	/// Receive() and ReceiveAll() must not be called concurrently on the same connection.
+	/// </summary>
+	/// <returns> The number of messages written to the front of the output </returns>
+	size_t ReceiveAll(std::span<LiteConnMessage> messages);
 
 #ifdef ENABLE_TEST_HOOKS
 	void SimulateDisconnect() {
 		socket->Close();
 	}
 
+	// Sends the messages still waiting for the routing thread first so they are counted
 	size_t NumImpMsg() {
+		std::lock_guard<std::mutex> guard(lock);
+		DrainOutbound();
 		return autoResendEntries.size();
 	}
 
+	size_t NumPartialMessages() {
+		std::lock_guard<std::mutex> guard(lock);
+		return partialMessages.size();
+	}
+
 	uint32_t SessionID() {
 		return sessionID;
 	}
+
+	uint32_t Features() {
+		return features;
+	}
 #endif
 };
 
 class LiteConnManager {
+	friend class LiteConnReplay;
 private:
+	/// <summary>
+	/// A handshake seen by a routing thread. sessionID is 0 for a SYN waiting for its SYN | ACK, and the validated cookie for a completed handshake.
+	/// </summary>
+	struct ConnectionRequest {
+		sockaddr_in address;
+		uint32_t checksum;
+		uint32_t features;
+		size_t shard;
+		uint32_t sessionID = 0;
+	};
+
+	/// <summary>
+	/// A routing thread with its own socket and the connections it serves, shards share no locks on the routing path
+	/// </summary>
+	struct Shard {
+		const size_t id;
+		std::shared_ptr<UDPSocket> socket;
+		std::shared_ptr<TimerQueue> timers;
+
+		// The lock guards the following fields, connections is indexed by the manager's slot index
+		std::mutex lock = {};
+		std::vector<std::weak_ptr<LiteConnConnection>> connections;
+		SessionTable sessions;
+		std::vector<uint32_t> slotSessions;
+		// The alias session id of each slot's connection, EMPTY if it has none
+		std::vector<uint32_t> slotAliases;
+
+		// Packets received by another shard for a session owned by this one
+		std::mutex inboxLock = {};
+		std::vector<PacketSlot> inbox = {};
+
+		// Connections with messages queued by the application, see LiteConnConnection::EnqueueMessage()
+		std::shared_ptr<MpscRing<std::weak_ptr<LiteConnConnection>>> sendReady;
+
+		// Only used by the routing thread
+		std::vector<PacketSlot> receiveSlots;
+		std::vector<TimerEvent> expired = {};
+		std::vector<PacketSlot> forwarded = {};
+		std::vector<ConnectionRequest> newHandshakes = {};
+		std::vector<ConnectionRequest> newRequests = {};
+		HandshakeLimiter limiter;
+		Histogram routingLoop;
+		std::thread thread = {};
+
+		Shard(size_t id, std::shared_ptr<UDPSocket> socket, size_t numConnections, const LiteConnSetting& setting, std::shared_ptr<const VirtualClock> clock);
+	};
+
 	const size_t numConnections;
+	const uint32_t features;
+	const size_t maxFrameSize;
+	const size_t maxMessageSize;
+	const std::vector<ChannelType> channels;
+	const size_t sendQueueCapacity;
+	const OverflowPolicy unreliableOverflow;
+	const OverflowPolicy requestOverflow;
+	const std::optional<CongestionSetting> congestion;
+	const size_t acceptBacklog;
+	const HandshakeCookie cookies;
+	const bool rotateSessionOnMigration;
+	const std::shared_ptr<const PayloadCodec> codec;
+	const size_t compressionThreshold;
+	const std::chrono::steady_clock::duration metricsInterval;
+	const std::function<void(const LiteConnManagerStats&)> metricsSink;
 	size_t queueCapacity;
-	std::shared_ptr<UDPSocket> socket;
 	std::chrono::steady_clock::duration updateInterval;
 	std::mt19937 checksumGenerator = {};
+	std::vector<std::unique_ptr<Shard>> shards;
 
-	// The lock guards the following fields
+	// The lock guards the following fields, it is never acquired by a routing thread that holds a shard lock
 	std::mutex lock = {};
 	std::condition_variable cv = {};
 	std::vector<std::weak_ptr<LiteConnConnection>> connections;
-
-	struct ConnectionRequest {
-		sockaddr_in address;
-		uint32_t checksum;
-	};
+	std::vector<size_t> slotShards;
 	std::list<ConnectionRequest> connectionRequests = {};
+	size_t nextShard = 0;
 
-	std::thread routeThread = {};
+	// Maps session ids to the shard owning them, used when a packet arrives on another shard's socket.
+	// No other lock is acquired while holding directoryLock.
+	std::shared_mutex directoryLock = {};
+	SessionTable directory;
 
+	// Receive buffers reused by every ReadBatch() call of a routing thread
+	static constexpr size_t RECEIVE_BATCH_SIZE = 32;
+	// Token buckets of each routing thread's handshake limiter
+	static constexpr size_t HANDSHAKE_BUCKETS = 1024;
+	// SYNs a routing thread queues per loop at most, the ACKs are bounded by the accept backlog
+	static constexpr size_t MAX_HANDSHAKES_PER_LOOP = 256;
+
+	// Used by LiteConnReplay, the manager runs on the virtual clock with the cookie key of the recorded manager and its socket is muted
+	LiteConnManager(std::shared_ptr<VirtualClock> clock, const std::array<uint64_t, 2>& cookieKey, size_t packetQueueCapacity, size_t numConnections, DWORD maxPacketSize, std::chrono::steady_clock::duration updateInterval, LiteConnSetting setting);
 	uint32_t GenerateChecksum();
+	// Without a clock every shard gets a routing thread, with one a single shard is created and routed by the replay
+	void StartShards(USHORT port, DWORD maxPacketSize, const LiteConnSetting& setting, std::shared_ptr<const VirtualClock> clock = nullptr);
+	void RouteAndTimeout(Shard& shard);
+	// One iteration of the routing loop, returns false once the socket is closed. A replay hands the datagrams over through the inbox.
+	bool RouteOnce(Shard& shard, std::chrono::steady_clock::time_point& nextTimerRun, bool readSocket);
+	// Moves the slot's buffer out when the datagram is kept by a connection or forwarded to another shard
+	void RoutePacket(Shard& shard, PacketSlot& slot, bool allowForward);
+	// Queues a SYN or a handshake ACK with a valid cookie, dropping it if its source exceeded its handshake rate
+	void RouteHandshake(Shard& shard, const LiteConnHeader& header, const PacketSlot& slot);
+	// Answers the queued SYNs and moves the completed handshakes into the backlog, assumes lock is acquired
+	void AdmitHandshakes(Shard& shard);
+	// Passes a snapshot to the metrics sink, called by the first routing thread without holding any lock
+	void DumpMetrics();
+	// Creates a connection served by the shard with the manager's settings applied
+	std::shared_ptr<LiteConnConnection> CreateConnection(Shard& shard, sockaddr_in peerAddr, uint32_t sessionID, TimeoutSetting timeout);
+
+	// Assumes lock is acquired
+	size_t FindFreeSlot();
+	void AssignSlot(size_t index, size_t shard, const std::shared_ptr<LiteConnConnection>& connection);
+	void ReleaseSlot(size_t index);
+
+	// Assumes the shard lock is acquired
+	void RegisterSession(Shard& shard, size_t index, const std::shared_ptr<LiteConnConnection>& connection);
+	void UnregisterSession(Shard& shard, size_t index);
 public:
 	std::atomic<bool> isListening = false;
 
-	LiteConnManager(USHORT port, size_t numConnections, size_t packetQueueCapacity, DWORD maxPacketSize, std::chrono::steady_clock::duration updateInterval);
+	LiteConnManager(USHORT port, size_t numConnections, size_t packetQueueCapacity, DWORD maxPacketSize, std::chrono::steady_clock::duration updateInterval, LiteConnSetting setting = {});
 
-	LiteConnManager(size_t packetQueueCapacity, size_t numConnections, DWORD maxPacketSize, std::chrono::steady_clock::duration updateInterval);
+	LiteConnManager(size_t packetQueueCapacity, size_t numConnections, DWORD maxPacketSize, std::chrono::steady_clock::duration updateInterval, LiteConnSetting setting = {});
 
 	LiteConnManager(const LiteConnManager& other) = delete;
 	LiteConnManager(LiteConnManager&& other) = delete;
@@ -333,8 +1056,11 @@ public:
 
 	~LiteConnManager();
 
-	void RouteAndTimeout();
-	
+	/// <summary>
+	/// The number of routing threads, which may be less than requested in LiteConnSetting
+	/// </summary>
+	size_t NumWorkers() const;
+
 	/// <summary>
 	/// Attempts to establish a connection from the list of pending connection requests
 	/// </summary>
@@ -350,6 +1076,19 @@ public:
 
 	size_t Count();
 
+	/// <summary>
+	/// Aggregates the metrics of the open connections, the sockets and the routing threads. Each connection is read
+	/// under its own lock, so the totals are not taken at a single instant.
+	/// </summary>
+	LiteConnManagerStats Stats();
+
+	/// <summary>
+	/// Sends the same request to every connection. The payload is copied once into a buffer shared by all of them,
+	/// each connection only writes its own header and the datagram is gathered from both when it is sent.
+	/// </summary>
+	/// <returns> The response of each connection in order, empty for connections that are null or not connected </returns>
+	std::vector<std::optional<LiteConnResponse>> BroadcastRequest(std::span<const std::shared_ptr<LiteConnConnection>> connections, const std::span<const char> data);
+
 	/// <summary>
 	/// Attempts to connect to a host that is actively listening
 	/// </summary>
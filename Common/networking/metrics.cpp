@@ -0,0 +1,51 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+std::chrono::microseconds Histogram::Snapshot::Mean() const {
+	if (count == 0) return {};
+	return sum / count;
+}
+
+std::chrono::microseconds Histogram::Snapshot::Percentile(double quantile) const {
+	if (count == 0) return {};
+	auto rank = static_cast<uint64_t>(std::ceil(std::clamp(quantile, 0.0, 1.0) * count));
+	rank = std::max<uint64_t>(rank, 1);
+	uint64_t seen = 0;
+	for (size_t i = 0; i < NUM_BUCKETS - 1; i++) {
+		seen += buckets[i];
+		if (seen >= rank) return std::min(std::chrono::microseconds(uint64_t(1) << i), max);
+	}
+	return max;
+}
+
+Histogram::Snapshot& Histogram::Snapshot::operator += (const Snapshot& other) {
+	for (size_t i = 0; i < NUM_BUCKETS; i++) {
+		buckets[i] += other.buckets[i];
+	}
+	count += other.count;
+	sum += other.sum;
+	max = std::max(max, other.max);
+	return *this;
+}
+
+void Histogram::Record(std::chrono::steady_clock::duration value) {
+	auto micros = static_cast<uint64_t>(std::max<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(value).count(), 0));
+	auto bucket = std::min<size_t>(std::bit_width(micros), NUM_BUCKETS - 1);
+	buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(micros, std::memory_order_relaxed);
+	auto longest = max.load(std::memory_order_relaxed);
+	while (micros > longest && !max.compare_exchange_weak(longest, micros, std::memory_order_relaxed)) {}
+}
+
+Histogram::Snapshot Histogram::Read() const {
+	Snapshot snapshot;
+	for (size_t i = 0; i < NUM_BUCKETS; i++) {
+		snapshot.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+		snapshot.count += snapshot.buckets[i];
+	}
+	snapshot.sum = std::chrono::microseconds(sum.load(std::memory_order_relaxed));
+	snapshot.max = std::chrono::microseconds(max.load(std::memory_order_relaxed));
+	return snapshot;
+}
@@ -0,0 +1,46 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+/// <summary>
+/// A distribution of durations in power of two buckets of microseconds. Recording is a few relaxed atomic operations,
+/// so it may be called on hot paths while other threads read the histogram.
+/// </summary>
+class Histogram {
+public:
+	// Bucket i counts durations of at least 2^(i - 1) and less than 2^i microseconds, the last bucket counts everything longer
+	static constexpr size_t NUM_BUCKETS = 32;
+
+	struct Snapshot {
+		std::array<uint64_t, NUM_BUCKETS> buckets = {};
+		uint64_t count = 0;
+		std::chrono::microseconds sum = {};
+		std::chrono::microseconds max = {};
+
+		// Zero if nothing was recorded
+		std::chrono::microseconds Mean() const;
+		/// <summary>
+		/// The upper bound of the bucket holding the quantile, never more than the longest recorded duration
+		/// </summary>
+		/// <param name="quantile"> Between 0 and 1 </param>
+		std::chrono::microseconds Percentile(double quantile) const;
+		// Adds the samples of another snapshot, used to aggregate connections or routing threads
+		Snapshot& operator += (const Snapshot& other);
+	};
+private:
+	std::array<std::atomic<uint64_t>, NUM_BUCKETS> buckets = {};
+	std::atomic<uint64_t> sum = 0;
+	std::atomic<uint64_t> max = 0;
+public:
+	void Record(std::chrono::steady_clock::duration value);
+
+	/// <summary>
+	/// Reads the buckets one at a time, samples recorded concurrently may be missing from some of the totals
+	/// </summary>
+	Snapshot Read() const;
+};
+#endif
@@ -0,0 +1,94 @@
+#ifndef MPSC_RING_H
+#define MPSC_RING_H
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+
+/// <summary>
+/// Bounded lock-free queue that any number of threads push to and one consumer pops from.
+/// Several consuming threads must be serialized by the caller, e.g. by popping only while holding a lock.
+/// </summary>
+template<typename T>
+class MpscRing {
+private:
+	// Keeps the producer and consumer indices on separate cache lines
+	static constexpr size_t CACHE_LINE = 64;
+
+	// A slot is free for the push at position p while sequence == p, and holds the item of that push while sequence == p + 1
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	const size_t mask;
+	std::unique_ptr<Cell[]> cells;
+
+	alignas(CACHE_LINE) std::atomic<size_t> tail = 0;
+	// Only used by the consumer
+	alignas(CACHE_LINE) std::atomic<size_t> head = 0;
+
+	static size_t SlotCount(size_t capacity) {
+		size_t count = 1;
+		while (count < capacity) count <<= 1;
+		return count;
+	}
+public:
+	/// <param name="capacity"> Rounded up to a power of two </param>
+	explicit MpscRing(size_t capacity) : mask(SlotCount(capacity) - 1), cells(std::make_unique<Cell[]>(mask + 1)) {
+		for (size_t i = 0; i <= mask; i++) {
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+	MpscRing(const MpscRing& other) = delete;
+	MpscRing& operator = (const MpscRing& other) = delete;
+
+	/// <summary>
+	/// Can be called from any thread
+	/// </summary>
+	/// <returns> false if the ring is full, the value is left untouched </returns>
+	bool TryPush(T&& value) {
+		auto position = tail.load(std::memory_order_relaxed);
+		Cell* cell;
+		while (true) {
+			cell = &cells[position & mask];
+			auto sequence = cell->sequence.load(std::memory_order_acquire);
+			auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+			if (difference == 0) {
+				// Claim the slot, another producer may have taken it in the meantime
+				if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+			}
+			else if (difference < 0) {
+				// The consumer has not freed the slot of the previous round yet
+				return false;
+			}
+			else {
+				position = tail.load(std::memory_order_relaxed);
+			}
+		}
+		cell->value = std::move(value);
+		cell->sequence.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	/// <summary>
+	/// Called by the consumer, an item whose push has not completed yet is not visible even if later pushes have
+	/// </summary>
+	std::optional<T> TryPop() {
+		auto position = head.load(std::memory_order_relaxed);
+		auto& cell = cells[position & mask];
+		if (cell.sequence.load(std::memory_order_acquire) != position + 1) return {};
+		// The slot is reset so resources held by the item are released now rather than when the slot is reused
+		std::optional<T> result = std::exchange(cell.value, T{});
+		cell.sequence.store(position + mask + 1, std::memory_order_release);
+		head.store(position + 1, std::memory_order_relaxed);
+		return result;
+	}
+
+	size_t Capacity() const {
+		return mask + 1;
+	}
+};
+#endif
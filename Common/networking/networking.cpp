@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include "networking.hpp"
 
+#ifdef _WIN32
 WSADATA Networking::wsaData = {};
 
 void Networking::init() {
@@ -12,4 +13,8 @@ void Networking::init() {
         exit(1);
     }
     onexit(WSACleanup);
-}
\ No newline at end of file
+}
+#else
+// POSIX sockets need no library initialization
+void Networking::init() {}
+#endif
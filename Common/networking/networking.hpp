@@ -1,11 +1,47 @@
 #ifndef NETWORKING_H
 #define NETWORKING_H
-#include <winsock2.h> 
-#include <windows.h>    
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
 #include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+// Winsock names used throughout the networking code, mapped onto their POSIX equivalents
+using SOCKET = int;
+using USHORT = unsigned short;
+using DWORD = uint32_t;
+constexpr SOCKET INVALID_SOCKET = -1;
+constexpr int SOCKET_ERROR = -1;
+
+inline uint64_t htonll(uint64_t value) { return htobe64(value); }
+inline uint64_t ntohll(uint64_t value) { return be64toh(value); }
+
+inline uint32_t htonf(float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return htonl(bits);
+}
+
+inline float ntohf(uint32_t value) {
+	value = ntohl(value);
+	float result;
+	memcpy(&result, &value, sizeof(result));
+	return result;
+}
+#endif
 
 namespace Networking {
+#ifdef _WIN32
 	extern WSADATA wsaData;
+#endif
 	void init();
 }
-#endif
\ No newline at end of file
+#endif
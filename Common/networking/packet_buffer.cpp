@@ -0,0 +1,136 @@
+#include "packet_buffer.hpp"
+#include <new>
+#include <cassert>
+#include <utility>
+
+PacketBuffer::PacketBuffer(Block* block) : block(block) {}
+
+PacketBuffer::PacketBuffer(const PacketBuffer& other) : block(other.block) {
+	if (block) block->refCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+PacketBuffer::PacketBuffer(PacketBuffer&& other) noexcept : block(std::exchange(other.block, nullptr)) {}
+
+PacketBuffer& PacketBuffer::operator = (const PacketBuffer& other) {
+	if (this != &other) {
+		if (other.block) other.block->refCount.fetch_add(1, std::memory_order_relaxed);
+		Release();
+		block = other.block;
+	}
+	return *this;
+}
+
+PacketBuffer& PacketBuffer::operator = (PacketBuffer&& other) noexcept {
+	if (this != &other) {
+		Release();
+		block = std::exchange(other.block, nullptr);
+	}
+	return *this;
+}
+
+PacketBuffer::~PacketBuffer() {
+	Release();
+}
+
+void PacketBuffer::Release() {
+	auto released = std::exchange(block, nullptr);
+	if (!released || released->refCount.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+	auto pool = std::move(released->pool);
+	if (pool) {
+		pool->Return(released);
+	}
+	else {
+		Free(released);
+	}
+}
+
+PacketBuffer::Block* PacketBuffer::Allocate(size_t capacity) {
+	auto memory = ::operator new(sizeof(Block) + capacity);
+	auto result = new (memory) Block{};
+	result->capacity = capacity;
+	return result;
+}
+
+void PacketBuffer::Free(Block* block) {
+	block->~Block();
+	::operator delete(block);
+}
+
+char* PacketBuffer::Data() const { return block ? block->Data() : nullptr; }
+
+size_t PacketBuffer::Capacity() const { return block ? block->capacity : 0; }
+
+uint32_t PacketBuffer::UseCount() const { return block ? block->refCount.load(std::memory_order_relaxed) : 0; }
+
+PacketBuffer::operator bool() const { return block != nullptr; }
+
+PacketBufferPool::PacketBufferPool(size_t bufferSize, size_t maxIdle) : bufferSize(bufferSize), maxIdle(maxIdle) {}
+
+PacketBufferPool::~PacketBufferPool() {
+	for (auto block : idle) {
+		PacketBuffer::Free(block);
+	}
+}
+
+PacketBuffer PacketBufferPool::Acquire(size_t capacity) {
+	PacketBuffer::Block* block = nullptr;
+	if (capacity > bufferSize) {
+		block = PacketBuffer::Allocate(capacity);
+	}
+	else {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (!idle.empty()) {
+				block = idle.back();
+				idle.pop_back();
+			}
+		}
+		if (!block) block = PacketBuffer::Allocate(bufferSize);
+		block->pool = shared_from_this();
+	}
+	block->refCount.store(1, std::memory_order_relaxed);
+	return PacketBuffer(block);
+}
+
+void PacketBufferPool::Return(PacketBuffer::Block* block) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (idle.size() < maxIdle) {
+			idle.push_back(block);
+			return;
+		}
+	}
+	PacketBuffer::Free(block);
+}
+
+size_t PacketBufferPool::BufferSize() const { return bufferSize; }
+
+size_t PacketBufferPool::IdleCount() {
+	std::lock_guard<std::mutex> guard(lock);
+	return idle.size();
+}
+
+PacketView::PacketView(PacketBuffer buffer, size_t offset, size_t length)
+	: buffer(std::move(buffer)), offset(offset), length(length)
+{
+	assert(offset + length <= this->buffer.Capacity());
+}
+
+PacketView PacketView::Slice(size_t start, size_t count) const {
+	assert(start + count <= length);
+	return PacketView(buffer, offset + start, count);
+}
+
+void PacketView::RemovePrefix(size_t count) {
+	assert(count <= length);
+	offset += count;
+	length -= count;
+}
+
+bool PacketView::ExpandFront(size_t count) {
+	if (count > offset) return false;
+	offset -= count;
+	length += count;
+	return true;
+}
@@ -0,0 +1,120 @@
+#ifndef PACKET_BUFFER_H
+#define PACKET_BUFFER_H
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Bytes reserved in front of outgoing payloads so protocol headers can be written in place
+constexpr size_t PACKET_HEADROOM = 64;
+
+class PacketBufferPool;
+
+/// <summary>
+/// Reference counted handle to a packet buffer. Copies share the same memory, and the buffer
+/// returns to its pool once the last handle is released.
+/// </summary>
+class PacketBuffer {
+	friend class PacketBufferPool;
+private:
+	struct Block {
+		std::atomic<uint32_t> refCount;
+		size_t capacity;
+		// Keeps the pool alive while the buffer is in use, empty for buffers allocated outside the pool
+		std::shared_ptr<PacketBufferPool> pool;
+
+		char* Data() { return reinterpret_cast<char*>(this + 1); }
+	};
+
+	Block* block = nullptr;
+
+	explicit PacketBuffer(Block* block);
+	void Release();
+	static Block* Allocate(size_t capacity);
+	static void Free(Block* block);
+public:
+	PacketBuffer() = default;
+	PacketBuffer(const PacketBuffer& other);
+	PacketBuffer(PacketBuffer&& other) noexcept;
+	PacketBuffer& operator = (const PacketBuffer& other);
+	PacketBuffer& operator = (PacketBuffer&& other) noexcept;
+	~PacketBuffer();
+
+	char* Data() const;
+	size_t Capacity() const;
+	// Number of handles sharing the buffer
+	uint32_t UseCount() const;
+	explicit operator bool() const;
+};
+
+/// <summary>
+/// Free list of equally sized packet buffers, must be owned by a std::shared_ptr.
+/// Acquiring and releasing a buffer allocates nothing once the pool has warmed up.
+/// </summary>
+class PacketBufferPool : public std::enable_shared_from_this<PacketBufferPool> {
+	friend class PacketBuffer;
+private:
+	const size_t bufferSize;
+	const size_t maxIdle;
+	std::mutex lock;
+	std::vector<PacketBuffer::Block*> idle;
+
+	void Return(PacketBuffer::Block* block);
+public:
+	/// <param name="bufferSize"> The capacity of every pooled buffer </param>
+	/// <param name="maxIdle"> Released buffers beyond this count are freed instead of kept </param>
+	PacketBufferPool(size_t bufferSize, size_t maxIdle = 1024);
+	PacketBufferPool(const PacketBufferPool& other) = delete;
+	PacketBufferPool& operator = (const PacketBufferPool& other) = delete;
+	~PacketBufferPool();
+
+	/// <summary>
+	/// Takes a buffer from the pool, requests larger than BufferSize() get a dedicated buffer that is freed on release
+	/// </summary>
+	PacketBuffer Acquire(size_t capacity = 0);
+	size_t BufferSize() const;
+	size_t IdleCount();
+};
+
+/// <summary>
+/// A window into a PacketBuffer, used to carry payloads from the socket to the application without copying
+/// </summary>
+class PacketView {
+private:
+	PacketBuffer buffer;
+	size_t offset = 0;
+	size_t length = 0;
+public:
+	PacketView() = default;
+	PacketView(PacketBuffer buffer, size_t offset, size_t length);
+
+	char* data() { return buffer.Data() + offset; }
+	const char* data() const { return buffer.Data() + offset; }
+	size_t size() const { return length; }
+	bool empty() const { return length == 0; }
+	char* begin() { return data(); }
+	char* end() { return data() + length; }
+	const char* begin() const { return data(); }
+	const char* end() const { return data() + length; }
+
+	/// <summary>
+	/// A view of part of this view sharing the same buffer
+	/// </summary>
+	PacketView Slice(size_t start, size_t count) const;
+
+	/// <summary>
+	/// Drops bytes from the front of the view without moving the rest
+	/// </summary>
+	void RemovePrefix(size_t count);
+
+	/// <summary>
+	/// Extends the view into the headroom in front of it, used to write headers in place
+	/// </summary>
+	/// <returns> false if there is not enough headroom </returns>
+	bool ExpandFront(size_t count);
+
+	const PacketBuffer& Buffer() const { return buffer; }
+};
+#endif
@@ -0,0 +1,155 @@
+#include "payload_codec.hpp"
+#include <algorithm>
+#include <cstring>
+
+// Matches and literal runs of at least 15 bytes continue their length in bytes of 255 until a smaller byte
+static constexpr size_t RUN_MASK = 15;
+
+static uint32_t ReadSequence(const char* data) {
+	uint32_t sequence;
+	memcpy(&sequence, data, sizeof(uint32_t));
+	return sequence;
+}
+
+static char* WriteLength(char* out, const char* end, size_t length) {
+	for (length -= RUN_MASK; length >= 255; length -= 255) {
+		if (out == end) return nullptr;
+		*out++ = static_cast<char>(255);
+	}
+	if (out == end) return nullptr;
+	*out++ = static_cast<char>(length);
+	return out;
+}
+
+static bool ReadLength(const char*& in, const char* end, size_t& length) {
+	while (in != end) {
+		auto byte = static_cast<uint8_t>(*in++);
+		length += byte;
+		if (byte != 255) return true;
+	}
+	return false;
+}
+
+// Writes the literals followed by a match, or only the literals when matchLength is 0, returns nullptr if out of space
+static char* WriteSequence(char* out, const char* end, const char* literals, size_t literalCount, size_t offset, size_t matchLength) {
+	if (out == end) return nullptr;
+	auto& token = *out++;
+	size_t matchCode = matchLength != 0 ? matchLength - 4 : 0;
+	token = static_cast<char>((std::min(literalCount, RUN_MASK) << 4) | std::min(matchCode, RUN_MASK));
+	if (literalCount >= RUN_MASK && !(out = WriteLength(out, end, literalCount))) return nullptr;
+	if (static_cast<size_t>(end - out) < literalCount) return nullptr;
+	out = std::copy(literals, literals + literalCount, out);
+	if (matchLength == 0) return out;
+
+	if (end - out < 2) return nullptr;
+	*out++ = static_cast<char>(offset & 0xff);
+	*out++ = static_cast<char>(offset >> 8);
+	if (matchCode >= RUN_MASK) return WriteLength(out, end, matchCode);
+	return out;
+}
+
+uint32_t PayloadCodec::Hash(uint32_t sequence) {
+	return (sequence * 2654435761U) >> (32 - HASH_BITS);
+}
+
+PayloadCodec::PayloadCodec(std::span<const char> dictionary)
+	: dictionary(dictionary.end() - std::min(dictionary.size(), MAX_OFFSET), dictionary.end()), dictionaryTable(size_t(1) << HASH_BITS, NO_POSITION)
+{
+	auto& kept = this->dictionary;
+	for (size_t i = 0; i + MIN_MATCH <= kept.size(); i++) {
+		dictionaryTable[Hash(ReadSequence(kept.data() + i))] = static_cast<uint32_t>(i);
+	}
+
+	// FNV-1a
+	uint32_t hash = 2166136261U;
+	for (auto byte : kept) {
+		hash = (hash ^ static_cast<uint8_t>(byte)) * 16777619U;
+	}
+	dictionaryID = hash != 0 ? hash : 1;
+}
+
+size_t PayloadCodec::Bound(size_t size) {
+	return size + size / 255 + 16;
+}
+
+size_t PayloadCodec::Compress(std::span<const char> input, std::span<char> output) const {
+	// Positions below the dictionary's size are in the dictionary, the input follows it
+	thread_local std::vector<uint32_t> table;
+	table.assign(dictionaryTable.begin(), dictionaryTable.end());
+	const size_t base = dictionary.size();
+	auto at = [&](size_t position) {
+		return position < base ? dictionary.data() + position : input.data() + (position - base);
+	};
+
+	char* out = output.data();
+	const char* end = output.data() + output.size();
+	size_t anchor = 0;
+	size_t i = 0;
+	while (i + MIN_MATCH <= input.size()) {
+		auto sequence = ReadSequence(input.data() + i);
+		auto& slot = table[Hash(sequence)];
+		size_t candidate = slot;
+		slot = static_cast<uint32_t>(base + i);
+		if (candidate == NO_POSITION || base + i - candidate > MAX_OFFSET || ReadSequence(at(candidate)) != sequence) {
+			i++;
+			continue;
+		}
+
+		// A match in the dictionary ends with it, the input is not contiguous with the dictionary
+		size_t limit = input.size() - i;
+		if (candidate < base) limit = std::min(limit, base - candidate);
+		const char* match = at(candidate);
+		size_t length = MIN_MATCH;
+		while (length < limit && match[length] == input[i + length]) length++;
+
+		out = WriteSequence(out, end, input.data() + anchor, i - anchor, base + i - candidate, length);
+		if (!out) return 0;
+		i += length;
+		anchor = i;
+		// Also index a position inside the match, repeated structures often restart there
+		if (i >= 2 && i + MIN_MATCH - 2 <= input.size()) {
+			table[Hash(ReadSequence(input.data() + i - 2))] = static_cast<uint32_t>(base + i - 2);
+		}
+	}
+	out = WriteSequence(out, end, input.data() + anchor, input.size() - anchor, 0, 0);
+	if (!out) return 0;
+	size_t size = out - output.data();
+	return size < input.size() ? size : 0;
+}
+
+bool PayloadCodec::Decompress(std::span<const char> input, std::span<char> output) const {
+	const char* in = input.data();
+	const char* inEnd = input.data() + input.size();
+	size_t produced = 0;
+	while (in != inEnd) {
+		auto token = static_cast<uint8_t>(*in++);
+		size_t literals = token >> 4;
+		if (literals == RUN_MASK && !ReadLength(in, inEnd, literals)) return false;
+		if (literals > static_cast<size_t>(inEnd - in) || literals > output.size() - produced) return false;
+		std::copy(in, in + literals, output.data() + produced);
+		in += literals;
+		produced += literals;
+		// The last sequence has no match
+		if (in == inEnd) break;
+
+		if (inEnd - in < 2) return false;
+		size_t offset = static_cast<uint8_t>(in[0]) | (size_t(static_cast<uint8_t>(in[1])) << 8);
+		in += 2;
+		size_t length = token & RUN_MASK;
+		if (length == RUN_MASK && !ReadLength(in, inEnd, length)) return false;
+		length += MIN_MATCH;
+		if (offset == 0 || offset > produced + dictionary.size() || length > output.size() - produced) return false;
+
+		// Byte by byte since a match may overlap its own output, negative positions are in the dictionary
+		auto source = static_cast<int64_t>(produced) - static_cast<int64_t>(offset);
+		for (size_t k = 0; k < length; k++, source++) {
+			output[produced + k] = source < 0 ? dictionary[dictionary.size() + source] : output[source];
+		}
+		produced += length;
+	}
+	return produced == output.size();
+}
+
+uint32_t PayloadCodec::DictionaryID() const {
+	return dictionaryID;
+}
@@ -0,0 +1,48 @@
+#ifndef PAYLOAD_CODEC_H
+#define PAYLOAD_CODEC_H
+#include <vector>
+#include <span>
+#include <cstdint>
+#include <cstddef>
+
+/// <summary>
+/// LZ77 block compression in the format of LZ4 blocks, with matches that may also reference a preset dictionary.
+/// Repetitive game messages such as snapshots compress well against a dictionary holding typical messages, even when
+/// a single message is too short to repeat itself. The dictionary is read only, so one codec is shared by every connection.
+/// </summary>
+class PayloadCodec {
+private:
+	static constexpr size_t MIN_MATCH = 4;
+	static constexpr size_t MAX_OFFSET = UINT16_MAX;
+	static constexpr unsigned int HASH_BITS = 12;
+	static constexpr uint32_t NO_POSITION = UINT32_MAX;
+
+	// Only the last MAX_OFFSET bytes of the dictionary can be referenced
+	std::vector<char> dictionary;
+	// Positions of the dictionary's 4 byte sequences by hash, copied as the start of every compression
+	std::vector<uint32_t> dictionaryTable;
+	uint32_t dictionaryID;
+
+	static uint32_t Hash(uint32_t sequence);
+public:
+	/// <param name="dictionary"> Bytes likely to appear in messages, both peers must use the same dictionary </param>
+	explicit PayloadCodec(std::span<const char> dictionary = {});
+
+	/// <returns> The output size that always suffices to compress size bytes </returns>
+	static size_t Bound(size_t size);
+
+	/// <returns> The compressed size, or 0 if the output is full or would not be smaller than the input </returns>
+	size_t Compress(std::span<const char> input, std::span<char> output) const;
+
+	/// <summary>
+	/// Decompresses a block into output, whose size must be the size of the original data
+	/// </summary>
+	/// <returns> false if the block is malformed or does not decompress to exactly output.size() bytes </returns>
+	bool Decompress(std::span<const char> input, std::span<char> output) const;
+
+	/// <summary>
+	/// Identifies the dictionary so peers can tell whether they share it, never 0
+	/// </summary>
+	uint32_t DictionaryID() const;
+};
+#endif
@@ -0,0 +1,71 @@
+#include "replay.hpp"
+#include <cstring>
+
+std::optional<ReplayResult> LiteConnReplay::Run(const std::string& path, const ReplaySetting& setting) {
+	CaptureReader reader(path);
+	std::array<uint64_t, 2> cookieKey;
+	if (!reader.Good() || reader.Metadata().size() != sizeof(cookieKey)) return {};
+	memcpy(cookieKey.data(), reader.Metadata().data(), sizeof(cookieKey));
+
+	auto first = reader.Next();
+	if (!first) return ReplayResult{};
+	auto clock = std::make_shared<VirtualClock>(first->time);
+	LiteConnManager manager(clock, cookieKey, setting.packetQueueCapacity, setting.numConnections, setting.maxPacketSize, setting.updateInterval, setting.setting);
+	if (!manager.Good()) return {};
+	manager.isListening = true;
+	auto& shard = *manager.shards.front();
+
+	ReplayResult result;
+	std::vector<std::shared_ptr<LiteConnConnection>> connections;
+	auto nextTimerRun = clock->Now();
+	auto route = [&]() {
+		manager.RouteOnce(shard, nextTimerRun, false);
+		while (auto connection = manager.Accept(setting.timeout, std::chrono::steady_clock::duration::zero())) {
+			connections.push_back(std::move(connection));
+		}
+		for (size_t i = 0; i < connections.size(); i++) {
+			while (auto message = connections[i]->Receive()) {
+				result.messages++;
+				if (setting.onMessage) setting.onMessage(i, *message);
+			}
+		}
+	};
+
+	auto start = std::chrono::steady_clock::now();
+	auto firstTime = first->time;
+	auto lastTime = firstTime;
+	for (auto packet = std::move(first); packet; packet = reader.Next()) {
+		lastTime = packet->time;
+		if (packet->direction != PacketDirection::Inbound) {
+			result.skipped++;
+			continue;
+		}
+		// Timers due before the datagram fire at their own time, each run moves nextTimerRun past the clock
+		while (true) {
+			auto due = std::max(shard.timers->NextDeadline(), nextTimerRun);
+			if (due >= packet->time) break;
+			clock->AdvanceTo(due);
+			route();
+		}
+		clock->AdvanceTo(packet->time);
+
+		PacketSlot slot = {
+			.address = packet->address,
+			.timeReceived = packet->time,
+			.buffer = shard.socket->AcquireBuffer(packet->payload.size()),
+			.size = packet->payload.size()
+		};
+		std::copy(packet->payload.begin(), packet->payload.end(), slot.buffer.Data());
+		{
+			std::lock_guard<std::mutex> guard(shard.inboxLock);
+			shard.inbox.push_back(std::move(slot));
+		}
+		result.inbound++;
+		route();
+	}
+	result.elapsed = std::chrono::steady_clock::now() - start;
+	result.recorded = lastTime - firstTime;
+	result.accepted = connections.size();
+	result.stats = manager.Stats();
+	return result;
+}
@@ -0,0 +1,51 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+#include <functional>
+#include "lite_conn.hpp"
+
+/// <summary>
+/// The manager a capture is replayed into, it should match the recorded manager for the replay to take the same decisions
+/// </summary>
+struct ReplaySetting {
+	size_t numConnections = 64;
+	size_t packetQueueCapacity = 256;
+	DWORD maxPacketSize = DEFAULT_UDP_BUFFER_SIZE;
+	std::chrono::steady_clock::duration updateInterval = std::chrono::milliseconds(10);
+	// capturePath records the replayed session into a new capture, numWorkers is ignored as a replay routes on one shard
+	LiteConnSetting setting = {};
+	// Passed to Accept() for every handshake the capture completes
+	TimeoutSetting timeout = {
+		.connectionTimeout = std::chrono::seconds(5),
+		.connectionRetryInterval = std::chrono::milliseconds(100),
+		.impRetryInterval = std::chrono::milliseconds(100),
+		.replyKeepDuration = std::chrono::seconds(5)
+	};
+	// Called with the index of the accepted connection, in accept order, for every message it receives
+	std::function<void(size_t, const LiteConnMessage&)> onMessage = {};
+};
+
+struct ReplayResult {
+	// Inbound datagrams fed to the manager, the recorded outbound ones are skipped
+	uint64_t inbound = 0;
+	uint64_t skipped = 0;
+	size_t accepted = 0;
+	uint64_t messages = 0;
+	// The time covered by the capture and the time the replay took
+	std::chrono::steady_clock::duration recorded = {};
+	std::chrono::steady_clock::duration elapsed = {};
+	// Taken after the last datagram, before the connections are closed
+	LiteConnManagerStats stats;
+};
+
+/// <summary>
+/// Feeds the inbound datagrams of a capture through a LiteConnManager on a virtual clock. The clock is advanced to each
+/// datagram's recorded time and to every timer due in between, so timers fire at the recorded times however fast the
+/// replay runs. Connections are accepted as soon as their handshake completes and their messages are read right away.
+/// The replayed manager's datagrams never reach the network.
+/// </summary>
+class LiteConnReplay {
+public:
+	/// <returns> Empty if the file is not a capture recorded by a LiteConnManager </returns>
+	static std::optional<ReplayResult> Run(const std::string& path, const ReplaySetting& setting = {});
+};
+#endif
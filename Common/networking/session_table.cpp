@@ -0,0 +1,84 @@
+#include "session_table.hpp"
+#include <cassert>
+
+SessionTable::SessionTable(size_t capacity) {
+	// Keep the load factor at or below one half so probe sequences stay short
+	size_t size = 2;
+	shift = 31;
+	while (size < capacity * 2) {
+		size <<= 1;
+		shift--;
+	}
+	buckets.assign(size, Bucket{ EMPTY, NO_SLOT });
+	mask = size - 1;
+}
+
+size_t SessionTable::Home(uint32_t sessionID) const {
+	// Fibonacci hashing spreads sequential and random ids alike over the buckets
+	return static_cast<uint32_t>(sessionID * 2654435769u) >> shift;
+}
+
+void SessionTable::Grow() {
+	std::vector<Bucket> old(buckets.size() * 2, Bucket{ EMPTY, NO_SLOT });
+	old.swap(buckets);
+	mask = buckets.size() - 1;
+	shift--;
+	count = 0;
+	for (auto& bucket : old) {
+		if (bucket.sessionID != EMPTY) Assign(bucket.sessionID, bucket.slot);
+	}
+}
+
+uint32_t SessionTable::Find(uint32_t sessionID) const {
+	if (sessionID == EMPTY) return NO_SLOT;
+	for (size_t i = Home(sessionID);; i = (i + 1) & mask) {
+		auto& bucket = buckets[i];
+		if (bucket.sessionID == sessionID) return bucket.slot;
+		if (bucket.sessionID == EMPTY) return NO_SLOT;
+	}
+}
+
+void SessionTable::Assign(uint32_t sessionID, uint32_t slot) {
+	assert(sessionID != EMPTY);
+	if ((count + 1) * 2 > buckets.size()) Grow();
+
+	for (size_t i = Home(sessionID);; i = (i + 1) & mask) {
+		auto& bucket = buckets[i];
+		if (bucket.sessionID == sessionID) {
+			bucket.slot = slot;
+			return;
+		}
+		if (bucket.sessionID == EMPTY) {
+			bucket = { sessionID, slot };
+			count++;
+			return;
+		}
+	}
+}
+
+bool SessionTable::Erase(uint32_t sessionID) {
+	if (sessionID == EMPTY) return false;
+	size_t hole = Home(sessionID);
+	while (buckets[hole].sessionID != sessionID) {
+		if (buckets[hole].sessionID == EMPTY) return false;
+		hole = (hole + 1) & mask;
+	}
+
+	// Backward shift deletion: pull later entries of the probe run into the hole so no tombstones are needed
+	for (size_t i = (hole + 1) & mask; buckets[i].sessionID != EMPTY; i = (i + 1) & mask) {
+		size_t home = Home(buckets[i].sessionID);
+		// The entry may move only if its home bucket is not cyclically within (hole, i]
+		bool reachable = hole <= i ? (home > hole && home <= i) : (home > hole || home <= i);
+		if (!reachable) {
+			buckets[hole] = buckets[i];
+			hole = i;
+		}
+	}
+	buckets[hole] = { EMPTY, NO_SLOT };
+	count--;
+	return true;
+}
+
+bool SessionTable::Contains(uint32_t sessionID) const { return Find(sessionID) != NO_SLOT; }
+
+size_t SessionTable::Size() const { return count; }
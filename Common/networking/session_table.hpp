@@ -0,0 +1,48 @@
+#ifndef SESSION_TABLE_H
+#define SESSION_TABLE_H
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/// <summary>
+/// Flat open addressing hash table mapping session ids to connection slots.
+/// Session id 0 is never assigned to a connection and marks an empty bucket.
+/// </summary>
+class SessionTable {
+private:
+	struct Bucket {
+		uint32_t sessionID;
+		uint32_t slot;
+	};
+
+	std::vector<Bucket> buckets;
+	size_t mask;
+	unsigned int shift;
+	size_t count = 0;
+
+	size_t Home(uint32_t sessionID) const;
+	void Grow();
+public:
+	static constexpr uint32_t EMPTY = 0;
+	static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+	/// <summary>
+	/// Creates a table that holds at least capacity sessions before it needs to grow
+	/// </summary>
+	SessionTable(size_t capacity);
+
+	/// <returns> The slot assigned to the session, or NO_SLOT if the session is unknown </returns>
+	uint32_t Find(uint32_t sessionID) const;
+
+	/// <summary>
+	/// Maps the session to the slot, replacing any slot it was previously mapped to
+	/// </summary>
+	void Assign(uint32_t sessionID, uint32_t slot);
+
+	/// <returns> true if the session was in the table </returns>
+	bool Erase(uint32_t sessionID);
+
+	bool Contains(uint32_t sessionID) const;
+	size_t Size() const;
+};
+#endif
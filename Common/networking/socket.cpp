@@ -1,9 +1,81 @@
 #include <iostream>
+#include <array>
+#include <cassert>
+#include <climits>
 #include "socket.hpp"
+#include "impairment.hpp"
+#include "capture.hpp"
 #include "debug/log.hpp"
+#ifndef _WIN32
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#endif
+
+#ifdef _WIN32
+static int LastSocketError() { return WSAGetLastError(); }
+static void CloseSocket(SOCKET sock) { closesocket(sock); }
+static SOCKET CreateSocket() { return socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP); }
+static bool IsNetworkDown(int error) { return error == WSAENETDOWN; }
+static bool IsWouldBlock(int error) { return error == WSAEWOULDBLOCK; }
+static bool IsAddressLost(int error) { return error == WSAENETUNREACH || error == WSAEADDRNOTAVAIL; }
+// Winsock has no load balancing equivalent of SO_REUSEPORT
+static void SetReusePort(SOCKET sock, bool reusePort) {}
+static int SendParts(SOCKET sock, std::span<const std::span<const char>> parts, const sockaddr_in& target) {
+	std::array<WSABUF, MAX_PACKET_PARTS> buffers;
+	for (size_t i = 0; i < parts.size(); i++) {
+		buffers[i].buf = const_cast<char*>(parts[i].data());
+		buffers[i].len = static_cast<ULONG>(parts[i].size());
+	}
+	DWORD sent = 0;
+	return WSASendTo(sock, buffers.data(), static_cast<DWORD>(parts.size()), &sent, 0, reinterpret_cast<const sockaddr*>(&target), sizeof(target), nullptr, nullptr);
+}
+#else
+static int LastSocketError() { return errno; }
+static void CloseSocket(SOCKET sock) { close(sock); }
+static SOCKET CreateSocket() { return socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP); }
+static bool IsNetworkDown(int error) { return error == ENETDOWN; }
+static bool IsWouldBlock(int error) { return error == EAGAIN || error == EWOULDBLOCK; }
+static bool IsAddressLost(int error) { return error == ENETUNREACH || error == EADDRNOTAVAIL || error == ENETDOWN; }
+static void SetReusePort(SOCKET sock, bool reusePort) {
+	if (!reusePort) return;
+	int enable = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == SOCKET_ERROR) {
+		Debug::LogError("[Error] Failed to enable SO_REUSEPORT due to error ", errno);
+	}
+}
+static int SendParts(SOCKET sock, std::span<const std::span<const char>> parts, const sockaddr_in& target) {
+	std::array<iovec, MAX_PACKET_PARTS> vectors;
+	for (size_t i = 0; i < parts.size(); i++) {
+		vectors[i].iov_base = const_cast<char*>(parts[i].data());
+		vectors[i].iov_len = parts[i].size();
+	}
+	msghdr message = {};
+	message.msg_name = const_cast<sockaddr_in*>(&target);
+	message.msg_namelen = sizeof(target);
+	message.msg_iov = vectors.data();
+	message.msg_iovlen = parts.size();
+	return sendmsg(sock, &message, 0) < 0 ? SOCKET_ERROR : 0;
+}
+
+// Largest payload a single IPv4 UDP datagram can carry
+constexpr DWORD MAX_UDP_PAYLOAD = 65507;
+
+enum PollerTag : uint32_t {
+	SocketTag,
+	WakeTag
+};
+
+// Number of datagrams handed to a single recvmmsg()/sendmmsg() call
+constexpr size_t MAX_MESSAGES_PER_CALL = 64;
+#endif
+
+// How long SendPacket() waits for room in a full send buffer before the datagram is dropped
+constexpr auto SEND_WAIT_TIMEOUT = std::chrono::milliseconds(100);
 
 UDPSocket::UDPSocket(DWORD maxPacketSize)
-	: port(), sock(socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)),
+	: port(), sock(CreateSocket()),
 	closed(true), blocked(false), reconfiguring(false), lock()
 {
 	sockaddr_in addr = {};
@@ -11,104 +83,183 @@ UDPSocket::UDPSocket(DWORD maxPacketSize)
 	addr.sin_port = 0;
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
+#ifdef _WIN32
 	int optLen = sizeof(bufferSize);
 	getsockopt(sock, SOL_SOCKET, SO_MAX_MSG_SIZE, reinterpret_cast<char*>(&bufferSize), &optLen);
 	bufferSize = min(bufferSize, maxPacketSize);
+#else
+	bufferSize = std::min(MAX_UDP_PAYLOAD, maxPacketSize);
+#endif
+	readBuffer.resize(bufferSize);
+	pool = std::make_shared<PacketBufferPool>(bufferSize + PACKET_HEADROOM);
 
 	if (bind(sock, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
-		Debug::LogError("[Error] Failed to bind socket due to error ", WSAGetLastError());
+		Debug::LogError("[Error] Failed to bind socket due to error ", LastSocketError());
 	}
 	else {
 		closed = false;
-		int addrLen = sizeof(addr);
+		socklen_t addrLen = sizeof(addr);
 		getsockname(sock, reinterpret_cast<sockaddr*>(&addr), &addrLen);
 		port = addr.sin_port;
 	}
+	InitPoller();
 }
 
-UDPSocket::UDPSocket(USHORT port,DWORD maxPacketSize)
-	: port(htons(port)), sock(socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)),
-	closed(true), blocked(false), reconfiguring(false), lock()
+UDPSocket::UDPSocket(USHORT port, DWORD maxPacketSize, bool reusePort)
+	: sock(CreateSocket()), port(htons(port)), reusePort(reusePort),
+	closed(true), reconfiguring(false), lock(), blocked(false)
 {
 	sockaddr_in addr = {};
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
+#ifdef _WIN32
 	int optLen = sizeof(bufferSize);
 	getsockopt(sock, SOL_SOCKET, SO_MAX_MSG_SIZE, reinterpret_cast<char*>(&bufferSize), &optLen);
 
 	bufferSize = min(bufferSize, maxPacketSize);
+#else
+	bufferSize = std::min(MAX_UDP_PAYLOAD, maxPacketSize);
+#endif
+	readBuffer.resize(bufferSize);
+	pool = std::make_shared<PacketBufferPool>(bufferSize + PACKET_HEADROOM);
 
+	SetReusePort(sock, reusePort);
 	if (bind(sock, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
-		Debug::LogError("[Error] Failed to bind socket due to error ", WSAGetLastError());
+		Debug::LogError("[Error] Failed to bind socket due to error ", LastSocketError());
 	}
 	else {
 		closed = false;
+		// Resolve the port actually bound when an ephemeral port was requested
+		socklen_t addrLen = sizeof(addr);
+		getsockname(sock, reinterpret_cast<sockaddr*>(&addr), &addrLen);
+		this->port = addr.sin_port;
 	}
+	InitPoller();
 }
 
 UDPSocket::~UDPSocket() {
 	if (!closed) {
 		closed = true;
-		closesocket(sock);
+		CloseSocket(sock);
+	}
+#ifdef _WIN32
+	if (wakeSock != INVALID_SOCKET) closesocket(wakeSock);
+#else
+	if (epollFd >= 0) close(epollFd);
+	if (wakeFd >= 0) close(wakeFd);
+#endif
+}
+
+#ifdef _WIN32
+void UDPSocket::InitPoller() {
+	wakeSock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	wakeAddr.sin_family = AF_INET;
+	wakeAddr.sin_port = 0;
+	wakeAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(wakeSock, reinterpret_cast<sockaddr*>(&wakeAddr), sizeof(wakeAddr)) == SOCKET_ERROR) {
+		Debug::LogError("[Error] Failed to bind wake socket due to error ", WSAGetLastError());
+		closesocket(wakeSock);
+		wakeSock = INVALID_SOCKET;
+		return;
+	}
+	int addrLen = sizeof(wakeAddr);
+	getsockname(wakeSock, reinterpret_cast<sockaddr*>(&wakeAddr), &addrLen);
+	u_long nonBlocking = 1;
+	ioctlsocket(wakeSock, FIONBIO, &nonBlocking);
+}
+#else
+void UDPSocket::InitPoller() {
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epollFd < 0 || wakeFd < 0) {
+		Debug::LogError("[Error] Failed to create socket poller due to error ", errno);
+		return;
 	}
+	epoll_event wakeEvent = {};
+	wakeEvent.events = EPOLLIN;
+	wakeEvent.data.u32 = WakeTag;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &wakeEvent);
+
+	epoll_event socketEvent = {};
+	socketEvent.events = EPOLLIN;
+	socketEvent.data.u32 = SocketTag;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, sock, &socketEvent);
 }
+#endif
 
 bool UDPSocket::Rebind() {
 	Debug::Log("[Warning] The ip bound to the socket has gone down, attempting to reconfigure");
-	closesocket(sock);
-	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	CloseSocket(sock);
+	sock = CreateSocket();
 	sockaddr_in addr = {};
 	addr.sin_family = AF_INET;
 	addr.sin_port = port;
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
+	SetReusePort(sock, reusePort);
 	if (bind(sock, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
-		Debug::LogError("[Error] Failed to rebind socket due to error ", WSAGetLastError());
+		Debug::LogError("[Error] Failed to rebind socket due to error ", LastSocketError());
+		CloseSocket(sock);
 		closed = true;
+		Wake();
 		return false;
 	}
+#ifndef _WIN32
+	// The closed descriptor was dropped from the epoll set, register its replacement
+	epoll_event socketEvent = {};
+	socketEvent.events = EPOLLIN;
+	socketEvent.data.u32 = SocketTag;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, sock, &socketEvent);
+	pollingWritable = false;
+#endif
 	return true;
 }
 
 void UDPSocket::SendPacket(const Packet& packet) {
-	if (closed) {
-		Debug::LogError("[Error] Attempting to write to a closed socket!"); 
-		return;
-	}
-
-	std::lock_guard<std::mutex> guard(lock);
-	while (sendto(sock, packet.payload.data(), packet.payload.size(), 0, reinterpret_cast<const sockaddr*>(&packet.address), sizeof(packet.address)) == SOCKET_ERROR) {
-		auto error = WSAGetLastError();
-		if (error == WSAENETDOWN) {
-			if (!Rebind()) { Debug::LogError("[Error] Failed to send packet since all network interfaces have gone down"); return; }
-			continue;
-		}
-		Debug::LogError("[Error] Failed to send packet due to error ", error);
-		return;
-	}
+	SendPacket(packet.payload, packet.address);
 }
 
 void UDPSocket::SendPacket(const std::span<const char> payload, const sockaddr_in& target) {
+	SendPacket(std::span(&payload, 1), target);
+}
+
+void UDPSocket::SendPacket(std::span<const std::span<const char>> parts, const sockaddr_in& target) {
+	assert(parts.size() <= MAX_PACKET_PARTS);
 	if (closed) {
+		sendErrors++;
 		Debug::LogError("[Error] Attempting to write to a closed socket!");
 		return;
 	}
+	RecordSent(parts, target);
+	if (muted) return;
 
 	std::lock_guard<std::mutex> guard(lock);
-	while (sendto(sock, payload.data(), payload.size(), 0, reinterpret_cast<const sockaddr*>(&target), sizeof(target)) == SOCKET_ERROR) {
-		auto error = WSAGetLastError();
-		if (error == WSAENETDOWN) {
-			if (!Rebind()) { Debug::LogError("[Error] Failed to send packet since all network interfaces have gone down"); return; }
+	while (SendParts(sock, parts, target) == SOCKET_ERROR) {
+		auto error = LastSocketError();
+		if (IsNetworkDown(error)) {
+			if (!Rebind()) { sendErrors++; Debug::LogError("[Error] Failed to send packet since all network interfaces have gone down"); return; }
 			continue;
 		}
+#ifndef _WIN32
+		if (error == EINTR) continue;
+#endif
+		// The socket does not block, a full send buffer is waited on like a blocking send would
+		if (IsWouldBlock(error) && WaitWritable()) continue;
+		sendErrors++;
 		Debug::LogError("[Error] Failed to send packet due to error ", error);
 		return;
 	}
+	size_t size = 0;
+	for (auto& part : parts) {
+		size += part.size();
+	}
+	CountSent(size);
 }
 
-std::optional<Packet> UDPSocket::Read() {
+#ifdef _WIN32
+std::optional<Packet> UDPSocket::ReceiveOne() {
 	if (closed) {
 		return {};
 	}
@@ -123,7 +274,7 @@ std::optional<Packet> UDPSocket::Read() {
 	int addrSize = sizeof(otherAddr);
 
 	std::lock_guard<std::mutex> guard(lock);
-	std::vector<char> buffer(bufferSize);
+	auto& buffer = readBuffer;
 	int error;
 	while ((error = select(0, &readfds, nullptr, nullptr, &timeout)) > 0) {
 		int byteRead = recvfrom(sock, buffer.data(), bufferSize, 0, (sockaddr*)&otherAddr, &addrSize);
@@ -131,20 +282,24 @@ std::optional<Packet> UDPSocket::Read() {
 		if (byteRead == SOCKET_ERROR) {
 			auto error = WSAGetLastError();
 			if (error == WSAECONNRESET) {
+				receiveErrors++;
 				std::cout << "[Warning] One message could not reach the remote port" << std::endl;
 				continue;
 			}
 			if (error == WSAEMSGSIZE) {
+				receiveErrors++;
 				std::cout << "[Warning] An oversized packet was dropped" << std::endl;
 				continue;
 			}
-			if (error == WSAENETUNREACH || error == WSAEADDRNOTAVAIL) {
+			if (IsAddressLost(error)) {
 				if (!Rebind()) { return {}; }
 				continue;
 			}
+			receiveErrors++;
 			std::cout << "[Error] Packet read failure: " << error << "\n";
 			continue;
 		}
+		CountReceived(byteRead);
 		if (!blocked)
 		{
 			return Packet{
@@ -160,6 +315,545 @@ std::optional<Packet> UDPSocket::Read() {
 	return {};
 }
 
+size_t UDPSocket::ReceiveBatch(std::span<PacketSlot> slots) {
+	if (closed || slots.empty()) {
+		return 0;
+	}
+	TIMEVAL timeout = {
+		.tv_sec = 0,
+		.tv_usec = 0
+	};
+
+	std::lock_guard<std::mutex> guard(lock);
+	size_t filled = 0;
+	// Winsock has no batched receive, drain the socket one datagram at a time into the slots
+	while (filled < slots.size()) {
+		fd_set readfds;
+		FD_ZERO(&readfds);
+		FD_SET(sock, &readfds);
+		int ready = select(0, &readfds, nullptr, nullptr, &timeout);
+		if (ready == SOCKET_ERROR) {
+			Debug::LogError("[Error] select() returned with error ", WSAGetLastError());
+			break;
+		}
+		if (ready == 0) {
+			break;
+		}
+
+		auto& slot = slots[filled];
+		// A buffer still shared with a delivered message must not be overwritten
+		if (slot.buffer.Capacity() < bufferSize || slot.buffer.UseCount() > 1) slot.buffer = pool->Acquire();
+		int addrSize = sizeof(slot.address);
+		int byteRead = recvfrom(sock, slot.buffer.Data(), bufferSize, 0, (sockaddr*)&slot.address, &addrSize);
+
+		if (byteRead == SOCKET_ERROR) {
+			auto error = WSAGetLastError();
+			if (error == WSAECONNRESET) {
+				receiveErrors++;
+				std::cout << "[Warning] One message could not reach the remote port" << std::endl;
+				continue;
+			}
+			if (error == WSAEMSGSIZE) {
+				receiveErrors++;
+				std::cout << "[Warning] An oversized packet was dropped" << std::endl;
+				continue;
+			}
+			if (IsAddressLost(error)) {
+				if (!Rebind()) { break; }
+				continue;
+			}
+			receiveErrors++;
+			std::cout << "[Error] Packet read failure: " << error << "\n";
+			continue;
+		}
+		CountReceived(byteRead);
+		if (!blocked) {
+			slot.size = byteRead;
+			slot.timeReceived = std::chrono::steady_clock::now();
+			filled++;
+		}
+	}
+	return filled;
+}
+
+void UDPSocket::Flush() {
+	std::lock_guard<std::mutex> queueGuard(sendQueueLock);
+	if (sendQueue.empty()) {
+		return;
+	}
+	if (!closed) {
+		std::lock_guard<std::mutex> guard(lock);
+		// Winsock has no batched send, the queue only saves the per packet locking
+		size_t sent = 0;
+		for (; sent < sendQueue.size(); sent++) {
+			const auto& queued = sendQueue[sent];
+			bool delivered = true;
+			bool blocked = false;
+			while (sendto(sock, sendBuffer.data() + queued.offset, queued.size, 0, reinterpret_cast<const sockaddr*>(&queued.address), sizeof(queued.address)) == SOCKET_ERROR) {
+				auto error = WSAGetLastError();
+				delivered = false;
+				if (IsNetworkDown(error)) {
+					if (!Rebind()) { sendErrors++; Debug::LogError("[Error] Failed to send packet since all network interfaces have gone down"); break; }
+					delivered = true;
+					continue;
+				}
+				if (IsWouldBlock(error)) {
+					blocked = true;
+					break;
+				}
+				sendErrors++;
+				Debug::LogError("[Error] Failed to send packet due to error ", error);
+				break;
+			}
+			if (blocked) {
+				KeepUnsent(sent);
+				return;
+			}
+			if (delivered) CountSent(queued.size);
+			if (closed) break;
+		}
+	}
+	sendQueue.clear();
+	sendBuffer.clear();
+	sendBlocked = false;
+}
+
+bool UDPSocket::WaitWritable() {
+	fd_set writable;
+	FD_ZERO(&writable);
+	FD_SET(sock, &writable);
+	TIMEVAL timeout = { 0, static_cast<long>(std::chrono::microseconds(SEND_WAIT_TIMEOUT).count()) };
+	return select(0, nullptr, &writable, nullptr, &timeout) > 0;
+}
+
+bool UDPSocket::WaitSocket(std::chrono::steady_clock::time_point deadline) {
+	if (closed) return false;
+
+	// A deadline of time_point::max() waits without timeout
+	TIMEVAL timeout = {};
+	TIMEVAL* timeoutPtr = nullptr;
+	if (deadline != std::chrono::steady_clock::time_point::max()) {
+		auto remaining = std::chrono::ceil<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now());
+		remaining = std::clamp(remaining, std::chrono::microseconds{}, std::chrono::microseconds(std::chrono::hours(24)));
+		timeout.tv_sec = static_cast<long>(remaining.count() / 1000000);
+		timeout.tv_usec = static_cast<long>(remaining.count() % 1000000);
+		timeoutPtr = &timeout;
+	}
+
+	fd_set readfds;
+	FD_ZERO(&readfds);
+	FD_SET(sock, &readfds);
+	if (wakeSock != INVALID_SOCKET) FD_SET(wakeSock, &readfds);
+
+	if (select(0, &readfds, nullptr, nullptr, timeoutPtr) == SOCKET_ERROR) {
+		if (!closed) Debug::LogError("[Error] select() returned with error ", WSAGetLastError());
+		return false;
+	}
+	if (wakeSock != INVALID_SOCKET && FD_ISSET(wakeSock, &readfds)) {
+		char drain[16];
+		while (recv(wakeSock, drain, sizeof(drain), 0) != SOCKET_ERROR) {}
+	}
+	return FD_ISSET(sock, &readfds);
+}
+
+void UDPSocket::Wake() {
+	if (wakeSock == INVALID_SOCKET) return;
+	char signal = 0;
+	sendto(wakeSock, &signal, sizeof(signal), 0, reinterpret_cast<const sockaddr*>(&wakeAddr), sizeof(wakeAddr));
+}
+#else
+std::optional<Packet> UDPSocket::ReceiveOne() {
+	if (closed) {
+		return {};
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	auto& buffer = readBuffer;
+	while (true) {
+		sockaddr_in otherAddr = {};
+		socklen_t addrSize = sizeof(otherAddr);
+		// MSG_TRUNC reports the full datagram length so oversized packets can be dropped like Winsock's WSAEMSGSIZE
+		auto byteRead = recvfrom(sock, buffer.data(), bufferSize, MSG_TRUNC, (sockaddr*)&otherAddr, &addrSize);
+
+		if (byteRead == SOCKET_ERROR) {
+			auto error = errno;
+			if (error == EAGAIN || error == EWOULDBLOCK) {
+				return {};
+			}
+			if (error == EINTR) {
+				continue;
+			}
+			if (error == ECONNREFUSED) {
+				receiveErrors++;
+				std::cout << "[Warning] One message could not reach the remote port" << std::endl;
+				continue;
+			}
+			if (IsAddressLost(error)) {
+				if (!Rebind()) { return {}; }
+				continue;
+			}
+			receiveErrors++;
+			std::cout << "[Error] Packet read failure: " << error << "\n";
+			return {};
+		}
+		if (static_cast<size_t>(byteRead) > bufferSize) {
+			receiveErrors++;
+			std::cout << "[Warning] An oversized packet was dropped" << std::endl;
+			continue;
+		}
+		CountReceived(byteRead);
+		if (!blocked)
+		{
+			return Packet{
+					.address = otherAddr,
+					.timeReceived = std::chrono::steady_clock::now(),
+					.payload = {buffer.data(), buffer.data() + byteRead},
+			};
+		}
+	}
+}
+
+size_t UDPSocket::ReceiveBatch(std::span<PacketSlot> slots) {
+	if (closed || slots.empty()) {
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	mmsghdr messages[MAX_MESSAGES_PER_CALL];
+	iovec vectors[MAX_MESSAGES_PER_CALL];
+	size_t filled = 0;
+	while (filled < slots.size()) {
+		size_t requested = std::min(MAX_MESSAGES_PER_CALL, slots.size() - filled);
+		for (size_t i = 0; i < requested; i++) {
+			auto& slot = slots[filled + i];
+			// A buffer still shared with a delivered message must not be overwritten
+			if (slot.buffer.Capacity() < bufferSize || slot.buffer.UseCount() > 1) slot.buffer = pool->Acquire();
+			vectors[i] = { slot.buffer.Data(), bufferSize };
+			messages[i] = {};
+			messages[i].msg_hdr.msg_name = &slot.address;
+			messages[i].msg_hdr.msg_namelen = sizeof(slot.address);
+			messages[i].msg_hdr.msg_iov = &vectors[i];
+			messages[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int received = recvmmsg(sock, messages, static_cast<unsigned int>(requested), MSG_DONTWAIT, nullptr);
+		if (received == SOCKET_ERROR) {
+			auto error = errno;
+			if (error == EAGAIN || error == EWOULDBLOCK) {
+				break;
+			}
+			if (error == EINTR) {
+				continue;
+			}
+			if (error == ECONNREFUSED) {
+				receiveErrors++;
+				std::cout << "[Warning] One message could not reach the remote port" << std::endl;
+				continue;
+			}
+			if (IsAddressLost(error)) {
+				if (!Rebind()) { break; }
+				continue;
+			}
+			receiveErrors++;
+			std::cout << "[Error] Packet read failure: " << error << "\n";
+			break;
+		}
+
+		// Compact the accepted datagrams to the front, swapping keeps every slot's buffer allocated
+		auto timeReceived = std::chrono::steady_clock::now();
+		size_t accepted = 0;
+		for (int i = 0; i < received; i++) {
+			if (messages[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				receiveErrors++;
+				std::cout << "[Warning] An oversized packet was dropped" << std::endl;
+				continue;
+			}
+			CountReceived(messages[i].msg_len);
+			if (blocked) {
+				continue;
+			}
+			auto& slot = slots[filled + i];
+			slot.size = messages[i].msg_len;
+			slot.timeReceived = timeReceived;
+			if (accepted != static_cast<size_t>(i)) {
+				std::swap(slots[filled + accepted], slot);
+			}
+			accepted++;
+		}
+		filled += accepted;
+
+		if (static_cast<size_t>(received) < requested) {
+			break;
+		}
+	}
+	return filled;
+}
+
+void UDPSocket::Flush() {
+	std::lock_guard<std::mutex> queueGuard(sendQueueLock);
+	if (sendQueue.empty()) {
+		return;
+	}
+	if (!closed) {
+		std::lock_guard<std::mutex> guard(lock);
+		mmsghdr messages[MAX_MESSAGES_PER_CALL];
+		iovec vectors[MAX_MESSAGES_PER_CALL];
+		size_t sent = 0;
+		while (sent < sendQueue.size() && !closed) {
+			size_t requested = std::min(MAX_MESSAGES_PER_CALL, sendQueue.size() - sent);
+			for (size_t i = 0; i < requested; i++) {
+				auto& queued = sendQueue[sent + i];
+				vectors[i] = { sendBuffer.data() + queued.offset, queued.size };
+				messages[i] = {};
+				messages[i].msg_hdr.msg_name = &queued.address;
+				messages[i].msg_hdr.msg_namelen = sizeof(queued.address);
+				messages[i].msg_hdr.msg_iov = &vectors[i];
+				messages[i].msg_hdr.msg_iovlen = 1;
+			}
+
+			int result = sendmmsg(sock, messages, static_cast<unsigned int>(requested), 0);
+			if (result == SOCKET_ERROR) {
+				auto error = errno;
+				if (IsNetworkDown(error)) {
+					if (!Rebind()) { sendErrors++; Debug::LogError("[Error] Failed to send packet since all network interfaces have gone down"); break; }
+					continue;
+				}
+				if (error == EINTR) continue;
+				// The rest is sent once the send buffer drained, WaitReadable() returns when the socket becomes writable
+				if (IsWouldBlock(error)) {
+					KeepUnsent(sent);
+					return;
+				}
+				// sendmmsg() only fails when the first datagram could not be sent, skip it and carry on with the rest
+				sendErrors++;
+				Debug::LogError("[Error] Failed to send packet due to error ", error);
+				sent++;
+				continue;
+			}
+			for (int i = 0; i < result; i++) {
+				CountSent(sendQueue[sent + i].size);
+			}
+			sent += result;
+		}
+	}
+	sendQueue.clear();
+	sendBuffer.clear();
+	sendBlocked = false;
+}
+
+bool UDPSocket::WaitWritable() {
+	pollfd writable = { .fd = sock, .events = POLLOUT };
+	int timeout = static_cast<int>(SEND_WAIT_TIMEOUT.count());
+	while (true) {
+		int result = poll(&writable, 1, timeout);
+		if (result == SOCKET_ERROR && errno == EINTR) continue;
+		return result > 0;
+	}
+}
+
+bool UDPSocket::WaitSocket(std::chrono::steady_clock::time_point deadline) {
+	if (closed || epollFd < 0) return false;
+
+	// Only the routing thread waits, so the registration is changed without a lock
+	bool blockedSend = sendBlocked;
+	if (blockedSend != pollingWritable) {
+		epoll_event socketEvent = {};
+		socketEvent.events = blockedSend ? EPOLLIN | EPOLLOUT : EPOLLIN;
+		socketEvent.data.u32 = SocketTag;
+		epoll_ctl(epollFd, EPOLL_CTL_MOD, sock, &socketEvent);
+		pollingWritable = blockedSend;
+	}
+
+	// A deadline of time_point::max() waits without timeout
+	int timeout = -1;
+	if (deadline != std::chrono::steady_clock::time_point::max()) {
+		auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		timeout = static_cast<int>(std::clamp<std::chrono::milliseconds::rep>(remaining.count(), 0, INT_MAX));
+	}
+
+	epoll_event events[2];
+	int count = epoll_wait(epollFd, events, 2, timeout);
+	if (count == SOCKET_ERROR) {
+		if (errno != EINTR) Debug::LogError("[Error] epoll_wait() returned with error ", errno);
+		return false;
+	}
+
+	bool readable = false;
+	for (int i = 0; i < count; i++) {
+		if (events[i].data.u32 == WakeTag) {
+			uint64_t signals;
+			read(wakeFd, &signals, sizeof(signals));
+		}
+		else if (events[i].events & (EPOLLIN | EPOLLERR)) {
+			readable = true;
+		}
+	}
+	return readable;
+}
+
+void UDPSocket::Wake() {
+	if (wakeFd < 0) return;
+	uint64_t signal = 1;
+	write(wakeFd, &signal, sizeof(signal));
+}
+#endif
+
+std::optional<Packet> UDPSocket::Read() {
+	{
+		std::lock_guard<std::mutex> guard(impairmentLock);
+		if (!impairment && !recording) return ReceiveOne();
+	}
+	PacketSlot slot;
+	if (ReadBatch(std::span(&slot, 1)) == 0) return {};
+	return Packet{
+		.address = slot.address,
+		.timeReceived = slot.timeReceived,
+		.payload = {slot.buffer.Data(), slot.buffer.Data() + slot.size},
+	};
+}
+
+size_t UDPSocket::ReadBatch(std::span<PacketSlot> slots) {
+	size_t count;
+	{
+		std::lock_guard<std::mutex> guard(impairmentLock);
+		if (!impairment) {
+			count = ReceiveBatch(slots);
+		}
+		else if (slots.empty()) {
+			return 0;
+		}
+		else {
+			// Everything pending is handed to the impairment, the slots serve as the receive buffers
+			size_t received;
+			do {
+				received = ReceiveBatch(slots);
+				for (size_t i = 0; i < received; i++) {
+					impairment->Admit(std::move(slots[i]));
+				}
+			} while (received == slots.size());
+			count = impairment->Release(slots, std::chrono::steady_clock::now());
+		}
+	}
+	RecordReceived(slots.first(count));
+	return count;
+}
+
+bool UDPSocket::WaitReadable(std::chrono::steady_clock::time_point deadline) {
+	{
+		std::lock_guard<std::mutex> guard(impairmentLock);
+		if (impairment) {
+			// A held datagram becoming due counts as a readable one
+			auto release = impairment->NextRelease();
+			if (release <= std::chrono::steady_clock::now()) return true;
+			deadline = std::min(deadline, release);
+		}
+	}
+	if (WaitSocket(deadline)) return true;
+	std::lock_guard<std::mutex> guard(impairmentLock);
+	return impairment && impairment->NextRelease() <= std::chrono::steady_clock::now();
+}
+
+void UDPSocket::SetImpairment(const ImpairmentSetting& setting) {
+	std::lock_guard<std::mutex> guard(impairmentLock);
+	impairment = std::make_unique<Impairment>(setting);
+}
+
+void UDPSocket::ClearImpairment() {
+	std::lock_guard<std::mutex> guard(impairmentLock);
+	impairment.reset();
+}
+
+std::optional<ImpairmentStats> UDPSocket::GetImpairmentStats() {
+	std::lock_guard<std::mutex> guard(impairmentLock);
+	if (!impairment) return {};
+	return impairment->Stats();
+}
+
+PacketBuffer UDPSocket::AcquireBuffer(size_t capacity) {
+	return pool->Acquire(capacity);
+}
+
+void UDPSocket::KeepUnsent(size_t sent) {
+	if (sent > 0) {
+		size_t offset = sent < sendQueue.size() ? sendQueue[sent].offset : sendBuffer.size();
+		sendQueue.erase(sendQueue.begin(), sendQueue.begin() + sent);
+		sendBuffer.erase(sendBuffer.begin(), sendBuffer.begin() + offset);
+		for (auto& queued : sendQueue) {
+			queued.offset -= offset;
+		}
+	}
+	sendBlocked = true;
+}
+
+void UDPSocket::QueuePacket(const std::span<const char> payload, const sockaddr_in& target) {
+	QueuePacket(std::span(&payload, 1), target);
+}
+
+void UDPSocket::QueuePacket(std::span<const std::span<const char>> parts, const sockaddr_in& target) {
+	if (closed) {
+		sendErrors++;
+		Debug::LogError("[Error] Attempting to write to a closed socket!");
+		return;
+	}
+
+	RecordSent(parts, target);
+	if (muted) return;
+
+	std::lock_guard<std::mutex> guard(sendQueueLock);
+	size_t offset = sendBuffer.size();
+	for (auto& part : parts) {
+		sendBuffer.insert(sendBuffer.end(), part.begin(), part.end());
+	}
+	sendQueue.push_back({ target, offset, sendBuffer.size() - offset });
+}
+
+void UDPSocket::CountSent(size_t bytes) {
+	packetsSent.fetch_add(1, std::memory_order_relaxed);
+	bytesSent.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void UDPSocket::CountReceived(size_t bytes) {
+	packetsReceived.fetch_add(1, std::memory_order_relaxed);
+	bytesReceived.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void UDPSocket::RecordSent(std::span<const std::span<const char>> parts, const sockaddr_in& target) {
+	if (!recording) return;
+	std::lock_guard<std::mutex> guard(recorderLock);
+	if (recorder) recorder->Record(PacketDirection::Outbound, target, parts);
+}
+
+void UDPSocket::RecordReceived(std::span<const PacketSlot> slots) {
+	if (!recording || slots.empty()) return;
+	std::lock_guard<std::mutex> guard(recorderLock);
+	if (!recorder) return;
+	for (auto& slot : slots) {
+		auto payload = slot.Payload();
+		recorder->Record(PacketDirection::Inbound, slot.address, std::span(&payload, 1));
+	}
+}
+
+void UDPSocket::SetRecorder(std::shared_ptr<PacketRecorder> recorder) {
+	std::lock_guard<std::mutex> guard(recorderLock);
+	this->recorder = std::move(recorder);
+	recording = this->recorder != nullptr;
+}
+
+void UDPSocket::SetMuted(bool muted) {
+	this->muted = muted;
+}
+
+SocketStats UDPSocket::Stats() const {
+	return SocketStats{
+		.packetsSent = packetsSent.load(std::memory_order_relaxed),
+		.bytesSent = bytesSent.load(std::memory_order_relaxed),
+		.packetsReceived = packetsReceived.load(std::memory_order_relaxed),
+		.bytesReceived = bytesReceived.load(std::memory_order_relaxed),
+		.sendErrors = sendErrors.load(std::memory_order_relaxed),
+		.receiveErrors = receiveErrors.load(std::memory_order_relaxed)
+	};
+}
+
 const DWORD UDPSocket::MaxPacketSize() const { return bufferSize; }
 
 const USHORT UDPSocket::Port() const {
@@ -168,8 +862,10 @@ const USHORT UDPSocket::Port() const {
 
 void UDPSocket::Close() {
 	std::lock_guard<std::mutex> guard(lock);
-	closed = true;
-	closesocket(sock);
+	if (!closed.exchange(true)) {
+		CloseSocket(sock);
+	}
+	Wake();
 }
 
-bool UDPSocket::IsClosed() const { return closed; }
\ No newline at end of file
+bool UDPSocket::IsClosed() const { return closed; }
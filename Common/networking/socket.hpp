@@ -1,7 +1,5 @@
 #ifndef SOCKET_H
 #define SOCKET_H
-#include <winsock2.h>
-#include <ws2tcpip.h>
 #include <thread>
 #include <list>
 #include <vector>
@@ -14,8 +12,17 @@
 #include <functional>
 #include <iostream>
 #include <chrono>
+#include "networking.hpp"
+#include "packet_buffer.hpp"
+
+class Impairment;
+struct ImpairmentSetting;
+struct ImpairmentStats;
+class PacketRecorder;
 
 constexpr auto DEFAULT_UDP_BUFFER_SIZE = 1500;
+// Largest number of parts a datagram can be gathered from
+constexpr size_t MAX_PACKET_PARTS = 4;
 
 inline bool SockAddrInEqual(sockaddr_in address1, sockaddr_in address2) {
 	return address1.sin_family == address2.sin_family &&
@@ -29,21 +36,107 @@ struct Packet {
 	std::vector<char> payload;
 };
 
+/// <summary>
+/// A receive slot for UDPSocket::ReadBatch. The buffer may be moved out to keep the datagram,
+/// the next read then refills the slot from the socket's buffer pool.
+/// </summary>
+struct PacketSlot {
+	sockaddr_in address = {};
+	std::chrono::steady_clock::time_point timeReceived;
+	PacketBuffer buffer;
+	size_t size = 0;
+
+	std::span<const char> Payload() const { return { buffer.Data(), size }; }
+};
+
+/// <summary>
+/// Counters of a socket since it was opened, received datagrams are counted before any impairment is applied
+/// </summary>
+struct SocketStats {
+	uint64_t packetsSent = 0;
+	uint64_t bytesSent = 0;
+	uint64_t packetsReceived = 0;
+	uint64_t bytesReceived = 0;
+	// Datagrams that could not be sent
+	uint64_t sendErrors = 0;
+	// Failed reads, oversized datagrams and unreachable port reports
+	uint64_t receiveErrors = 0;
+};
+
 class UDPSocket {
 private:
 	SOCKET sock;
 	USHORT port;
+	bool reusePort = false;
 	DWORD bufferSize = 0;
 	std::atomic<bool> closed;
 	std::atomic<bool> reconfiguring;
 	std::mutex lock;
+	std::vector<char> readBuffer;
+	std::shared_ptr<PacketBufferPool> pool;
+
+	// Datagrams queued by QueuePacket(), the payloads are stored back to back in sendBuffer
+	struct QueuedPacket {
+		sockaddr_in address;
+		size_t offset;
+		size_t size;
+	};
+	std::mutex sendQueueLock;
+	std::vector<QueuedPacket> sendQueue;
+	std::vector<char> sendBuffer;
+	// Set when Flush() stopped at a full send buffer, the rest of the queue is sent by the next Flush()
+	std::atomic<bool> sendBlocked = false;
+#ifdef _WIN32
+	// Loopback socket that is written to by Wake() so select() in WaitReadable returns early
+	SOCKET wakeSock = INVALID_SOCKET;
+	sockaddr_in wakeAddr = {};
+#else
+	int epollFd = -1;
+	int wakeFd = -1;
+	// The socket is registered for EPOLLOUT while sendBlocked is set, so WaitReadable() returns once it can be flushed
+	bool pollingWritable = false;
+#endif
+	// Received datagrams pass through the impairment before they are read when one is set
+	std::mutex impairmentLock;
+	std::unique_ptr<Impairment> impairment;
+
+	// Read datagrams and every datagram sent or queued are appended to the recorder when one is set
+	std::mutex recorderLock;
+	std::shared_ptr<PacketRecorder> recorder;
+	std::atomic<bool> recording = false;
+	// Set while replaying a capture, sent datagrams are recorded but never reach the network
+	std::atomic<bool> muted = false;
+
+	std::atomic<uint64_t> packetsSent = 0;
+	std::atomic<uint64_t> bytesSent = 0;
+	std::atomic<uint64_t> packetsReceived = 0;
+	std::atomic<uint64_t> bytesReceived = 0;
+	std::atomic<uint64_t> sendErrors = 0;
+	std::atomic<uint64_t> receiveErrors = 0;
+
 	// Called when IP failure detected, assume lock is already acquired
 	bool Rebind();
+	// Read from the network, Read(), ReadBatch() and WaitReadable() apply the impairment on top of them
+	std::optional<Packet> ReceiveOne();
+	size_t ReceiveBatch(std::span<PacketSlot> slots);
+	bool WaitSocket(std::chrono::steady_clock::time_point deadline);
+	// Waits for room in the send buffer of the socket, assume lock is already acquired
+	bool WaitWritable();
+	// Drops the first sent datagrams of the send queue and keeps the rest, assume sendQueueLock is already acquired
+	void KeepUnsent(size_t sent);
+	// Sets up the readiness notification used by WaitReadable() and Wake()
+	void InitPoller();
+	void CountSent(size_t bytes);
+	void CountReceived(size_t bytes);
+	void RecordSent(std::span<const std::span<const char>> parts, const sockaddr_in& target);
+	void RecordReceived(std::span<const PacketSlot> slots);
 public:
 	std::atomic<bool> blocked;
 
 	UDPSocket(DWORD maxPacketSize = DEFAULT_UDP_BUFFER_SIZE);
-	UDPSocket(USHORT port, DWORD maxPacketSize);
+	/// <param name="port"> The port to bind to, 0 picks an ephemeral port </param>
+	/// <param name="reusePort"> Allows several sockets to bind the same port, the kernel spreads datagrams between them by source address (SO_REUSEPORT, POSIX only) </param>
+	UDPSocket(USHORT port, DWORD maxPacketSize, bool reusePort = false);
 	UDPSocket(const UDPSocket& other) = delete;
 	UDPSocket(UDPSocket&& other) = delete;
 	UDPSocket& operator = (const UDPSocket& other) = delete;
@@ -52,11 +145,81 @@ public:
 
 	void SendPacket(const Packet& packet);
 	void SendPacket(const std::span<const char> payload, const sockaddr_in& target);
+	/// <summary>
+	/// Sends the parts as a single datagram without joining them first, so a header and a payload can live in separate buffers
+	/// </summary>
+	/// <param name="parts"> At most MAX_PACKET_PARTS parts </param>
+	void SendPacket(std::span<const std::span<const char>> parts, const sockaddr_in& target);
 	const DWORD MaxPacketSize() const;
 	const USHORT Port() const;
 	std::optional<Packet> Read();
 
+	/// <summary>
+	/// Reads as many pending datagrams as there are slots without blocking, using one recvmmsg() call per batch on Linux
+	/// </summary>
+	/// <param name="slots"> The slots to fill, slots without a buffer are given one from the pool </param>
+	/// <returns> The number of slots filled from the front of the span </returns>
+	size_t ReadBatch(std::span<PacketSlot> slots);
+
+	/// <summary>
+	/// Takes a buffer from the socket's pool, pooled buffers hold MaxPacketSize() plus PACKET_HEADROOM bytes
+	/// </summary>
+	PacketBuffer AcquireBuffer(size_t capacity = 0);
+
+	/// <summary>
+	/// Copies the datagram into the send queue, nothing is written to the network until Flush() is called
+	/// </summary>
+	void QueuePacket(const std::span<const char> payload, const sockaddr_in& target);
+	/// <summary>
+	/// Copies the parts back to back into the send queue as a single datagram
+	/// </summary>
+	void QueuePacket(std::span<const std::span<const char>> parts, const sockaddr_in& target);
+
+	/// <summary>
+	/// Sends every queued datagram, using sendmmsg() on Linux. Datagrams that do not fit into a full send buffer
+	/// stay queued for the next call.
+	/// </summary>
+	void Flush();
+
+	/// <summary>
+	/// Blocks until the socket has a datagram to read, Wake() is called or the deadline is reached
+	/// </summary>
+	/// <param name="deadline"> time_point::max() blocks without a deadline </param>
+	/// <returns> true if a datagram may be read without blocking </returns>
+	bool WaitReadable(std::chrono::steady_clock::time_point deadline);
+
+	/// <summary>
+	/// Interrupts a thread blocked in WaitReadable()
+	/// </summary>
+	void Wake();
+
+	/// <summary>
+	/// Applies simulated loss, delay, reordering, duplication and a bandwidth limit to received datagrams, for testing.
+	/// Sent datagrams are not impaired, the peer's socket is impaired as well to impair both directions.
+	/// </summary>
+	void SetImpairment(const ImpairmentSetting& setting);
+	/// <summary>
+	/// Stops impairing, datagrams still held back are dropped
+	/// </summary>
+	void ClearImpairment();
+	std::optional<ImpairmentStats> GetImpairmentStats();
+
+	/// <summary>
+	/// Appends every datagram read from or written to the socket to the recorder, null stops recording.
+	/// Received datagrams are recorded as they are read, after any impairment.
+	/// </summary>
+	void SetRecorder(std::shared_ptr<PacketRecorder> recorder);
+	/// <summary>
+	/// Drops sent and queued datagrams after they are recorded, so a replayed session does not reach the recorded peers
+	/// </summary>
+	void SetMuted(bool muted);
+
+	/// <summary>
+	/// Reads the counters without locking, they are updated with relaxed atomics
+	/// </summary>
+	SocketStats Stats() const;
+
 	void Close();
 	bool IsClosed() const;
 };
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,120 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <span>
+#include <utility>
+#include <cstddef>
+
+/// <summary>
+/// Bounded lock-free queue between one producer and one consumer. Several producing or consuming threads
+/// must be serialized by the caller, e.g. by pushing only while holding a lock.
+/// </summary>
+template<typename T>
+class SpscRing {
+private:
+	// Keeps the producer and consumer indices on separate cache lines
+	static constexpr size_t CACHE_LINE = 64;
+
+	const size_t capacity;
+	const size_t mask;
+	std::unique_ptr<T[]> slots;
+
+	// Only written by the consumer, cachedTail avoids reading tail while items are known to be available
+	alignas(CACHE_LINE) std::atomic<size_t> head = 0;
+	size_t cachedTail = 0;
+	// Only written by the producer, cachedHead avoids reading head while space is known to be available
+	alignas(CACHE_LINE) std::atomic<size_t> tail = 0;
+	size_t cachedHead = 0;
+
+	static size_t SlotCount(size_t capacity) {
+		size_t count = 1;
+		while (count < capacity) count <<= 1;
+		return count;
+	}
+
+	bool HasSpace(size_t position) {
+		if (position - cachedHead < capacity) return true;
+		cachedHead = head.load(std::memory_order_acquire);
+		return position - cachedHead < capacity;
+	}
+public:
+	/// <param name="capacity"> The number of items the ring holds at most, at least 1 </param>
+	explicit SpscRing(size_t capacity)
+		: capacity(capacity > 0 ? capacity : 1), mask(SlotCount(this->capacity) - 1), slots(std::make_unique<T[]>(mask + 1)) {}
+	SpscRing(const SpscRing& other) = delete;
+	SpscRing& operator = (const SpscRing& other) = delete;
+
+	/// <summary>
+	/// Called by the producer
+	/// </summary>
+	/// <returns> false if the ring is full, the value is left untouched </returns>
+	bool TryPush(T&& value) {
+		auto position = tail.load(std::memory_order_relaxed);
+		if (!HasSpace(position)) return false;
+		slots[position & mask] = std::move(value);
+		tail.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	/// <summary>
+	/// Called by the producer, constructs the item with brace initialization so aggregates can be emplaced
+	/// </summary>
+	template<typename... Args>
+	bool TryEmplace(Args&&... args) {
+		auto position = tail.load(std::memory_order_relaxed);
+		if (!HasSpace(position)) return false;
+		slots[position & mask] = T{ std::forward<Args>(args)... };
+		tail.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	/// <summary>
+	/// Called by the consumer
+	/// </summary>
+	std::optional<T> TryPop() {
+		auto position = head.load(std::memory_order_relaxed);
+		if (position == cachedTail) {
+			cachedTail = tail.load(std::memory_order_acquire);
+			if (position == cachedTail) return {};
+		}
+		// The slot is reset so resources held by the item are released now rather than when the slot is reused
+		std::optional<T> result = std::exchange(slots[position & mask], T{});
+		head.store(position + 1, std::memory_order_release);
+		return result;
+	}
+
+	/// <summary>
+	/// Called by the consumer, moves as many items as fit into the output with a single synchronization
+	/// </summary>
+	/// <returns> The number of items written to the front of the output </returns>
+	size_t PopBatch(std::span<T> output) {
+		auto position = head.load(std::memory_order_relaxed);
+		cachedTail = tail.load(std::memory_order_acquire);
+		size_t count = std::min(cachedTail - position, output.size());
+		for (size_t i = 0; i < count; i++) {
+			output[i] = std::exchange(slots[(position + i) & mask], T{});
+		}
+		head.store(position + count, std::memory_order_release);
+		return count;
+	}
+
+	/// <summary>
+	/// The number of items in the ring, may be outdated when called by neither the producer nor the consumer
+	/// </summary>
+	size_t Size() const {
+		auto position = head.load(std::memory_order_acquire);
+		return tail.load(std::memory_order_acquire) - position;
+	}
+
+	bool Empty() const {
+		return Size() == 0;
+	}
+
+	size_t Capacity() const {
+		return capacity;
+	}
+};
+#endif
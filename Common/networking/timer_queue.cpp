@@ -0,0 +1,40 @@
+#include "timer_queue.hpp"
+#include <algorithm>
+
+// Orders the heap so the earliest deadline is at the front
+static bool LaterDeadline(const TimerEvent& a, const TimerEvent& b) {
+	return a.deadline > b.deadline;
+}
+
+TimerQueue::TimerQueue(std::shared_ptr<const VirtualClock> clock) : clock(std::move(clock)) {}
+
+std::chrono::steady_clock::time_point TimerQueue::Now() const {
+	return clock ? clock->Now() : std::chrono::steady_clock::now();
+}
+
+bool TimerQueue::Schedule(TimerEvent event) {
+	std::lock_guard<std::mutex> guard(lock);
+	bool earliest = heap.empty() || event.deadline < heap.front().deadline;
+	heap.emplace_back(std::move(event));
+	std::push_heap(heap.begin(), heap.end(), LaterDeadline);
+	return earliest;
+}
+
+void TimerQueue::PopExpired(std::chrono::steady_clock::time_point now, std::vector<TimerEvent>& expired) {
+	std::lock_guard<std::mutex> guard(lock);
+	while (!heap.empty() && heap.front().deadline <= now) {
+		std::pop_heap(heap.begin(), heap.end(), LaterDeadline);
+		expired.emplace_back(std::move(heap.back()));
+		heap.pop_back();
+	}
+}
+
+std::chrono::steady_clock::time_point TimerQueue::NextDeadline() {
+	std::lock_guard<std::mutex> guard(lock);
+	return heap.empty() ? std::chrono::steady_clock::time_point::max() : heap.front().deadline;
+}
+
+size_t TimerQueue::Size() {
+	std::lock_guard<std::mutex> guard(lock);
+	return heap.size();
+}
@@ -0,0 +1,66 @@
+#ifndef TIMER_QUEUE_H
+#define TIMER_QUEUE_H
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+#include "virtual_clock.hpp"
+
+class LiteConnConnection;
+
+enum class TimerKind : uint8_t {
+	Resend, // Retransmit the important packet with the id unless it was acknowledged
+	AckExpire, // Forget the cached acknowledgement of the id
+	Heartbeat, // Send a heartbeat, or retry the handshake while not connected
+	Timeout, // Close the connection if nothing was received for too long
+	Flush, // Send the acknowledgements and bundled packets queued since the last flush
+	Reassembly, // Drop the partially received message with the id if no fragment arrived for too long
+	PathChallenge, // Resend the path challenge with the token as id unless it was answered, or give up on the new address
+	WindowUpdate, // Advertise the receive window that the application freed since the last advertisement
+	Pace // Send the messages waiting for the pacer
+};
+
+struct TimerEvent {
+	std::chrono::steady_clock::time_point deadline;
+	std::weak_ptr<LiteConnConnection> connection;
+	TimerKind kind;
+	uint64_t id;
+};
+
+/// <summary>
+/// Min-heap of connection timers shared by the connections of one routing thread.
+/// Timers are never cancelled, the connection checks whether the timer is still relevant when it fires and reschedules it if its deadline moved.
+/// </summary>
+class TimerQueue {
+private:
+	// No other lock is acquired while holding the lock
+	std::mutex lock;
+	std::vector<TimerEvent> heap;
+	std::shared_ptr<const VirtualClock> clock;
+public:
+	/// <param name="clock"> The time of the connections sharing the queue, steady_clock when null </param>
+	explicit TimerQueue(std::shared_ptr<const VirtualClock> clock = nullptr);
+
+	/// <summary>
+	/// The current time deadlines are compared to, connections read the time from the queue they schedule their timers on
+	/// </summary>
+	std::chrono::steady_clock::time_point Now() const;
+
+	/// <summary>
+	/// Adds a timer, can be called from any thread
+	/// </summary>
+	/// <returns> true if the timer is now the earliest one, the routing thread should be woken to adjust its sleep </returns>
+	bool Schedule(TimerEvent event);
+
+	/// <summary>
+	/// Moves every timer due at or before the given time into expired, earliest first
+	/// </summary>
+	void PopExpired(std::chrono::steady_clock::time_point now, std::vector<TimerEvent>& expired);
+
+	/// <returns> The earliest deadline, or time_point::max() if no timer is scheduled </returns>
+	std::chrono::steady_clock::time_point NextDeadline();
+
+	size_t Size();
+};
+#endif
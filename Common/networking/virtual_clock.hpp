@@ -0,0 +1,29 @@
+#ifndef VIRTUAL_CLOCK_H
+#define VIRTUAL_CLOCK_H
+#include <atomic>
+#include <chrono>
+
+/// <summary>
+/// A time source that only moves when it is advanced, used to replay a capture at the recorded times regardless of
+/// how fast the replay runs. Its time points are on the steady_clock scale so recorded timestamps can be used directly.
+/// </summary>
+class VirtualClock {
+private:
+	std::atomic<std::chrono::steady_clock::rep> ticks;
+public:
+	explicit VirtualClock(std::chrono::steady_clock::time_point start) : ticks(start.time_since_epoch().count()) {}
+
+	std::chrono::steady_clock::time_point Now() const {
+		return std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(ticks.load(std::memory_order_acquire)));
+	}
+
+	/// <summary>
+	/// Moves the clock forward to the given time, the clock never moves backwards
+	/// </summary>
+	void AdvanceTo(std::chrono::steady_clock::time_point time) {
+		auto target = time.time_since_epoch().count();
+		auto current = ticks.load(std::memory_order_relaxed);
+		while (current < target && !ticks.compare_exchange_weak(current, target, std::memory_order_release, std::memory_order_relaxed)) {}
+	}
+};
+#endif
@@ -20,7 +20,7 @@ static int randInt(int min, int max) {
 }
 
 MultiplayerGame::MultiplayerGame(int FPS, USHORT port) 
-	: gameClock(FPS), connectionManager(port, 2, packetQueueCapacity, maxPacketSize, std::chrono::seconds(1) / FPS) 
+	: gameClock(FPS), connectionManager(port, 2, packetQueueCapacity, maxPacketSize, std::chrono::seconds(1) / FPS, ConnectionSetting) 
 {
 	connectionManager.isListening = true;
 }
@@ -58,6 +58,28 @@ Coroutine MultiplayerGame::WaitForSeconds(float time) {
 	co_yield Coroutine::YieldOption::Wait(time);
 }
 
+Coroutine MultiplayerGame::AwaitSliceResult(LiteConnResponse response, int playerID) {
+	auto pkt = co_await response;
+	if (!pkt) {
+		Debug::LogError("Error: The client ", (playerID + 1), " refused to respond to fruit slice result");
+		co_return;
+	}
+	auto result = SliceResult::Deserialize(pkt->data);
+	if (!result) {
+		Debug::LogError("Error: Failed to deserialize client ", (playerID + 1), " slice result");
+		co_return;
+	}
+
+	if (result->isSliced) {
+		Debug::Log("Client ", (playerID + 1), " sliced slicable!");
+		contexts[playerID].score++;
+	}
+	else {
+		Debug::Log("Client ", (playerID + 1), " missed slicable");
+		// contexts[playerID].numMisses++;
+	}
+}
+
 void MultiplayerGame::StartCoroutine(Coroutine&& coroutine) {
 	coroutineManager.AddCoroutine(std::forward<Coroutine>(coroutine));
 }
@@ -76,43 +98,7 @@ void MultiplayerGame::Step() {
 	if (state == GameState::Game) {
 		// Check fruit slice result for both players
 
-		for (auto i = pendingSlicables.begin(); i != pendingSlicables.end();) {
-			bool slicableFinished = true;
-			for (auto playerID = 0; playerID < 2; playerID++) {
-				if (!i->results[playerID]) continue;
-				if (i->results[playerID].WaitForResponse(std::chrono::seconds())) {
-					auto pkt = i->results[playerID].GetResponse();
-					if (!pkt) {
-						Debug::LogError("Error: The client ", (playerID + 1), " refused to respond to fruit slice result");
-						continue;
-					}
-					auto response = SliceResult::Deserialize(pkt->data);
-					if (!response) {
-						Debug::LogError("Error: Failed to deserialize client ", (playerID + 1), " slice result");
-						continue;
-					}
-
-					if (response->isSliced) {
-						Debug::Log("Client ", (playerID + 1), " sliced slicable!");
-						contexts[playerID].score++;
-					}
-					else {
-						Debug::Log("Client ", (playerID + 1), " missed slicable");
-						// contexts[playerID].numMisses++;
-					}
-				}
-				else {
-					slicableFinished = false;
-				}
-			}
-
-			if (slicableFinished) {
-				i = pendingSlicables.erase(i);
-			}
-			else {
-				++i;
-			}
-		}
+		responseTasks.Run(gameClock);
 
 		if (contexts[0].numMisses >= MTP_Setting::missTolerence && contexts[1].numMisses >= MTP_Setting::missTolerence) {
 			state = GameState::Wait;
@@ -153,15 +139,15 @@ void MultiplayerGame::SendUpdate() {
 	contexts[1].isConnected = players[1] && players[1]->IsConnected();
 
 	if (contexts[0].isConnected) {
-		players[0]->SendData(ServerPacket::SerializeGameState(contextIndex, contexts[0], contexts[1]));
+		players[0]->Send(MTP_Channel::GameState, ServerPacket::SerializeGameState(contextIndex, contexts[0], contexts[1]));
 	}
 	if (contexts[1].isConnected) {
-		players[1]->SendData(ServerPacket::SerializeGameState(contextIndex, contexts[1], contexts[0]));
+		players[1]->Send(MTP_Channel::GameState, ServerPacket::SerializeGameState(contextIndex, contexts[1], contexts[0]));
 	}
 }
 
 void MultiplayerGame::ProcessInput() {
-	// Populate player input array and sort by index
+	// Populate player input arrays, the input channel delivers them in order and drops stale ones
 	std::vector<PlayerInputState> inputs[2];
 
 	bool disconnect = false;
@@ -172,8 +158,11 @@ void MultiplayerGame::ProcessInput() {
 			contexts[i] = {};
 		}
 		else if (players[i]->IsConnected()) {
-			for (auto pkt = players[i]->Receive(); pkt.has_value(); pkt = players[i]->Receive()) {
-				auto clientData = ClientPacket::Deserialize(pkt->data);
+			auto count = players[i]->ReceiveAll(received);
+			for (auto& pkt : std::span(received.data(), count)) {
+				auto clientData = ClientPacket::Deserialize(pkt.data);
+				// Return the datagram to the pool now rather than when the slot is reused
+				pkt = {};
 
 				std::visit(
 					overload{
@@ -185,17 +174,10 @@ void MultiplayerGame::ProcessInput() {
 		}
 	}
 
-	auto comparator = [](const PlayerInputState& a, const PlayerInputState& b) {
-		return a.index < b.index;
-	};
-
-	std::sort(inputs[0].begin(), inputs[0].end(), comparator);
-	std::sort(inputs[1].begin(), inputs[1].end(), comparator);
-
 	if (state == GameState::Game) {
 		if (disconnect) {
 			objManager.UnregisterAll();
-			pendingSlicables.clear();
+			responseTasks.Clear();
 			state = GameState::Wait;
 			Debug::Log("Player Disconnected!");
 			SendCommand(ServerPacket::Disconnect);
@@ -222,17 +204,17 @@ void MultiplayerGame::ProcessInput() {
 void MultiplayerGame::SendCommand(ServerPacket::ServerCommand cmd) {
 	auto signal = ServerPacket::SerializeCommand(cmd);
 	if (players[0] && players[0]->IsConnected()) {
-		players[0]->SendReliableData(signal);
+		players[0]->Send(MTP_Channel::Command, signal);
 	}
 	if (players[1] && players[1]->IsConnected()) {
-		players[1]->SendReliableData(signal);
+		players[1]->Send(MTP_Channel::Command, signal);
 	}
 }
 
 void MultiplayerGame::SendCommand(ServerPacket::ServerCommand cmd, std::shared_ptr<LiteConnConnection>& player) {
 	auto signal = ServerPacket::SerializeCommand(cmd);
 	if (player && player->IsConnected()) {
-		player->SendReliableData(signal);
+		player->Send(MTP_Channel::Command, signal);
 	}
 }
 
@@ -257,31 +239,15 @@ void MultiplayerGame::SpawnFruit()
 					.vel = velocity,
 					.fruitType = fruitType
 			});
-		SlicableAwaitResult wait;
-		wait.isBomb = fruitType == SlicableType::Bomb;
-
-		if (players[0]) {
-			auto result1 = players[0]->SendRequest(signal);
-			if (result1) {
-				wait.results[0] = std::move(result1.value());
+		auto results = connectionManager.BroadcastRequest(players, signal);
+		for (auto playerID = 0; playerID < 2; playerID++) {
+			if (!players[playerID]) continue;
+			if (results[playerID]) {
+				responseTasks.AddCoroutine(AwaitSliceResult(std::move(results[playerID].value()), playerID));
 			}
 			else {
-				Debug::LogError("Failed to send fruit spawn request to player 1: ");
+				Debug::LogError("Failed to send fruit spawn request to player ", (playerID + 1));
 			}
 		}
-
-		if (players[1]) {
-			auto result2 = players[1]->SendRequest(signal);
-			if (result2) {
-				wait.results[1] = std::move(result2.value());
-			}
-			else {
-				Debug::LogError("Failed to send fruit spawn request to player 2");
-			}
-		}
-
-		if (wait.results[0] || wait.results[1]) {
-			pendingSlicables.push_back(std::move(wait));
-		}
 	}
 }
\ No newline at end of file
@@ -6,12 +6,6 @@
 #include "infrastructure/clock.hpp"
 #include "networking/lite_conn.hpp"
 
-struct SlicableAwaitResult {
-	uint32_t index = 0;
-	bool isBomb = false;
-	LiteConnResponse results[2];
-};
-
 class MultiplayerGame {
 public:
 	enum class GameState {
@@ -33,8 +27,8 @@ private:
 	uint64_t contextIndex = 0;
 	PlayerContext contexts[2] = {};
 	std::shared_ptr<LiteConnConnection> players[2];
-
-	std::list<SlicableAwaitResult> pendingSlicables;
+	// Large enough to take every queued message of a player at once
+	std::array<LiteConnMessage, packetQueueCapacity> received;
 
 	float spawnTimer = 0;
 	uint64_t spawnIndex = 0;
@@ -42,6 +36,8 @@ private:
 	ObjectManager objManager = {};
 	LiteConnManager connectionManager;
 	CoroutineManager coroutineManager;
+	// Coroutines awaiting the slice results of the players, resumed in Step
+	CoroutineManager responseTasks;
 	Clock gameClock;
 
 	GameState state = GameState::Wait;
@@ -50,6 +46,7 @@ private:
 	void StartCoroutine(Coroutine&& coroutine);
 
 	Coroutine WaitForSeconds(float time);
+	Coroutine AwaitSliceResult(LiteConnResponse response, int playerID);
 
 	void SendCommand(ServerPacket::ServerCommand cmd);
 	void SendCommand(ServerPacket::ServerCommand cmd, std::shared_ptr<LiteConnConnection>& player);
@@ -0,0 +1,129 @@
+#include <catch2/catch_test_macros.hpp>
+#include <filesystem>
+#include <thread>
+#include "networking/capture.hpp"
+#include "networking/socket.hpp"
+
+static std::string CapturePath(const std::string& name) {
+    return (std::filesystem::temp_directory_path() / name).string();
+}
+
+static sockaddr_in Address(uint32_t ip, uint16_t port) {
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(ip);
+    address.sin_port = htons(port);
+    return address;
+}
+
+TEST_CASE("PacketRecorder records are read back in order", "[Capture]") {
+    auto path = CapturePath("lite_conn_capture_test.lcap");
+    const std::string metadata = "key";
+    auto source = Address(INADDR_LOOPBACK, 1234);
+    auto target = Address(0x0A000001, 5678);
+    std::string large(2000, 'x');
+    auto before = std::chrono::steady_clock::now();
+    {
+        PacketRecorder recorder(path, metadata);
+        REQUIRE(recorder.Good());
+        std::string first = "hello";
+        std::span<const char> firstPart = first;
+        recorder.Record(PacketDirection::Inbound, source, std::span(&firstPart, 1));
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        // Parts are joined into one record
+        std::array<std::span<const char>, 2> parts = { std::span<const char>(large).first(500), std::span<const char>(large).subspan(500) };
+        recorder.Record(PacketDirection::Outbound, target, parts);
+        recorder.Record(PacketDirection::Outbound, target, {});
+    }
+    auto after = std::chrono::steady_clock::now();
+
+    CaptureReader reader(path);
+    REQUIRE(reader.Good());
+    REQUIRE(std::string(reader.Metadata().begin(), reader.Metadata().end()) == metadata);
+
+    auto first = reader.Next();
+    REQUIRE(first);
+    REQUIRE(first->direction == PacketDirection::Inbound);
+    REQUIRE(first->address.sin_addr.s_addr == source.sin_addr.s_addr);
+    REQUIRE(first->address.sin_port == source.sin_port);
+    REQUIRE(std::string(first->payload.begin(), first->payload.end()) == "hello");
+    REQUIRE(first->time >= before);
+
+    auto second = reader.Next();
+    REQUIRE(second);
+    REQUIRE(second->direction == PacketDirection::Outbound);
+    REQUIRE(second->address.sin_addr.s_addr == target.sin_addr.s_addr);
+    REQUIRE(std::string(second->payload.begin(), second->payload.end()) == large);
+    REQUIRE(second->time - first->time >= std::chrono::milliseconds(5));
+
+    auto third = reader.Next();
+    REQUIRE(third);
+    REQUIRE(third->payload.empty());
+    REQUIRE(third->time <= after);
+    REQUIRE(!reader.Next());
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("CaptureReader rejects other files and stops at a truncated record", "[Capture]") {
+    auto path = CapturePath("lite_conn_capture_truncated.lcap");
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << "not a capture";
+    }
+    REQUIRE(!CaptureReader(path).Good());
+    REQUIRE(!CaptureReader(CapturePath("lite_conn_capture_missing.lcap")).Good());
+
+    {
+        PacketRecorder recorder(path);
+        std::string payload(100, 'y');
+        std::span<const char> part = payload;
+        recorder.Record(PacketDirection::Inbound, Address(INADDR_LOOPBACK, 1), std::span(&part, 1));
+        recorder.Record(PacketDirection::Inbound, Address(INADDR_LOOPBACK, 2), std::span(&part, 1));
+    }
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 10);
+    CaptureReader reader(path);
+    REQUIRE(reader.Good());
+    REQUIRE(reader.Next());
+    REQUIRE(!reader.Next());
+    REQUIRE(!reader.Good());
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("UDPSocket records sent and received datagrams", "[Capture]") {
+    auto path = CapturePath("lite_conn_capture_socket.lcap");
+    UDPSocket socket1;
+    UDPSocket socket2;
+    auto addr2 = Address(INADDR_LOOPBACK, ntohs(socket2.Port()));
+    {
+        auto recorder = std::make_shared<PacketRecorder>(path);
+        socket2.SetRecorder(recorder);
+        socket1.SetRecorder(recorder);
+
+        std::string message = "recorded";
+        socket1.SendPacket(message, addr2);
+        socket1.QueuePacket(message, addr2);
+        socket1.Flush();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        std::vector<PacketSlot> slots(4);
+        REQUIRE(socket2.ReadBatch(slots) == 2);
+
+        // A muted socket records the datagram without sending it
+        socket1.SetMuted(true);
+        socket1.SendPacket(message, addr2);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        REQUIRE(socket2.ReadBatch(slots) == 0);
+
+        socket1.SetRecorder(nullptr);
+        socket2.SetRecorder(nullptr);
+    }
+
+    CaptureReader reader(path);
+    REQUIRE(reader.Good());
+    std::vector<PacketDirection> directions;
+    while (auto packet = reader.Next()) {
+        REQUIRE(std::string(packet->payload.begin(), packet->payload.end()) == "recorded");
+        directions.push_back(packet->direction);
+    }
+    REQUIRE(directions == std::vector<PacketDirection>{ PacketDirection::Outbound, PacketDirection::Outbound, PacketDirection::Inbound, PacketDirection::Inbound, PacketDirection::Outbound });
+    std::filesystem::remove(path);
+}
@@ -0,0 +1,89 @@
+#include <catch2/catch_test_macros.hpp>
+#include "networking/congestion.hpp"
+
+TEST_CASE("CongestionController grows and shrinks the window", "[Congestion]") {
+    CongestionSetting setting = {
+        .initialWindow = 4,
+        .minWindow = 2,
+        .maxWindow = 64,
+        .decrease = 0.5,
+        .queueDelayThreshold = {}
+    };
+    CongestionController controller(setting);
+    REQUIRE(controller.Window() == 4);
+
+    // One packet per acknowledgement until the first congestion signal
+    controller.OnAcknowledged(4);
+    REQUIRE(controller.Window() == 8);
+
+    auto start = std::chrono::steady_clock::time_point(std::chrono::seconds(1));
+    controller.OnLoss(start, start + std::chrono::milliseconds(100));
+    REQUIRE(controller.Window() == 4);
+    REQUIRE(controller.Decreases() == 1);
+
+    // Losses of packets sent before the decrease belong to the same congestion event
+    controller.OnLoss(start + std::chrono::milliseconds(50), start + std::chrono::milliseconds(150));
+    REQUIRE(controller.Window() == 4);
+
+    // One packet per window afterwards
+    controller.OnAcknowledged(4);
+    REQUIRE(controller.Window() == 4);
+    controller.OnAcknowledged(1);
+    REQUIRE(controller.Window() == 5);
+
+    // Never below the minimum nor above the maximum
+    for (int i = 1; i <= 10; i++) {
+        controller.OnLoss(start + std::chrono::seconds(i), start + std::chrono::seconds(i));
+    }
+    REQUIRE(controller.Window() == 2);
+    controller.OnAcknowledged(100000);
+    REQUIRE(controller.Window() == 64);
+}
+
+TEST_CASE("CongestionController reacts to growing round trips", "[Congestion]") {
+    CongestionSetting setting = {
+        .initialWindow = 16,
+        .queueDelayThreshold = std::chrono::milliseconds(20)
+    };
+    CongestionController controller(setting);
+    auto now = std::chrono::steady_clock::time_point(std::chrono::seconds(1));
+
+    controller.OnRoundTrip(std::chrono::milliseconds(30), now, now);
+    controller.OnRoundTrip(std::chrono::milliseconds(45), now, now);
+    REQUIRE(controller.Window() == 16);
+    controller.OnRoundTrip(std::chrono::milliseconds(60), now, now);
+    REQUIRE(controller.Window() == 8);
+
+    // The pacer sends the gain times the window per round trip, capped by the bandwidth
+    REQUIRE(controller.PacingRate({}, 1000) == 0);
+    REQUIRE(controller.PacingRate(std::chrono::milliseconds(100), 1000) == 2 * 8 * 1000 / 0.1);
+    setting.maxBandwidth = 50000;
+    CongestionController capped(setting);
+    REQUIRE(capped.PacingRate({}, 1000) == 50000);
+    REQUIRE(capped.PacingRate(std::chrono::milliseconds(100), 1000) == 50000);
+}
+
+TEST_CASE("TokenBucket paces sends to its rate", "[Congestion]") {
+    auto now = std::chrono::steady_clock::time_point(std::chrono::seconds(1));
+    TokenBucket bucket(1000, 500, now);
+
+    // A send may take the budget below 0 and delays the next one accordingly
+    REQUIRE(bucket.Ready(now));
+    bucket.Take(1500, now);
+    REQUIRE(!bucket.Ready(now));
+    auto ready = bucket.NextReady(now);
+    REQUIRE(ready > now + std::chrono::milliseconds(999));
+    REQUIRE(ready <= now + std::chrono::milliseconds(1001));
+    REQUIRE(!bucket.Ready(now + std::chrono::milliseconds(999)));
+    REQUIRE(bucket.Ready(ready));
+
+    // The budget never exceeds the burst
+    now += std::chrono::seconds(10);
+    bucket.Take(501, now);
+    REQUIRE(!bucket.Ready(now));
+
+    // A rate of 0 never limits
+    bucket.SetRate(0, now);
+    REQUIRE(bucket.Ready(now));
+    REQUIRE(bucket.NextReady(now) == now);
+}
@@ -0,0 +1,75 @@
+#include <catch2/catch_test_macros.hpp>
+#include <string>
+#include "networking/handshake_guard.hpp"
+
+static sockaddr_in MakeAddress(uint32_t ip, uint16_t port) {
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(ip);
+    address.sin_port = htons(port);
+    return address;
+}
+
+TEST_CASE("SipHash matches the reference vectors", "[HandshakeGuard]") {
+    // Key 00 01 .. 0f, messages 00 01 .. (n - 1), from the SipHash paper
+    std::array<uint64_t, 2> key = { 0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL };
+    std::string message;
+    REQUIRE(SipHash(key, message) == 0x726fdb47dd0e0e31ULL);
+    for (char i = 0; i < 15; i++) {
+        message.push_back(i);
+    }
+    REQUIRE(SipHash(key, message) == 0xa129ca6149be45e5ULL);
+}
+
+TEST_CASE("HandshakeCookie validates only what it issued", "[HandshakeGuard]") {
+    HandshakeCookie cookies(std::chrono::seconds(5));
+    auto now = std::chrono::steady_clock::now();
+    auto client = MakeAddress(0x7f000001, 30000);
+
+    auto cookie = cookies.Issue(client, 1234, 3, now);
+    REQUIRE(cookie != 0);
+    // The same SYN gets the same cookie, so retried SYNs need no state either
+    REQUIRE(cookies.Issue(client, 1234, 3, now) == cookie);
+    REQUIRE(cookies.Validate(cookie, client, 1234, 3, now));
+
+    // Any echoed field that differs from the SYN invalidates the cookie
+    REQUIRE(!cookies.Validate(cookie + 1, client, 1234, 3, now));
+    REQUIRE(!cookies.Validate(cookie, MakeAddress(0x7f000002, 30000), 1234, 3, now));
+    REQUIRE(!cookies.Validate(cookie, MakeAddress(0x7f000001, 30001), 1234, 3, now));
+    REQUIRE(!cookies.Validate(cookie, client, 1235, 3, now));
+    REQUIRE(!cookies.Validate(cookie, client, 1234, 1, now));
+
+    // A cookie outlives its time bucket by one bucket
+    REQUIRE(cookies.Validate(cookie, client, 1234, 3, now + std::chrono::seconds(5)));
+    REQUIRE(!cookies.Validate(cookie, client, 1234, 3, now + std::chrono::seconds(10)));
+
+    // Another manager's key issues different cookies
+    HandshakeCookie other(std::chrono::seconds(5));
+    REQUIRE(!other.Validate(cookie, client, 1234, 3, now));
+}
+
+TEST_CASE("HandshakeLimiter enforces the rate per source address", "[HandshakeGuard]") {
+    HandshakeLimiter limiter(64, 10, 3);
+    auto now = std::chrono::steady_clock::now();
+    auto flooder = MakeAddress(0x0a000001, 1000);
+
+    // The burst is available at once, then the bucket is empty
+    for (int i = 0; i < 3; i++) {
+        REQUIRE(limiter.TryTake(flooder, now));
+    }
+    REQUIRE(!limiter.TryTake(flooder, now));
+    // Changing the source port does not reset the budget
+    REQUIRE(!limiter.TryTake(MakeAddress(0x0a000001, 1001), now));
+
+    // Tokens come back at the configured rate
+    now += std::chrono::milliseconds(100);
+    REQUIRE(limiter.TryTake(flooder, now));
+    REQUIRE(!limiter.TryTake(flooder, now));
+
+    // Other sources are not affected unless they share the bucket
+    size_t admitted = 0;
+    for (uint32_t ip = 1; ip <= 32; ip++) {
+        if (limiter.TryTake(MakeAddress(0x0b000000 + ip, 1000), now)) admitted++;
+    }
+    REQUIRE(admitted >= 16);
+}
@@ -0,0 +1,128 @@
+#include <catch2/catch_test_macros.hpp>
+#include <algorithm>
+#include <cstring>
+#include "networking/impairment.hpp"
+
+// Datagrams of the given size holding their number in the first bytes
+static std::vector<PacketSlot> MakeSlots(PacketBufferPool& pool, uint32_t count, size_t size, std::chrono::steady_clock::time_point arrival) {
+    std::vector<PacketSlot> slots(count);
+    for (uint32_t i = 0; i < count; i++) {
+        slots[i].buffer = pool.Acquire();
+        memcpy(slots[i].buffer.Data(), &i, sizeof(i));
+        slots[i].size = size;
+        slots[i].timeReceived = arrival;
+    }
+    return slots;
+}
+
+static uint32_t Number(const PacketSlot& slot) {
+    uint32_t number;
+    memcpy(&number, slot.buffer.Data(), sizeof(number));
+    return number;
+}
+
+// Releases everything held and returns the numbers and release times in delivery order
+static std::vector<std::pair<uint32_t, std::chrono::steady_clock::time_point>> Drain(Impairment& impairment) {
+    std::vector<std::pair<uint32_t, std::chrono::steady_clock::time_point>> result;
+    std::vector<PacketSlot> slots(16);
+    while (auto count = impairment.Release(slots, std::chrono::steady_clock::time_point::max())) {
+        for (size_t i = 0; i < count; i++) {
+            result.emplace_back(Number(slots[i]), slots[i].timeReceived);
+        }
+    }
+    return result;
+}
+
+TEST_CASE("Impairment decisions depend only on the seed", "[Impairment]") {
+    auto pool = std::make_shared<PacketBufferPool>(64);
+    auto now = std::chrono::steady_clock::now();
+    ImpairmentSetting setting = {
+        .lossRate = 0.3,
+        .duplicateRate = 0.1,
+        .reorderRate = 0.1,
+        .latency = std::chrono::milliseconds(40),
+        .jitter = std::chrono::milliseconds(10),
+        .distribution = DelayDistribution::Normal,
+        .seed = 42
+    };
+
+    auto run = [&](uint64_t seed) {
+        auto current = setting;
+        current.seed = seed;
+        Impairment impairment(current);
+        for (auto& slot : MakeSlots(*pool, 1000, 32, now)) {
+            impairment.Admit(std::move(slot));
+        }
+        auto stats = impairment.Stats();
+        REQUIRE(stats.received == 1000);
+        REQUIRE(stats.dropped > 250);
+        REQUIRE(stats.dropped < 350);
+        REQUIRE(stats.duplicated > 40);
+        REQUIRE(stats.reordered > 40);
+        auto delivered = Drain(impairment);
+        REQUIRE(delivered.size() == 1000 - stats.dropped + stats.duplicated);
+        return delivered;
+    };
+    auto first = run(42);
+    REQUIRE(run(42) == first);
+    REQUIRE(run(43) != first);
+
+    // Delays stay around the latency and are never negative
+    for (auto& [number, release] : first) {
+        REQUIRE(release >= now);
+        REQUIRE(release <= now + std::chrono::milliseconds(120));
+    }
+}
+
+TEST_CASE("Impairment holds datagrams until they are due", "[Impairment]") {
+    auto pool = std::make_shared<PacketBufferPool>(64);
+    auto now = std::chrono::steady_clock::now();
+    Impairment impairment({ .latency = std::chrono::milliseconds(50) });
+    REQUIRE(impairment.NextRelease() == std::chrono::steady_clock::time_point::max());
+
+    for (auto& slot : MakeSlots(*pool, 5, 32, now)) {
+        impairment.Admit(std::move(slot));
+    }
+    REQUIRE(impairment.NextRelease() == now + std::chrono::milliseconds(50));
+    std::vector<PacketSlot> slots(8);
+    REQUIRE(impairment.Release(slots, now + std::chrono::milliseconds(49)) == 0);
+    // Datagrams due at the same time keep their order
+    REQUIRE(impairment.Release(slots, now + std::chrono::milliseconds(50)) == 5);
+    for (uint32_t i = 0; i < 5; i++) {
+        REQUIRE(Number(slots[i]) == i);
+        REQUIRE(slots[i].timeReceived == now + std::chrono::milliseconds(50));
+    }
+
+    // Held back datagrams are overtaken by the ones that arrive after them
+    Impairment reordering({ .reorderRate = 0.5, .reorderDelay = std::chrono::milliseconds(10) });
+    auto spread = MakeSlots(*pool, 100, 32, now);
+    for (size_t i = 0; i < spread.size(); i++) {
+        spread[i].timeReceived = now + std::chrono::milliseconds(i);
+        reordering.Admit(std::move(spread[i]));
+    }
+    REQUIRE(reordering.Stats().reordered > 20);
+    auto delivered = Drain(reordering);
+    REQUIRE(delivered.size() == 100);
+    REQUIRE(!std::is_sorted(delivered.begin(), delivered.end()));
+    REQUIRE(std::is_sorted(delivered.begin(), delivered.end(), [](auto& a, auto& b) { return a.second < b.second; }));
+}
+
+TEST_CASE("Impairment limits the bandwidth of the link", "[Impairment]") {
+    auto pool = std::make_shared<PacketBufferPool>(128);
+    auto now = std::chrono::steady_clock::now();
+    // 100 byte datagrams take 100ms each at 1000 bytes per second
+    Impairment impairment({ .bandwidth = 1000, .maxQueueDelay = std::chrono::milliseconds(500) });
+    for (auto& slot : MakeSlots(*pool, 10, 100, now)) {
+        impairment.Admit(std::move(slot));
+    }
+    // Datagrams that would wait more than 500ms for the link are dropped
+    REQUIRE(impairment.Stats().dropped == 4);
+    auto delivered = Drain(impairment);
+    REQUIRE(delivered.size() == 6);
+    for (uint32_t i = 0; i < 6; i++) {
+        REQUIRE(delivered[i].first == i);
+        auto expected = now + std::chrono::milliseconds(100) * (i + 1);
+        REQUIRE(delivered[i].second - expected < std::chrono::microseconds(1));
+        REQUIRE(expected - delivered[i].second < std::chrono::microseconds(1));
+    }
+}
@@ -0,0 +1,77 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include "networking/metrics.hpp"
+
+TEST_CASE("Histogram sorts durations into power of two buckets", "[Histogram]") {
+    Histogram histogram;
+    auto empty = histogram.Read();
+    REQUIRE(empty.count == 0);
+    REQUIRE(empty.Mean() == std::chrono::microseconds(0));
+    REQUIRE(empty.Percentile(0.99) == std::chrono::microseconds(0));
+
+    histogram.Record(std::chrono::nanoseconds(500));
+    histogram.Record(std::chrono::microseconds(1));
+    histogram.Record(std::chrono::microseconds(3));
+    histogram.Record(std::chrono::microseconds(100));
+    // Negative durations count as 0, durations beyond the last bucket land in it
+    histogram.Record(std::chrono::microseconds(-5));
+    histogram.Record(std::chrono::hours(2));
+
+    auto snapshot = histogram.Read();
+    REQUIRE(snapshot.count == 6);
+    REQUIRE(snapshot.buckets[0] == 2);
+    REQUIRE(snapshot.buckets[1] == 1);
+    REQUIRE(snapshot.buckets[2] == 1);
+    REQUIRE(snapshot.buckets[7] == 1);
+    REQUIRE(snapshot.buckets[Histogram::NUM_BUCKETS - 1] == 1);
+    REQUIRE(snapshot.max == std::chrono::hours(2));
+    REQUIRE(snapshot.sum == std::chrono::hours(2) + std::chrono::microseconds(104));
+}
+
+TEST_CASE("Histogram percentiles are bucket upper bounds", "[Histogram]") {
+    Histogram histogram;
+    for (int i = 0; i < 90; i++) {
+        histogram.Record(std::chrono::microseconds(10));
+    }
+    for (int i = 0; i < 10; i++) {
+        histogram.Record(std::chrono::microseconds(1000));
+    }
+    auto snapshot = histogram.Read();
+    REQUIRE(snapshot.Percentile(0) == std::chrono::microseconds(16));
+    REQUIRE(snapshot.Percentile(0.5) == std::chrono::microseconds(16));
+    REQUIRE(snapshot.Percentile(0.9) == std::chrono::microseconds(16));
+    // The last bucket is capped by the longest duration
+    REQUIRE(snapshot.Percentile(0.99) == std::chrono::microseconds(1000));
+    REQUIRE(snapshot.Percentile(1) == std::chrono::microseconds(1000));
+    REQUIRE(snapshot.Mean() == std::chrono::microseconds(109));
+
+    Histogram other;
+    other.Record(std::chrono::microseconds(5000));
+    auto merged = snapshot;
+    merged += other.Read();
+    REQUIRE(merged.count == 101);
+    REQUIRE(merged.max == std::chrono::microseconds(5000));
+    REQUIRE(merged.Percentile(1) == std::chrono::microseconds(5000));
+}
+
+TEST_CASE("Histogram records from several threads", "[Histogram]") {
+    Histogram histogram;
+    constexpr int THREADS = 4;
+    constexpr int COUNT = 10000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < COUNT; i++) {
+                histogram.Record(std::chrono::microseconds(t + 1));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    auto snapshot = histogram.Read();
+    REQUIRE(snapshot.count == THREADS * COUNT);
+    REQUIRE(snapshot.sum == std::chrono::microseconds(COUNT * (1 + 2 + 3 + 4)));
+    REQUIRE(snapshot.max == std::chrono::microseconds(THREADS));
+}
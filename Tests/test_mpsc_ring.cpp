@@ -0,0 +1,67 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <memory>
+#include "networking/mpsc_ring.hpp"
+
+TEST_CASE("MpscRing holds at most its capacity", "[MpscRing]") {
+    MpscRing<int> ring(3);
+    // Rounded up to a power of two
+    REQUIRE(ring.Capacity() == 4);
+    REQUIRE(!ring.TryPop().has_value());
+
+    for (int i = 0; i < 4; i++) {
+        REQUIRE(ring.TryPush(int(i)));
+    }
+    REQUIRE(!ring.TryPush(4));
+    REQUIRE(ring.TryPop() == 0);
+    REQUIRE(ring.TryPush(4));
+    for (int i = 1; i <= 4; i++) {
+        REQUIRE(ring.TryPop() == i);
+    }
+    REQUIRE(!ring.TryPop().has_value());
+}
+
+TEST_CASE("MpscRing releases popped items", "[MpscRing]") {
+    MpscRing<std::shared_ptr<int>> ring(2);
+    auto item = std::make_shared<int>(1);
+    REQUIRE(ring.TryPush(std::shared_ptr<int>(item)));
+    REQUIRE(item.use_count() == 2);
+    ring.TryPop();
+    REQUIRE(item.use_count() == 1);
+}
+
+TEST_CASE("MpscRing keeps the order of every producer", "[MpscRing]") {
+    constexpr uint32_t numProducers = 4;
+    constexpr uint32_t count = 50000;
+    MpscRing<uint64_t> ring(64);
+
+    std::vector<std::thread> producers;
+    for (uint32_t producer = 0; producer < numProducers; producer++) {
+        producers.emplace_back([&ring, producer]() {
+            for (uint32_t i = 0; i < count;) {
+                if (ring.TryPush((uint64_t(producer) << 32) | i)) i++;
+                else std::this_thread::yield();
+            }
+        });
+    }
+
+    std::vector<uint32_t> next(numProducers, 0);
+    bool inOrder = true;
+    for (uint32_t received = 0; received < numProducers * count;) {
+        auto value = ring.TryPop();
+        if (!value) continue;
+        auto producer = static_cast<uint32_t>(value.value() >> 32);
+        inOrder = inOrder && static_cast<uint32_t>(value.value()) == next[producer]++;
+        received++;
+    }
+    for (auto& producer : producers) {
+        producer.join();
+    }
+
+    REQUIRE(inOrder);
+    REQUIRE(!ring.TryPop().has_value());
+    for (auto received : next) {
+        REQUIRE(received == count);
+    }
+}
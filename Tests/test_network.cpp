@@ -1,7 +1,8 @@
 #include <catch2/catch_session.hpp>
 #include "networking/networking.hpp"
 
-void main(int argc, char* argv[]) {
+int main(int argc, char* argv[]) {
     Networking::init();
     int result = Catch::Session().run(argc, argv);
+    return result;
 }
\ No newline at end of file
@@ -0,0 +1,64 @@
+#include <catch2/catch_test_macros.hpp>
+#include <cstring>
+#include "networking/packet_buffer.hpp"
+
+TEST_CASE("PacketBufferPool recycles released buffers", "[PacketBuffer]") {
+    auto pool = std::make_shared<PacketBufferPool>(128);
+    char* first;
+    {
+        auto buffer = pool->Acquire();
+        REQUIRE(buffer);
+        REQUIRE(buffer.Capacity() == 128);
+        REQUIRE(buffer.UseCount() == 1);
+        first = buffer.Data();
+
+        // Copies share the memory, the buffer is returned once the last copy is gone
+        auto copy = buffer;
+        REQUIRE(copy.Data() == first);
+        REQUIRE(buffer.UseCount() == 2);
+        buffer = {};
+        REQUIRE(copy.UseCount() == 1);
+        REQUIRE(pool->IdleCount() == 0);
+    }
+    REQUIRE(pool->IdleCount() == 1);
+
+    auto reused = pool->Acquire();
+    REQUIRE(reused.Data() == first);
+    REQUIRE(pool->IdleCount() == 0);
+
+    // Oversized requests bypass the pool
+    {
+        auto large = pool->Acquire(1024);
+        REQUIRE(large.Capacity() == 1024);
+    }
+    REQUIRE(pool->IdleCount() == 0);
+
+    // A buffer may outlive its pool
+    pool.reset();
+    REQUIRE(reused.Capacity() == 128);
+}
+
+TEST_CASE("PacketView shrinks and grows within its buffer without copying", "[PacketBuffer]") {
+    auto pool = std::make_shared<PacketBufferPool>(64);
+    auto buffer = pool->Acquire();
+    std::memcpy(buffer.Data(), "headerpayload", 13);
+
+    PacketView view(buffer, 6, 7);
+    REQUIRE(std::string(view.begin(), view.end()) == "payload");
+    REQUIRE(view.data() == buffer.Data() + 6);
+
+    REQUIRE(view.ExpandFront(6));
+    REQUIRE(std::string(view.begin(), view.end()) == "headerpayload");
+    REQUIRE(!view.ExpandFront(1));
+
+    view.RemovePrefix(9);
+    REQUIRE(std::string(view.begin(), view.end()) == "load");
+    REQUIRE(view.Buffer().UseCount() == 2);
+
+    // Slices share the buffer and keep it alive after the view is gone
+    auto slice = view.Slice(1, 2);
+    REQUIRE(std::string(slice.begin(), slice.end()) == "oa");
+    REQUIRE(slice.data() == buffer.Data() + 10);
+    view = {};
+    REQUIRE(slice.Buffer().UseCount() == 2);
+}
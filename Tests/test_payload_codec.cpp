@@ -0,0 +1,82 @@
+#include <catch2/catch_test_macros.hpp>
+#include <string>
+#include <vector>
+#include "networking/payload_codec.hpp"
+
+static std::vector<char> RoundTrip(const PayloadCodec& codec, std::span<const char> input, size_t& compressedSize) {
+    std::vector<char> compressed(PayloadCodec::Bound(input.size()));
+    compressedSize = codec.Compress(input, compressed);
+    if (compressedSize == 0) return {};
+    std::vector<char> output(input.size());
+    REQUIRE(codec.Decompress(std::span(compressed.data(), compressedSize), output));
+    return output;
+}
+
+TEST_CASE("PayloadCodec compresses repetitive data losslessly", "[PayloadCodec]") {
+    PayloadCodec codec;
+    std::string snapshot;
+    for (int i = 0; i < 40; i++) {
+        snapshot += "player=" + std::to_string(i % 4) + ";x=12.5;y=0;z=-3.25;hp=100|";
+    }
+    size_t size;
+    auto output = RoundTrip(codec, snapshot, size);
+    REQUIRE(std::string(output.begin(), output.end()) == snapshot);
+    REQUIRE(size < snapshot.size() / 4);
+
+    // Long runs need extended lengths for both literals and matches
+    std::string runs(300, 'a');
+    for (int i = 0; i < 300; i++) runs.push_back(static_cast<char>(i * 131 + i / 3));
+    runs += std::string(1000, 'b');
+    output = RoundTrip(codec, runs, size);
+    REQUIRE(std::string(output.begin(), output.end()) == runs);
+
+    // Data that does not shrink is left to the caller
+    std::vector<char> noise(256);
+    uint32_t state = 1;
+    for (auto& byte : noise) {
+        state = state * 1664525 + 1013904223;
+        byte = static_cast<char>(state >> 24);
+    }
+    std::vector<char> compressed(PayloadCodec::Bound(noise.size()));
+    REQUIRE(codec.Compress(noise, compressed) == 0);
+}
+
+TEST_CASE("PayloadCodec references the preset dictionary", "[PayloadCodec]") {
+    const std::string message = "{\"type\":\"spawn\",\"fruit\":\"apple\",\"position\":[1.5,2.0,3.5]}";
+    const std::string sample = "{\"type\":\"spawn\",\"fruit\":\"banana\",\"position\":[0.0,0.0,0.0]}";
+    PayloadCodec plain;
+    PayloadCodec trained(sample);
+
+    // A short message does not repeat itself, but shares most of its bytes with the dictionary
+    std::vector<char> compressed(PayloadCodec::Bound(message.size()));
+    REQUIRE(plain.Compress(message, compressed) == 0);
+    size_t size;
+    auto output = RoundTrip(trained, message, size);
+    REQUIRE(std::string(output.begin(), output.end()) == message);
+    REQUIRE(size < message.size() / 2);
+
+    REQUIRE(trained.DictionaryID() != plain.DictionaryID());
+    REQUIRE(PayloadCodec(sample).DictionaryID() == trained.DictionaryID());
+}
+
+TEST_CASE("PayloadCodec rejects malformed blocks", "[PayloadCodec]") {
+    PayloadCodec codec;
+    std::string input(200, 'x');
+    std::vector<char> compressed(PayloadCodec::Bound(input.size()));
+    size_t size = codec.Compress(input, compressed);
+    REQUIRE(size != 0);
+    compressed.resize(size);
+
+    std::vector<char> output(input.size());
+    REQUIRE(codec.Decompress(compressed, output));
+    // The original size must match exactly
+    std::vector<char> shorter(input.size() - 1);
+    REQUIRE(!codec.Decompress(compressed, shorter));
+    std::vector<char> longer(input.size() + 1);
+    REQUIRE(!codec.Decompress(compressed, longer));
+    // Truncated blocks and offsets before the start of the data fail instead of reading out of bounds
+    REQUIRE(!codec.Decompress(std::span(compressed.data(), 2), output));
+    const char badOffset[] = { 0x10, 'x', 0x05, 0x00 };
+    std::vector<char> small(5);
+    REQUIRE(!codec.Decompress(badOffset, small));
+}
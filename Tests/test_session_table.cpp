@@ -0,0 +1,53 @@
+#include <catch2/catch_test_macros.hpp>
+#include <random>
+#include <unordered_map>
+#include "networking/session_table.hpp"
+
+TEST_CASE("SessionTable assign, find and erase", "[SessionTable]") {
+    SessionTable table(4);
+    REQUIRE(table.Find(SessionTable::EMPTY) == SessionTable::NO_SLOT);
+    REQUIRE(table.Find(42) == SessionTable::NO_SLOT);
+
+    table.Assign(42, 0);
+    table.Assign(7, 1);
+    REQUIRE(table.Find(42) == 0);
+    REQUIRE(table.Find(7) == 1);
+    REQUIRE(table.Size() == 2);
+
+    // Reassigning an id moves it to the new slot
+    table.Assign(42, 3);
+    REQUIRE(table.Find(42) == 3);
+    REQUIRE(table.Size() == 2);
+
+    REQUIRE(table.Erase(42));
+    REQUIRE(!table.Erase(42));
+    REQUIRE(!table.Contains(42));
+    REQUIRE(table.Find(7) == 1);
+    REQUIRE(table.Size() == 1);
+}
+
+TEST_CASE("SessionTable stays consistent under random churn", "[SessionTable]") {
+    // Start small so the table has to grow, and the probe runs wrap around the end of the buckets
+    SessionTable table(2);
+    std::unordered_map<uint32_t, uint32_t> reference;
+    std::mt19937 generator(1234);
+    // A narrow id range makes collisions and long probe runs common
+    std::uniform_int_distribution<uint32_t> ids(1, 300);
+
+    for (uint32_t step = 0; step < 20000; step++) {
+        uint32_t id = ids(generator);
+        if (generator() % 3 == 0) {
+            REQUIRE(table.Erase(id) == (reference.erase(id) == 1));
+        }
+        else {
+            table.Assign(id, step);
+            reference[id] = step;
+        }
+        REQUIRE(table.Size() == reference.size());
+    }
+
+    for (uint32_t id = 1; id <= 300; id++) {
+        auto entry = reference.find(id);
+        REQUIRE(table.Find(id) == (entry == reference.end() ? SessionTable::NO_SLOT : entry->second));
+    }
+}
@@ -0,0 +1,73 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <array>
+#include "networking/spsc_ring.hpp"
+
+TEST_CASE("SpscRing holds at most its capacity", "[SpscRing]") {
+    SpscRing<int> ring(3);
+    REQUIRE(ring.Capacity() == 3);
+    REQUIRE(ring.Empty());
+    REQUIRE(!ring.TryPop().has_value());
+
+    REQUIRE(ring.TryPush(1));
+    REQUIRE(ring.TryEmplace(2));
+    REQUIRE(ring.TryPush(3));
+    // The capacity is exact even though the slots are rounded up to a power of two
+    REQUIRE(!ring.TryPush(4));
+    REQUIRE(ring.Size() == 3);
+
+    REQUIRE(ring.TryPop() == 1);
+    REQUIRE(ring.TryPush(4));
+
+    std::array<int, 8> output = {};
+    REQUIRE(ring.PopBatch(std::span(output.data(), 2)) == 2);
+    REQUIRE(output[0] == 2);
+    REQUIRE(output[1] == 3);
+    REQUIRE(ring.PopBatch(output) == 1);
+    REQUIRE(output[0] == 4);
+    REQUIRE(ring.PopBatch(output) == 0);
+    REQUIRE(ring.Empty());
+}
+
+TEST_CASE("SpscRing releases popped items", "[SpscRing]") {
+    SpscRing<std::shared_ptr<int>> ring(2);
+    auto item = std::make_shared<int>(1);
+    REQUIRE(ring.TryPush(std::shared_ptr<int>(item)));
+    REQUIRE(item.use_count() == 2);
+    ring.TryPop();
+    REQUIRE(item.use_count() == 1);
+}
+
+TEST_CASE("SpscRing passes items between threads in order", "[SpscRing]") {
+    constexpr uint32_t count = 100000;
+    SpscRing<uint32_t> ring(64);
+
+    std::thread producer([&]() {
+        for (uint32_t i = 0; i < count;) {
+            if (ring.TryPush(uint32_t(i))) i++;
+            else std::this_thread::yield();
+        }
+    });
+
+    std::vector<uint32_t> received;
+    std::array<uint32_t, 16> batch;
+    while (received.size() < count) {
+        // Alternate between single and batched pops
+        if (received.size() % 2 == 0) {
+            if (auto value = ring.TryPop()) received.push_back(value.value());
+        }
+        else {
+            auto numPopped = ring.PopBatch(batch);
+            received.insert(received.end(), batch.begin(), batch.begin() + numPopped);
+        }
+    }
+    producer.join();
+
+    REQUIRE(ring.Empty());
+    bool inOrder = true;
+    for (uint32_t i = 0; i < count; i++) {
+        inOrder = inOrder && received[i] == i;
+    }
+    REQUIRE(inOrder);
+}
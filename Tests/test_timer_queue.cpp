@@ -0,0 +1,34 @@
+#include <catch2/catch_test_macros.hpp>
+#include "networking/timer_queue.hpp"
+
+TEST_CASE("TimerQueue pops due timers in deadline order", "[TimerQueue]") {
+    TimerQueue timers;
+    auto start = std::chrono::steady_clock::now();
+    REQUIRE(timers.NextDeadline() == std::chrono::steady_clock::time_point::max());
+
+    REQUIRE(timers.Schedule({ start + std::chrono::milliseconds(30), {}, TimerKind::Resend, 3 }));
+    REQUIRE(!timers.Schedule({ start + std::chrono::milliseconds(50), {}, TimerKind::Timeout, 5 }));
+    // An earlier deadline is reported so the routing thread can be woken
+    REQUIRE(timers.Schedule({ start + std::chrono::milliseconds(10), {}, TimerKind::Heartbeat, 1 }));
+    REQUIRE(!timers.Schedule({ start + std::chrono::milliseconds(20), {}, TimerKind::AckExpire, 2 }));
+    REQUIRE(timers.Size() == 4);
+    REQUIRE(timers.NextDeadline() == start + std::chrono::milliseconds(10));
+
+    std::vector<TimerEvent> expired;
+    timers.PopExpired(start, expired);
+    REQUIRE(expired.empty());
+
+    timers.PopExpired(start + std::chrono::milliseconds(30), expired);
+    REQUIRE(expired.size() == 3);
+    REQUIRE(expired[0].kind == TimerKind::Heartbeat);
+    REQUIRE(expired[1].id == 2);
+    REQUIRE(expired[2].id == 3);
+    REQUIRE(timers.Size() == 1);
+    REQUIRE(timers.NextDeadline() == start + std::chrono::milliseconds(50));
+
+    expired.clear();
+    timers.PopExpired(start + std::chrono::seconds(1), expired);
+    REQUIRE(expired.size() == 1);
+    REQUIRE(expired[0].kind == TimerKind::Timeout);
+    REQUIRE(timers.NextDeadline() == std::chrono::steady_clock::time_point::max());
+}
@@ -1,5 +1,10 @@
 #include <catch2/catch_test_macros.hpp>
+#include <algorithm>
+#include <thread>
+#include <filesystem>
 #include "networking/lite_conn.hpp"
+#include "networking/replay.hpp"
+#include "infrastructure/coroutine.hpp"
 
 TEST_CASE("UDPConnection 3-way handshake succeeds and closure", "[UDPConnection]") {
     LiteConnManager host1(30000, 2, 10, 1500, std::chrono::milliseconds(10));
@@ -114,8 +119,12 @@ TEST_CASE("UDPConnection 3-way handshake client retry connection", "[UDPConnecti
     }
 }
 
-TEST_CASE("UDPConnection 3-way handshake server retry connection", "[UDPConnection]") {
-    LiteConnManager serverHost(30000, 2, 10, 1500, std::chrono::milliseconds(10));
+TEST_CASE("UDPConnection 3-way handshake server keeps no state before the cookie returns", "[UDPConnection]") {
+    // Cookies change when the clock crosses into the next lifetime, a lifetime longer than the clock ever ran keeps them stable
+    LiteConnSetting setting = {
+        .cookieLifetime = std::chrono::hours(24 * 365 * 100)
+    };
+    LiteConnManager serverHost(30000, 2, 10, 1500, std::chrono::milliseconds(10), setting);
     REQUIRE(serverHost.Good());
     serverHost.isListening = true;
 
@@ -130,71 +139,153 @@ TEST_CASE("UDPConnection 3-way handshake server retry connection", "[UDPConnecti
     serverAddr.sin_family = AF_INET;
     serverAddr.sin_port = htons(30000);
 
-    sockaddr_in clientAddr = {};
-    clientAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-    clientAddr.sin_family = AF_INET;
-    clientAddr.sin_port = htons(40000);
     UDPSocket client (40000, 1500);
 
     // Client initialize connection
-    {
-        LiteConnHeader header = {
-            .sessionID = 0,
-            .flag = LiteConnHeaderFlag::SYN,
-            .id32 = 5,
-        };
-        
-        client.SendPacket(LiteConnHeader::Serialize(header), serverAddr);
-    }
+    LiteConnHeader syn = {
+        .sessionID = 0,
+        .flag = LiteConnHeaderFlag::SYN,
+        .id32 = 5,
+        .id64 = LiteConnFeature::ALL
+    };
+    client.SendPacket(LiteConnHeader::Serialize(syn), serverAddr);
 
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-    auto server = serverHost.Accept(timeout);
-    REQUIRE(server);
-    REQUIRE(serverHost.Count() == 1);
-    
-    // Verify server ack
+    // The server answers without accepting or allocating a connection
+    LiteConnHeader synAck = syn;
     {
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
         auto pkt = client.Read();
         REQUIRE(pkt.has_value());
         auto optHeader = LiteConnHeader::Deserialize(pkt.value().payload);
         REQUIRE(optHeader.has_value());
-        LiteConnHeader& header = optHeader.value();
-        REQUIRE(header.flag == (LiteConnHeaderFlag::SYN | LiteConnHeaderFlag::ACK));
-        REQUIRE(header.sessionID == 5);
-
-        // Currently no more packets should be present in the queue
-        REQUIRE(!client.Read().has_value());
+        synAck = optHeader.value();
+        REQUIRE(synAck.flag == (LiteConnHeaderFlag::SYN | LiteConnHeaderFlag::ACK));
+        REQUIRE(synAck.sessionID == 5);
+        REQUIRE(synAck.id32 != 0);
+        REQUIRE(serverHost.Count() == 0);
+        REQUIRE(!serverHost.Accept(timeout, std::chrono::milliseconds(0)));
 
-        // Verify server retransmission, 2 packets should be received
+        // Nothing is retransmitted since nothing is remembered, a retried SYN gets the same cookie
         std::this_thread::sleep_for(std::chrono::milliseconds(300));
-
-        // Case 1 client ACK is lost so server request for retransmission
+        REQUIRE(!client.Read().has_value());
+        client.SendPacket(LiteConnHeader::Serialize(syn), serverAddr);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
         pkt = client.Read();
         REQUIRE(pkt.has_value());
         auto optHeader2 = LiteConnHeader::Deserialize(pkt.value().payload);
         REQUIRE(optHeader2.has_value());
-        LiteConnHeader& header2 = optHeader2.value();
-        REQUIRE(header2.flag == LiteConnHeaderFlag::SYN);
-        REQUIRE(header2.sessionID == header.id32);
+        REQUIRE(optHeader2.value() == synAck);
+    }
 
-        // Case 2 server ACK is lost so server retransmits sessionID
-        pkt = client.Read();
-        REQUIRE(pkt.has_value());
-        auto optHeader3 = LiteConnHeader::Deserialize(pkt.value().payload);
-        REQUIRE(optHeader3.has_value());
-        LiteConnHeader& header3 = optHeader3.value();
-        REQUIRE(header3 == header);
+    // ACKs that do not return the cookie issued for the SYN are ignored
+    {
+        LiteConnHeader forged = {
+            .sessionID = synAck.id32 + 1,
+            .flag = LiteConnHeaderFlag::ACK,
+            .id32 = 5,
+            .id64 = synAck.id64
+        };
+        client.SendPacket(LiteConnHeader::Serialize(forged), serverAddr);
+        forged.sessionID = synAck.id32;
+        forged.id32 = 6;
+        client.SendPacket(LiteConnHeader::Serialize(forged), serverAddr);
+        REQUIRE(!serverHost.Accept(timeout, std::chrono::milliseconds(100)));
     }
 
+    // The ACK with the cookie completes the handshake, repeating it does not accept the client twice
+    LiteConnHeader ack = {
+        .sessionID = synAck.id32,
+        .flag = LiteConnHeaderFlag::ACK,
+        .id32 = 5,
+        .id64 = synAck.id64
+    };
+    client.SendPacket(LiteConnHeader::Serialize(ack), serverAddr);
+    client.SendPacket(LiteConnHeader::Serialize(ack), serverAddr);
+    auto server = serverHost.Accept(timeout, std::chrono::milliseconds(100));
+    REQUIRE(server);
+    REQUIRE(server->IsConnected());
+    REQUIRE(serverHost.Count() == 1);
+    client.SendPacket(LiteConnHeader::Serialize(ack), serverAddr);
+    REQUIRE(!serverHost.Accept(timeout, std::chrono::milliseconds(100)));
+
     // Verify the connection has timed out
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
         REQUIRE(server->IsDisconnected());
         REQUIRE(serverHost.Count() == 0);
     }
 }
 
+TEST_CASE("UDPConnection limits handshakes per source and bounds the accept backlog", "[UDPConnection]") {
+    LiteConnSetting setting = {
+        .handshakeRate = 0,
+        .handshakeBurst = 8,
+        .acceptBacklog = 2
+    };
+    LiteConnManager serverHost(30000, 8, 10, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(serverHost.Good());
+    serverHost.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(1000),
+        .connectionRetryInterval = std::chrono::milliseconds(300),
+        .impRetryInterval = std::chrono::milliseconds(250)
+    };
+
+    sockaddr_in serverAddr = {};
+    serverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(30000);
+
+    UDPSocket client(40000, 1500);
+
+    // A flood of SYNs is answered up to the burst of the source
+    for (uint32_t checksum = 1; checksum <= 6; checksum++) {
+        LiteConnHeader syn = {
+            .sessionID = 0,
+            .flag = LiteConnHeaderFlag::SYN,
+            .id32 = checksum
+        };
+        client.SendPacket(LiteConnHeader::Serialize(syn), serverAddr);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::vector<LiteConnHeader> synAcks;
+    while (auto pkt = client.Read()) {
+        auto header = LiteConnHeader::Deserialize(pkt.value().payload);
+        REQUIRE(header.has_value());
+        synAcks.push_back(header.value());
+    }
+    REQUIRE(synAcks.size() == 6);
+
+    // Completed handshakes beyond the backlog are dropped, and the burst runs out after two more
+    for (auto& synAck : synAcks) {
+        LiteConnHeader ack = {
+            .sessionID = synAck.id32,
+            .flag = LiteConnHeaderFlag::ACK,
+            .id32 = synAck.sessionID,
+            .id64 = synAck.id64
+        };
+        client.SendPacket(LiteConnHeader::Serialize(ack), serverAddr);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto first = serverHost.Accept(timeout, std::chrono::milliseconds(100));
+    auto second = serverHost.Accept(timeout, std::chrono::milliseconds(100));
+    REQUIRE(first);
+    REQUIRE(second);
+    REQUIRE(!serverHost.Accept(timeout, std::chrono::milliseconds(100)));
+    REQUIRE(serverHost.Count() == 2);
+
+    // The source has no tokens left, its SYNs are no longer answered
+    LiteConnHeader syn = {
+        .sessionID = 0,
+        .flag = LiteConnHeaderFlag::SYN,
+        .id32 = 7
+    };
+    client.SendPacket(LiteConnHeader::Serialize(syn), serverAddr);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(!client.Read().has_value());
+}
+
 TEST_CASE("UDPConnection 3-way handshake client retransmit acknoledgement", "[UDPConnection]") {
     LiteConnManager clientHost(30000, 2, 10, 1500, std::chrono::milliseconds(10));
     REQUIRE(clientHost.Good());
@@ -551,6 +642,8 @@ TEST_CASE("UDPConnection send request data packets", "[UDPConnection]") {
     std::string sm1 = "S: Yes, what about you?";
     std::string cm2 = "C: No! I do not love you";
     std::string sm2 = "S: NOOOO! Please love me!!!!";
+    // The routing thread wakes as soon as a datagram arrives, so the rejection is held back until the server has checked its handle
+    std::atomic<bool> rejectAllowed = false;
 
     std::thread cThread([&]() {
             // Send first message
@@ -591,6 +684,7 @@ TEST_CASE("UDPConnection send request data packets", "[UDPConnection]") {
             // Close request
             auto& crpHandle2 = reply2.requestHandle.value();
             REQUIRE(crpHandle2.IsValid());
+            while (!rejectAllowed) std::this_thread::yield();
             crpHandle2.Reject();
             REQUIRE(!crpHandle2.IsValid());
         });
@@ -633,6 +727,7 @@ TEST_CASE("UDPConnection send request data packets", "[UDPConnection]") {
         auto& sr2Handle = sr2HandleOpt.value();
         // Verify the handle is not closed immediately, but after peer has sent back rejection
         REQUIRE(!sr2Handle.WaitForResponse(std::chrono::seconds()));
+        rejectAllowed = true;
         REQUIRE(sr2Handle.WaitForResponse(std::chrono::milliseconds(1000)));
         REQUIRE(!sr2Handle.GetResponse().has_value());
     });
@@ -648,7 +743,8 @@ TEST_CASE("UDPConnection send request data packets", "[UDPConnection]") {
 }
 
 TEST_CASE("UDPConnection send IMP data packets with respect to queue capacity constraint", "[UDPConnection]") {
-    LiteConnManager host1(30000, 2, 2, 1500, std::chrono::milliseconds(10));
+    // Without FLOW the sender learns about the full queue only from the missing acknowledgement
+    LiteConnManager host1(30000, 2, 2, 1500, std::chrono::milliseconds(10), LiteConnSetting{ .features = LiteConnFeature::ALL & ~LiteConnFeature::FLOW });
     REQUIRE(host1.Good());
 
     LiteConnManager host2(40000, 2, 1, 1500, std::chrono::milliseconds(10));
@@ -772,4 +868,2073 @@ TEST_CASE("UDPConnection send IMP data packets with respect to queue capacity co
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
     REQUIRE(s1->IsDisconnected());
     REQUIRE(host2.Count() == 0);
-}
\ No newline at end of file
+}
+TEST_CASE("UDPConnection sharded manager serves clients on every worker", "[UDPConnection]") {
+    LiteConnSetting setting = { .numWorkers = 4 };
+    LiteConnManager serverHost(40000, 8, 10, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(serverHost.Good());
+    serverHost.isListening = true;
+#ifdef SO_REUSEPORT
+    REQUIRE(serverHost.NumWorkers() == 4);
+#else
+    REQUIRE(serverHost.NumWorkers() == 1);
+#endif
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(1000),
+        .connectionRetryInterval = std::chrono::milliseconds(300),
+        .impRetryInterval = std::chrono::milliseconds(100),
+        .replyKeepDuration = std::chrono::seconds(1)
+    };
+
+    sockaddr_in serverAddr = {};
+    serverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(40000);
+
+    // A sharded client receives replies on whichever of its sockets the kernel picks, exercising packet forwarding
+    LiteConnManager shardedClientHost(10, 4, 1500, std::chrono::milliseconds(10), { .numWorkers = 2 });
+    std::vector<std::unique_ptr<LiteConnManager>> clientHosts;
+    std::vector<std::shared_ptr<LiteConnConnection>> clients;
+    std::vector<std::shared_ptr<LiteConnConnection>> servers;
+    for (int i = 0; i < 6; i++) {
+        LiteConnManager* host = &shardedClientHost;
+        if (i >= 2) {
+            clientHosts.emplace_back(std::make_unique<LiteConnManager>(10, 2, 1500, std::chrono::milliseconds(10)));
+            host = clientHosts.back().get();
+        }
+        auto client = host->ConnectPeer(serverAddr, timeout);
+        REQUIRE(client);
+        auto server = serverHost.Accept(timeout, std::chrono::seconds(1));
+        REQUIRE(server);
+        REQUIRE(client->WaitForConnectionComplete(std::chrono::seconds(1)));
+        REQUIRE(server->WaitForConnectionComplete(std::chrono::seconds(1)));
+        clients.push_back(client);
+        servers.push_back(server);
+    }
+    REQUIRE(serverHost.Count() == 6);
+    REQUIRE(shardedClientHost.Count() == 2);
+
+    // Each accepted connection must be talking to the client that created it
+    for (int i = 0; i < 6; i++) {
+        const std::string msg = "Client " + std::to_string(i);
+        clients[i]->SendReliableData(msg);
+    }
+    for (auto& server : servers) {
+        REQUIRE(server->WaitForDataPacket(std::chrono::seconds(1)));
+    }
+    for (int i = 0; i < 6; i++) {
+        auto received = servers[i]->Receive();
+        REQUIRE(received);
+        REQUIRE(std::string(received->data.begin(), received->data.end()) == "Client " + std::to_string(i));
+
+        const std::string reply = "Server " + std::to_string(i);
+        servers[i]->SendReliableData(reply);
+        REQUIRE(clients[i]->WaitForDataPacket(std::chrono::seconds(1)));
+        auto response = clients[i]->Receive();
+        REQUIRE(response);
+        REQUIRE(std::string(response->data.begin(), response->data.end()) == reply);
+    }
+
+    // Heartbeats keep every connection alive past the connection timeout
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    for (int i = 0; i < 6; i++) {
+        REQUIRE(clients[i]->IsConnected());
+        REQUIRE(servers[i]->IsConnected());
+    }
+
+    for (auto& client : clients) {
+        client->Disconnect();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(serverHost.Count() == 0);
+}
+
+TEST_CASE("UDPConnection coalesces selective acknowledgements", "[UDPConnection]") {
+    LiteConnManager serverHost(30000, 2, 64, 1500, std::chrono::milliseconds(10));
+    REQUIRE(serverHost.Good());
+    serverHost.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(1000),
+        .connectionRetryInterval = std::chrono::milliseconds(500),
+        .impRetryInterval = std::chrono::milliseconds(250),
+        .replyKeepDuration = std::chrono::seconds(1)
+    };
+
+    sockaddr_in serverAddr = {};
+    serverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(30000);
+    UDPSocket client(40000, 1500);
+
+    // Client offers selective acknowledgement in its syn packet
+    {
+        LiteConnHeader header = {
+            .sessionID = 0,
+            .flag = LiteConnHeaderFlag::SYN,
+            .id32 = 5,
+            .id64 = LiteConnFeature::SACK
+        };
+        client.SendPacket(LiteConnHeader::Serialize(header), serverAddr);
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::shared_ptr<LiteConnConnection> server;
+    uint32_t sessionID;
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        auto pkt = client.Read();
+        REQUIRE(pkt.has_value());
+        auto optHeader = LiteConnHeader::Deserialize(pkt.value().payload);
+        REQUIRE(optHeader.has_value());
+        LiteConnHeader& header = optHeader.value();
+        REQUIRE(header.flag == (LiteConnHeaderFlag::SYN | LiteConnHeaderFlag::ACK));
+        REQUIRE(header.id64 == LiteConnFeature::SACK);
+        sessionID = header.id32;
+
+        // The ACK returns the cookie with the checksum and the features it was issued for
+        LiteConnHeader ackHeader = {
+            .sessionID = sessionID,
+            .flag = LiteConnHeaderFlag::ACK,
+            .id32 = 5,
+            .id64 = header.id64
+        };
+        client.SendPacket(LiteConnHeader::Serialize(ackHeader), serverAddr);
+        server = serverHost.Accept(timeout, std::chrono::seconds(1));
+        REQUIRE(server);
+        REQUIRE(server->Features() == LiteConnFeature::SACK);
+        REQUIRE(server->IsConnected());
+    }
+
+    // A burst of reliable packets, including a gap and ids far enough apart to need a second bitmap
+    std::vector<uint32_t> ids;
+    for (uint32_t id = 0; id < 40; id++) {
+        if (id != 17) ids.push_back(id);
+    }
+    ids.push_back(200);
+    for (auto id : ids) {
+        LiteConnHeader header = {
+            .sessionID = sessionID,
+            .index = id + 1,
+            .flag = LiteConnHeaderFlag::IMP | LiteConnHeaderFlag::DATA,
+            .id32 = id
+        };
+        client.SendPacket(LiteConnHeader::Serialize(header), serverAddr);
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::vector<uint32_t> acked;
+    size_t ackPackets = 0;
+    while (auto pkt = client.Read()) {
+        auto optHeader = LiteConnHeader::Deserialize(pkt.value().payload);
+        REQUIRE(optHeader.has_value());
+        LiteConnHeader& header = optHeader.value();
+        if (header.flag != LiteConnHeaderFlag::ACK) continue;
+        ackPackets++;
+        acked.push_back(header.id32);
+        for (uint32_t bit = 0; bit < 64; bit++) {
+            if (header.id64 & (uint64_t(1) << bit)) acked.push_back(header.id32 - (bit + 1));
+        }
+    }
+    std::sort(acked.begin(), acked.end());
+    REQUIRE(acked == ids);
+    // The ids arrive together so they are acknowledged by a handful of packets instead of one each
+    REQUIRE(ackPackets < ids.size() / 4);
+
+    size_t received = 0;
+    while (server->Receive()) received++;
+    REQUIRE(received == ids.size());
+}
+
+TEST_CASE("UDPConnection selective acknowledgement negotiation", "[UDPConnection]") {
+    LiteConnManager host1(30000, 2, 100, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 100, 1500, std::chrono::milliseconds(10), LiteConnSetting{ .features = 0 });
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(1000),
+        .connectionRetryInterval = std::chrono::milliseconds(500),
+        .impRetryInterval = std::chrono::milliseconds(250),
+        .replyKeepDuration = std::chrono::seconds(1)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    // The server does not accept the feature so both sides fall back to one ACK per packet
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    auto s1 = host2.Accept(timeout);
+    REQUIRE(s1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+    REQUIRE(s1->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+    REQUIRE(c1->Features() == 0);
+    REQUIRE(s1->Features() == 0);
+
+    std::array<char, 8> data = {};
+    for (int i = 0; i < 50; i++) {
+        c1->SendReliableData(data);
+        s1->SendReliableData(data);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    REQUIRE(c1->NumImpMsg() == 0);
+    REQUIRE(s1->NumImpMsg() == 0);
+}
+
+TEST_CASE("UDPConnection adapts the retransmission timeout to the round trip time", "[UDPConnection]") {
+    LiteConnManager serverHost(30000, 2, 10, 1500, std::chrono::milliseconds(5));
+    REQUIRE(serverHost.Good());
+    serverHost.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::seconds(3),
+        .connectionRetryInterval = std::chrono::milliseconds(500),
+        .impRetryInterval = std::chrono::milliseconds(300),
+        .replyKeepDuration = std::chrono::seconds(1)
+    };
+
+    sockaddr_in serverAddr = {};
+    serverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(30000);
+    UDPSocket client(40000, 1500);
+
+    // Handshake without optional features so every packet is acknowledged on its own
+    {
+        LiteConnHeader header = {
+            .sessionID = 0,
+            .flag = LiteConnHeaderFlag::SYN,
+            .id32 = 5
+        };
+        client.SendPacket(LiteConnHeader::Serialize(header), serverAddr);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    std::shared_ptr<LiteConnConnection> server;
+    uint32_t sessionID;
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        auto pkt = client.Read();
+        REQUIRE(pkt.has_value());
+        auto header = LiteConnHeader::Deserialize(pkt.value().payload);
+        REQUIRE(header.has_value());
+        sessionID = header.value().id32;
+        LiteConnHeader ackHeader = {
+            .sessionID = sessionID,
+            .flag = LiteConnHeaderFlag::ACK,
+            .id32 = 5,
+            .id64 = header.value().id64
+        };
+        client.SendPacket(LiteConnHeader::Serialize(ackHeader), serverAddr);
+        server = serverHost.Accept(timeout, std::chrono::seconds(1));
+        REQUIRE(server);
+        REQUIRE(server->IsConnected());
+    }
+    // Before any sample the configured interval is used
+    REQUIRE(server->Stats().retransmitTimeout == timeout.impRetryInterval);
+
+    // Returns the id32 of the reliable data packets received by the client
+    auto readReliable = [&]() {
+        std::vector<uint32_t> ids;
+        while (auto pkt = client.Read()) {
+            auto header = LiteConnHeader::Deserialize(pkt.value().payload);
+            REQUIRE(header.has_value());
+            if (header.value().flag == (LiteConnHeaderFlag::IMP | LiteConnHeaderFlag::DATA)) {
+                ids.push_back(header.value().id32);
+            }
+        }
+        return ids;
+    };
+
+    // The client acknowledges every packet after a delay that the server should measure
+    const std::string msg = "Hello from server!\n";
+    for (int i = 0; i < 6; i++) {
+        server->SendReliableData(msg);
+        std::this_thread::sleep_for(std::chrono::milliseconds(80));
+        for (auto id : readReliable()) {
+            LiteConnHeader ackHeader = {
+                .sessionID = sessionID,
+                .flag = LiteConnHeaderFlag::ACK,
+                .id32 = id
+            };
+            client.SendPacket(LiteConnHeader::Serialize(ackHeader), serverAddr);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    auto stats = server->Stats();
+    REQUIRE(stats.unacknowledged == 0);
+    REQUIRE(stats.smoothedRtt >= std::chrono::milliseconds(60));
+    REQUIRE(stats.smoothedRtt <= std::chrono::milliseconds(200));
+    REQUIRE(stats.retransmitTimeout >= stats.smoothedRtt);
+    REQUIRE(stats.retransmitTimeout < timeout.impRetryInterval);
+
+    // Unacknowledged packets are retransmitted with exponential backoff instead of a fixed cadence
+    auto retransmissionsBefore = stats.retransmissions;
+    server->SendReliableData(msg);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1200));
+    auto copies = readReliable();
+    stats = server->Stats();
+    REQUIRE(stats.unacknowledged == 1);
+    REQUIRE(copies.size() == 1 + stats.retransmissions - retransmissionsBefore);
+    REQUIRE(copies.size() >= 3);
+    REQUIRE(copies.size() <= 6);
+}
+
+TEST_CASE("UDPConnection bundles small packets into shared datagrams", "[UDPConnection]") {
+    LiteConnManager serverHost(30000, 2, 64, 1500, std::chrono::milliseconds(10));
+    REQUIRE(serverHost.Good());
+    serverHost.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(1000),
+        .connectionRetryInterval = std::chrono::milliseconds(500),
+        .impRetryInterval = std::chrono::milliseconds(250),
+        .replyKeepDuration = std::chrono::seconds(1)
+    };
+
+    sockaddr_in serverAddr = {};
+    serverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(30000);
+    UDPSocket client(40000, 1500);
+
+    {
+        LiteConnHeader header = {
+            .sessionID = 0,
+            .flag = LiteConnHeaderFlag::SYN,
+            .id32 = 5,
+            .id64 = LiteConnFeature::BUNDLE
+        };
+        client.SendPacket(LiteConnHeader::Serialize(header), serverAddr);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::shared_ptr<LiteConnConnection> server;
+    uint32_t sessionID;
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        auto pkt = client.Read();
+        REQUIRE(pkt.has_value());
+        auto header = LiteConnHeader::Deserialize(pkt.value().payload);
+        REQUIRE(header.has_value());
+        REQUIRE(header.value().id64 == LiteConnFeature::BUNDLE);
+        sessionID = header.value().id32;
+        // The ACK returns the cookie with the checksum and the features it was issued for
+        LiteConnHeader ackHeader = {
+            .sessionID = sessionID,
+            .flag = LiteConnHeaderFlag::ACK,
+            .id32 = 5,
+            .id64 = header.value().id64
+        };
+        client.SendPacket(LiteConnHeader::Serialize(ackHeader), serverAddr);
+        server = serverHost.Accept(timeout, std::chrono::seconds(1));
+        REQUIRE(server);
+        REQUIRE(server->Features() == LiteConnFeature::BUNDLE);
+        REQUIRE(server->IsConnected());
+    }
+
+    // A burst of small messages leaves in one datagram
+    for (char i = 0; i < 20; i++) {
+        std::array<char, 2> msg = { 'a', static_cast<char>('a' + i) };
+        if (i % 2) server->SendReliableData(msg);
+        else server->SendData(msg);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    {
+        auto pkt = client.Read();
+        REQUIRE(pkt.has_value());
+        REQUIRE(!client.Read().has_value());
+        auto& payload = pkt.value().payload;
+        auto header = LiteConnHeader::Deserialize(payload);
+        REQUIRE(header.has_value());
+        REQUIRE(header.value().flag == LiteConnHeaderFlag::BUNDLE);
+        REQUIRE(header.value().sessionID == sessionID);
+
+        size_t offset = LiteConnHeader::Size;
+        char expected = 0;
+        while (offset < payload.size()) {
+            uint16_t length;
+            std::memcpy(&length, payload.data() + offset, sizeof(length));
+            length = ntohs(length);
+            offset += sizeof(length);
+            REQUIRE(offset + length <= payload.size());
+            std::span<const char> packet(payload.data() + offset, length);
+            offset += length;
+
+            auto inner = LiteConnHeader::Deserialize(packet);
+            REQUIRE(inner.has_value());
+            REQUIRE(inner.value().flag == (expected % 2 ? LiteConnHeaderFlag::IMP | LiteConnHeaderFlag::DATA : LiteConnHeaderFlag::DATA));
+            REQUIRE(packet.size() == LiteConnHeader::Size + 2);
+            REQUIRE(packet[LiteConnHeader::Size + 1] == 'a' + expected);
+            expected++;
+        }
+        REQUIRE(expected == 20);
+    }
+
+    // The server splits a bundle it receives into separate messages
+    {
+        std::vector<char> datagram(LiteConnHeader::Size);
+        LiteConnHeader::Serialize(LiteConnHeader{ .sessionID = sessionID, .index = 1, .flag = LiteConnHeaderFlag::BUNDLE }, datagram);
+        const std::string messages[] = { "first", "second", "third" };
+        uint32_t index = 2;
+        for (auto& message : messages) {
+            LiteConnHeader header = {
+                .sessionID = sessionID,
+                .index = index++,
+                .flag = LiteConnHeaderFlag::DATA
+            };
+            uint16_t length = htons(static_cast<uint16_t>(LiteConnHeader::Size + message.size()));
+            auto lengthBytes = reinterpret_cast<const char*>(&length);
+            datagram.insert(datagram.end(), lengthBytes, lengthBytes + sizeof(length));
+            auto serialized = LiteConnHeader::Serialize(header);
+            datagram.insert(datagram.end(), serialized.begin(), serialized.end());
+            datagram.insert(datagram.end(), message.begin(), message.end());
+        }
+        client.SendPacket(datagram, serverAddr);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        for (auto& message : messages) {
+            auto item = server->Receive();
+            REQUIRE(item.has_value());
+            REQUIRE(std::string(item.value().data.begin(), item.value().data.end()) == message);
+        }
+        REQUIRE(!server->Receive().has_value());
+    }
+}
+
+TEST_CASE("UDPConnection fragments reliable messages larger than a frame", "[UDPConnection]") {
+    LiteConnSetting setting = { .maxMessageSize = 200000 };
+    LiteConnManager host1(30000, 2, 10, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 10, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(1000),
+        .connectionRetryInterval = std::chrono::milliseconds(500),
+        .impRetryInterval = std::chrono::milliseconds(250),
+        .replyKeepDuration = std::chrono::seconds(1)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    auto s1 = host2.Accept(timeout);
+    REQUIRE(s1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+    REQUIRE(s1->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+    REQUIRE(c1->Features() & LiteConnFeature::FRAGMENT);
+
+    std::vector<char> large(100000);
+    for (size_t i = 0; i < large.size(); i++) {
+        large[i] = static_cast<char>(i * 31 + i / 7);
+    }
+    const std::string small = "Small message";
+    c1->SendReliableData(large);
+    c1->SendReliableData(small);
+
+    // Both messages arrive whole, the fragments are not visible to the application
+    std::vector<std::vector<char>> received;
+    while (received.size() < 2 && s1->WaitForDataPacket(std::chrono::milliseconds(1000))) {
+        auto item = s1->Receive();
+        REQUIRE(item.has_value());
+        received.emplace_back(item.value().data.begin(), item.value().data.end());
+    }
+    REQUIRE(received.size() == 2);
+    std::sort(received.begin(), received.end(), [](auto& a, auto& b) { return a.size() < b.size(); });
+    REQUIRE(std::string(received[0].begin(), received[0].end()) == small);
+    REQUIRE(received[1] == large);
+    REQUIRE(s1->NumPartialMessages() == 0);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(c1->NumImpMsg() == 0);
+
+    // Messages beyond the configured maximum are refused by the sender
+    std::vector<char> tooLarge(setting.maxMessageSize + 1);
+    c1->SendReliableData(tooLarge);
+    REQUIRE(c1->NumImpMsg() == 0);
+}
+
+TEST_CASE("UDPConnection refuses requests and responses larger than a datagram", "[UDPConnection]") {
+    LiteConnManager host1(30000, 2, 10, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 10, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(1000),
+        .connectionRetryInterval = std::chrono::milliseconds(500),
+        .impRetryInterval = std::chrono::milliseconds(250),
+        .replyKeepDuration = std::chrono::seconds(1)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    auto s1 = host2.Accept(timeout);
+    REQUIRE(s1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+
+    // Requests are not fragmented, a request that does not fit is refused without sending anything
+    std::vector<char> large(4000, 'x');
+    REQUIRE(!c1->SendRequest(large));
+    REQUIRE(c1->NumImpMsg() == 0);
+
+    // A response that does not fit rejects the request, so the requester is not left waiting
+    const std::string question = "Question";
+    auto response = c1->SendRequest(question);
+    REQUIRE(response);
+    REQUIRE(s1->WaitForDataPacket(std::chrono::milliseconds(500)));
+    auto request = s1->Receive();
+    REQUIRE(request.has_value());
+    REQUIRE(request->requestHandle);
+    request->requestHandle->Respond(large);
+    REQUIRE(response->WaitForResponse(std::chrono::milliseconds(500)));
+    REQUIRE(!response->GetResponse().has_value());
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(c1->NumImpMsg() == 0);
+    REQUIRE(s1->NumImpMsg() == 0);
+}
+
+TEST_CASE("UDPConnection compresses large data messages with a shared dictionary", "[UDPConnection]") {
+    const std::string sample = "player=0;x=0.0;y=0.0;z=0.0;hp=100|";
+    LiteConnSetting setting = {
+        .compressionThreshold = 64,
+        .compressionDictionary = std::vector<char>(sample.begin(), sample.end())
+    };
+    LiteConnManager host1(30000, 2, 10, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 10, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(1000),
+        .connectionRetryInterval = std::chrono::milliseconds(500),
+        .impRetryInterval = std::chrono::milliseconds(250),
+        .replyKeepDuration = std::chrono::seconds(1)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+    auto s1 = host2.Accept(timeout, std::chrono::milliseconds(500));
+    REQUIRE(s1);
+    REQUIRE(c1->Features() & LiteConnFeature::COMPRESS);
+    REQUIRE(s1->Features() & LiteConnFeature::COMPRESS);
+
+    std::string snapshot;
+    for (int i = 0; i < 30; i++) {
+        snapshot += "player=" + std::to_string(i % 4) + ";x=1.5;y=0.0;z=-2.0;hp=100|";
+    }
+    const std::string small = "Small message";
+    c1->SendReliableData(snapshot);
+    c1->SendData(small);
+
+    // Both arrive as sent, only the message above the threshold was compressed
+    std::vector<std::string> received;
+    while (received.size() < 2 && s1->WaitForDataPacket(std::chrono::milliseconds(1000))) {
+        auto item = s1->Receive();
+        REQUIRE(item.has_value());
+        received.emplace_back(item.value().data.begin(), item.value().data.end());
+    }
+    REQUIRE(received.size() == 2);
+    std::sort(received.begin(), received.end(), [](auto& a, auto& b) { return a.size() < b.size(); });
+    REQUIRE(received[0] == small);
+    REQUIRE(received[1] == snapshot);
+
+    auto stats = c1->Stats();
+    REQUIRE(stats.compressedMessages == 1);
+    REQUIRE(stats.uncompressedBytes == snapshot.size());
+    REQUIRE(stats.compressedBytes < stats.uncompressedBytes / 4);
+    REQUIRE(stats.compressionTime > std::chrono::steady_clock::duration::zero());
+    REQUIRE(s1->Stats().decompressionTime > std::chrono::steady_clock::duration::zero());
+
+    // A peer with another dictionary connects without compression
+    LiteConnSetting otherSetting = setting;
+    otherSetting.compressionDictionary = { 'x', 'y', 'z', 'w' };
+    LiteConnManager host3(30001, 2, 10, 1500, std::chrono::milliseconds(10), otherSetting);
+    REQUIRE(host3.Good());
+    auto c2 = host3.ConnectPeer(addr2, timeout);
+    REQUIRE(c2);
+    REQUIRE(c2->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+    REQUIRE(!(c2->Features() & LiteConnFeature::COMPRESS));
+    auto s2 = host2.Accept(timeout, std::chrono::milliseconds(500));
+    REQUIRE(s2);
+    REQUIRE(!(s2->Features() & LiteConnFeature::COMPRESS));
+    c2->SendReliableData(snapshot);
+    REQUIRE(s2->WaitForDataPacket(std::chrono::milliseconds(1000)));
+    auto item = s2->Receive();
+    REQUIRE(item.has_value());
+    REQUIRE(std::string(item.value().data.begin(), item.value().data.end()) == snapshot);
+}
+
+TEST_CASE("LiteConnHeader compact encoding round trips", "[UDPConnection]") {
+    std::vector<LiteConnHeader> headers = {
+        { .sessionID = 0x12345678, .index = 3, .flag = LiteConnHeaderFlag::DATA },
+        { .sessionID = 1, .index = 300, .flag = LiteConnHeaderFlag::DATA | LiteConnHeaderFlag::IMP, .id32 = 70000 },
+        { .sessionID = 2, .index = UINT32_MAX, .flag = LiteConnHeaderFlag::ACK, .id32 = UINT32_MAX, .id64 = 0xffffffffffffffffULL },
+        { .sessionID = 3, .index = 0, .flag = LiteConnHeaderFlag::HBT, .id64 = uint64_t(1) << 55 },
+        { .sessionID = 4, .index = 0, .flag = LiteConnHeaderFlag::HBT, .id64 = uint64_t(1) << 56 },
+    };
+    for (auto& header : headers) {
+        std::array<char, LiteConnHeader::MaxSize> buffer;
+        auto size = LiteConnHeader::SerializeCompact(header, buffer);
+        REQUIRE(size == LiteConnHeader::CompactSize(header));
+        REQUIRE(size <= LiteConnHeader::MaxCompactSize);
+        auto parsed = LiteConnHeader::DeserializeCompact(std::span<const char>(buffer.data(), size));
+        REQUIRE(parsed.has_value());
+        REQUIRE(parsed->first == header);
+        REQUIRE(parsed->second == size);
+        // Truncated headers are rejected
+        REQUIRE(!LiteConnHeader::DeserializeCompact(std::span<const char>(buffer.data(), size - 1)));
+    }
+
+    // An unreliable data packet early in a session takes 7 bytes instead of the fixed 21
+    REQUIRE(LiteConnHeader::CompactSize(headers[0]) == 7);
+    REQUIRE(LiteConnHeader::CompactSize(headers[1]) == 11);
+    REQUIRE(LiteConnHeader::CompactSize(headers[2]) == LiteConnHeader::MaxCompactSize);
+
+    // Fixed format headers, such as a repeated handshake ACK, are still read
+    LiteConnHeader ack = { .sessionID = 9, .index = 0, .flag = LiteConnHeaderFlag::ACK, .id32 = 5, .id64 = LiteConnFeature::ALL };
+    auto parsed = LiteConnHeader::DeserializeCompact(LiteConnHeader::Serialize(ack));
+    REQUIRE(parsed.has_value());
+    REQUIRE(parsed->first == ack);
+    REQUIRE(parsed->second == LiteConnHeader::Size);
+}
+
+TEST_CASE("UDPConnection negotiates compact headers", "[UDPConnection]") {
+    LiteConnManager serverHost(30000, 2, 10, 1500, std::chrono::milliseconds(10));
+    REQUIRE(serverHost.Good());
+    serverHost.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(2000),
+        .connectionRetryInterval = std::chrono::milliseconds(500),
+        .impRetryInterval = std::chrono::milliseconds(250)
+    };
+
+    sockaddr_in serverAddr = {};
+    serverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(30000);
+    UDPSocket client(40000, 1500);
+
+    // The handshake itself uses the fixed format
+    {
+        LiteConnHeader header = {
+            .sessionID = 0,
+            .flag = LiteConnHeaderFlag::SYN,
+            .id32 = 5,
+            .id64 = LiteConnFeature::COMPACT
+        };
+        client.SendPacket(LiteConnHeader::Serialize(header), serverAddr);
+    }
+    std::shared_ptr<LiteConnConnection> server;
+    uint32_t sessionID;
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        auto pkt = client.Read();
+        REQUIRE(pkt.has_value());
+        REQUIRE(pkt.value().payload.size() == LiteConnHeader::Size);
+        auto header = LiteConnHeader::Deserialize(pkt.value().payload);
+        REQUIRE(header.has_value());
+        REQUIRE(header.value().id64 == LiteConnFeature::COMPACT);
+        sessionID = header.value().id32;
+        LiteConnHeader ackHeader = {
+            .sessionID = sessionID,
+            .flag = LiteConnHeaderFlag::ACK,
+            .id32 = 5,
+            .id64 = header.value().id64
+        };
+        client.SendPacket(LiteConnHeader::Serialize(ackHeader), serverAddr);
+        server = serverHost.Accept(timeout, std::chrono::seconds(1));
+        REQUIRE(server);
+        REQUIRE(server->Features() == LiteConnFeature::COMPACT);
+    }
+
+    // Data from the server carries a compact header
+    const std::string update = "update";
+    server->SendData(update);
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        auto pkt = client.Read();
+        REQUIRE(pkt.has_value());
+        auto& payload = pkt.value().payload;
+        auto header = LiteConnHeader::DeserializeCompact(payload);
+        REQUIRE(header.has_value());
+        REQUIRE(header->first.sessionID == sessionID);
+        REQUIRE(header->first.flag == LiteConnHeaderFlag::DATA);
+        REQUIRE(header->second < LiteConnHeader::Size / 2);
+        REQUIRE(std::string(payload.begin() + header->second, payload.end()) == update);
+    }
+
+    // Compact packets from the client are read, the ACK is compact as well
+    {
+        LiteConnHeader header = {
+            .sessionID = sessionID,
+            .index = 1,
+            .flag = LiteConnHeaderFlag::DATA | LiteConnHeaderFlag::IMP,
+            .id32 = 1
+        };
+        const std::string input = "input";
+        std::vector<char> packet(LiteConnHeader::MaxSize + input.size());
+        auto size = LiteConnHeader::SerializeCompact(header, packet);
+        std::copy(input.begin(), input.end(), packet.begin() + size);
+        packet.resize(size + input.size());
+        client.SendPacket(packet, serverAddr);
+
+        REQUIRE(server->WaitForDataPacket(std::chrono::milliseconds(1000)));
+        auto item = server->Receive();
+        REQUIRE(item.has_value());
+        REQUIRE(std::string(item.value().data.begin(), item.value().data.end()) == input);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        auto pkt = client.Read();
+        REQUIRE(pkt.has_value());
+        auto ack = LiteConnHeader::DeserializeCompact(pkt.value().payload);
+        REQUIRE(ack.has_value());
+        REQUIRE(ack->first.flag == LiteConnHeaderFlag::ACK);
+        REQUIRE(ack->first.id32 == 1);
+        REQUIRE(ack->second == pkt.value().payload.size());
+    }
+
+    // A peer that does not offer COMPACT keeps the fixed format
+    LiteConnManager legacyHost(30001, 2, 10, 1500, std::chrono::milliseconds(10), { .features = LiteConnFeature::ALL & ~LiteConnFeature::COMPACT });
+    REQUIRE(legacyHost.Good());
+    auto legacy = legacyHost.ConnectPeer(serverAddr, timeout);
+    REQUIRE(legacy);
+    REQUIRE(legacy->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+    auto legacyServer = serverHost.Accept(timeout, std::chrono::milliseconds(500));
+    REQUIRE(legacyServer);
+    REQUIRE(!(legacyServer->Features() & LiteConnFeature::COMPACT));
+    legacyServer->SendReliableData(update);
+    REQUIRE(legacy->WaitForDataPacket(std::chrono::milliseconds(1000)));
+    auto item = legacy->Receive();
+    REQUIRE(item.has_value());
+    REQUIRE(std::string(item.value().data.begin(), item.value().data.end()) == update);
+}
+
+TEST_CASE("UDPConnection closes when a fragmented message stalls", "[UDPConnection]") {
+    LiteConnManager serverHost(30000, 2, 10, 1500, std::chrono::milliseconds(10));
+    REQUIRE(serverHost.Good());
+    serverHost.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(2000),
+        .connectionRetryInterval = std::chrono::milliseconds(500),
+        .impRetryInterval = std::chrono::milliseconds(250),
+        .replyKeepDuration = std::chrono::seconds(1),
+        .reassemblyTimeout = std::chrono::milliseconds(300)
+    };
+
+    sockaddr_in serverAddr = {};
+    serverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(30000);
+    UDPSocket client(40000, 1500);
+
+    {
+        LiteConnHeader header = {
+            .sessionID = 0,
+            .flag = LiteConnHeaderFlag::SYN,
+            .id32 = 5,
+            .id64 = LiteConnFeature::FRAGMENT
+        };
+        client.SendPacket(LiteConnHeader::Serialize(header), serverAddr);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::shared_ptr<LiteConnConnection> server;
+    uint32_t sessionID;
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        auto pkt = client.Read();
+        REQUIRE(pkt.has_value());
+        auto header = LiteConnHeader::Deserialize(pkt.value().payload);
+        REQUIRE(header.has_value());
+        sessionID = header.value().id32;
+        // The ACK returns the cookie with the checksum and the features it was issued for
+        LiteConnHeader ackHeader = {
+            .sessionID = sessionID,
+            .flag = LiteConnHeaderFlag::ACK,
+            .id32 = 5,
+            .id64 = header.value().id64
+        };
+        client.SendPacket(LiteConnHeader::Serialize(ackHeader), serverAddr);
+        server = serverHost.Accept(timeout, std::chrono::seconds(1));
+        REQUIRE(server);
+        REQUIRE(server->IsConnected());
+    }
+
+    // Only the first of three fragments is sent
+    {
+        LiteConnHeader header = {
+            .sessionID = sessionID,
+            .index = 1,
+            .flag = LiteConnHeaderFlag::IMP | LiteConnHeaderFlag::DATA,
+            .id32 = 0,
+            .id64 = (uint64_t(7) << 32) | (uint64_t(0) << 16) | 3
+        };
+        std::vector<char> packet(LiteConnHeader::Size + 100, 'x');
+        LiteConnHeader::Serialize(header, packet);
+        client.SendPacket(packet, serverAddr);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(server->NumPartialMessages() == 1);
+    REQUIRE(!server->Receive().has_value());
+
+    // The fragment was acknowledged, so the message cannot be dropped once the reassembly timeout passes and the connection is closed
+    bool acknowledged = false;
+    while (auto pkt = client.Read()) {
+        auto header = LiteConnHeader::Deserialize(pkt.value().payload);
+        REQUIRE(header.has_value());
+        acknowledged |= header.value().flag == LiteConnHeaderFlag::ACK && header.value().id32 == 0;
+    }
+    REQUIRE(acknowledged);
+    std::this_thread::sleep_for(std::chrono::milliseconds(400));
+    REQUIRE(server->NumPartialMessages() == 0);
+    REQUIRE(server->IsDisconnected());
+    bool closed = false;
+    while (auto pkt = client.Read()) {
+        auto header = LiteConnHeader::Deserialize(pkt.value().payload);
+        REQUIRE(header.has_value());
+        closed |= header.value().flag == LiteConnHeaderFlag::FIN;
+    }
+    REQUIRE(closed);
+}
+
+TEST_CASE("UDPConnection reassembles concurrent large messages under loss", "[UDPConnection]") {
+    // Either message takes more than half of the reassembly budget
+    LiteConnSetting setting = {
+        .maxMessageSize = 20000,
+        .impairment = ImpairmentSetting{
+            .lossRate = 0.2,
+            .seed = 11
+        }
+    };
+    LiteConnManager host1(30000, 2, 10, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 10, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(5000),
+        .connectionRetryInterval = std::chrono::milliseconds(100),
+        .impRetryInterval = std::chrono::milliseconds(50),
+        .replyKeepDuration = std::chrono::seconds(5),
+        .maxRetryInterval = std::chrono::milliseconds(200),
+        .reassemblyTimeout = std::chrono::seconds(1)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::seconds(3)));
+    auto s1 = host2.Accept(timeout, std::chrono::seconds(3));
+    REQUIRE(s1);
+    REQUIRE(c1->Features() & LiteConnFeature::FRAGMENT);
+
+    std::vector<char> first(12000, 'a');
+    std::vector<char> second(12000, 'b');
+    c1->SendReliableData(first);
+    c1->SendReliableData(second);
+
+    // The second message waits for room in the budget, neither one is dropped
+    std::vector<std::vector<char>> received;
+    while (received.size() < 2 && s1->WaitForDataPacket(std::chrono::seconds(3))) {
+        while (auto item = s1->Receive()) {
+            received.emplace_back(item.value().data.begin(), item.value().data.end());
+        }
+    }
+    REQUIRE(received.size() == 2);
+    std::sort(received.begin(), received.end());
+    REQUIRE(received[0] == first);
+    REQUIRE(received[1] == second);
+    REQUIRE(s1->NumPartialMessages() == 0);
+    REQUIRE(s1->IsConnected());
+    REQUIRE(c1->Stats().retransmissions > 0);
+}
+
+TEST_CASE("UDPConnection validates a new peer address before migrating", "[UDPConnection]") {
+    LiteConnSetting setting = {
+        .rotateSessionOnMigration = true
+    };
+    LiteConnManager serverHost(30000, 2, 10, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(serverHost.Good());
+    serverHost.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(2000),
+        .connectionRetryInterval = std::chrono::milliseconds(500),
+        .impRetryInterval = std::chrono::milliseconds(250)
+    };
+
+    sockaddr_in serverAddr = {};
+    serverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(30000);
+    UDPSocket client(40000, 1500);
+
+    {
+        LiteConnHeader header = {
+            .sessionID = 0,
+            .flag = LiteConnHeaderFlag::SYN,
+            .id32 = 5,
+            .id64 = LiteConnFeature::MIGRATE
+        };
+        client.SendPacket(LiteConnHeader::Serialize(header), serverAddr);
+    }
+    std::shared_ptr<LiteConnConnection> server;
+    uint32_t sessionID;
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        auto pkt = client.Read();
+        REQUIRE(pkt.has_value());
+        auto header = LiteConnHeader::Deserialize(pkt.value().payload);
+        REQUIRE(header.has_value());
+        REQUIRE(header.value().id64 == LiteConnFeature::MIGRATE);
+        sessionID = header.value().id32;
+        LiteConnHeader ackHeader = {
+            .sessionID = sessionID,
+            .flag = LiteConnHeaderFlag::ACK,
+            .id32 = 5,
+            .id64 = header.value().id64
+        };
+        client.SendPacket(LiteConnHeader::Serialize(ackHeader), serverAddr);
+        server = serverHost.Accept(timeout, std::chrono::seconds(1));
+        REQUIRE(server);
+        REQUIRE(server->IsConnected());
+    }
+
+    // Reads the packets a socket received, the last one with the flag is returned
+    auto readFlag = [](UDPSocket& socket, uint8_t flag) {
+        std::optional<LiteConnHeader> result;
+        while (auto pkt = socket.Read()) {
+            auto header = LiteConnHeader::Deserialize(pkt.value().payload);
+            REQUIRE(header.has_value());
+            if (header.value().flag == flag) result = header.value();
+        }
+        return result;
+    };
+    auto sendHeader = [&](UDPSocket& socket, LiteConnHeader header) {
+        socket.SendPacket(LiteConnHeader::Serialize(header), serverAddr);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    };
+    const uint8_t challengeFlag = LiteConnHeaderFlag::SYN | LiteConnHeaderFlag::HBT;
+    const uint8_t responseFlag = LiteConnHeaderFlag::SYN | LiteConnHeaderFlag::HBT | LiteConnHeaderFlag::ACK;
+
+    // The client rebinds to another port, its packets are processed but the server keeps sending to the old address
+    UDPSocket moved(40001, 1500);
+    sendHeader(moved, { .sessionID = sessionID, .index = 1, .flag = LiteConnHeaderFlag::HBT });
+    REQUIRE(ntohs(server->PeerAddr().sin_port) == 40000);
+    REQUIRE(readFlag(client, LiteConnHeaderFlag::ACK | LiteConnHeaderFlag::HBT).has_value());
+    auto challenge = readFlag(moved, challengeFlag);
+    REQUIRE(challenge.has_value());
+    REQUIRE(challenge->sessionID == sessionID);
+    // A new session id is offered with the challenge
+    uint32_t rotatedID = challenge->id32;
+    REQUIRE(rotatedID != 0);
+    REQUIRE(rotatedID != sessionID);
+
+    // A wrong token, or the right token from another address, does not move the connection
+    sendHeader(moved, { .sessionID = sessionID, .index = 2, .flag = responseFlag, .id32 = rotatedID, .id64 = challenge->id64 + 1 });
+    REQUIRE(ntohs(server->PeerAddr().sin_port) == 40000);
+    {
+        UDPSocket attacker(40002, 1500);
+        sendHeader(attacker, { .sessionID = sessionID, .index = 1, .flag = responseFlag, .id32 = rotatedID, .id64 = challenge->id64 });
+    }
+    REQUIRE(ntohs(server->PeerAddr().sin_port) == 40000);
+    REQUIRE(server->SessionID() == sessionID);
+
+    // The echoed token from the new address completes the migration and the rotation
+    sendHeader(moved, { .sessionID = sessionID, .index = 3, .flag = responseFlag, .id32 = rotatedID, .id64 = challenge->id64 });
+    REQUIRE(ntohs(server->PeerAddr().sin_port) == 40001);
+    REQUIRE(server->SessionID() == rotatedID);
+    readFlag(moved, 0);
+    server->SendData("moved");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto data = readFlag(moved, LiteConnHeaderFlag::DATA);
+    REQUIRE(data.has_value());
+    REQUIRE(data->sessionID == rotatedID);
+    REQUIRE(!readFlag(client, LiteConnHeaderFlag::DATA).has_value());
+
+    // Packets sent under the previous id before the peer learnt the new one are still routed
+    sendHeader(moved, { .sessionID = sessionID, .index = 4, .flag = LiteConnHeaderFlag::HBT });
+    REQUIRE(readFlag(moved, LiteConnHeaderFlag::ACK | LiteConnHeaderFlag::HBT).has_value());
+    sendHeader(moved, { .sessionID = rotatedID, .index = 5, .flag = LiteConnHeaderFlag::HBT });
+    REQUIRE(readFlag(moved, LiteConnHeaderFlag::ACK | LiteConnHeaderFlag::HBT).has_value());
+
+    // A challenge of the peer is echoed under the id it was sent with, and the offered id is adopted
+    sendHeader(moved, { .sessionID = rotatedID, .index = 6, .flag = challengeFlag, .id32 = 77, .id64 = 1234 });
+    auto response = readFlag(moved, responseFlag);
+    REQUIRE(response.has_value());
+    REQUIRE(response->sessionID == rotatedID);
+    REQUIRE(response->id32 == 77);
+    REQUIRE(response->id64 == 1234);
+    REQUIRE(server->SessionID() == 77);
+    REQUIRE(server->IsConnected());
+}
+
+TEST_CASE("UDPConnection channels sequence and order messages", "[UDPConnection]") {
+    LiteConnSetting setting = {
+        .channels = { ChannelType::UnreliableSequenced, ChannelType::ReliableOrdered, ChannelType::Unreliable }
+    };
+    LiteConnManager serverHost(30000, 2, 64, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(serverHost.Good());
+    serverHost.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(1000),
+        .connectionRetryInterval = std::chrono::milliseconds(500),
+        .impRetryInterval = std::chrono::milliseconds(250),
+        .replyKeepDuration = std::chrono::seconds(1)
+    };
+
+    sockaddr_in serverAddr = {};
+    serverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(30000);
+    UDPSocket client(40000, 1500);
+
+    {
+        LiteConnHeader header = {
+            .sessionID = 0,
+            .flag = LiteConnHeaderFlag::SYN,
+            .id32 = 5,
+            .id64 = LiteConnFeature::CHANNEL
+        };
+        client.SendPacket(LiteConnHeader::Serialize(header), serverAddr);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::shared_ptr<LiteConnConnection> server;
+    uint32_t sessionID;
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        auto pkt = client.Read();
+        REQUIRE(pkt.has_value());
+        auto header = LiteConnHeader::Deserialize(pkt.value().payload);
+        REQUIRE(header.has_value());
+        sessionID = header.value().id32;
+        // The ACK returns the cookie with the checksum and the features it was issued for
+        LiteConnHeader ackHeader = {
+            .sessionID = sessionID,
+            .flag = LiteConnHeaderFlag::ACK,
+            .id32 = 5,
+            .id64 = header.value().id64
+        };
+        client.SendPacket(LiteConnHeader::Serialize(ackHeader), serverAddr);
+        server = serverHost.Accept(timeout, std::chrono::seconds(1));
+        REQUIRE(server);
+        REQUIRE(server->Features() == LiteConnFeature::CHANNEL);
+        REQUIRE(server->IsConnected());
+    }
+
+    uint32_t index = 1;
+    uint32_t impIndex = 0;
+    // Sends a message with a channel envelope, the sequence number is left out for channels without one
+    auto send = [&](uint8_t channel, std::optional<uint32_t> sequence, const std::string& message, bool reliable) {
+        std::vector<char> packet(LiteConnHeader::Size);
+        LiteConnHeader header = {
+            .sessionID = sessionID,
+            .index = index++,
+            .flag = reliable ? LiteConnHeaderFlag::IMP | LiteConnHeaderFlag::DATA : LiteConnHeaderFlag::DATA,
+            .id32 = reliable ? impIndex++ : 0
+        };
+        LiteConnHeader::Serialize(header, packet);
+        packet.push_back(static_cast<char>(channel));
+        if (sequence) {
+            uint32_t serialized = htonl(sequence.value());
+            auto bytes = reinterpret_cast<const char*>(&serialized);
+            packet.insert(packet.end(), bytes, bytes + sizeof(serialized));
+        }
+        packet.insert(packet.end(), message.begin(), message.end());
+        client.SendPacket(packet, serverAddr);
+    };
+    auto receiveAll = [&]() {
+        std::vector<std::pair<uint8_t, std::string>> messages;
+        while (auto item = server->Receive()) {
+            messages.emplace_back(item.value().channel, std::string(item.value().data.begin(), item.value().data.end()));
+        }
+        return messages;
+    };
+    using Messages = std::vector<std::pair<uint8_t, std::string>>;
+
+    // The ordered channel holds back messages until the missing one arrives, other channels are not blocked
+    send(1, 1, "ordered 1", true);
+    send(1, 2, "ordered 2", true);
+    send(2, {}, "unreliable", false);
+    send(NO_CHANNEL, {}, "plain", false);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(receiveAll() == Messages{ { 2, "unreliable" }, { NO_CHANNEL, "plain" } });
+
+    send(1, 0, "ordered 0", true);
+    // A duplicate of a delivered message is dropped even with a new reliability id
+    send(1, 1, "ordered 1", true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(receiveAll() == Messages{ { 1, "ordered 0" }, { 1, "ordered 1" }, { 1, "ordered 2" } });
+
+    // The sequenced channel drops messages older than the newest one
+    send(0, 5, "state 5", false);
+    send(0, 3, "state 3", false);
+    send(0, 6, "state 6", false);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(receiveAll() == Messages{ { 0, "state 5" }, { 0, "state 6" } });
+}
+
+TEST_CASE("UDPConnection delivers ordered channel messages in sending order", "[UDPConnection]") {
+    LiteConnSetting setting = {
+        .channels = { ChannelType::ReliableOrdered, ChannelType::UnreliableSequenced }
+    };
+    LiteConnManager host1(30000, 2, 100, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 100, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(1000),
+        .connectionRetryInterval = std::chrono::milliseconds(500),
+        .impRetryInterval = std::chrono::milliseconds(250),
+        .replyKeepDuration = std::chrono::seconds(1)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    auto s1 = host2.Accept(timeout);
+    REQUIRE(s1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+    REQUIRE(s1->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+    REQUIRE(c1->Features() & LiteConnFeature::CHANNEL);
+
+    for (uint32_t i = 0; i < 60; i++) {
+        auto message = std::to_string(i);
+        c1->Send(0, message);
+    }
+    // Channels that are not configured are refused
+    c1->Send(2, std::string("nowhere"));
+    c1->SendReliableData(std::string("plain"));
+
+    std::vector<std::string> ordered;
+    bool plain = false;
+    while (ordered.size() < 60 || !plain) {
+        if (!s1->WaitForDataPacket(std::chrono::milliseconds(1000))) break;
+        auto item = s1->Receive();
+        REQUIRE(item.has_value());
+        std::string message(item.value().data.begin(), item.value().data.end());
+        if (item.value().channel == NO_CHANNEL) {
+            REQUIRE(message == "plain");
+            plain = true;
+        }
+        else {
+            REQUIRE(item.value().channel == 0);
+            ordered.push_back(message);
+        }
+    }
+    REQUIRE(plain);
+    REQUIRE(ordered.size() == 60);
+    for (uint32_t i = 0; i < 60; i++) {
+        REQUIRE(ordered[i] == std::to_string(i));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    REQUIRE(!s1->Receive().has_value());
+}
+
+TEST_CASE("UDPConnection receives messages in batches", "[UDPConnection]") {
+    LiteConnManager host1(30000, 2, 16, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 16, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(1000),
+        .connectionRetryInterval = std::chrono::milliseconds(500),
+        .impRetryInterval = std::chrono::milliseconds(250),
+        .replyKeepDuration = std::chrono::seconds(1)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    auto s1 = host2.Accept(timeout);
+    REQUIRE(s1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+    REQUIRE(s1->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+
+    // More than the queue holds, the rest is dropped and retransmitted once there is space
+    for (uint32_t i = 0; i < 24; i++) {
+        c1->SendReliableData(std::to_string(i));
+    }
+
+    std::vector<std::string> received;
+    std::array<LiteConnMessage, 8> batch;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(3);
+    while (received.size() < 24 && std::chrono::steady_clock::now() < deadline) {
+        s1->WaitForDataPacket(std::chrono::milliseconds(100));
+        auto count = s1->ReceiveAll(batch);
+        REQUIRE(count <= batch.size());
+        for (size_t i = 0; i < count; i++) {
+            received.emplace_back(batch[i].data.begin(), batch[i].data.end());
+        }
+    }
+    REQUIRE(received.size() == 24);
+    std::sort(received.begin(), received.end());
+    REQUIRE(std::unique(received.begin(), received.end()) == received.end());
+
+    // Messages left after disconnecting are dropped
+    c1->SendReliableData(std::string("late"));
+    REQUIRE(s1->WaitForDataPacket(std::chrono::milliseconds(500)));
+    c1->Disconnect();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(s1->IsDisconnected());
+    REQUIRE(s1->ReceiveAll(batch) == 0);
+    REQUIRE(!s1->Receive().has_value());
+}
+
+TEST_CASE("UDPConnection sends from several threads", "[UDPConnection]") {
+    // A small send queue makes the senders fall back to sending on their own thread at times
+    LiteConnSetting setting = {
+        .channels = { ChannelType::ReliableOrdered },
+        .sendQueueCapacity = 8
+    };
+    LiteConnManager host1(30000, 2, 200, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 200, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(1000),
+        .connectionRetryInterval = std::chrono::milliseconds(500),
+        .impRetryInterval = std::chrono::milliseconds(250),
+        .replyKeepDuration = std::chrono::seconds(1)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    auto s1 = host2.Accept(timeout);
+    REQUIRE(s1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+    REQUIRE(s1->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+
+    constexpr int numSenders = 4;
+    constexpr int count = 40;
+    std::vector<std::thread> senders;
+    for (int sender = 0; sender < numSenders; sender++) {
+        senders.emplace_back([&c1, sender]() {
+            for (int i = 0; i < count; i++) {
+                c1->Send(0, std::to_string(sender) + ":" + std::to_string(i));
+            }
+        });
+    }
+    for (auto& sender : senders) {
+        sender.join();
+    }
+
+    // Every message arrives once and the messages of each sender stay in order
+    std::vector<int> next(numSenders, 0);
+    int received = 0;
+    bool inOrder = true;
+    while (received < numSenders * count) {
+        if (!s1->WaitForDataPacket(std::chrono::milliseconds(1000))) break;
+        while (auto item = s1->Receive()) {
+            std::string message(item.value().data.begin(), item.value().data.end());
+            auto separator = message.find(':');
+            auto sender = std::stoi(message.substr(0, separator));
+            inOrder = inOrder && std::stoi(message.substr(separator + 1)) == next[sender]++;
+            received++;
+        }
+    }
+    REQUIRE(inOrder);
+    REQUIRE(received == numSenders * count);
+}
+
+TEST_CASE("UDPConnection sends requests and responses from several threads", "[UDPConnection]") {
+    // Requests and responses share the send queue with data messages, a small one makes some of them fall back to the caller's thread
+    LiteConnSetting setting = {
+        .sendQueueCapacity = 8
+    };
+    LiteConnManager host1(30000, 2, 200, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 200, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(1000),
+        .connectionRetryInterval = std::chrono::milliseconds(500),
+        .impRetryInterval = std::chrono::milliseconds(250),
+        .replyKeepDuration = std::chrono::seconds(1)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    auto s1 = host2.Accept(timeout);
+    REQUIRE(s1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+    REQUIRE(s1->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+
+    constexpr int numSenders = 4;
+    constexpr int count = 20;
+    std::atomic<bool> serving = true;
+    // Every request is answered with its own text, except every fifth one which is rejected
+    std::thread server([&]() {
+        while (serving) {
+            if (!s1->WaitForDataPacket(std::chrono::milliseconds(50))) continue;
+            while (auto item = s1->Receive()) {
+                auto& handle = item.value().requestHandle;
+                if (!handle) continue;
+                std::string message(item.value().data.begin(), item.value().data.end());
+                if (std::stoi(message.substr(message.find(':') + 1)) % 5 == 0) {
+                    handle.value().Reject();
+                }
+                else {
+                    handle.value().Respond(message);
+                }
+            }
+        }
+    });
+
+    std::atomic<int> answered = 0;
+    std::atomic<int> rejected = 0;
+    std::vector<std::thread> senders;
+    for (int sender = 0; sender < numSenders; sender++) {
+        senders.emplace_back([&, sender]() {
+            std::vector<std::pair<std::string, LiteConnResponse>> requests;
+            for (int i = 0; i < count; i++) {
+                auto message = std::to_string(sender) + ":" + std::to_string(i);
+                auto response = c1->SendRequest(message);
+                if (response) requests.emplace_back(message, std::move(response.value()));
+            }
+            for (auto& [message, response] : requests) {
+                if (!response.WaitForResponse(std::chrono::milliseconds(2000))) continue;
+                auto reply = response.GetResponse();
+                if (!reply) {
+                    rejected++;
+                }
+                else if (std::string(reply.value().data.begin(), reply.value().data.end()) == message) {
+                    answered++;
+                }
+            }
+        });
+    }
+    for (auto& sender : senders) {
+        sender.join();
+    }
+    serving = false;
+    server.join();
+
+    REQUIRE(answered == numSenders * count * 4 / 5);
+    REQUIRE(rejected == numSenders * count / 5);
+}
+
+static Coroutine AwaitAnswer(LiteConnResponse response, std::optional<std::string>& answer, bool& finished) {
+    auto message = co_await response;
+    if (message) {
+        answer = std::string(message.value().data.begin(), message.value().data.end());
+    }
+    finished = true;
+}
+
+TEST_CASE("LiteConnResponse resumes an awaiting coroutine", "[UDPConnection]") {
+    LiteConnManager host1(30000, 2, 16, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 16, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(1000),
+        .connectionRetryInterval = std::chrono::milliseconds(500),
+        .impRetryInterval = std::chrono::milliseconds(250),
+        .replyKeepDuration = std::chrono::seconds(1)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    auto s1 = host2.Accept(timeout);
+    REQUIRE(s1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+    REQUIRE(s1->WaitForConnectionComplete(std::chrono::milliseconds(500)));
+
+    Clock clock(60);
+    CoroutineManager tasks;
+    std::optional<std::string> answer;
+    bool finished = false;
+
+    auto response = c1->SendRequest(std::string("question"));
+    REQUIRE(response.has_value());
+    tasks.AddCoroutine(AwaitAnswer(std::move(response.value()), answer, finished));
+    // The coroutine runs until it awaits the response and is parked
+    tasks.Run(clock);
+    REQUIRE(!finished);
+    REQUIRE(!tasks.Empty());
+
+    REQUIRE(s1->WaitForDataPacket(std::chrono::milliseconds(1000)));
+    auto request = s1->Receive();
+    REQUIRE(request.has_value());
+    REQUIRE(request.value().requestHandle.has_value());
+    request.value().requestHandle.value().Respond(std::string("answer"));
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (!finished && std::chrono::steady_clock::now() < deadline) {
+        tasks.Run(clock);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(finished);
+    REQUIRE(answer == "answer");
+    REQUIRE(tasks.Empty());
+
+    // Requests closed by the connection resume their coroutine without a response
+    answer.reset();
+    finished = false;
+    response = c1->SendRequest(std::string("unanswered"));
+    REQUIRE(response.has_value());
+    tasks.AddCoroutine(AwaitAnswer(std::move(response.value()), answer, finished));
+    tasks.Run(clock);
+    REQUIRE(!finished);
+    s1->Disconnect();
+
+    deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (!finished && std::chrono::steady_clock::now() < deadline) {
+        tasks.Run(clock);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(finished);
+    REQUIRE(!answer.has_value());
+    REQUIRE(tasks.Empty());
+}
+
+TEST_CASE("UDPConnection broadcasts a request with a shared payload", "[UDPConnection]") {
+    LiteConnManager serverHost(40000, 4, 10, 1500, std::chrono::milliseconds(10));
+    REQUIRE(serverHost.Good());
+    serverHost.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(1000),
+        .connectionRetryInterval = std::chrono::milliseconds(300),
+        .impRetryInterval = std::chrono::milliseconds(100),
+        .replyKeepDuration = std::chrono::seconds(1)
+    };
+
+    sockaddr_in serverAddr = {};
+    serverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(40000);
+
+    // One client predates bundling, so the shared payload is both bundled and gathered into its own datagram
+    LiteConnManager clientHost(10, 2, 1500, std::chrono::milliseconds(10));
+    LiteConnManager legacyHost(10, 1, 1500, std::chrono::milliseconds(10), { .features = LiteConnFeature::ALL & ~LiteConnFeature::BUNDLE });
+    std::vector<std::shared_ptr<LiteConnConnection>> clients;
+    std::vector<std::shared_ptr<LiteConnConnection>> servers;
+    for (auto host : { &clientHost, &clientHost, &legacyHost }) {
+        auto client = host->ConnectPeer(serverAddr, timeout);
+        REQUIRE(client);
+        auto server = serverHost.Accept(timeout, std::chrono::seconds(1));
+        REQUIRE(server);
+        REQUIRE(client->WaitForConnectionComplete(std::chrono::seconds(1)));
+        REQUIRE(server->WaitForConnectionComplete(std::chrono::seconds(1)));
+        clients.push_back(client);
+        servers.push_back(server);
+    }
+    // Null connections are skipped
+    servers.push_back(nullptr);
+
+    const std::string msg = "Spawn";
+    auto responses = serverHost.BroadcastRequest(servers, msg);
+    REQUIRE(responses.size() == 4);
+    REQUIRE(!responses[3]);
+
+    for (size_t i = 0; i < clients.size(); i++) {
+        REQUIRE(responses[i]);
+        REQUIRE(clients[i]->WaitForDataPacket(std::chrono::seconds(1)));
+        auto request = clients[i]->Receive();
+        REQUIRE(request);
+        REQUIRE(std::string(request->data.begin(), request->data.end()) == msg);
+        REQUIRE(request->requestHandle);
+        request->requestHandle->Respond(std::string("Client ") + std::to_string(i));
+    }
+    for (size_t i = 0; i < clients.size(); i++) {
+        auto response = responses[i]->GetResponse();
+        REQUIRE(response);
+        REQUIRE(std::string(response->data.begin(), response->data.end()) == "Client " + std::to_string(i));
+    }
+
+    // Connections that are no longer connected get no request
+    clients[0]->Disconnect();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(servers[0]->IsDisconnected());
+    responses = serverHost.BroadcastRequest(servers, msg);
+    REQUIRE(!responses[0]);
+    REQUIRE(responses[1]);
+    REQUIRE(responses[2]);
+}
+
+TEST_CASE("UDPConnection delivers reliable messages over an impaired network", "[UDPConnection]") {
+    // Both directions lose, delay, reorder and duplicate datagrams
+    LiteConnSetting setting = {
+        .impairment = ImpairmentSetting{
+            .lossRate = 0.2,
+            .duplicateRate = 0.1,
+            .reorderRate = 0.1,
+            .latency = std::chrono::milliseconds(20),
+            .jitter = std::chrono::milliseconds(5),
+            .seed = 7
+        }
+    };
+    LiteConnManager host1(30000, 2, 10, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 10, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(5000),
+        .connectionRetryInterval = std::chrono::milliseconds(100),
+        .impRetryInterval = std::chrono::milliseconds(100),
+        .replyKeepDuration = std::chrono::seconds(5)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::seconds(3)));
+    auto s1 = host2.Accept(timeout, std::chrono::seconds(3));
+    REQUIRE(s1);
+
+    constexpr int COUNT = 100;
+    for (int i = 0; i < COUNT; i++) {
+        c1->SendReliableData(std::to_string(i));
+    }
+
+    // Every message arrives exactly once despite the losses and duplicates
+    std::vector<int> received;
+    while (received.size() < COUNT && s1->WaitForDataPacket(std::chrono::seconds(3))) {
+        while (auto item = s1->Receive()) {
+            received.push_back(std::stoi(std::string(item.value().data.begin(), item.value().data.end())));
+        }
+    }
+    std::sort(received.begin(), received.end());
+    REQUIRE(received.size() == COUNT);
+    for (int i = 0; i < COUNT; i++) {
+        REQUIRE(received[i] == i);
+    }
+    REQUIRE(c1->Stats().retransmissions > 0);
+}
+
+TEST_CASE("UDPConnection and LiteConnManager report metrics", "[UDPConnection]") {
+    std::atomic<int> dumps = 0;
+    LiteConnSetting setting = {
+        .metricsInterval = std::chrono::milliseconds(20),
+        .metricsSink = [&](const LiteConnManagerStats& stats) { dumps++; }
+    };
+    LiteConnManager host1(30000, 2, 10, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host1.Good());
+    // The small receive queue of the server overflows when it does not read
+    LiteConnManager host2(40000, 2, 4, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(5000),
+        .connectionRetryInterval = std::chrono::milliseconds(100),
+        .impRetryInterval = std::chrono::milliseconds(100),
+        .replyKeepDuration = std::chrono::seconds(5)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::seconds(3)));
+    auto s1 = host2.Accept(timeout, std::chrono::seconds(3));
+    REQUIRE(s1);
+
+    constexpr int COUNT = 20;
+    std::string message(100, 'x');
+    for (int i = 0; i < COUNT; i++) {
+        c1->SendData(message);
+    }
+    for (int i = 0; i < 50 && s1->Stats().queueFullDrops == 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto server = s1->Stats();
+    REQUIRE(server.packetsReceived > 0);
+    REQUIRE(server.bytesReceived >= server.packetsReceived * message.size());
+    REQUIRE(server.queueFullDrops > 0);
+    REQUIRE(server.queueFullDrops <= COUNT);
+    while (s1->Receive()) {}
+
+    // Reliable messages are acknowledged, each acknowledgement of a packet sent once is a round trip sample
+    c1->SendReliableData(message);
+    for (int i = 0; i < 100 && c1->Stats().roundTrips.count == 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto client = c1->Stats();
+    // Messages are bundled, so only the bytes are bounded by the messages
+    REQUIRE(client.packetsSent > 0);
+    REQUIRE(client.bytesSent >= (COUNT + 1) * message.size());
+    REQUIRE(client.roundTrips.count > 0);
+    REQUIRE(client.roundTrips.Percentile(0.5) <= client.roundTrips.max);
+
+    auto managerStats = host1.Stats();
+    REQUIRE(managerStats.connections == 1);
+    REQUIRE(managerStats.packetsSent == c1->Stats().packetsSent);
+    // The socket also counts the SYN and datagrams sent after the snapshot of the connection
+    REQUIRE(managerStats.sockets.packetsSent >= managerStats.packetsSent);
+    REQUIRE(managerStats.sockets.sendErrors == 0);
+    REQUIRE(managerStats.routingLoop.count > 0);
+    REQUIRE(managerStats.roundTrips.count == client.roundTrips.count);
+
+    for (int i = 0; i < 100 && dumps < 2; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    REQUIRE(dumps >= 2);
+}
+
+TEST_CASE("LiteConnReplay delivers the recorded messages again", "[UDPConnection]") {
+    auto capture = (std::filesystem::temp_directory_path() / "lite_conn_replay_test.lcap").string();
+    auto replayed = (std::filesystem::temp_directory_path() / "lite_conn_replay_output.lcap").string();
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(5000),
+        .connectionRetryInterval = std::chrono::milliseconds(100),
+        .impRetryInterval = std::chrono::milliseconds(100),
+        .replyKeepDuration = std::chrono::seconds(5)
+    };
+
+    constexpr int COUNT = 50;
+    std::vector<std::string> received;
+    {
+        LiteConnManager host1(30000, 2, 64, 1500, std::chrono::milliseconds(10));
+        REQUIRE(host1.Good());
+        LiteConnManager host2(40000, 2, 64, 1500, std::chrono::milliseconds(10), { .capturePath = capture });
+        REQUIRE(host2.Good());
+        host2.isListening = true;
+
+        sockaddr_in addr2 = {};
+        addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr2.sin_family = AF_INET;
+        addr2.sin_port = htons(40000);
+
+        auto c1 = host1.ConnectPeer(addr2, timeout);
+        REQUIRE(c1);
+        REQUIRE(c1->WaitForConnectionComplete(std::chrono::seconds(3)));
+        auto s1 = host2.Accept(timeout, std::chrono::seconds(3));
+        REQUIRE(s1);
+
+        for (int i = 0; i < COUNT; i++) {
+            c1->SendReliableData("message " + std::to_string(i));
+            if (i % 10 == 9) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        while (received.size() < COUNT && s1->WaitForDataPacket(std::chrono::seconds(3))) {
+            while (auto item = s1->Receive()) {
+                received.emplace_back(item->data.begin(), item->data.end());
+            }
+        }
+        REQUIRE(received.size() == COUNT);
+    }
+
+    // The replay accepts the recorded handshake with the recorded cookie key and the recorded clock
+    std::vector<std::string> replayedMessages;
+    ReplaySetting setting = {
+        .numConnections = 2,
+        .packetQueueCapacity = 64,
+        .setting = { .capturePath = replayed },
+        .timeout = timeout,
+        .onMessage = [&](size_t connection, const LiteConnMessage& message) {
+            REQUIRE(connection == 0);
+            replayedMessages.emplace_back(message.data.begin(), message.data.end());
+        }
+    };
+    auto result = LiteConnReplay::Run(capture, setting);
+    REQUIRE(result);
+    REQUIRE(result->accepted == 1);
+    REQUIRE(result->inbound > 0);
+    REQUIRE(result->skipped > 0);
+    REQUIRE(result->messages == COUNT);
+    REQUIRE(replayedMessages == received);
+    REQUIRE(result->recorded > std::chrono::milliseconds(200));
+    // The handshake datagrams are handled by the manager
+    REQUIRE(result->stats.packetsReceived > 0);
+    REQUIRE(result->stats.packetsReceived < result->inbound);
+
+    // The replayed manager answered the peer in its own capture without sending anything
+    CaptureReader output(replayed);
+    REQUIRE(output.Good());
+    size_t outbound = 0;
+    while (auto packet = output.Next()) {
+        if (packet->direction == PacketDirection::Outbound) outbound++;
+    }
+    REQUIRE(outbound > 0);
+
+    REQUIRE(!LiteConnReplay::Run(replayed + ".missing"));
+    std::filesystem::remove(capture);
+    std::filesystem::remove(replayed);
+}
+
+TEST_CASE("UDPConnection replaces the oldest unreliable messages of a full queue", "[UDPConnection]") {
+    LiteConnManager host1(30000, 2, 10, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 2, 1500, std::chrono::milliseconds(10), LiteConnSetting{ .unreliableOverflow = OverflowPolicy::DropOldest });
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(5000),
+        .connectionRetryInterval = std::chrono::milliseconds(100),
+        .impRetryInterval = std::chrono::milliseconds(100),
+        .replyKeepDuration = std::chrono::seconds(5)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::seconds(3)));
+    auto s1 = host2.Accept(timeout, std::chrono::seconds(3));
+    REQUIRE(s1);
+
+    // Sent one at a time so the messages arrive in order, the queue holds two and replaces at most two more
+    for (char i = '1'; i <= '5'; i++) {
+        c1->SendData(std::string(1, i));
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    }
+
+    std::array<LiteConnMessage, 8> messages;
+    REQUIRE(s1->ReceiveAll(messages) == 2);
+    REQUIRE(std::string(messages[0].data.begin(), messages[0].data.end()) == "3");
+    REQUIRE(std::string(messages[1].data.begin(), messages[1].data.end()) == "4");
+    REQUIRE(!messages[0].reliable);
+    REQUIRE(s1->Stats().queueFullDrops == 3);
+
+    // Reliable messages are never replaced
+    c1->SendReliableData(std::string("reliable"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    for (char i = '6'; i <= '8'; i++) {
+        c1->SendData(std::string(1, i));
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    }
+    auto first = s1->Receive();
+    REQUIRE(first);
+    REQUIRE(first->reliable);
+    REQUIRE(std::string(first->data.begin(), first->data.end()) == "reliable");
+    auto second = s1->Receive();
+    REQUIRE(second);
+    REQUIRE(std::string(second->data.begin(), second->data.end()) == "8");
+    REQUIRE(!s1->Receive());
+}
+
+TEST_CASE("UDPConnection rejects requests arriving at a full queue", "[UDPConnection]") {
+    LiteConnManager host1(30000, 2, 10, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 1, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(5000),
+        .connectionRetryInterval = std::chrono::milliseconds(100),
+        .impRetryInterval = std::chrono::milliseconds(100),
+        .replyKeepDuration = std::chrono::seconds(5)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::seconds(3)));
+    auto s1 = host2.Accept(timeout, std::chrono::seconds(3));
+    REQUIRE(s1);
+
+    c1->SendReliableData(std::string("fills the queue"));
+    for (int i = 0; i < 100 && c1->NumImpMsg() != 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    REQUIRE(c1->NumImpMsg() == 0);
+
+    auto response = c1->SendRequest(std::string("request"));
+    REQUIRE(response);
+    REQUIRE(response->WaitForResponse(std::chrono::seconds(1)));
+    REQUIRE(!response->GetResponse());
+    REQUIRE(s1->Stats().queueFullDrops == 1);
+
+    auto message = s1->Receive();
+    REQUIRE(message);
+    REQUIRE(!message->requestHandle);
+    REQUIRE(!s1->Receive());
+}
+
+TEST_CASE("UDPConnection holds reliable messages beyond the peer's receive window", "[UDPConnection]") {
+    LiteConnManager host1(30000, 2, 10, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 4, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(5000),
+        .connectionRetryInterval = std::chrono::milliseconds(100),
+        .impRetryInterval = std::chrono::milliseconds(100),
+        .replyKeepDuration = std::chrono::seconds(5)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::seconds(3)));
+    auto s1 = host2.Accept(timeout, std::chrono::seconds(3));
+    REQUIRE(s1);
+    REQUIRE(c1->Features() & LiteConnFeature::FLOW);
+    // The idle peers exchange heartbeats, which advertise the windows
+    std::this_thread::sleep_for(std::chrono::milliseconds(350));
+
+    constexpr int COUNT = 10;
+    for (int i = 0; i < COUNT; i++) {
+        c1->SendReliableData(std::to_string(i));
+    }
+    for (int i = 0; i < 100 && c1->NumImpMsg() != 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    // Only what fits into the queue was sent, nothing had to be retransmitted
+    REQUIRE(c1->NumImpMsg() == 0);
+    REQUIRE(c1->Stats().heldMessages == COUNT - 4);
+    REQUIRE(c1->Stats().retransmissions == 0);
+    REQUIRE(s1->Stats().queueFullDrops == 0);
+
+    // Reading frees the window, the held messages follow in order
+    int received = 0;
+    for (int i = 0; i < 200 && received < COUNT; i++) {
+        while (auto message = s1->Receive()) {
+            REQUIRE(std::string(message->data.begin(), message->data.end()) == std::to_string(received));
+            received++;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    REQUIRE(received == COUNT);
+    REQUIRE(c1->Stats().heldMessages == 0);
+    REQUIRE(s1->Stats().queueFullDrops == 0);
+}
+
+TEST_CASE("UDPConnection holds the fragments of a large message beyond the peer's receive window", "[UDPConnection]") {
+    LiteConnManager host1(30000, 2, 10, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 4, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(5000),
+        .connectionRetryInterval = std::chrono::milliseconds(100),
+        .impRetryInterval = std::chrono::milliseconds(100),
+        .replyKeepDuration = std::chrono::seconds(5)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::seconds(3)));
+    auto s1 = host2.Accept(timeout, std::chrono::seconds(3));
+    REQUIRE(s1);
+    REQUIRE(c1->Features() & LiteConnFeature::FLOW);
+    REQUIRE(c1->Features() & LiteConnFeature::FRAGMENT);
+    std::this_thread::sleep_for(std::chrono::milliseconds(350));
+
+    // About 20 fragments, only as many as the queue holds are sent before the peer moves its window
+    std::vector<char> large(30000);
+    for (size_t i = 0; i < large.size(); i++) {
+        large[i] = static_cast<char>(i * 13 + i / 5);
+    }
+    c1->SendReliableData(large);
+    REQUIRE(c1->NumImpMsg() <= 4);
+    REQUIRE(c1->Stats().heldMessages > 0);
+
+    // Stored fragments take no room in the queue, so the receiver keeps the window moving without being read
+    REQUIRE(s1->WaitForDataPacket(std::chrono::seconds(2)));
+    auto message = s1->Receive();
+    REQUIRE(message.has_value());
+    REQUIRE(std::vector<char>(message->data.begin(), message->data.end()) == large);
+    REQUIRE(c1->Stats().heldMessages == 0);
+    REQUIRE(s1->Stats().queueFullDrops == 0);
+}
+
+TEST_CASE("UDPConnection bounds its bandwidth with congestion control", "[UDPConnection]") {
+    LiteConnSetting setting = {
+        .congestion = CongestionSetting{
+            .initialWindow = 8,
+            .maxBandwidth = 100000,
+            .pacingBurst = 10000
+        }
+    };
+    LiteConnManager host1(30000, 2, 10, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 256, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(5000),
+        .connectionRetryInterval = std::chrono::milliseconds(100),
+        .impRetryInterval = std::chrono::milliseconds(100),
+        .replyKeepDuration = std::chrono::seconds(5)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::seconds(3)));
+    auto s1 = host2.Accept(timeout, std::chrono::seconds(3));
+    REQUIRE(s1);
+
+    // 50 KB at 100 KB/s take about half a second
+    constexpr int COUNT = 50;
+    std::string message(1000, 'x');
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < COUNT; i++) {
+        c1->SendReliableData(message);
+    }
+    REQUIRE(c1->NumImpMsg() <= c1->Stats().congestionWindow);
+    REQUIRE(c1->Stats().heldMessages > 0);
+
+    int received = 0;
+    for (int i = 0; i < 300 && received < COUNT; i++) {
+        while (s1->Receive()) {
+            received++;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    REQUIRE(received == COUNT);
+    REQUIRE(elapsed >= std::chrono::milliseconds(350));
+
+    auto stats = c1->Stats();
+    REQUIRE(stats.heldMessages == 0);
+    REQUIRE(stats.congestionWindow >= 8);
+    REQUIRE(stats.pacingRate > 0);
+    REQUIRE(stats.pacingRate <= 100000);
+}
+
+TEST_CASE("UDPConnection sends the fragments of a large message within the congestion window", "[UDPConnection]") {
+    LiteConnSetting setting = {
+        .congestion = CongestionSetting{
+            .initialWindow = 4,
+            .minWindow = 4,
+            .maxWindow = 4
+        }
+    };
+    LiteConnManager host1(30000, 2, 10, 1500, std::chrono::milliseconds(10), setting);
+    REQUIRE(host1.Good());
+    LiteConnManager host2(40000, 2, 10, 1500, std::chrono::milliseconds(10));
+    REQUIRE(host2.Good());
+    host2.isListening = true;
+
+    TimeoutSetting timeout = {
+        .connectionTimeout = std::chrono::milliseconds(5000),
+        .connectionRetryInterval = std::chrono::milliseconds(100),
+        .impRetryInterval = std::chrono::milliseconds(100),
+        .replyKeepDuration = std::chrono::seconds(5)
+    };
+
+    sockaddr_in addr2 = {};
+    addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr2.sin_family = AF_INET;
+    addr2.sin_port = htons(40000);
+
+    auto c1 = host1.ConnectPeer(addr2, timeout);
+    REQUIRE(c1);
+    REQUIRE(c1->WaitForConnectionComplete(std::chrono::seconds(3)));
+    auto s1 = host2.Accept(timeout, std::chrono::seconds(3));
+    REQUIRE(s1);
+    REQUIRE(c1->Features() & LiteConnFeature::FRAGMENT);
+
+    // About 20 fragments against a window of 4 packets
+    std::vector<char> large(30000);
+    for (size_t i = 0; i < large.size(); i++) {
+        large[i] = static_cast<char>(i * 7 + i / 3);
+    }
+    c1->SendReliableData(large);
+    REQUIRE(c1->NumImpMsg() <= 4);
+    REQUIRE(c1->Stats().heldMessages > 0);
+
+    std::optional<LiteConnMessage> message;
+    for (int i = 0; i < 200 && !message; i++) {
+        REQUIRE(c1->NumImpMsg() <= 4);
+        message = s1->Receive();
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    REQUIRE(message.has_value());
+    REQUIRE(std::vector<char>(message->data.begin(), message->data.end()) == large);
+    REQUIRE(c1->Stats().heldMessages == 0);
+}
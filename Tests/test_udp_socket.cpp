@@ -1,5 +1,6 @@
 #include <catch2/catch_test_macros.hpp>
 #include "networking/socket.hpp"
+#include "networking/impairment.hpp"
 
 TEST_CASE("UDPSocket send and receive msg", "[UDPSocket]") {
     UDPSocket socket1;
@@ -153,4 +154,142 @@ TEST_CASE("UDPSocket drop oversized packet but keep packet <= bufferSize", "[UDP
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
     result = socket1.Read();
     REQUIRE(result);
-}
\ No newline at end of file
+}
+TEST_CASE("UDPSocket wait for readiness and wake", "[UDPSocket]") {
+    UDPSocket sender;
+    UDPSocket receiver;
+
+    sockaddr_in receiverAddr = {};
+    receiverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    receiverAddr.sin_family = AF_INET;
+    receiverAddr.sin_port = receiver.Port();
+
+    // Nothing to read, the wait runs until the deadline
+    auto start = std::chrono::steady_clock::now();
+    REQUIRE(!receiver.WaitReadable(start + std::chrono::milliseconds(50)));
+    REQUIRE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(45));
+
+    // A pending datagram ends the wait immediately
+    const std::string msg = "Wake up";
+    sender.SendPacket(msg, receiverAddr);
+    REQUIRE(receiver.WaitReadable(std::chrono::steady_clock::now() + std::chrono::seconds(1)));
+    auto result = receiver.Read();
+    REQUIRE(result);
+    REQUIRE(std::string(result->payload.begin(), result->payload.end()) == msg);
+
+    // Wake() interrupts a blocked waiter from another thread
+    std::thread waker([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        receiver.Wake();
+    });
+    start = std::chrono::steady_clock::now();
+    REQUIRE(!receiver.WaitReadable(start + std::chrono::seconds(5)));
+    REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+    waker.join();
+}
+
+TEST_CASE("UDPSocket batched send and receive", "[UDPSocket]") {
+    UDPSocket sender;
+    UDPSocket receiver(1500);
+
+    sockaddr_in receiverAddr = {};
+    receiverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    receiverAddr.sin_family = AF_INET;
+    receiverAddr.sin_port = receiver.Port();
+
+    // Nothing is sent until the queue is flushed
+    for (int i = 0; i < 10; i++) {
+        const std::string msg = "Packet " + std::to_string(i);
+        sender.QueuePacket(msg, receiverAddr);
+    }
+    const std::string oversized(receiver.MaxPacketSize() + 100, 'x');
+    sender.QueuePacket(oversized, receiverAddr);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(!receiver.Read());
+
+    sender.Flush();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // The batch is read in order across several calls and the oversized datagram is dropped
+    std::vector<PacketSlot> slots(4);
+    std::vector<std::string> received;
+    size_t count;
+    while ((count = receiver.ReadBatch(slots)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            auto payload = slots[i].Payload();
+            received.emplace_back(payload.begin(), payload.end());
+            REQUIRE(slots[i].address.sin_port == sender.Port());
+        }
+    }
+    REQUIRE(received.size() == 10);
+    for (int i = 0; i < 10; i++) {
+        REQUIRE(received[i] == "Packet " + std::to_string(i));
+    }
+    REQUIRE(receiver.ReadBatch(slots) == 0);
+}
+
+TEST_CASE("UDPSocket gathers a datagram from several parts", "[UDPSocket]") {
+    UDPSocket sender;
+    UDPSocket receiver(1500);
+
+    sockaddr_in receiverAddr = {};
+    receiverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    receiverAddr.sin_family = AF_INET;
+    receiverAddr.sin_port = receiver.Port();
+
+    const std::string header = "Header|";
+    const std::string body = "Shared body";
+    std::array<std::span<const char>, 2> parts = { std::span<const char>(header), std::span<const char>(body) };
+    sender.SendPacket(parts, receiverAddr);
+    sender.QueuePacket(parts, receiverAddr);
+    sender.Flush();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    for (int i = 0; i < 2; i++) {
+        auto result = receiver.Read();
+        REQUIRE(result);
+        REQUIRE(std::string(result->payload.begin(), result->payload.end()) == header + body);
+    }
+    REQUIRE(!receiver.Read());
+}
+
+TEST_CASE("UDPSocket impairs received datagrams", "[UDPSocket]") {
+    UDPSocket sender;
+    UDPSocket receiver(1500);
+
+    sockaddr_in receiverAddr = {};
+    receiverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    receiverAddr.sin_family = AF_INET;
+    receiverAddr.sin_port = receiver.Port();
+
+    // Datagrams are held back by the latency, the wait ends once the first one is due
+    receiver.SetImpairment({ .latency = std::chrono::milliseconds(100) });
+    auto start = std::chrono::steady_clock::now();
+    for (char i = 0; i < 3; i++) {
+        sender.SendPacket(std::string(1, 'a' + i), receiverAddr);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    REQUIRE(!receiver.Read());
+    REQUIRE(receiver.WaitReadable(start + std::chrono::seconds(1)));
+    REQUIRE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(95));
+    std::array<PacketSlot, 4> slots;
+    REQUIRE(receiver.ReadBatch(slots) == 3);
+    for (char i = 0; i < 3; i++) {
+        REQUIRE(std::string(slots[i].buffer.Data(), slots[i].size) == std::string(1, 'a' + i));
+    }
+    REQUIRE(receiver.GetImpairmentStats()->received == 3);
+
+    // Every datagram is lost at a loss rate of 1, and none once the impairment is cleared
+    receiver.SetImpairment({ .lossRate = 1 });
+    sender.SendPacket(std::string("lost"), receiverAddr);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    REQUIRE(!receiver.Read());
+    REQUIRE(receiver.GetImpairmentStats()->dropped == 1);
+    receiver.ClearImpairment();
+    REQUIRE(!receiver.GetImpairmentStats());
+    sender.SendPacket(std::string("delivered"), receiverAddr);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    auto result = receiver.Read();
+    REQUIRE(result);
+    REQUIRE(std::string(result->payload.begin(), result->payload.end()) == "delivered");
+}